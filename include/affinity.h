@@ -0,0 +1,40 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/**
+ * This header requires _GNU_SOURCE (see posixver.h) for cpu_set_t.
+ */
+
+#include <stddef.h>
+#include <sched.h>
+
+/**
+ * Parse a list of CPUs in the format used by the kernel (e.g. "0-3,8,10-11") into 'set'
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int cpu_list_parse(const char* list, cpu_set_t* set);
+
+/**
+ * Bind the calling thread to the CPUs in 'set'
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int affinity_pin(const cpu_set_t* set);
+
+/**
+ * Return the number of NUMA nodes of the host (1 if it cannot be determined)
+ */
+int numa_node_count(void);
+
+/**
+ * Ask the kernel to allocate the pages of the buffer of 'length' bytes starting at 'addr'
+ * on the NUMA node of the CPU the calling thread is running on.
+ * Only the pages entirely contained in the buffer are affected, and only if they have not been touched yet.
+ * Nothing is done on single-node hosts.
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int numa_bind_local(void* addr, const size_t length);
+
+#endif
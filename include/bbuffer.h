@@ -0,0 +1,45 @@
+#ifndef BBUFFER_H
+#define BBUFFER_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+typedef struct {
+  void** data;
+  size_t capacity;
+  size_t front;
+  size_t count;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} bbuffer_t;
+
+/**
+ * Create a new bounded buffer that can hold up to 'capacity' elements
+ *
+ * Return pointer to buffer on success, NULL on error (set errno)
+ */
+bbuffer_t* bbuffer_create(const size_t capacity);
+
+/**
+ * Destroy a bounded buffer (the data still contained are freed)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int bbuffer_destroy(bbuffer_t* buffer);
+
+/**
+ * Add a data to the buffer, waiting for a free slot if the buffer is full
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int bbuffer_enqueue(bbuffer_t* buffer, void* data);
+
+/**
+ * Remove a data from the buffer, waiting for one if the buffer is empty
+ *
+ * Return pointer to data on success, NULL on error (set errno)
+ */
+void* bbuffer_dequeue(bbuffer_t* buffer);
+
+#endif
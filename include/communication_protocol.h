@@ -9,12 +9,13 @@
  * Standard lengths for making requests and responses
  */
 #define METADATA_LENGTH 10
-#define REQUEST_CODE_LENGTH 1
+#define REQUEST_CODE_LENGTH 2
 #define RESPONSE_CODE_LENGTH 1
 #define OPEN_FLAGS_LENGTH 1
 
 /**
  * Request codes used to make a request to the server
+ * (a request code is sent as two decimal digits, "%02d")
  */
 #define OPEN_FILE 1
 #define READ_FILE 2
@@ -25,6 +26,26 @@
 #define UNLOCK_FILE 7
 #define CLOSE_FILE 8
 #define REMOVE_FILE 9
+#define GET_STATS 10
+/**
+ * A NEGOTIATE_SHM request carries the size of the memory the client asks to share with the server:
+ * the OK response carries the size granted, and the memfd of the shared memory is passed with it (SCM_RIGHTS).
+ * From then on, the content of a write, append or read request that fits in the shared memory
+ * is placed in it instead of being sent through the socket, which carries the headers only.
+ */
+#define NEGOTIATE_SHM 11
+/**
+ * A READ_FILE_FD request is a READ_FILE request whose client accepts a file descriptor in place of the content:
+ * the content of a file large enough is returned in a sealed memfd passed with the response code (SCM_RIGHTS),
+ * and the size in the response is not followed by the content (which is sent as usual if no memfd is passed).
+ */
+#define READ_FILE_FD 12
+/**
+ * A MAP_INDEX request asks for the index of the files recently read (see shm_index.h):
+ * a read-only file descriptor of its segment is passed with the OK response code (SCM_RIGHTS),
+ * followed by the size of the segment.
+ */
+#define MAP_INDEX 13
 
 /**
  * Response codes used to send a response to the client
@@ -14,8 +14,47 @@
  * (putting ';' at the end of that definition would immediately defeat
  * the entire point of using 'do/while' and make that macro pretty much
  * equivalent to the compound-statement version)
+ *
+ * TIMEDWAIT waits on the condition variable X until the deadline Z at most,
+ * setting R to 0 if signaled or to ETIMEDOUT if the deadline has passed.
+ */
+
+#ifdef LOCK_PROFILE
+
+#include <lock_profile.h>
+
+/**
+ * In a build with LOCK_PROFILE defined (make LOCK_PROFILE=1, after make clean)
+ * every call site of LOCK, UNLOCK, WAIT and TIMEDWAIT counts acquisitions, contended acquisitions,
+ * wait and hold times of its mutex (see lock_profile.h)
  */
 
+#define LOCK(X) \
+  do { \
+    static lock_site_t lock_site = LOCK_SITE(X); \
+    lock_profile_lock(X, &lock_site); \
+  } while (0)
+
+#define UNLOCK(X) \
+  do { \
+    static lock_site_t lock_site = LOCK_SITE(X); \
+    lock_profile_unlock(X, &lock_site); \
+  } while (0)
+
+#define WAIT(X, Y) \
+  do { \
+    static lock_site_t lock_site = LOCK_SITE(Y); \
+    lock_profile_wait(X, Y, &lock_site); \
+  } while (0)
+
+#define TIMEDWAIT(X, Y, Z, R) \
+  do { \
+    static lock_site_t lock_site = LOCK_SITE(Y); \
+    (R) = lock_profile_timedwait(X, Y, Z, &lock_site); \
+  } while (0)
+
+#else
+
 #define LOCK(X) \
   do { \
     EXIT_ON_NZ(pthread_mutex_lock(X)); \
@@ -31,6 +70,17 @@
     EXIT_ON_NZ(pthread_cond_wait(X, Y)); \
   } while (0)
 
+#define TIMEDWAIT(X, Y, Z, R) \
+  do { \
+    if (((R) = pthread_cond_timedwait(X, Y, Z)) && (R) != ETIMEDOUT) { \
+      errno = (R); \
+      perror("pthread_cond_timedwait"); \
+      exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+#endif
+
 #define SIGNAL(X) \
   do { \
     EXIT_ON_NZ(pthread_cond_signal(X)); \
@@ -1,11 +1,45 @@
 #ifndef CONFIG_PARSER_H
 #define CONFIG_PARSER_H
 
+// requires _GNU_SOURCE (see posixver.h) for cpu_set_t
+#include <sched.h>
+#include <limits.h>
+
 typedef struct {
   long worker_pool_size;
   long storage_max_file_number;
   long storage_max_size;
   long backlog;
+  long max_request_size;
+  long worker_pool_max;
+  long queue_latency_target;
+  long worker_idle_timeout;
+  // percentage of the workers that can serve each request class at the same time
+  long control_worker_share;
+  long bulk_worker_share;
+  // CPUs the master and the workers are bound to (none if empty)
+  cpu_set_t master_cpus;
+  cpu_set_t worker_cpus;
+  // file where the requests are traced (empty if none)
+  char trace_file[PATH_MAX];
+  // milliseconds after which a request is logged as slow (0 if the requests are not timed)
+  long slow_request_threshold;
+  // whether each worker counts the cycles, instructions, cache misses and context switches of the requests
+  long perf_counters;
+  // bytes of memory a client can share with the server to exchange file content (0 if no memory is shared)
+  long shm_max_size;
+  // bytes from which a file read by a client that accepts it is returned as a memfd (0 if never)
+  long memfd_min_size;
+  // bytes of the log of the index the clients on the same host read the files from (0 if there is no index)
+  long shm_index_size;
+  // slots of the index
+  long shm_index_slots;
+  // snapshot of the storage loaded at startup and written at shutdown (empty if none)
+  char snapshot_file[PATH_MAX];
+  // write-ahead log of the changes to the storage (empty if none)
+  char wal_file[PATH_MAX];
+  // bytes of records in the log after which a snapshot is written (0 to write it only at shutdown)
+  long wal_checkpoint_size;
 } config_t;
 
 /**
@@ -0,0 +1,181 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// bytes waiting to be sent to a client above which the server stops reading its requests
+#define CONN_OUTPUT_CAP (8 * 1024 * 1024)
+
+typedef struct out_chunk_s {
+  char* data;
+  size_t size;
+  // bytes of data already sent
+  size_t sent;
+  // file descriptor passed with the first byte of data not sent yet (-1 if none)
+  int fd;
+  struct out_chunk_s* next;
+} out_chunk_t;
+
+/**
+ * Server side state of a client connection
+ *
+ * Data sent by the client is received in large chunks into a growable input buffer
+ * and requests are parsed in place.
+ * The input side is used by one thread at a time: the master while the client is idle,
+ * the worker that handles its request otherwise.
+ * Data sent to the client goes through an output queue: any thread can write to it
+ * without blocking, the master flushes it when the socket becomes writable.
+ */
+typedef struct {
+  int fd;
+  // number of the connection since the server started, used to trace the requests
+  unsigned int id;
+  char* buffer;
+  size_t capacity;
+  // received data not yet parsed is in buffer[start, end)
+  size_t start;
+  size_t end;
+  // byte overwritten by conn_terminate (NULL if none)
+  char* terminated;
+  char saved;
+  // bytes of requests parsed since the connection was created
+  size_t read_bytes;
+  // data waiting to be sent to the client
+  out_chunk_t* out_head;
+  out_chunk_t* out_tail;
+  size_t out_bytes;
+  // bytes written to the connection since it was created (sent or queued)
+  size_t written_bytes;
+  // set when the client cannot receive data anymore, output is discarded
+  char broken;
+  pthread_mutex_t out_mutex;
+  // set by the master when it stops reading requests until the output queue drains
+  char parked;
+  // used to print a summary of the connection
+  size_t recv_count;
+  size_t send_count;
+  size_t request_count;
+  // memory shared with the client, where the content that fits in it is placed
+  // instead of going through the socket (NULL if none was negotiated)
+  char* shm;
+  size_t shm_size;
+} conn_t;
+
+/**
+ * Create a connection for the socket 'fd'
+ *
+ * Return a pointer to the connection on success, NULL on error (set errno)
+ */
+conn_t* conn_create(const int fd);
+
+/**
+ * Destroy a connection (the socket is not closed)
+ */
+void conn_destroy(conn_t* conn);
+
+/**
+ * Return the number of received bytes not yet parsed
+ */
+size_t conn_pending(const conn_t* conn);
+
+/**
+ * Make sure that at least 'size' bytes not yet parsed are in the input buffer,
+ * receiving as much data as available from the socket.
+ * Pointers previously returned by conn_take may be invalidated.
+ *
+ * Return 1 on success, 0 if the client closed the connection, -1 on error (set errno)
+ */
+int conn_fill(conn_t* conn, const size_t size);
+
+/**
+ * Look at the first 'size' bytes not yet parsed, receiving without blocking if fewer are in the input buffer
+ * (used to look at the request code before handing the client to a worker)
+ *
+ * Return a pointer to the bytes, valid until the next conn_fill, NULL if they are not available yet
+ */
+char* conn_peek(conn_t* conn, const size_t size);
+
+/**
+ * Parse 'size' bytes from the input buffer (conn_fill must have been called before)
+ *
+ * Return a pointer to the parsed bytes, valid until the next conn_fill
+ */
+char* conn_take(conn_t* conn, const size_t size);
+
+/**
+ * Terminate with '\0' the 'size' bytes starting at 'data', previously returned by conn_take,
+ * so that they can be used as a string without being copied.
+ * The overwritten byte is restored by conn_release.
+ */
+void conn_terminate(conn_t* conn, char* data, const size_t size);
+
+/**
+ * Restore the byte overwritten by conn_terminate, at the end of a request
+ */
+void conn_release(conn_t* conn);
+
+/**
+ * Move the next 'size' bytes of the request to 'buf',
+ * taking them from the input buffer first and then straight from the socket
+ *
+ * Return 1 on success, 0 if the client closed the connection, -1 on error (set errno)
+ */
+int conn_read(conn_t* conn, void* buf, size_t size);
+
+/**
+ * Discard the next 'size' bytes of the request, using a fixed-size buffer whatever the size is
+ *
+ * Return 1 on success, 0 if the client closed the connection, -1 on error (set errno)
+ */
+int conn_skip(conn_t* conn, size_t size);
+
+/**
+ * Send data to the client without blocking, queuing (a copy of) what cannot be sent immediately
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int conn_write(conn_t* conn, const void* data, const size_t size);
+
+/**
+ * Like conn_write, but the connection takes ownership of the heap-allocated 'data',
+ * which is freed once sent (no copy is made)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int conn_write_owned(conn_t* conn, char* data, const size_t size);
+
+/**
+ * Like conn_write, but also pass the file descriptor 'fd' to the client (SCM_RIGHTS)
+ * with the first byte of data: the connection takes ownership of 'fd' and closes it once passed
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int conn_write_fd(conn_t* conn, const void* data, const size_t size, const int fd);
+
+/**
+ * Send as much queued data as possible without blocking
+ *
+ * Return the number of bytes still queued on success, -1 on error (set errno)
+ */
+ssize_t conn_flush(conn_t* conn);
+
+/**
+ * Mark the connection as broken after an error sending data to the client:
+ * the data queued and the data written later are discarded, and the socket is shut down
+ * so that the master drops the connection
+ */
+void conn_break(conn_t* conn);
+
+/**
+ * Return the number of bytes waiting to be sent to the client
+ */
+size_t conn_output(conn_t* conn);
+
+/**
+ * Return the number of bytes written to the connection since it was created
+ */
+size_t conn_written(conn_t* conn);
+
+#endif
@@ -5,6 +5,67 @@
 
 #include <stddef.h>
 #include <time.h>
+#include <pthread.h>
+
+#include <bbuffer.h>
+#include <icl_hash.h>
+
+/**
+ * Connection handle
+ *
+ * Every handle owns its own socket, so the server sees each handle as a distinct client:
+ * files opened or locked through a handle are owned by that handle only.
+ * Requests made on the same handle by different threads are serialized.
+ */
+typedef struct {
+  int socket;
+  char* socket_name;
+  pthread_mutex_t mutex;
+  // memory shared with the server (NULL if none was negotiated, see fss_negotiate_shm)
+  char* shm;
+  size_t shm_size;
+  // index of the files recently read, mapped read-only (NULL if not mapped, see fss_map_index)
+  void* index;
+  size_t index_size;
+  // absolute pathnames of the files opened through the handle (only these are read from the index)
+  icl_hash_t* opened;
+} fss_conn_t;
+
+/**
+ * Pool of connection handles shared by many threads
+ *
+ * A thread acquires an idle handle, makes its requests and then releases it.
+ * Since locks are owned by a handle, a thread that locks a file must keep
+ * the same handle until the file is unlocked.
+ */
+typedef struct {
+  fss_conn_t** connections;
+  size_t size;
+  // stack of the handles not acquired by any thread
+  fss_conn_t** idle;
+  size_t idle_count;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} fss_pool_t;
+
+/**
+ * Sink where the files received from the server are stored on disk
+ *
+ * The sink keeps its directory open and creates the files relative to it,
+ * so it does not depend on (nor change) the working directory and can be shared by many threads.
+ * Files are written directly by the storing thread or, if the sink has a queue,
+ * by a background writer thread.
+ */
+typedef struct {
+  char* directory;
+  int dirfd;
+  // files waiting for the background writer (NULL if files are written directly)
+  bbuffer_t* queue;
+  pthread_t writer;
+  pthread_mutex_t mutex;
+  // first error met by the background writer (0 if none)
+  int error;
+} fss_sink_t;
 
 extern char fss_verbose;
 
@@ -15,6 +76,30 @@ extern char fss_verbose;
  */
 int store_file(const char* abs_pathname, const char* content, const size_t size, const char* directory);
 
+/**
+ * Create a sink that stores files in the existent specified directory,
+ * using a background writer with a queue of 'queue_length' files (0 to write files directly)
+ *
+ * Return a pointer to the sink on success, NULL on error (set errno)
+ */
+fss_sink_t* fss_sink_create(const char* directory, const size_t queue_length);
+
+/**
+ * Destroy a sink, waiting for the background writer to store all the queued files
+ *
+ * Return 0 on success, -1 on error or if a queued file could not be stored (set errno)
+ */
+int fss_sink_destroy(fss_sink_t* sink);
+
+/**
+ * Store a file in the sink, naming it after the last component of 'pathname'
+ * (a counter is appended to the name if a file with the same name already exists).
+ * The sink takes ownership of the heap-allocated 'content' buffer, which is freed once written.
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_sink_store(fss_sink_t* sink, const char* pathname, char* content, const size_t size);
+
 /**
  * Sleep for an interval measured in milliseconds
  */
@@ -121,4 +206,112 @@ int closeFile(const char* pathname);
  */
 int removeFile(const char* pathname);
 
+/**
+ * The following functions are the handle-based counterparts of the functions above:
+ * they have the same semantics, but the request is made on the connection 'conn'
+ * (if 'conn' is NULL, the request is made on the connection opened by openConnection)
+ * and the files sent by the server are stored in 'sink' instead of 'dirname' (if 'sink' is not NULL)
+ */
+
+/**
+ * Open a new connection to the socket file 'sockname' (see openConnection)
+ *
+ * Return a pointer to the connection handle on success, NULL on error (set errno)
+ */
+fss_conn_t* fss_connect(const char* sockname, int msec, const struct timespec abstime);
+
+/**
+ * Close a connection and deallocate its handle
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_disconnect(fss_conn_t* conn);
+
+int fss_open_file(fss_conn_t* conn, const char* pathname, int flags);
+int fss_read_file(fss_conn_t* conn, const char* pathname, void** buf, size_t* size);
+int fss_read_n_files(fss_conn_t* conn, int N, fss_sink_t* sink);
+int fss_write_file(fss_conn_t* conn, const char* pathname, fss_sink_t* sink);
+int fss_append_to_file(fss_conn_t* conn, const char* pathname, void* buf, size_t size, fss_sink_t* sink);
+int fss_lock_file(fss_conn_t* conn, const char* pathname);
+int fss_unlock_file(fss_conn_t* conn, const char* pathname);
+int fss_close_file(fss_conn_t* conn, const char* pathname);
+int fss_remove_file(fss_conn_t* conn, const char* pathname);
+
+/**
+ * Get the statistics of the server: the report is returned in a heap-allocated, null-terminated buffer
+ * in 'buf' and 'size' contains its length. It is made of lines of tab-separated fields
+ * (the lines starting with '#' are comments): the usage of the storage, the bytes received and sent,
+ * the lock requests that had to wait, the responses sent for each response code
+ * and the latency percentiles of each operation.
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_stats(fss_conn_t* conn, char** buf, size_t* size);
+
+/**
+ * Read a file like fss_read_file, but return its content in a read-only mapping to be released with fss_unmap_file:
+ * the server returns a file large enough (MEMFD_MIN_SIZE) as a sealed memfd, which is mapped without copying
+ * the content, while a smaller file is received through the socket as usual.
+ * It is only possible when the client and the server run on the same host.
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_map_file(fss_conn_t* conn, const char* pathname, void** buf, size_t* size);
+
+/**
+ * Release the content of a file returned by fss_map_file
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_unmap_file(void* buf, const size_t size);
+
+/**
+ * Ask the server to share up to 'size' bytes of memory with the connection (the server may grant less):
+ * from then on, the content of the files read, written or appended through the connection
+ * that fits in the shared memory is exchanged in it instead of being copied through the socket.
+ * It is only possible when the client and the server run on the same host.
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_negotiate_shm(fss_conn_t* conn, const size_t size);
+
+/**
+ * Map the index of the files recently read by the clients, if the server shares one:
+ * from then on, fss_read_file copies the files published in the index without a request to the server,
+ * and falls back to the socket for the others (or when a file changes while it is copied).
+ * As through the socket, only the files opened through the connection (and not closed or removed since) can be read.
+ * It is only possible when the client and the server run on the same host.
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_map_index(fss_conn_t* conn);
+
+/**
+ * Create a pool of 'size' connections to the socket file 'sockname'
+ *
+ * Return a pointer to the pool on success, NULL on error (set errno)
+ */
+fss_pool_t* fss_pool_create(const char* sockname, const size_t size, int msec, const struct timespec abstime);
+
+/**
+ * Close all the connections of a pool and deallocate it
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int fss_pool_destroy(fss_pool_t* pool);
+
+/**
+ * Acquire an idle connection from the pool, waiting for one to be released if necessary
+ *
+ * Return a pointer to the connection handle on success, NULL on error (set errno)
+ */
+fss_conn_t* fss_pool_acquire(fss_pool_t* pool);
+
+/**
+ * Give a connection back to the pool
+ *
+ * Return 0 on success, -1 on error (set errno, EINVAL if the connection is not acquired from the pool)
+ */
+int fss_pool_release(fss_pool_t* pool, fss_conn_t* conn);
+
 #endif
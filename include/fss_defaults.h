@@ -10,5 +10,23 @@
 #define DEF_STORAGE_MAX_FILE_NUMBER 1000
 #define DEF_STORAGE_MAX_SIZE 134217728
 #define DEF_BACKLOG 32
+// if not specified, the maximum request size is the storage capacity
+#define DEF_MAX_REQUEST_SIZE 0
+#define DEF_WORKER_POOL_MAX 20
+// milliseconds
+#define DEF_QUEUE_LATENCY_TARGET 20
+#define DEF_WORKER_IDLE_TIMEOUT 10000
+// percentages of WORKER_POOL_MAX
+#define DEF_CONTROL_WORKER_SHARE 100
+#define DEF_BULK_WORKER_SHARE 75
+// milliseconds
+#define DEF_SLOW_REQUEST_THRESHOLD 100
+#define DEF_PERF_COUNTERS 0
+// bytes
+#define DEF_SHM_MAX_SIZE 67108864
+#define DEF_MEMFD_MIN_SIZE 1048576
+#define DEF_SHM_INDEX_SIZE 0
+#define DEF_SHM_INDEX_SLOTS 4096
+#define DEF_WAL_CHECKPOINT_SIZE 67108864
 
 #endif
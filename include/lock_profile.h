@@ -0,0 +1,71 @@
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * Counters of a call site of LOCK, UNLOCK, WAIT or TIMEDWAIT in a build with LOCK_PROFILE defined
+ * (see concurrency.h). Each expansion of the macros has its own static site,
+ * which is added to the list of the sites the first time it is used.
+ *
+ * Hold times are measured from when a mutex is acquired through LOCK (or reacquired through WAIT or TIMEDWAIT)
+ * to when it is released through UNLOCK (or WAIT or TIMEDWAIT), and are counted by the acquiring site;
+ * a mutex released by a wait made without the macros counts as held.
+ */
+typedef struct lock_site_s {
+  const char* file;
+  int line;
+  // text of the mutex argument of the macro
+  const char* expression;
+  char registered;
+  // storage, file_mutex, file_ordering, ubuffer... (set when the site is registered)
+  const char* lock_class;
+  uint64_t acquisitions;
+  // acquisitions that found the mutex locked, and nanoseconds they waited for it
+  uint64_t contended;
+  uint64_t wait_time;
+  // nanoseconds the mutex was held after being acquired here
+  uint64_t hold_time;
+  // waits on a condition variable made here, and nanoseconds they lasted
+  uint64_t cond_waits;
+  uint64_t cond_wait_time;
+  struct lock_site_s* next;
+} lock_site_t;
+
+// mutexes held at the same time by a thread whose hold time is measured
+#define LOCK_PROFILE_HELD 16
+
+#define LOCK_SITE(X) {.file = __FILE__, .line = __LINE__, .expression = #X}
+
+/**
+ * Lock a mutex, counting the acquisition in 'site'
+ */
+void lock_profile_lock(pthread_mutex_t* mutex, lock_site_t* site);
+
+/**
+ * Unlock a mutex, counting its hold time in the site that acquired it
+ */
+void lock_profile_unlock(pthread_mutex_t* mutex, lock_site_t* site);
+
+/**
+ * Wait on a condition variable, counting the wait in 'site'
+ */
+void lock_profile_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, lock_site_t* site);
+
+/**
+ * Wait on a condition variable until 'deadline' at most, counting the wait in 'site'
+ *
+ * Return 0 if signaled, ETIMEDOUT if the deadline has passed
+ */
+int lock_profile_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline, lock_site_t* site);
+
+/**
+ * Print the counters of the call sites used so far, ranked by the time waited to acquire the mutexes,
+ * as lines of tab-separated fields (the lines starting with '#' are comments)
+ */
+void lock_profile_print(FILE* stream);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+/**
+ * Events counted for the calling thread through perf_event_open(2)
+ */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_CACHE_MISSES 2
+#define PERF_CONTEXT_SWITCHES 3
+#define PERF_EVENTS 4
+
+typedef struct {
+  // counts of the events, valid only for the events whose bit (1 << event) is set in 'available'
+  uint64_t value[PERF_EVENTS];
+  unsigned int available;
+} perf_sample_t;
+
+/**
+ * Counters of the events of a thread, read together as a group
+ *
+ * The events the kernel or the hardware do not support (e.g. in a virtual machine, or with
+ * a restrictive kernel.perf_event_paranoid) are left out. If the kernel cannot be counted,
+ * only the user space of the thread is.
+ */
+typedef struct {
+  // file descriptor of the group leader (-1 if no event could be counted)
+  int leader;
+  int fd[PERF_EVENTS];
+  // event counted by each file descriptor
+  int event[PERF_EVENTS];
+  int count;
+  char user_only;
+} perf_counters_t;
+
+/**
+ * Start counting the events of the calling thread
+ *
+ * Return the number of events counted (0 if none is available)
+ */
+int perf_counters_open(perf_counters_t* counters);
+
+/**
+ * Read the counts of the events since the counters were opened
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int perf_counters_read(perf_counters_t* counters, perf_sample_t* sample);
+
+/**
+ * Compute in 'delta' the counts of the events between two samples
+ */
+void perf_counters_delta(const perf_sample_t* start, const perf_sample_t* end, perf_sample_t* delta);
+
+/**
+ * Stop counting the events
+ */
+void perf_counters_close(perf_counters_t* counters);
+
+#endif
@@ -9,8 +9,10 @@
  *
  * Defining _DEFAULT_SOURCE enables features from the 2008 edition of POSIX,
  * as well as certain BSD and SVID features without a separate feature test macro to control them.
+ * Defining _GNU_SOURCE also enables the Linux specific calls (e.g. splice, pipe2).
  */
 
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #endif
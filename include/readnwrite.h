@@ -2,6 +2,7 @@
 #define READNWRITE_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stddef.h>
 
 /**
@@ -18,4 +19,12 @@ ssize_t readn(int fd, void* buf, size_t size);
  */
 ssize_t writen(int fd, void* buf, size_t size);
 
+/**
+ * Write all the 'iovcnt' buffers described by 'iov' to a descriptor, in a single writev when possible.
+ * The elements of 'iov' are modified to keep track of partial writes.
+ *
+ * Return 1 on success, 0 if writev return 0, -1 on error (set errno)
+ */
+ssize_t writevn(int fd, struct iovec* iov, int iovcnt);
+
 #endif
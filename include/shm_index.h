@@ -0,0 +1,108 @@
+#ifndef SHM_INDEX_H
+#define SHM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Index of the files recently read, in a memory segment the clients on the same host map read-only
+ * to read those files without a request to the server.
+ *
+ * The segment holds a header, a hash table of slots and a log where the pathname and the content
+ * of each file published are written one after the other, wrapping around when the log is full.
+ * Only the server writes the segment (one thread at a time), while the clients read it without locks:
+ * - each slot is protected by a seqlock, whose sequence number is odd while the slot is being written;
+ * - the position of an entry in the log is its generation: the log keeps count of the bytes written
+ *   since it was created ('head'), and an entry at position p is overwritten as soon as head > p + log size.
+ * A reader copies the entry, then checks that neither the slot nor the log changed under it;
+ * a lookup that fails the check (or finds no entry) has to be made through the socket instead.
+ */
+
+#define SHM_INDEX_MAGIC 0x46535349444e5831ULL
+// slots where a pathname can be placed, starting from the one its hash points to
+#define SHM_INDEX_PROBES 4
+
+typedef struct {
+  uint64_t magic;
+  uint64_t slot_count;
+  uint64_t log_size;
+  // bytes written to the log since it was created
+  uint64_t head;
+} shm_index_header_t;
+
+typedef struct {
+  // odd while the slot is being written
+  uint32_t sequence;
+  // 0 if the slot is empty
+  uint32_t pathname_length;
+  uint64_t hash;
+  // generation of the entry, i.e. its position in the log (the pathname comes first, then the content)
+  uint64_t position;
+  uint64_t size;
+} shm_index_slot_t;
+
+/**
+ * Writer side of an index, owned by the server
+ */
+typedef struct {
+  int fd;
+  // segment and its size
+  void* map;
+  size_t size;
+  shm_index_header_t* header;
+  shm_index_slot_t* slots;
+  char* log;
+  pthread_mutex_t mutex;
+} shm_index_t;
+
+/**
+ * Create an index with 'slot_count' slots and a log of 'log_size' bytes
+ *
+ * Return a pointer to the index on success, NULL on error (set errno)
+ */
+shm_index_t* shm_index_create(const size_t slot_count, const size_t log_size);
+
+/**
+ * Destroy an index (the clients that mapped it keep their own mapping)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int shm_index_destroy(shm_index_t* index);
+
+/**
+ * Open a read-only file descriptor of the segment of an index, to be passed to a client
+ *
+ * Return the file descriptor on success, -1 on error (set errno)
+ */
+int shm_index_reader_fd(shm_index_t* index);
+
+/**
+ * Publish the content of a file, unless it is already published
+ * (the content of a file has to be withdrawn before it changes)
+ *
+ * Return 0 on success, -1 on error (set errno, EFBIG if the file takes more than a sixteenth of the log)
+ */
+int shm_index_publish(shm_index_t* index, const char* pathname, const char* content, const size_t size);
+
+/**
+ * Withdraw the content of a file, if it was published
+ */
+void shm_index_withdraw(shm_index_t* index, const char* pathname);
+
+/**
+ * Check that a segment of 'size' bytes mapped by a client holds a valid index
+ *
+ * Return 0 if it does, -1 otherwise (set errno)
+ */
+int shm_index_check(const void* map, const size_t size);
+
+/**
+ * Look up a file in a segment mapped by a client, copying its content in a newly allocated buffer
+ * (with a terminating null byte not counted in 'size')
+ *
+ * Return 0 on success, -1 if the file is not published or changed while it was copied
+ */
+int shm_index_lookup(const void* map, const char* pathname, void** buffer, size_t* size);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+/**
+ * Format of a snapshot of the storage (see storage_save and storage_load)
+ *
+ * A snapshot can be mapped and read in place: every structure is at an offset aligned to its size.
+ *   header | contents | pathnames | index
+ * - the header describes the format and where the other sections are;
+ * - the content of each file starts at an offset aligned to SNAPSHOT_ALIGNMENT;
+ * - the pathnames are null-terminated strings, one after the other;
+ * - the index, at the end, has an entry for each file, in the order the files were added to the storage
+ *   (the order of the replacement algorithm).
+ * The snapshot is written in the byte order of the host, which is recorded in the header.
+ * Only what outlives the clients is kept: locks, opens and pending lock requests are not.
+ */
+
+#define SNAPSHOT_MAGIC "FSSSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_ALIGNMENT 64
+
+// the file has been modified since it was created (used by the replacement algorithm)
+#define SNAPSHOT_MODIFIED 1
+
+typedef struct {
+  // SNAPSHOT_MAGIC, null-terminated
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  // sizes of the structures, to reject a snapshot written with a different layout
+  uint32_t header_size;
+  uint32_t entry_size;
+  uint32_t alignment;
+  uint32_t reserved;
+  uint64_t file_count;
+  // bytes of content of all the files
+  uint64_t content_size;
+  uint64_t pathnames_offset;
+  uint64_t index_offset;
+  // size of the whole snapshot, to reject a truncated one
+  uint64_t snapshot_size;
+  // seconds since the Epoch when the snapshot was written
+  uint64_t created;
+  // position of the write-ahead log up to which the changes are in the snapshot (0 if there was no log)
+  uint64_t log_position;
+} snapshot_header_t;
+
+typedef struct {
+  uint64_t content_offset;
+  uint64_t size;
+  // offset of the pathname from the start of the pathnames section, and its length
+  uint64_t pathname_offset;
+  uint32_t pathname_length;
+  uint32_t flags;
+} snapshot_entry_t;
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef STAGES_H
+#define STAGES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <error_handling.h>
+
+/**
+ * Stages of the service of a request, timed separately
+ */
+// waiting in the queue for a worker
+#define STAGE_QUEUE 0
+// waiting for the storage mutex
+#define STAGE_STORAGE_LOCK 1
+// waiting for the mutexes of a file or for its readers and writers to finish
+#define STAGE_FILE_WAIT 2
+// copying file content
+#define STAGE_COPY 3
+// receiving the content of a write or append request
+#define STAGE_RECEIVE 4
+// sending the response (or queuing it if the client is not ready)
+#define STAGE_SEND 5
+// waiting for the records of a change to be synced to the write-ahead log
+#define STAGE_SYNC 6
+#define STAGES 7
+
+// slow requests kept in the log, the older ones are overwritten
+#define SLOW_LOG_LENGTH 256
+// trailing characters of the pathname kept in the log
+#define SLOW_LOG_PATHNAME_LENGTH 63
+
+typedef struct {
+  // nanoseconds
+  uint64_t time[STAGES];
+} stage_times_t;
+
+/**
+ * Stage times of the request being served by the calling thread (NULL if it is not timed):
+ * the storage and the connections add to it the time spent in the stages they go through
+ */
+extern __thread stage_times_t* stage_times;
+
+/**
+ * Execute the statements, adding the time they take to 'stage' if the request is timed
+ */
+#define STAGE_TIMED(stage, ...) \
+  do { \
+    if (stage_times) { \
+      struct timespec stage_start, stage_end; \
+      EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &stage_start)); \
+      __VA_ARGS__; \
+      EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &stage_end)); \
+      stage_times->time[stage] += (stage_end.tv_sec - stage_start.tv_sec) * 1000000000ULL + stage_end.tv_nsec - stage_start.tv_nsec; \
+    } else { \
+      __VA_ARGS__; \
+    } \
+  } while (0)
+
+typedef struct {
+  // when the request was served (wall clock)
+  struct timespec served;
+  unsigned int connection;
+  long request_code;
+  long response;
+  // nanoseconds from when the client was queued to when the response was sent
+  uint64_t total;
+  stage_times_t stages;
+  char pathname[SLOW_LOG_PATHNAME_LENGTH + 1];
+} slow_request_t;
+
+/**
+ * Ring buffer of the last requests that took longer than a threshold
+ */
+typedef struct {
+  slow_request_t ring[SLOW_LOG_LENGTH];
+  // position of the next request to log
+  size_t next;
+  // requests logged since the server started
+  size_t total;
+  // nanoseconds
+  uint64_t threshold;
+  pthread_mutex_t mutex;
+} slow_log_t;
+
+/**
+ * Create a log of the requests slower than 'threshold' milliseconds
+ *
+ * Return a pointer to the log on success, NULL on error (set errno)
+ */
+slow_log_t* slow_log_create(const long threshold);
+
+/**
+ * Destroy a log
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int slow_log_destroy(slow_log_t* log);
+
+/**
+ * Log a request if it took at least the threshold (called by any thread)
+ */
+void slow_log_add(slow_log_t* log, const unsigned int connection, const long request_code, const long response, const char* pathname, const uint64_t total, const stage_times_t* stages);
+
+/**
+ * Print the logged requests, from the oldest, as lines of tab-separated fields
+ * (the lines starting with '#' are comments)
+ */
+void slow_log_dump(slow_log_t* log, FILE* stream);
+
+#endif
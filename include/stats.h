@@ -0,0 +1,128 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <storage.h>
+#include <stages.h>
+#include <perf_counters.h>
+
+// size of a cache line, the shards of different workers never share one
+#define STATS_CACHE_LINE 64
+
+// request codes counted (indexed by request code, 0 for the requests with an unknown code)
+#define STATS_REQUESTS 14
+// response codes counted (indexed by response code)
+#define STATS_RESPONSES 10
+
+/**
+ * Latency histogram buckets: the latencies below 16 microseconds have a bucket each,
+ * then every power of two of microseconds is split in 8 buckets (relative error below 12.5%)
+ */
+#define STATS_SUB_BUCKETS 8
+#define STATS_BUCKETS 256
+
+typedef struct {
+  uint64_t count;
+  // microseconds
+  uint64_t total_latency;
+  uint64_t max_latency;
+  uint64_t histogram[STATS_BUCKETS];
+  // requests timed stage by stage, and nanoseconds they spent in each stage
+  uint64_t timed;
+  uint64_t stage_time[STAGES];
+  // requests measured with each hardware or software event, counts of the event,
+  // and bytes received and sent by the requests measured with any event
+  uint64_t perf_samples[PERF_EVENTS];
+  uint64_t perf_count[PERF_EVENTS];
+  uint64_t perf_bytes;
+} stats_op_t;
+
+/**
+ * Counters of a worker
+ *
+ * A shard is updated only by the worker that owns it, without locks nor atomic read-modify-write
+ * instructions, and read by any thread merging the shards: every counter is loaded and stored
+ * atomically so that a reader never sees a torn value.
+ */
+typedef struct {
+  stats_op_t ops[STATS_REQUESTS];
+  uint64_t responses[STATS_RESPONSES];
+  // bytes of the requests received and of the responses sent
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  // lock requests that had to wait for the file to be unlocked
+  uint64_t lock_waits;
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_shard_t;
+
+/**
+ * Statistics of the requests served, split in one shard per worker
+ *
+ * A worker owns a shard from when it starts to when it exits, then the shard
+ * (and what it counted) is taken over by the next worker that starts.
+ */
+typedef struct {
+  stats_shard_t* shards;
+  size_t size;
+  // shards owned by a worker, protected by the mutex
+  char* owned;
+  size_t owned_count;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct timespec start;
+} stats_t;
+
+/**
+ * Create the statistics for up to 'size' workers alive at the same time
+ *
+ * Return a pointer to the statistics on success, NULL on error (set errno)
+ */
+stats_t* stats_create(const size_t size);
+
+/**
+ * Destroy the statistics
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int stats_destroy(stats_t* stats);
+
+/**
+ * Take a shard for the calling worker, waiting for an exiting worker to release its shard if none is free
+ *
+ * Return a pointer to the shard
+ */
+stats_shard_t* stats_attach(stats_t* stats);
+
+/**
+ * Release the shard of a worker that is exiting
+ */
+void stats_detach(stats_t* stats, stats_shard_t* shard);
+
+/**
+ * Count a request served in 'latency' microseconds, with the time spent in each stage if it was timed ('stages' not NULL)
+ * (called by the worker owning the shard)
+ */
+void stats_request(stats_shard_t* shard, const long request_code, const long response, const uint64_t latency, const stage_times_t* stages);
+
+/**
+ * Count the events of a request that received and sent 'bytes' bytes (called by the worker owning the shard)
+ */
+void stats_perf(stats_shard_t* shard, const long request_code, const perf_sample_t* delta, const uint64_t bytes);
+
+/**
+ * Add 'value' to a counter of a shard (called by the worker owning the shard)
+ */
+void stats_add(uint64_t* counter, const uint64_t value);
+
+/**
+ * Merge the shards and write a report of the statistics and of the storage usage
+ * in a heap-allocated buffer: lines of tab-separated fields, the lines starting with '#' are comments
+ *
+ * Return a pointer to the report on success, NULL on error (set errno)
+ */
+char* stats_report(stats_t* stats, storage_t* storage, size_t* length);
+
+#endif
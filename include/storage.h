@@ -5,6 +5,8 @@
 #include <pthread.h>
 
 #include <icl_hash.h>
+#include <shm_index.h>
+#include <wal.h>
 
 typedef struct user_node_s {
   int user;
@@ -28,6 +30,13 @@ typedef struct file_s {
   user_node_t* pending_locks;
   char active_writers;
   size_t active_readers;
+  // bytes accounted in the storage size but not (yet) part of the file content,
+  // reserved by an append in progress or left over by an aborted one
+  size_t reserved;
+  // sealed memfd holding the content, created by the first read that asks for it (-1 if none)
+  int memfd;
+  // unique for the whole server run, to tell the file from one created later with the same pathname
+  uint64_t serial;
   pthread_mutex_t mutex;
   pthread_mutex_t ordering;
   pthread_cond_t cond;
@@ -48,8 +57,26 @@ typedef struct {
   size_t max_file_number_reached;
   size_t max_size_reached;
   size_t replacement_counter;
+  size_t evicted_files;
+  // index where the files read are published for the clients on the same host (NULL if none)
+  shm_index_t* index;
+  // log where the changes to the storage are recorded (NULL if none)
+  wal_t* wal;
+  // serial of the last file added
+  uint64_t last_serial;
 } storage_t;
 
+/**
+ * Snapshot of the usage of a storage
+ */
+typedef struct {
+  size_t file_number;
+  size_t size;
+  size_t max_file_number_reached;
+  size_t max_size_reached;
+  size_t evicted_files;
+} storage_usage_t;
+
 /**
  * Deallocate a file
  */
@@ -69,11 +96,28 @@ storage_t* storage_create(const size_t max_file_number, const size_t max_size);
  */
 int storage_destroy(storage_t* storage);
 
+/**
+ * Publish in 'index' the content of the files read, as long as they are not modified nor locked
+ * (the index is not destroyed with the storage)
+ */
+void storage_set_index(storage_t* storage, shm_index_t* index);
+
+/**
+ * Record in 'wal' the files created, appended to and removed, while the changes are made
+ * (the log is not destroyed with the storage)
+ */
+void storage_set_wal(storage_t* storage, wal_t* wal);
+
 /**
  * Print a summary of the operations performed in the storage
  */
 void storage_print_summary(storage_t* storage);
 
+/**
+ * Get the current usage of a storage
+ */
+void storage_usage(storage_t* storage, storage_usage_t* usage);
+
 /**
  * Copy the contents of a file into a newly allocated buffer (with optional extra space)
  *
@@ -102,6 +146,22 @@ int storage_open(storage_t* storage, const char* pathname, const int flags, user
  */
 int storage_read(storage_t* storage, const char* pathname, void** buffer, size_t* size, const int user);
 
+/**
+ * Read a file in the storage like storage_read, but copy its content in 'dest'
+ * if it fits in 'capacity' bytes (then set *buffer to NULL)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int storage_read_to(storage_t* storage, const char* pathname, void* dest, const size_t capacity, void** buffer, size_t* size, const int user);
+
+/**
+ * Read a file in the storage as a sealed memfd, if its size is at least 'min_size' (*fd set to -1 otherwise).
+ * The memfd of a file is kept until its content changes, and each read returns a new descriptor of it.
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int storage_read_fd(storage_t* storage, const char* pathname, const size_t min_size, int* fd, size_t* size, const int user);
+
 /**
  * Read many files in the storage
  *
@@ -116,6 +176,14 @@ int storage_read_many(storage_t* storage, const long up_to, void** buffer, size_
  */
 char storage_can_write(storage_t* storage, const char* pathname, const int user);
 
+/**
+ * Check if a user can append to a file in the storage (the user opened the file
+ * and no other user holds its lock)
+ *
+ * Return 1 if user can append to the file, 0 if not (set errno)
+ */
+char storage_can_append(storage_t* storage, const char* pathname, const int user);
+
 /**
  * Append content to a file in the storage
  *
@@ -123,6 +191,36 @@ char storage_can_write(storage_t* storage, const char* pathname, const int user)
  */
 int storage_append(storage_t* storage, const char* pathname, const char* new_content, const size_t new_content_length, user_node_t** pending_locks, file_t** removed_list, const int user);
 
+/**
+ * Append content to a file in the storage like storage_append, taking the ownership of '*new_content'
+ * (then set to NULL) if the file is empty, so that the new content is not copied
+ * (and no space is allocated for it)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int storage_append_owned(storage_t* storage, const char* pathname, char** new_content, const size_t new_content_length, user_node_t** pending_locks, file_t** removed_list, const int user);
+
+/**
+ * Reserve space for appending 'length' bytes to a file in the storage, removing files if needed.
+ * The caller fills the reserved space (pointed by 'space') without holding any storage lock,
+ * then calls storage_append_commit or storage_append_abort;
+ * in the meantime the file cannot be read, written or removed.
+ * Removing the file and writing a snapshot wait for the space to be filled with the storage locked.
+ *
+ * Return a pointer to the reserved file on success, NULL on error (set errno)
+ */
+file_t* storage_append_reserve(storage_t* storage, const char* pathname, const size_t length, user_node_t** pending_locks, file_t** removed_list, const int user, char** space);
+
+/**
+ * Make the 'length' bytes reserved with storage_append_reserve part of the file content
+ */
+void storage_append_commit(storage_t* storage, file_t* file, const size_t length);
+
+/**
+ * Release a file reserved with storage_append_reserve, leaving its content unchanged
+ */
+void storage_append_abort(file_t* file);
+
 /**
  * Lock a file in the storage
  *
@@ -158,4 +256,32 @@ int storage_remove(storage_t* storage, const char* pathname, user_node_t** pendi
  */
 int storage_user_exit(storage_t* storage, user_node_t** pending_locks, const int user);
 
+/**
+ * Write a snapshot of the files in the storage (see snapshot.h) to 'pathname', replacing it once complete.
+ * The storage is locked only while the pathnames and sizes of the files are collected, then each content
+ * is written as a reader would read it: up to the size collected, since the contents are only appended to.
+ * A file removed in the meantime is left out of the snapshot.
+ * If the storage has a log, the snapshot records its position, then the records before it are dropped (checkpoint).
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int storage_save(storage_t* storage, const char* pathname);
+
+/**
+ * Load the files of a snapshot in an empty storage, copying their contents with up to 'threads' threads.
+ * The files that do not fit in the storage (as many as 'left_out') are left out.
+ * The position of the log recorded in the snapshot is returned in 'log_position'.
+ *
+ * Return 0 on success, -1 on error (set errno, EINVAL if the snapshot is not valid)
+ */
+int storage_load(storage_t* storage, const char* pathname, const size_t threads, size_t* left_out, uint64_t* log_position);
+
+/**
+ * Replay on the storage the records of the log in 'pathname' from 'log_position' on (see wal_replay),
+ * as many as 'records', before the storage has a log of its own
+ *
+ * Return 0 on success, -1 on error (set errno, ENOENT if there is no log)
+ */
+int storage_recover(storage_t* storage, const char* pathname, const uint64_t log_position, size_t* records);
+
 #endif
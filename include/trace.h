@@ -0,0 +1,99 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * A trace file is a header followed by fixed-size records, in the byte order of the server host.
+ * Records are written in the order the requests end, so their timestamps are not sorted.
+ */
+#define TRACE_MAGIC "FSSTRACE"
+#define TRACE_VERSION 1
+
+// opcode of the record written when a client leaves (the other opcodes are the request codes)
+#define TRACE_DISCONNECT 0
+
+// records kept in memory before being written to the file
+#define TRACE_BUFFER_RECORDS 4096
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // size of a record, to detect traces written by a different build
+  uint32_t record_size;
+} trace_header_t;
+
+typedef struct {
+  // nanoseconds from the start of the trace to when the request was ready to be served
+  uint64_t timestamp;
+  // hash of the pathname (0 for readNFiles and disconnections)
+  uint64_t pathname_hash;
+  // content length of a write or append request, N of a readNFiles request, flags of an open request
+  uint64_t request_size;
+  // bytes sent back to the client, response code included
+  uint64_t response_size;
+  // connection number, unique for the whole server run
+  uint32_t connection;
+  // microseconds from when the request was ready to be served to when the response was sent
+  uint32_t latency;
+  uint8_t opcode;
+  // response code (0 if the response has been delayed, as for a lock on a locked file)
+  uint8_t result;
+  uint8_t padding[6];
+} trace_record_t;
+
+typedef struct {
+  int fd;
+  struct timespec start;
+  trace_record_t* buffer;
+  size_t count;
+  pthread_mutex_t mutex;
+  // set when the records cannot be written, then the next ones are dropped
+  char disabled;
+  // used to print a summary of the trace
+  size_t total;
+} trace_t;
+
+/**
+ * Create (or truncate) the trace file 'pathname' and write its header
+ *
+ * Return a pointer to the trace on success, NULL on error (set errno)
+ */
+trace_t* trace_open(const char* pathname);
+
+/**
+ * Write the buffered records and close the trace
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int trace_close(trace_t* trace);
+
+/**
+ * Return the nanoseconds elapsed from the start of the trace to 't'
+ */
+uint64_t trace_timestamp(const trace_t* trace, const struct timespec* t);
+
+/**
+ * Return the hash of a pathname, as written in the records
+ */
+uint64_t trace_hash(const char* pathname);
+
+/**
+ * Add a record to the trace (called by any thread), writing the buffered records when the buffer is full.
+ * If they cannot be written, the trace is disabled: the buffered records and the next ones are dropped.
+ *
+ * Return 0 on success, -1 on error (set errno) when the trace gets disabled
+ */
+int trace_record(trace_t* trace, const trace_record_t* record);
+
+/**
+ * Check the header of a trace
+ *
+ * Return 0 if the trace can be read by this build, -1 otherwise (set errno)
+ */
+int trace_check_header(const trace_header_t* header);
+
+#endif
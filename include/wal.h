@@ -0,0 +1,155 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Write-ahead log of the changes to the storage, replayed on top of the last snapshot after a crash.
+ *
+ * The thread that changes the storage appends a record to the log (in memory) while making the change,
+ * so that the records are in the order the changes were made. A thread of the log writes the records
+ * to the log file and syncs it in batches: the records appended while a batch is being synced are
+ * written and synced together in the next one (group commit), and a request is answered once the
+ * batch with its records is synced.
+ *
+ * The position of a record is the count of bytes of records appended before it since the log was created:
+ * a snapshot records the position up to which it includes the changes, then the records before that
+ * position are dropped from the log file (checkpoint).
+ *
+ * Log file: a header, then the records, each one made of
+ *   wal_record_t | pathname (null-terminated) | data | padding to a multiple of 8 bytes
+ * The checksum of a record covers everything after it: the log ends at the first record that fails
+ * the check, like a record torn by a crash while it was written.
+ */
+
+#define WAL_MAGIC "FSSWAL"
+#define WAL_VERSION 1
+#define WAL_BYTE_ORDER 0x01020304
+
+// record types
+#define WAL_CREATE 1
+#define WAL_APPEND 2
+#define WAL_REMOVE 3
+
+typedef struct {
+  // WAL_MAGIC, null-terminated
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  // position of the first record in the file
+  uint64_t base;
+} wal_header_t;
+
+typedef struct {
+  // CRC-32 of the rest of the record
+  uint32_t crc;
+  uint32_t type;
+  // without the terminating null byte
+  uint32_t pathname_length;
+  uint32_t reserved;
+  // bytes of data
+  uint64_t size;
+} wal_record_t;
+
+typedef struct {
+  int fd;
+  char* pathname;
+  // records appended and not yet taken by the writer
+  char* buffer;
+  size_t length;
+  size_t capacity;
+  // buffer of the batch being written, reused for the next records
+  char* spare;
+  size_t spare_capacity;
+  // position of the first record in the file, past the last record appended and past the last record synced
+  uint64_t base;
+  uint64_t appended;
+  uint64_t synced;
+  // set while the writer writes and syncs a batch
+  char writing;
+  // set while a checkpoint copies the last records to the new file, the writer waits meanwhile
+  char checkpointing;
+  char stop;
+  // error of the first record that could not be appended or synced (0 if none), then nothing is synced anymore
+  int error;
+  // used to print a summary of the records synced
+  uint64_t records;
+  uint64_t batches;
+  pthread_mutex_t mutex;
+  // signaled when a record is appended
+  pthread_cond_t appended_cond;
+  // broadcast when a batch is synced
+  pthread_cond_t synced_cond;
+  pthread_t writer;
+} wal_t;
+
+/**
+ * Apply a record replayed from a log, with the null-terminated 'pathname' and 'size' bytes of 'data'
+ */
+typedef void (*wal_apply_t)(void* arg, const uint32_t type, const char* pathname, const char* data, const size_t size);
+
+/**
+ * Replay the records of the log in 'pathname' from 'position' on (the ones before are already in the snapshot),
+ * dropping from the file the records after the first one that fails the check
+ *
+ * Return 0 on success, -1 on error (set errno, ENOENT if there is no log, EINVAL if it is not valid
+ * or it does not start at or before 'position')
+ */
+int wal_replay(const char* pathname, const uint64_t position, wal_apply_t apply, void* arg, size_t* count);
+
+/**
+ * Open the log in 'pathname', creating it if it does not exist, and start its writer.
+ * The log starts at 'position' if it is created (or if all of its records are before 'position').
+ *
+ * Return a pointer to the log on success, NULL on error (set errno)
+ */
+wal_t* wal_create(const char* pathname, const uint64_t position);
+
+/**
+ * Sync the records appended, stop the writer and close the log
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int wal_destroy(wal_t* wal);
+
+/**
+ * Append a record to the log, to be synced by the writer
+ * (a record that cannot be appended makes wal_sync fail)
+ */
+void wal_append(wal_t* wal, const uint32_t type, const char* pathname, const char* data, const size_t size);
+
+/**
+ * Wait until every record appended so far is synced
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int wal_sync(wal_t* wal);
+
+/**
+ * Get the position past the last record appended
+ */
+uint64_t wal_position(wal_t* wal);
+
+/**
+ * Get the bytes of records in the log file (or to be written to it)
+ */
+uint64_t wal_size(wal_t* wal);
+
+/**
+ * Drop the records before 'position' from the log file, once they are synced,
+ * writing the ones after it to a new file that replaces the old one.
+ * The records are copied while the next ones are appended and synced to the old file,
+ * then only the writer waits while the last ones are copied (one checkpoint at a time).
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int wal_checkpoint(wal_t* wal, const uint64_t position);
+
+/**
+ * Print a summary of the records synced
+ */
+void wal_print_summary(wal_t* wal);
+
+#endif
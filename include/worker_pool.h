@@ -0,0 +1,172 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/select.h>
+
+// request classes, each served from its own lane of the queue
+#define LANE_CONTROL 0
+#define LANE_BULK 1
+#define LANES 2
+
+// latency histogram buckets, 4 per power of two of microseconds
+#define LATENCY_BUCKETS 160
+
+typedef struct job_s {
+  int fd;
+  // virtual time at which the client starts being served, used for fair queuing
+  double start_tag;
+  struct job_s* next;
+} job_t;
+
+/**
+ * A lane holds the ready clients of a request class
+ */
+typedef struct {
+  job_t* front;
+  job_t* back;
+  size_t queued;
+  // workers currently serving the lane and maximum number of them
+  size_t busy;
+  size_t cap;
+  // start tag of the last client dispatched
+  double vtime;
+  // service time received by the lane, divided by its share
+  double served;
+  double share;
+  // used to print a summary of the lane activity
+  size_t served_count;
+  size_t histogram[LATENCY_BUCKETS];
+} lane_t;
+
+/**
+ * State of a client kept by the pool for fair queuing
+ */
+typedef struct {
+  // virtual time at which the last request of the client finished
+  double finish_tag;
+  double start_tag;
+  // used to measure the time spent in the queue and the response time
+  struct timespec submitted;
+  struct timespec dispatched;
+  int lane;
+} client_state_t;
+
+/**
+ * Elastic pool of worker threads serving a queue of ready clients
+ *
+ * The pool keeps at least 'min_size' workers alive. When a client in the queue has waited
+ * longer than 'latency_target' milliseconds and no worker is idle, a new worker is started (up to 'max_size');
+ * a worker that stays idle for 'idle_timeout' milliseconds exits if there are more than 'min_size' workers.
+ *
+ * The queue is split in lanes, one per request class. Each lane can use only its share of the workers,
+ * and the lanes are served in proportion to their shares. Within a lane the clients are served
+ * in start-time fair queuing order: a client that has received more service time waits behind
+ * those that have received less, so that a client sending large requests cannot hold back the others.
+ */
+typedef struct {
+  lane_t lanes[LANES];
+  size_t queued;
+  // indexed by client fd
+  client_state_t clients[FD_SETSIZE];
+  size_t min_size;
+  size_t max_size;
+  // number of workers alive and number of idle workers
+  size_t size;
+  size_t idle;
+  long latency_target;
+  long idle_timeout;
+  // function executed by the workers, with the pool as argument
+  void* (*routine)(void*);
+  // argument for the workers
+  void* arg;
+  // workers that exited and have not been joined yet
+  pthread_t* exited;
+  size_t exited_count;
+  char terminating;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_cond_t exit_cond;
+  // used to print a summary of the pool activity
+  size_t peak_size;
+  size_t created;
+  size_t retired;
+  size_t dispatched;
+  double total_latency;
+  double max_latency;
+} worker_pool_t;
+
+/**
+ * Create a worker pool and start 'min_size' workers executing 'routine'.
+ * The routine is passed the pool, 'arg' is available in the 'arg' field;
+ * it gets the clients to serve with worker_pool_get, calls worker_pool_done once their request
+ * has been served, and must return when it gets -1.
+ * 'shares' gives for each lane the percentage of 'max_size' workers that can serve it at the same time.
+ *
+ * Return a pointer to the pool on success, NULL on error (set errno)
+ */
+worker_pool_t* worker_pool_create(const size_t min_size, const size_t max_size, const long shares[LANES], const long latency_target, const long idle_timeout, void* (*routine)(void*), void* arg);
+
+/**
+ * Stop a worker pool, waiting for the workers to serve the queued clients and exit
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int worker_pool_stop(worker_pool_t* pool);
+
+/**
+ * Destroy a worker pool (stopping it first if needed)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int worker_pool_destroy(worker_pool_t* pool);
+
+/**
+ * Put a ready client (fd lower than FD_SETSIZE) in the queue of 'lane'
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+int worker_pool_submit(worker_pool_t* pool, const int fd, const int lane);
+
+/**
+ * Get the next client to serve, waiting for one if the queue is empty (called by the workers)
+ *
+ * Return the client fd, -1 if the calling worker must exit
+ */
+int worker_pool_get(worker_pool_t* pool);
+
+/**
+ * Tell the pool that the request of a client got with worker_pool_get has been served
+ * (called by the workers before giving the client back to the master)
+ */
+void worker_pool_done(worker_pool_t* pool, const int fd);
+
+/**
+ * Return the time at which a client got with worker_pool_get was put in the queue
+ */
+struct timespec worker_pool_submitted(worker_pool_t* pool, const int fd);
+
+/**
+ * Forget the service received by a client (to be called when its connection is closed)
+ */
+void worker_pool_forget(worker_pool_t* pool, const int fd);
+
+/**
+ * Start a new worker if the queued clients have been waiting for too long
+ * (to be called periodically while the queue is not empty)
+ */
+void worker_pool_adjust(worker_pool_t* pool);
+
+/**
+ * Return the number of queued clients
+ */
+size_t worker_pool_queued(worker_pool_t* pool);
+
+/**
+ * Print a summary of the pool activity
+ */
+void worker_pool_print_summary(worker_pool_t* pool);
+
+#endif
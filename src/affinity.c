@@ -0,0 +1,147 @@
+#include <posixver.h>
+
+#include <affinity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// list of the NUMA nodes online, in the same format of the CPU lists
+#define NODE_LIST_PATH "/sys/devices/system/node/online"
+#define NODE_LIST_LENGTH 256
+// size in bits of the node masks passed to mbind
+#define MAX_NUMA_NODES 1024
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+int cpu_list_parse(const char* list, cpu_set_t* set)
+{
+  if (!list || !set) {
+    errno = EINVAL;
+    return -1;
+  }
+  // 'set' is left untouched on error
+  cpu_set_t parsed;
+  CPU_ZERO(&parsed);
+  const char* ptr = list;
+  while (*ptr) {
+    // parse a CPU or a range of CPUs
+    char* end;
+    errno = 0;
+    long first = strtol(ptr, &end, 10);
+    if (end == ptr || errno || first < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    long last = first;
+    ptr = end;
+    if (*ptr == '-') {
+      ptr++;
+      last = strtol(ptr, &end, 10);
+      if (end == ptr || errno || last < first) {
+        errno = EINVAL;
+        return -1;
+      }
+      ptr = end;
+    }
+    if (last >= CPU_SETSIZE) {
+      errno = EINVAL;
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, &parsed);
+    }
+    if (*ptr == ',') {
+      ptr++;
+    } else if (*ptr && *ptr != '\n') {
+      errno = EINVAL;
+      return -1;
+    } else {
+      break;
+    }
+  }
+  if (!CPU_COUNT(&parsed)) {
+    errno = EINVAL;
+    return -1;
+  }
+  *set = parsed;
+  return 0;
+}
+
+int affinity_pin(const cpu_set_t* set)
+{
+  if (!set) {
+    errno = EINVAL;
+    return -1;
+  }
+  int error;
+  if ((error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set)) != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+int numa_node_count(void)
+{
+  // the nodes do not change while the server runs
+  static int count = 0;
+  int nodes;
+  if ((nodes = __atomic_load_n(&count, __ATOMIC_RELAXED))) {
+    return nodes;
+  }
+  nodes = 1;
+  FILE* node_list;
+  if ((node_list = fopen(NODE_LIST_PATH, "r")) != NULL) {
+    char buffer[NODE_LIST_LENGTH];
+    cpu_set_t set;
+    // the node list has the same format of a CPU list
+    if (fgets(buffer, NODE_LIST_LENGTH, node_list) && cpu_list_parse(buffer, &set) == 0) {
+      nodes = CPU_COUNT(&set);
+    }
+    fclose(node_list);
+  }
+  __atomic_store_n(&count, nodes, __ATOMIC_RELAXED);
+  return nodes;
+}
+
+int numa_bind_local(void* addr, const size_t length)
+{
+  if (!addr) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (numa_node_count() < 2) {
+    // nothing to choose from
+    return 0;
+  }
+  unsigned int node;
+  if (syscall(SYS_getcpu, NULL, &node, NULL) == -1) {
+    return -1;
+  }
+  // mbind works on whole pages, leave out the pages shared with other buffers
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t)addr + page_size - 1) & ~(page_size - 1);
+  uintptr_t end = ((uintptr_t)addr + length) & ~(page_size - 1);
+  if (end <= start) {
+    return 0;
+  }
+  if (node >= MAX_NUMA_NODES) {
+    errno = EINVAL;
+    return -1;
+  }
+  unsigned long nodemask[MAX_NUMA_NODES / BITS_PER_LONG] = {0};
+  nodemask[node / BITS_PER_LONG] |= 1UL << (node % BITS_PER_LONG);
+  if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, nodemask, MAX_NUMA_NODES, 0) == -1) {
+    if (errno == ENOSYS) {
+      // the kernel has no NUMA support
+      return 0;
+    }
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+#include <bbuffer.h>
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <concurrency.h>
+
+bbuffer_t* bbuffer_create(const size_t capacity)
+{
+  if (!capacity) {
+    errno = EINVAL;
+    return NULL;
+  }
+  bbuffer_t* buffer;
+  if ((buffer = malloc(sizeof(bbuffer_t))) == NULL) {
+    return NULL;
+  }
+  if ((buffer->data = malloc(sizeof(void*) * capacity)) == NULL) {
+    free(buffer);
+    return NULL;
+  }
+  buffer->capacity = capacity;
+  buffer->front = buffer->count = 0;
+  // initialize mutex and condition variables
+  EXIT_ON_NZ(pthread_mutex_init(&(buffer->mutex), NULL));
+  EXIT_ON_NZ(pthread_cond_init(&(buffer->not_empty), NULL));
+  EXIT_ON_NZ(pthread_cond_init(&(buffer->not_full), NULL));
+
+  return buffer;
+}
+
+int bbuffer_destroy(bbuffer_t* buffer)
+{
+  if (!buffer) {
+    errno = EINVAL;
+    return -1;
+  }
+  // empty buffer
+  while (buffer->count) {
+    free(buffer->data[buffer->front]);
+    buffer->front = (buffer->front + 1) % buffer->capacity;
+    buffer->count--;
+  }
+  // destroy mutex and condition variables
+  EXIT_ON_NZ(pthread_mutex_destroy(&(buffer->mutex)));
+  EXIT_ON_NZ(pthread_cond_destroy(&(buffer->not_empty)));
+  EXIT_ON_NZ(pthread_cond_destroy(&(buffer->not_full)));
+  free(buffer->data);
+  free(buffer);
+
+  return 0;
+}
+
+int bbuffer_enqueue(bbuffer_t* buffer, void* data)
+{
+  if (!buffer || !data) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // lock buffer
+  LOCK(&(buffer->mutex));
+
+  while (buffer->count == buffer->capacity) {
+    // wait consumer
+    WAIT(&(buffer->not_full), &(buffer->mutex));
+  }
+
+  // FIFO insertion
+  buffer->data[(buffer->front + buffer->count) % buffer->capacity] = data;
+  buffer->count++;
+  SIGNAL(&(buffer->not_empty));
+
+  // unlock buffer
+  UNLOCK(&(buffer->mutex));
+
+  return 0;
+}
+
+void* bbuffer_dequeue(bbuffer_t* buffer)
+{
+  if (!buffer) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // lock buffer
+  LOCK(&(buffer->mutex));
+
+  while (!buffer->count) {
+    // wait producer
+    WAIT(&(buffer->not_empty), &(buffer->mutex));
+  }
+
+  // FIFO removal
+  void* data = buffer->data[buffer->front];
+  buffer->front = (buffer->front + 1) % buffer->capacity;
+  buffer->count--;
+  SIGNAL(&(buffer->not_full));
+
+  // unlock buffer
+  UNLOCK(&(buffer->mutex));
+
+  return data;
+}
@@ -8,26 +8,74 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <fss_api.h>
 #include <fss_defaults.h>
 #include <communication_protocol.h>
 #include <error_handling.h>
+#include <bbuffer.h>
+#include <concurrency.h>
 #include <free_item.h>
 #include <str2num.h>
 
-#define HELP_MESSAGE "- Client for File Storage Server -\n\nUsage: %s [options] ...\n\nOptions:\n   -h                     Print a list of all options and exit.\n   -f filename            Specify the socket name to connect to.\n   -w dirname[,n]         Send recursively up to n files in 'dirname'\n                          (no limits if n=0 or unspecified).\n   -W file1[,file2] ...   List of file names to be written to the server.\n   -D dirname             Folder where the evicted files are written.\n   -r file1[,file2] ...   List of file names to be read from the server.\n   -R [n]                 Read 'n' random files currently stored on the server\n                          (no limits if n=0 or unspecified).\n   -d dirname             Folder where to write files read by the server\n                          with the -r and -R options.\n   -t time                Time in milliseconds between sending\n                          two consecutive requests to the server.\n   -l file1[,file2] ...   List of file names on which to acquire the mutual exclusion.\n   -u file1[,file2] ...   List of file names on which to release the mutual exclusion.\n   -c file1[,file2] ...   List of files to be removed from the server if any.\n   -p                     Enables standard output printouts for each operation.\n"
+#define HELP_MESSAGE "- Client for File Storage Server -\n\nUsage: %s [options] ...\n\nOptions:\n   -h                     Print a list of all options and exit.\n   -f filename            Specify the socket name to connect to.\n   -w dirname[,n]         Send recursively up to n files in 'dirname'\n                          (no limits if n=0 or unspecified).\n   -j n                   Send the files of the '-w' option through n parallel\n                          connections and report the throughput at the end.\n   -W file1[,file2] ...   List of file names to be written to the server.\n   -a file1[,file2] ...   List of file names whose content is appended\n                          to the files of the same name on the server.\n   -D dirname             Folder where the evicted files are written.\n   -r file1[,file2] ...   List of file names to be read from the server.\n   -R [n]                 Read 'n' random files currently stored on the server\n                          (no limits if n=0 or unspecified).\n   -d dirname             Folder where to write files read by the server\n                          with the -r and -R options.\n   -t time                Time in milliseconds between sending\n                          two consecutive requests to the server.\n   -l file1[,file2] ...   List of file names on which to acquire the mutual exclusion.\n   -u file1[,file2] ...   List of file names on which to release the mutual exclusion.\n   -c file1[,file2] ...   List of files to be removed from the server if any.\n   -S                     Print the server statistics after the other requests:\n                          latency percentiles of each operation, bytes received\n                          and sent, responses for each response code.\n   -p                     Enables standard output printouts for each operation.\n"
 #define RETRY_DELAY 200
 #define TIMEOUT 5
-
-static ssize_t w_command(char* w_arg, const char* D_directory, const long open_flags);
-static ssize_t visit_n_write(const char* visit_dir, const char* save_dir, const long up_to, const long open_flags);
-static int W_command(char* W_files, const char* D_directory, const int open_flags);
-static int r_command(char* r_arg, const char* d_directory);
-static int R_command(const char* R_arg, const char* d_directory);
+// number of files that can be queued for each uploader thread
+#define UPLOAD_QUEUE_FACTOR 16
+// number of received files that can wait to be written on disk
+#define SINK_QUEUE_LENGTH 64
+
+// function applied to every file found in a directory visit
+typedef int (*visitor_t)(const char* pathname, const struct stat* statbuf, void* arg);
+
+typedef struct {
+  fss_sink_t* save_sink;
+  long open_flags;
+} write_args_t;
+
+typedef struct {
+  char* pathname;
+  off_t size;
+} upload_job_t;
+
+typedef struct {
+  bbuffer_t* jobs;
+  fss_pool_t* pool;
+  fss_sink_t* save_sink;
+  long open_flags;
+  pthread_mutex_t mutex;
+  // set when an uploader meets an unrecoverable error
+  char failed;
+  size_t uploaded_files;
+  size_t uploaded_bytes;
+} upload_args_t;
+
+typedef struct {
+  const char* visit_dir;
+  long up_to;
+  size_t uploaders;
+  upload_args_t* upload_args;
+  ssize_t visited_files;
+} walker_args_t;
+
+static ssize_t w_command(char* w_arg, fss_sink_t* D_sink, const long open_flags, const long connections, const char* socket_name, const struct timespec abstime);
+static ssize_t visit_n_apply(const char* visit_dir, const long up_to, visitor_t visit_file, void* arg);
+static int write_visitor(const char* pathname, const struct stat* statbuf, void* arg);
+static int enqueue_visitor(const char* pathname, const struct stat* statbuf, void* arg);
+static void* walker(void* args);
+static void* uploader(void* args);
+static ssize_t parallel_write(const char* visit_dir, fss_sink_t* save_sink, const long up_to, const long open_flags, const long connections, const char* socket_name, const struct timespec abstime);
+static int upload_file(fss_conn_t* conn, const char* pathname, fss_sink_t* save_sink, const long open_flags);
+static int W_command(char* W_files, fss_sink_t* D_sink, const int open_flags);
+static int a_command(char* a_files, fss_sink_t* D_sink);
+static int r_command(char* r_arg, fss_sink_t* d_sink);
+static int R_command(const char* R_arg, fss_sink_t* d_sink);
 static int l_command(char* l_files);
 static int u_command(char* u_files);
 static int c_command(char* c_files);
+static int S_command(void);
 
 int main(int argc, char* argv[])
 {
@@ -41,14 +89,17 @@ int main(int argc, char* argv[])
   // flags to keep track of the parsed options
   char h_flag = 0,
        w_flag = 0,
+       j_flag = 0,
        W_flag = 0,
+       a_flag = 0,
        D_flag = 0,
        r_flag = 0,
        R_flag = 0,
        d_flag = 0,
        l_flag = 0,
        u_flag = 0,
-       c_flag = 0;
+       c_flag = 0,
+       S_flag = 0;
   // counters to check the number of times certain options are specified
   int f_flag = 0,
       p_flag = 0;
@@ -58,7 +109,9 @@ int main(int argc, char* argv[])
   // we just keep pointers to option arguments
   char* f_arg = NULL,
       * w_arg = NULL,
+      * j_arg = NULL,
       * W_arg = NULL,
+      * a_arg = NULL,
       * D_arg = NULL,
       * r_arg = NULL,
       * R_arg = NULL,
@@ -71,7 +124,7 @@ int main(int argc, char* argv[])
   int opt;
   // disable getopt error messages
   opterr = 0;
-  while ((opt = getopt(argc, argv, ":hf:w:W:D:r:R:d:t:l:u:c:p")) != -1) {
+  while ((opt = getopt(argc, argv, ":hf:w:j:W:a:D:r:R:d:t:l:u:c:Sp")) != -1) {
 
     // in case of missing optional argument, continue parsing
     // (arguments cannot start with a hyphen '-')
@@ -96,10 +149,18 @@ int main(int argc, char* argv[])
         w_arg = optarg;
 	w_flag = 1;
         break;
+      case 'j':
+        j_arg = optarg;
+        j_flag = 1;
+        break;
       case 'W':
         W_arg = optarg;
         W_flag = 1;
         break;
+      case 'a':
+        a_arg = optarg;
+        a_flag = 1;
+        break;
       case 'D':
         D_arg = optarg;
         D_flag = 1;
@@ -131,6 +192,9 @@ int main(int argc, char* argv[])
         c_arg = optarg;
         c_flag = 1;
         break;
+      case 'S':
+        S_flag = 1;
+        break;
       case 'p':
 	fss_verbose = 1;
         p_flag++;
@@ -183,15 +247,26 @@ int main(int argc, char* argv[])
     fprintf(stderr, "error: unable to parse time value of '-t' option, setting default value (0)\n");
     time_between_requests = 0;
   }
+  // j (parallel connections) option check
+  long connections = 0;
+  if (j_arg && (str2num(j_arg, &connections) != 0 || connections < 1)) {
+    fprintf(stderr, "[%d]: ", getpid());
+    fprintf(stderr, "error: unable to parse n value of '-j' option, sending files sequentially\n");
+    connections = 0;
+  }
+  if (j_flag && !w_flag) {
+    fprintf(stderr, "[%d]: ", getpid());
+    fprintf(stderr, "error: cannot use '-j' option without '-w' option\n");
+  }
   // p (verbose) option check
   if (p_flag > 1) {
     fprintf(stderr, "[%d]: ", getpid());
     fprintf(stderr, "error: option '-p' cannot be repeated\n");
   }
   // D option check
-  if (D_flag && !w_flag && !W_flag) {
+  if (D_flag && !w_flag && !W_flag && !a_flag) {
     fprintf(stderr, "[%d]: ", getpid());
-    fprintf(stderr, "error: cannot use '-D' option without '-w' or '-W' options\n");
+    fprintf(stderr, "error: cannot use '-D' option without '-w', '-W' or '-a' options\n");
   }
   // d option check
   if (d_flag && !r_flag && !R_flag) {
@@ -209,20 +284,35 @@ int main(int argc, char* argv[])
     perror("openConnection");
     return EXIT_FAILURE;
   }
+  // open the directories where the received files are written
+  fss_sink_t* D_sink = NULL,
+            * d_sink = NULL;
+  if (D_arg && (w_flag || W_flag || a_flag) && (D_sink = fss_sink_create(D_arg, SINK_QUEUE_LENGTH)) == NULL) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("fss_sink_create");
+  }
+  if (d_arg && (r_flag || R_flag) && (d_sink = fss_sink_create(d_arg, SINK_QUEUE_LENGTH)) == NULL) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("fss_sink_create");
+  }
   if (w_flag) {
-    w_command(w_arg, D_arg, (O_CREATE|O_LOCK));
+    w_command(w_arg, D_sink, (O_CREATE|O_LOCK), connections, f_arg, abstime);
     sleep_for(msec);
   }
   if (W_flag) {
-    W_command(W_arg, D_arg, (O_CREATE|O_LOCK));
+    W_command(W_arg, D_sink, (O_CREATE|O_LOCK));
+    sleep_for(msec);
+  }
+  if (a_flag) {
+    a_command(a_arg, D_sink);
     sleep_for(msec);
   }
   if (r_flag) {
-    r_command(r_arg, d_arg);
+    r_command(r_arg, d_sink);
     sleep_for(msec);
   }
   if (R_flag) {
-    R_command(R_arg, d_arg);
+    R_command(R_arg, d_sink);
     sleep_for(msec);
   }
   if (l_flag) {
@@ -237,6 +327,18 @@ int main(int argc, char* argv[])
     c_command(c_arg);
     sleep_for(msec);
   }
+  if (S_flag) {
+    S_command();
+  }
+  // wait for the received files to be written
+  if (D_sink && fss_sink_destroy(D_sink) == -1) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("fss_sink_destroy");
+  }
+  if (d_sink && fss_sink_destroy(d_sink) == -1) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("fss_sink_destroy");
+  }
   if (closeConnection(f_arg) == -1) {
     fprintf(stderr, "[%d]: ", getpid());
     perror("closeConnection");
@@ -246,7 +348,7 @@ int main(int argc, char* argv[])
   return 0;
 }
 
-static ssize_t w_command(char* w_arg, const char* D_directory, const long open_flags)
+static ssize_t w_command(char* w_arg, fss_sink_t* D_sink, const long open_flags, const long connections, const char* socket_name, const struct timespec abstime)
 {
   char* token,
       * save_ptr = NULL,
@@ -260,10 +362,20 @@ static ssize_t w_command(char* w_arg, const char* D_directory, const long open_f
     fprintf(stderr, "error: unable to parse n value of '-w' option, setting default value (0)\n");
     w_n = 0;
   }
-  return visit_n_write(w_dirname, D_directory, w_n, open_flags);
+  if (connections) {
+    return parallel_write(w_dirname, D_sink, w_n, open_flags, connections, socket_name, abstime);
+  }
+  write_args_t write_args = {.save_sink = D_sink, .open_flags = open_flags};
+  return visit_n_apply(w_dirname, w_n, write_visitor, &write_args);
 }
 
-static ssize_t visit_n_write(const char* visit_dir, const char* save_dir, const long up_to, const long open_flags)
+/**
+ * Recursively visit 'visit_dir' and apply 'visit_file' to up to 'up_to' files
+ * (no limits if up_to <= 0), stopping the visit as soon as 'visit_file' returns -1
+ *
+ * Return the number of visited files on success, -1 on error
+ */
+static ssize_t visit_n_apply(const char* visit_dir, const long up_to, visitor_t visit_file, void* arg)
 {
   // variables initialization
   DIR* dir = NULL;
@@ -285,8 +397,8 @@ static ssize_t visit_n_write(const char* visit_dir, const char* save_dir, const
       goto end;
     }
     memcpy(pathname, visit_dir, strlen(visit_dir));
-    if (visit_dir[strlen(visit_dir)] != '/') {
-      strncat(pathname, "/", strlen("/"));
+    if (visit_dir[strlen(visit_dir) - 1] != '/') {
+      pathname[strlen(visit_dir)] = '/';
       memcpy(pathname + strlen(visit_dir) + 1, entry->d_name, strlen(entry->d_name));
     } else {
       memcpy(pathname + strlen(visit_dir), entry->d_name, strlen(entry->d_name));
@@ -301,49 +413,17 @@ static ssize_t visit_n_write(const char* visit_dir, const char* save_dir, const
     if (S_ISDIR(statbuf.st_mode)) {
       // entry is a directory
 
-      // recursively visit and write files in subdirectories
+      // recursively visit the subdirectories
       ssize_t subdir_count;
-      if ((subdir_count = visit_n_write(pathname, save_dir, up_to - processed_files, open_flags)) == -1) {
+      if ((subdir_count = visit_n_apply(pathname, up_to - processed_files, visit_file, arg)) == -1) {
         goto end;
       }
       processed_files += subdir_count;
 
     } else {
       // entry is a file
-
-      if (openFile(pathname, open_flags) == -1) {
-        fprintf(stderr, "[%d]: ", getpid());
-        perror("openFile");
-        if (errno != ECANCELED) {
-	  goto end;
-	}
-      } else {
-        if (writeFile(pathname, save_dir) == -1) {
-          fprintf(stderr, "[%d]: ", getpid());
-          perror("writeFile");
-	  if (errno != ECANCELED) {
-	    goto end;
-	  }
-	  // the file is empty, it must be removed
-	  if (removeFile(pathname) == -1) {
-            fprintf(stderr, "[%d]: ", getpid());
-            perror("removeFile");
-	    // could not remove the file, at least try to close it
-	    if (closeFile(pathname) == -1) {
-              fprintf(stderr, "[%d]: ", getpid());
-              perror("closeFile");
-	      if (errno != ECANCELED) {
-	        goto end;
-	      }
-	    }
-	  }
-        } else if (closeFile(pathname) == -1) {
-          fprintf(stderr, "[%d]: ", getpid());
-          perror("closeFile");
-	  if (errno != ECANCELED) {
-	    goto end;
-	  }
-        }
+      if (visit_file(pathname, &statbuf, arg) == -1) {
+        goto end;
       }
       processed_files++;
     }
@@ -368,52 +448,281 @@ static ssize_t visit_n_write(const char* visit_dir, const char* save_dir, const
   return -1;
 }
 
-static int W_command(char* W_files, const char* D_directory, const int open_flags)
+/**
+ * Visitor that writes a file to the server through the default connection
+ */
+static int write_visitor(const char* pathname, const struct stat* statbuf, void* arg)
+{
+  (void)statbuf;
+  write_args_t* write_args = (write_args_t*)arg;
+  return (upload_file(NULL, pathname, write_args->save_sink, write_args->open_flags) == -1 ? -1 : 0);
+}
+
+/**
+ * Visitor that hands a file over to the uploader threads
+ */
+static int enqueue_visitor(const char* pathname, const struct stat* statbuf, void* arg)
+{
+  upload_args_t* upload_args = (upload_args_t*)arg;
+
+  LOCK(&(upload_args->mutex));
+  char failed = upload_args->failed;
+  UNLOCK(&(upload_args->mutex));
+  if (failed) {
+    // stop the visit
+    return -1;
+  }
+
+  upload_job_t* job;
+  if ((job = malloc(sizeof(upload_job_t))) == NULL) {
+    return -1;
+  }
+  if ((job->pathname = strdup(pathname)) == NULL) {
+    free_item((void**)&job);
+    return -1;
+  }
+  job->size = statbuf->st_size;
+  // wait for a free slot if the uploaders are lagging behind
+  EXIT_ON_NEG_ONE(bbuffer_enqueue(upload_args->jobs, job));
+  return 0;
+}
+
+/**
+ * Function executed by the directory walker thread
+ */
+static void* walker(void* args)
+{
+  walker_args_t* walker_args = (walker_args_t*)args;
+  upload_args_t* upload_args = walker_args->upload_args;
+
+  walker_args->visited_files = visit_n_apply(walker_args->visit_dir, walker_args->up_to, enqueue_visitor, upload_args);
+
+  // send a termination message to each uploader
+  for (size_t i = 0; i < walker_args->uploaders; i++) {
+    upload_job_t* term;
+    EXIT_ON_NULL((term = calloc(1, sizeof(upload_job_t))));
+    EXIT_ON_NEG_ONE(bbuffer_enqueue(upload_args->jobs, term));
+  }
+  return NULL;
+}
+
+/**
+ * Function executed by the uploader threads, each on its own connection
+ */
+static void* uploader(void* args)
+{
+  upload_args_t* upload_args = (upload_args_t*)args;
+  fss_conn_t* conn;
+  EXIT_ON_NULL((conn = fss_pool_acquire(upload_args->pool)));
+
+  upload_job_t* job;
+  while (1) {
+    EXIT_ON_NULL((job = (upload_job_t*)bbuffer_dequeue(upload_args->jobs)));
+    if (!job->pathname) {
+      // termination message
+      break;
+    }
+    LOCK(&(upload_args->mutex));
+    char failed = upload_args->failed;
+    UNLOCK(&(upload_args->mutex));
+
+    if (!failed) {
+      int result = upload_file(conn, job->pathname, upload_args->save_sink, upload_args->open_flags);
+      LOCK(&(upload_args->mutex));
+      if (result == -1) {
+        upload_args->failed = 1;
+      } else if (result == 1) {
+        upload_args->uploaded_files++;
+        upload_args->uploaded_bytes += job->size;
+      }
+      UNLOCK(&(upload_args->mutex));
+    }
+    free_item((void**)&(job->pathname));
+    free_item((void**)&job);
+  }
+  free_item((void**)&job);
+
+  EXIT_ON_NEG_ONE(fss_pool_release(upload_args->pool, conn));
+  return NULL;
+}
+
+/**
+ * Recursively visit 'visit_dir' and write up to 'up_to' files to the server,
+ * using a walker thread that feeds 'connections' uploader threads
+ *
+ * Return the number of visited files on success, -1 on error
+ */
+static ssize_t parallel_write(const char* visit_dir, fss_sink_t* save_sink, const long up_to, const long open_flags, const long connections, const char* socket_name, const struct timespec abstime)
+{
+  // variables initialization
+  pthread_t* uploaders = NULL;
+  upload_args_t upload_args = {.save_sink = save_sink, .open_flags = open_flags};
+
+  if ((upload_args.pool = fss_pool_create(socket_name, connections, RETRY_DELAY, abstime)) == NULL) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("fss_pool_create");
+    return -1;
+  }
+  EXIT_ON_NULL((upload_args.jobs = bbuffer_create(connections * UPLOAD_QUEUE_FACTOR)));
+  EXIT_ON_NZ(pthread_mutex_init(&(upload_args.mutex), NULL));
+
+  struct timespec start, stop;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &start));
+
+  // start the pipeline
+  EXIT_ON_NULL((uploaders = malloc(sizeof(pthread_t) * connections)));
+  for (long i = 0; i < connections; i++) {
+    EXIT_ON_NZ(pthread_create(&uploaders[i], NULL, uploader, &upload_args));
+  }
+  walker_args_t walker_args = {.visit_dir = visit_dir, .up_to = up_to, .uploaders = connections, .upload_args = &upload_args};
+  pthread_t walker_thread;
+  EXIT_ON_NZ(pthread_create(&walker_thread, NULL, walker, &walker_args));
+
+  // wait for the pipeline to drain
+  EXIT_ON_NZ(pthread_join(walker_thread, NULL));
+  for (long i = 0; i < connections; i++) {
+    EXIT_ON_NZ(pthread_join(uploaders[i], NULL));
+  }
+  free_item((void**)&uploaders);
+
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &stop));
+  double elapsed = (stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) / 1000000000;
+  double megabytes = (double)upload_args.uploaded_bytes / 1048576;
+  fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "-w", visit_dir);
+  fprintf(stdout, "%zu file(s) (%.2f MB) written in %.3f s through %ld connection(s): %.1f files/s, %.2f MB/s\n",
+          upload_args.uploaded_files, megabytes, elapsed, connections,
+          (elapsed > 0 ? upload_args.uploaded_files / elapsed : 0), (elapsed > 0 ? megabytes / elapsed : 0));
+
+  EXIT_ON_NEG_ONE(bbuffer_destroy(upload_args.jobs));
+  EXIT_ON_NZ(pthread_mutex_destroy(&(upload_args.mutex)));
+  if (fss_pool_destroy(upload_args.pool) == -1) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("fss_pool_destroy");
+  }
+  return (upload_args.failed ? -1 : walker_args.visited_files);
+}
+
+/**
+ * Open, write and close a file on the server through the connection 'conn'
+ * (the default connection if 'conn' is NULL),
+ * removing the file from the server if it could not be written
+ *
+ * Return 1 if the file was written, 0 if the server refused a request, -1 on error
+ */
+static int upload_file(fss_conn_t* conn, const char* pathname, fss_sink_t* save_sink, const long open_flags)
+{
+  if (fss_open_file(conn, pathname, open_flags) == -1) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("openFile");
+    return (errno != ECANCELED ? -1 : 0);
+  }
+  if (fss_write_file(conn, pathname, save_sink) == -1) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("writeFile");
+    if (errno != ECANCELED) {
+      return -1;
+    }
+    // the file is empty, it must be removed
+    if (fss_remove_file(conn, pathname) == -1) {
+      fprintf(stderr, "[%d]: ", getpid());
+      perror("removeFile");
+      // could not remove the file, at least try to close it
+      if (fss_close_file(conn, pathname) == -1) {
+        fprintf(stderr, "[%d]: ", getpid());
+        perror("closeFile");
+        if (errno != ECANCELED) {
+          return -1;
+        }
+      }
+    }
+    return 0;
+  }
+  if (fss_close_file(conn, pathname) == -1) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("closeFile");
+    if (errno != ECANCELED) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+static int W_command(char* W_files, fss_sink_t* D_sink, const int open_flags)
 {
   char* current_file,
       * save_ptr = NULL;
   current_file = strtok_r(W_files, ",", &save_ptr);
   while (current_file) {
-    if (openFile(current_file, open_flags) == -1) {
+    if (upload_file(NULL, current_file, D_sink, open_flags) == -1) {
+      return -1;
+    }
+    current_file = strtok_r(NULL, ",", &save_ptr);
+  }
+  return 0;
+}
+
+static int a_command(char* a_files, fss_sink_t* D_sink)
+{
+  // variables initialization
+  char* file_content = NULL;
+  FILE* file = NULL;
+
+  char* current_file,
+      * save_ptr = NULL;
+
+  current_file = strtok_r(a_files, ",", &save_ptr);
+  while (current_file) {
+    // read the content to append
+    struct stat statbuf;
+    if (stat(current_file, &statbuf) == -1 || (file = fopen(current_file, "r")) == NULL) {
+      fprintf(stderr, "[%d]: ", getpid());
+      perror(current_file);
+      goto end;
+    }
+    size_t file_size = statbuf.st_size;
+    if ((file_content = malloc(sizeof(char) * (file_size ? file_size : 1))) == NULL || fread(file_content, 1, file_size, file) != file_size) {
+      fprintf(stderr, "[%d]: ", getpid());
+      perror(current_file);
+      goto end;
+    }
+    fclose(file);
+    file = NULL;
+    if (openFile(current_file, O_NOFLAG) == -1) {
       fprintf(stderr, "[%d]: ", getpid());
       perror("openFile");
       if (errno != ECANCELED) {
-        return -1;
+        goto end;
       }
     } else {
-      if (writeFile(current_file, D_directory) == -1) {
+      if (fss_append_to_file(NULL, current_file, file_content, file_size, D_sink) == -1) {
         fprintf(stderr, "[%d]: ", getpid());
-        perror("writeFile");
+        perror("appendToFile");
         if (errno != ECANCELED) {
-          return -1;
+          goto end;
         }
-        // the file is empty, it must be removed
-        if (removeFile(current_file) == -1) {
-          fprintf(stderr, "[%d]: ", getpid());
-          perror("removeFile");
-	  // could not remove the file, at least try to close it
-	  if (closeFile(current_file) == -1) {
-            fprintf(stderr, "[%d]: ", getpid());
-            perror("closeFile");
-	    if (errno != ECANCELED) {
-              return -1;
-	    }
-	  }
-	}
-      } else if (closeFile(current_file) == -1) {
+      }
+      if (closeFile(current_file) == -1) {
         fprintf(stderr, "[%d]: ", getpid());
         perror("closeFile");
         if (errno != ECANCELED) {
-          return -1;
-	}
+          goto end;
+        }
       }
     }
+    free_item((void**)&file_content);
     current_file = strtok_r(NULL, ",", &save_ptr);
   }
   return 0;
+
+  end:
+  if (file) {
+    fclose(file);
+  }
+  free_item((void**)&file_content);
+  return -1;
 }
 
-static int r_command(char* r_files, const char* d_directory)
+static int r_command(char* r_files, fss_sink_t* d_sink)
 {
   // variables initialization
   char* file_content = NULL;
@@ -442,10 +751,13 @@ static int r_command(char* r_files, const char* d_directory)
 	}
       }
     } else {
-      if (d_directory) {
-        if (store_file(current_file, file_content, file_size, d_directory) == -1) {
+      if (d_sink) {
+        int result = fss_sink_store(d_sink, current_file, file_content, file_size);
+        // the sink owns the file content now
+        file_content = NULL;
+        if (result == -1) {
           fprintf(stderr, "[%d]: ", getpid());
-          perror("store_file");
+          perror("fss_sink_store");
 	  goto end;
         }
       } else if (fss_verbose) {
@@ -470,7 +782,7 @@ static int r_command(char* r_files, const char* d_directory)
   return -1;
 }
 
-static int R_command(const char* R_arg, const char* d_directory)
+static int R_command(const char* R_arg, fss_sink_t* d_sink)
 {
   long R_n = 0;
   if (R_arg && str2num(R_arg, &R_n) != 0) {
@@ -478,7 +790,7 @@ static int R_command(const char* R_arg, const char* d_directory)
     fprintf(stderr, "error: unable to parse n value of '-R' option, setting default value (0)\n");
     R_n = 0;
   }
-  if (readNFiles(R_n, d_directory) == -1) {
+  if (fss_read_n_files(NULL, R_n, d_sink) == -1) {
     fprintf(stderr, "[%d]: ", getpid());
     perror("readNFiles");
     return -1;
@@ -539,3 +851,17 @@ static int c_command(char* c_files)
   }
   return 0;
 }
+
+static int S_command(void)
+{
+  char* report;
+  size_t report_size;
+  if (fss_stats(NULL, &report, &report_size) == -1) {
+    fprintf(stderr, "[%d]: ", getpid());
+    perror("fss_stats");
+    return -1;
+  }
+  fwrite(report, sizeof(char), report_size, stdout);
+  free_item((void**)&report);
+  return 0;
+}
@@ -1,3 +1,5 @@
+#include <posixver.h>
+
 #include <config_parser.h>
 
 #include <stdio.h>
@@ -10,6 +12,7 @@
 #include <error_handling.h>
 #include <free_item.h>
 #include <str2num.h>
+#include <affinity.h>
 
 #define BUFSIZE 1024
 
@@ -28,7 +31,25 @@ int parser(const char* config_file_path, char** server_socket, config_t* server_
        WORKER_POOL_SIZE_flag = 0,
        STORAGE_MAX_FILE_NUMBER_flag = 0,
        STORAGE_MAX_SIZE_flag = 0,
-       BACKLOG_flag = 0;
+       BACKLOG_flag = 0,
+       MAX_REQUEST_SIZE_flag = 0,
+       WORKER_POOL_MAX_flag = 0,
+       QUEUE_LATENCY_TARGET_flag = 0,
+       WORKER_IDLE_TIMEOUT_flag = 0,
+       MASTER_CPUS_flag = 0,
+       WORKER_CPUS_flag = 0,
+       CONTROL_WORKER_SHARE_flag = 0,
+       BULK_WORKER_SHARE_flag = 0,
+       TRACE_FILE_flag = 0,
+       SLOW_REQUEST_THRESHOLD_flag = 0,
+       PERF_COUNTERS_flag = 0,
+       SHM_MAX_SIZE_flag = 0,
+       MEMFD_MIN_SIZE_flag = 0,
+       SHM_INDEX_SIZE_flag = 0,
+       SHM_INDEX_SLOTS_flag = 0,
+       SNAPSHOT_FILE_flag = 0,
+       WAL_FILE_flag = 0,
+       WAL_CHECKPOINT_SIZE_flag = 0;
 
   // used to verify that the socket pathname fits into the array
   struct sockaddr_un sizecheck;
@@ -146,6 +167,148 @@ int parser(const char* config_file_path, char** server_socket, config_t* server_
 	server_config->backlog = value;
 	BACKLOG_flag = 1;
       }
+      if (strncmp(line, "MAX_REQUEST_SIZE", 16) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 1) {
+          fprintf(stderr, "error: %s: bad config file format\n", "MAX_REQUEST_SIZE");
+          continue;
+        }
+	server_config->max_request_size = value;
+	MAX_REQUEST_SIZE_flag = 1;
+      }
+      if (strncmp(line, "WORKER_POOL_MAX", 15) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 1) {
+          fprintf(stderr, "error: %s: bad config file format\n", "WORKER_POOL_MAX");
+          continue;
+        }
+	server_config->worker_pool_max = value;
+	WORKER_POOL_MAX_flag = 1;
+      }
+      if (strncmp(line, "QUEUE_LATENCY_TARGET", 20) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 1) {
+          fprintf(stderr, "error: %s: bad config file format\n", "QUEUE_LATENCY_TARGET");
+          continue;
+        }
+	server_config->queue_latency_target = value;
+	QUEUE_LATENCY_TARGET_flag = 1;
+      }
+      if (strncmp(line, "WORKER_IDLE_TIMEOUT", 19) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 1) {
+          fprintf(stderr, "error: %s: bad config file format\n", "WORKER_IDLE_TIMEOUT");
+          continue;
+        }
+	server_config->worker_idle_timeout = value;
+	WORKER_IDLE_TIMEOUT_flag = 1;
+      }
+      if (strncmp(line, "MASTER_CPUS", 11) == 0) {
+        if (cpu_list_parse(equalsign, &(server_config->master_cpus)) != 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "MASTER_CPUS");
+          continue;
+        }
+	MASTER_CPUS_flag = 1;
+      }
+      if (strncmp(line, "WORKER_CPUS", 11) == 0) {
+        if (cpu_list_parse(equalsign, &(server_config->worker_cpus)) != 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "WORKER_CPUS");
+          continue;
+        }
+	WORKER_CPUS_flag = 1;
+      }
+      if (strncmp(line, "CONTROL_WORKER_SHARE", 20) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 1 || value > 100) {
+          fprintf(stderr, "error: %s: bad config file format\n", "CONTROL_WORKER_SHARE");
+          continue;
+        }
+	server_config->control_worker_share = value;
+	CONTROL_WORKER_SHARE_flag = 1;
+      }
+      if (strncmp(line, "BULK_WORKER_SHARE", 17) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 1 || value > 100) {
+          fprintf(stderr, "error: %s: bad config file format\n", "BULK_WORKER_SHARE");
+          continue;
+        }
+	server_config->bulk_worker_share = value;
+	BULK_WORKER_SHARE_flag = 1;
+      }
+      if (strncmp(line, "TRACE_FILE", 10) == 0) {
+        if (!strlen(equalsign) || strlen(equalsign) >= PATH_MAX) {
+          fprintf(stderr, "error: %s: bad config file format\n", "TRACE_FILE");
+          continue;
+        }
+	strcpy(server_config->trace_file, equalsign);
+	TRACE_FILE_flag = 1;
+      }
+      if (strncmp(line, "SLOW_REQUEST_THRESHOLD", 22) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "SLOW_REQUEST_THRESHOLD");
+          continue;
+        }
+	server_config->slow_request_threshold = value;
+	SLOW_REQUEST_THRESHOLD_flag = 1;
+      }
+      if (strncmp(line, "PERF_COUNTERS", 13) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 0 || value > 1) {
+          fprintf(stderr, "error: %s: bad config file format\n", "PERF_COUNTERS");
+          continue;
+        }
+	server_config->perf_counters = value;
+	PERF_COUNTERS_flag = 1;
+      }
+      if (strncmp(line, "SHM_MAX_SIZE", 12) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "SHM_MAX_SIZE");
+          continue;
+        }
+	server_config->shm_max_size = value;
+	SHM_MAX_SIZE_flag = 1;
+      }
+      if (strncmp(line, "MEMFD_MIN_SIZE", 14) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "MEMFD_MIN_SIZE");
+          continue;
+        }
+	server_config->memfd_min_size = value;
+	MEMFD_MIN_SIZE_flag = 1;
+      }
+      if (strncmp(line, "SHM_INDEX_SIZE", 14) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "SHM_INDEX_SIZE");
+          continue;
+        }
+	server_config->shm_index_size = value;
+	SHM_INDEX_SIZE_flag = 1;
+      }
+      if (strncmp(line, "SHM_INDEX_SLOTS", 15) == 0) {
+        if (str2num(equalsign, &value) != 0 || value <= 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "SHM_INDEX_SLOTS");
+          continue;
+        }
+	server_config->shm_index_slots = value;
+	SHM_INDEX_SLOTS_flag = 1;
+      }
+      if (strncmp(line, "SNAPSHOT_FILE", 13) == 0) {
+        if (!strlen(equalsign) || strlen(equalsign) >= PATH_MAX - 4) {
+          fprintf(stderr, "error: %s: bad config file format\n", "SNAPSHOT_FILE");
+          continue;
+        }
+	strcpy(server_config->snapshot_file, equalsign);
+	SNAPSHOT_FILE_flag = 1;
+      }
+      if (strncmp(line, "WAL_FILE", 8) == 0) {
+        if (!strlen(equalsign) || strlen(equalsign) >= PATH_MAX - 4) {
+          fprintf(stderr, "error: %s: bad config file format\n", "WAL_FILE");
+          continue;
+        }
+	strcpy(server_config->wal_file, equalsign);
+	WAL_FILE_flag = 1;
+      }
+      if (strncmp(line, "WAL_CHECKPOINT_SIZE", 19) == 0) {
+        if (str2num(equalsign, &value) != 0 || value < 0) {
+          fprintf(stderr, "error: %s: bad config file format\n", "WAL_CHECKPOINT_SIZE");
+          continue;
+        }
+	server_config->wal_checkpoint_size = value;
+	WAL_CHECKPOINT_SIZE_flag = 1;
+      }
     } // while
 
     free_item((void**)&line);
@@ -182,6 +345,72 @@ int parser(const char* config_file_path, char** server_socket, config_t* server_
   if (!BACKLOG_flag) {
     server_config->backlog = DEF_BACKLOG;
   }
+  if (!MAX_REQUEST_SIZE_flag) {
+    server_config->max_request_size = DEF_MAX_REQUEST_SIZE;
+  }
+  if (!server_config->max_request_size || server_config->max_request_size > server_config->storage_max_size) {
+    // a request cannot store more than the storage capacity
+    server_config->max_request_size = server_config->storage_max_size;
+  }
+  if (!WORKER_POOL_MAX_flag) {
+    server_config->worker_pool_max = DEF_WORKER_POOL_MAX;
+  }
+  if (server_config->worker_pool_max < server_config->worker_pool_size) {
+    // the pool cannot shrink below its initial size
+    server_config->worker_pool_max = server_config->worker_pool_size;
+  }
+  if (!QUEUE_LATENCY_TARGET_flag) {
+    server_config->queue_latency_target = DEF_QUEUE_LATENCY_TARGET;
+  }
+  if (!WORKER_IDLE_TIMEOUT_flag) {
+    server_config->worker_idle_timeout = DEF_WORKER_IDLE_TIMEOUT;
+  }
+  if (!MASTER_CPUS_flag) {
+    // an empty set means that the threads are not pinned
+    CPU_ZERO(&(server_config->master_cpus));
+  }
+  if (!WORKER_CPUS_flag) {
+    CPU_ZERO(&(server_config->worker_cpus));
+  }
+  if (!CONTROL_WORKER_SHARE_flag) {
+    server_config->control_worker_share = DEF_CONTROL_WORKER_SHARE;
+  }
+  if (!BULK_WORKER_SHARE_flag) {
+    server_config->bulk_worker_share = DEF_BULK_WORKER_SHARE;
+  }
+  if (!TRACE_FILE_flag) {
+    // requests are not traced
+    server_config->trace_file[0] = '\0';
+  }
+  if (!SLOW_REQUEST_THRESHOLD_flag) {
+    server_config->slow_request_threshold = DEF_SLOW_REQUEST_THRESHOLD;
+  }
+  if (!PERF_COUNTERS_flag) {
+    server_config->perf_counters = DEF_PERF_COUNTERS;
+  }
+  if (!SHM_MAX_SIZE_flag) {
+    server_config->shm_max_size = DEF_SHM_MAX_SIZE;
+  }
+  if (!MEMFD_MIN_SIZE_flag) {
+    server_config->memfd_min_size = DEF_MEMFD_MIN_SIZE;
+  }
+  if (!SHM_INDEX_SIZE_flag) {
+    server_config->shm_index_size = DEF_SHM_INDEX_SIZE;
+  }
+  if (!SHM_INDEX_SLOTS_flag) {
+    server_config->shm_index_slots = DEF_SHM_INDEX_SLOTS;
+  }
+  if (!SNAPSHOT_FILE_flag) {
+    // no snapshot is loaded nor written
+    server_config->snapshot_file[0] = '\0';
+  }
+  if (!WAL_FILE_flag) {
+    // the changes are not logged
+    server_config->wal_file[0] = '\0';
+  }
+  if (!WAL_CHECKPOINT_SIZE_flag) {
+    server_config->wal_checkpoint_size = DEF_WAL_CHECKPOINT_SIZE;
+  }
 
   return 0;
 
@@ -0,0 +1,433 @@
+#include <posixver.h>
+
+#include <connection.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <free_item.h>
+#include <concurrency.h>
+#include <stages.h>
+
+// initial size of the input buffer, enough for most requests
+#define CONN_BUFFER_LENGTH 4096
+// size of the buffer used to discard data
+#define SKIP_BUFFER_LENGTH 65536
+
+conn_t* conn_create(const int fd)
+{
+  if (fd < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  conn_t* conn;
+  if ((conn = calloc(1, sizeof(conn_t))) == NULL) {
+    return NULL;
+  }
+  if ((conn->buffer = malloc(sizeof(char) * CONN_BUFFER_LENGTH)) == NULL) {
+    free_item((void**)&conn);
+    return NULL;
+  }
+  conn->fd = fd;
+  conn->capacity = CONN_BUFFER_LENGTH;
+  EXIT_ON_NZ(pthread_mutex_init(&(conn->out_mutex), NULL));
+  return conn;
+}
+
+/**
+ * Discard the data waiting to be sent to the client
+ */
+static void conn_discard(conn_t* conn)
+{
+  out_chunk_t* chunk;
+  while ((chunk = conn->out_head)) {
+    conn->out_head = chunk->next;
+    if (chunk->fd != -1) {
+      close(chunk->fd);
+    }
+    free_item((void**)&(chunk->data));
+    free_item((void**)&chunk);
+  }
+  conn->out_tail = NULL;
+  conn->out_bytes = 0;
+}
+
+void conn_destroy(conn_t* conn)
+{
+  if (!conn) {
+    return;
+  }
+  conn_discard(conn);
+  if (conn->shm) {
+    munmap(conn->shm, conn->shm_size);
+  }
+  EXIT_ON_NZ(pthread_mutex_destroy(&(conn->out_mutex)));
+  free_item((void**)&(conn->buffer));
+  free_item((void**)&conn);
+}
+
+size_t conn_pending(const conn_t* conn)
+{
+  return conn->end - conn->start;
+}
+
+/**
+ * Receive data from the socket into 'buf', counting the system calls
+ *
+ * Return the number of bytes received, 0 if the client closed the connection, -1 on error (set errno)
+ */
+static ssize_t conn_recv(conn_t* conn, void* buf, const size_t size)
+{
+  ssize_t received;
+  while (1) {
+    conn->recv_count++;
+    if ((received = recv(conn->fd, buf, size, 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ECONNRESET) {
+        // the client left
+        return 0;
+      }
+    }
+    return received;
+  }
+}
+
+int conn_fill(conn_t* conn, const size_t size)
+{
+  if (conn_pending(conn) >= size) {
+    return 1;
+  }
+  // one more byte is kept for conn_terminate
+  if (conn->capacity - conn->start < size + 1) {
+    // move the data not yet parsed to the beginning of the buffer
+    memmove(conn->buffer, conn->buffer + conn->start, conn_pending(conn));
+    conn->end -= conn->start;
+    conn->start = 0;
+    if (conn->capacity < size + 1) {
+      // the buffer is too small for the request
+      size_t new_capacity = conn->capacity * 2;
+      if (new_capacity < size + 1) {
+        new_capacity = size + 1;
+      }
+      char* new_buffer;
+      if ((new_buffer = realloc(conn->buffer, sizeof(char) * new_capacity)) == NULL) {
+        return -1;
+      }
+      conn->buffer = new_buffer;
+      conn->capacity = new_capacity;
+    }
+  }
+  while (conn_pending(conn) < size) {
+    // receive as much as it fits in the buffer
+    ssize_t received;
+    if ((received = conn_recv(conn, conn->buffer + conn->end, conn->capacity - conn->end - 1)) <= 0) {
+      return (int)received;
+    }
+    conn->end += received;
+  }
+  return 1;
+}
+
+char* conn_peek(conn_t* conn, const size_t size)
+{
+  if (conn_pending(conn) < size && conn->end + 1 < conn->capacity) {
+    // receive without blocking what the client has already sent
+    ssize_t received;
+    conn->recv_count++;
+    if ((received = recv(conn->fd, conn->buffer + conn->end, conn->capacity - conn->end - 1, MSG_DONTWAIT)) > 0) {
+      conn->end += received;
+    }
+    // otherwise nothing to parse yet, the client left or an error occurred:
+    // anyway the worker will find out when reading the request
+  }
+  return conn_pending(conn) >= size ? conn->buffer + conn->start : NULL;
+}
+
+char* conn_take(conn_t* conn, const size_t size)
+{
+  char* data = conn->buffer + conn->start;
+  conn->start += size;
+  conn->read_bytes += size;
+  return data;
+}
+
+void conn_terminate(conn_t* conn, char* data, const size_t size)
+{
+  conn_release(conn);
+  conn->terminated = data + size;
+  conn->saved = *(conn->terminated);
+  *(conn->terminated) = '\0';
+}
+
+void conn_release(conn_t* conn)
+{
+  if (conn->terminated) {
+    *(conn->terminated) = conn->saved;
+    conn->terminated = NULL;
+  }
+  if (conn->start == conn->end) {
+    // the buffer is empty, start again from the beginning
+    conn->start = conn->end = 0;
+  }
+}
+
+int conn_read(conn_t* conn, void* buf, size_t size)
+{
+  // take the data already received
+  size_t buffered = conn_pending(conn);
+  if (buffered > size) {
+    buffered = size;
+  }
+  memcpy(buf, conn_take(conn, buffered), buffered);
+  char* bufptr = (char*)buf + buffered;
+  size -= buffered;
+  // receive the rest straight into 'buf'
+  while (size > 0) {
+    ssize_t received;
+    if ((received = conn_recv(conn, bufptr, size)) <= 0) {
+      return (int)received;
+    }
+    conn->read_bytes += received;
+    bufptr += received;
+    size -= received;
+  }
+  return 1;
+}
+
+int conn_skip(conn_t* conn, size_t size)
+{
+  size_t buffered = conn_pending(conn);
+  if (buffered > size) {
+    buffered = size;
+  }
+  conn_take(conn, buffered);
+  size -= buffered;
+  char skip_buffer[SKIP_BUFFER_LENGTH];
+  while (size > 0) {
+    ssize_t received;
+    if ((received = conn_recv(conn, skip_buffer, (size > SKIP_BUFFER_LENGTH ? SKIP_BUFFER_LENGTH : size))) <= 0) {
+      return (int)received;
+    }
+    conn->read_bytes += received;
+    size -= received;
+  }
+  return 1;
+}
+
+/**
+ * Send data to the client without blocking, counting the system calls,
+ * passing the file descriptor 'fd' along with it if not -1
+ * (assume that the output queue is locked)
+ *
+ * Return the number of bytes sent (possibly 0), -1 on error (set errno)
+ */
+static ssize_t conn_send(conn_t* conn, const char* data, const size_t size, const int fd)
+{
+  struct iovec iov = {.iov_base = (void*)data, .iov_len = size};
+  struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+  char control[CMSG_SPACE(sizeof(int))];
+  if (fd != -1) {
+    memset(control, 0, sizeof(control));
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  ssize_t sent;
+  while (1) {
+    conn->send_count++;
+    if ((sent = sendmsg(conn->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the socket buffer is full
+        return 0;
+      }
+      if (errno == EPIPE || errno == ECONNRESET) {
+        // the client left: discard the output, the master will notice it when reading
+        conn->broken = 1;
+        return 0;
+      }
+    }
+    return sent;
+  }
+}
+
+/**
+ * Send data to the client without blocking and queue the rest,
+ * passing the file descriptor 'fd' with the first byte sent if not -1 (the connection closes it once passed)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int conn_enqueue(conn_t* conn, const char* data, const size_t size, const char owned, int fd)
+{
+  LOCK(&(conn->out_mutex));
+  conn->written_bytes += size;
+  size_t sent = 0;
+  if (!conn->out_head && !conn->broken) {
+    // nothing queued before: try to send immediately
+    ssize_t result;
+    if ((result = conn_send(conn, data, size, fd)) == -1) {
+      UNLOCK(&(conn->out_mutex));
+      return -1;
+    }
+    sent = result;
+  }
+  if (fd != -1 && (sent || conn->broken)) {
+    // the file descriptor has been passed (or cannot be anymore)
+    close(fd);
+    fd = -1;
+  }
+  if (sent == size || conn->broken) {
+    UNLOCK(&(conn->out_mutex));
+    if (owned) {
+      free((void*)data);
+    }
+    return 0;
+  }
+  out_chunk_t* chunk;
+  if ((chunk = malloc(sizeof(out_chunk_t))) == NULL) {
+    UNLOCK(&(conn->out_mutex));
+    return -1;
+  }
+  chunk->fd = fd;
+  if (owned) {
+    chunk->data = (char*)data;
+    chunk->size = size;
+    chunk->sent = sent;
+  } else {
+    // copy only the data not sent
+    if ((chunk->data = malloc(sizeof(char) * (size - sent))) == NULL) {
+      free_item((void**)&chunk);
+      UNLOCK(&(conn->out_mutex));
+      return -1;
+    }
+    memcpy(chunk->data, data + sent, size - sent);
+    chunk->size = size - sent;
+    chunk->sent = 0;
+  }
+  chunk->next = NULL;
+  if (conn->out_tail) {
+    conn->out_tail->next = chunk;
+  } else {
+    conn->out_head = chunk;
+  }
+  conn->out_tail = chunk;
+  conn->out_bytes += chunk->size - chunk->sent;
+  UNLOCK(&(conn->out_mutex));
+  return 0;
+}
+
+int conn_write(conn_t* conn, const void* data, const size_t size)
+{
+  if (!conn || !data) {
+    errno = EINVAL;
+    return -1;
+  }
+  int result;
+  STAGE_TIMED(STAGE_SEND, result = conn_enqueue(conn, (const char*)data, size, 0, -1));
+  return result;
+}
+
+int conn_write_owned(conn_t* conn, char* data, const size_t size)
+{
+  if (!conn || !data) {
+    errno = EINVAL;
+    return -1;
+  }
+  int result;
+  STAGE_TIMED(STAGE_SEND, result = conn_enqueue(conn, data, size, 1, -1));
+  if (result == -1) {
+    int myerrno = errno;
+    free_item((void**)&data);
+    errno = myerrno;
+    return -1;
+  }
+  return 0;
+}
+
+int conn_write_fd(conn_t* conn, const void* data, const size_t size, const int fd)
+{
+  if (!conn || !data || !size || fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  int result;
+  STAGE_TIMED(STAGE_SEND, result = conn_enqueue(conn, (const char*)data, size, 0, fd));
+  return result;
+}
+
+ssize_t conn_flush(conn_t* conn)
+{
+  LOCK(&(conn->out_mutex));
+  out_chunk_t* chunk;
+  while ((chunk = conn->out_head)) {
+    if (!conn->broken) {
+      ssize_t sent;
+      if ((sent = conn_send(conn, chunk->data + chunk->sent, chunk->size - chunk->sent, chunk->fd)) == -1) {
+        UNLOCK(&(conn->out_mutex));
+        return -1;
+      }
+      if (chunk->fd != -1 && sent) {
+        close(chunk->fd);
+        chunk->fd = -1;
+      }
+      chunk->sent += sent;
+      conn->out_bytes -= sent;
+      if (chunk->sent < chunk->size && !conn->broken) {
+        // the socket buffer is full
+        break;
+      }
+    }
+    // the chunk has been sent (or discarded)
+    conn->out_bytes -= chunk->size - chunk->sent;
+    conn->out_head = chunk->next;
+    if (!conn->out_head) {
+      conn->out_tail = NULL;
+    }
+    if (chunk->fd != -1) {
+      close(chunk->fd);
+    }
+    free_item((void**)&(chunk->data));
+    free_item((void**)&chunk);
+  }
+  ssize_t left = conn->out_bytes;
+  UNLOCK(&(conn->out_mutex));
+  return left;
+}
+
+void conn_break(conn_t* conn)
+{
+  LOCK(&(conn->out_mutex));
+  conn->broken = 1;
+  conn_discard(conn);
+  UNLOCK(&(conn->out_mutex));
+  // the master reads the end of the stream and closes the connection
+  shutdown(conn->fd, SHUT_RDWR);
+}
+
+size_t conn_output(conn_t* conn)
+{
+  LOCK(&(conn->out_mutex));
+  size_t left = conn->out_bytes;
+  UNLOCK(&(conn->out_mutex));
+  return left;
+}
+
+size_t conn_written(conn_t* conn)
+{
+  LOCK(&(conn->out_mutex));
+  size_t written = conn->written_bytes;
+  UNLOCK(&(conn->out_mutex));
+  return written;
+}
@@ -8,17 +8,55 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include <communication_protocol.h>
+#include <concurrency.h>
 #include <error_handling.h>
 #include <free_item.h>
 #include <readnwrite.h>
 #include <str2num.h>
+#include <shm_index.h>
+
+// size of the chunks in which received files are moved from the socket to the disk
+#define RECEIVE_CHUNK_SIZE 65536
+// files larger than this are sent with sendfile() instead of being mapped in memory
+#define UPLOAD_MMAP_LIMIT (256L * 1024 * 1024)
+// maximum number of bytes moved by a single sendfile()
+#define UPLOAD_CHUNK_SIZE (16L * 1024 * 1024)
+// buckets of the table of the files opened through a handle
+#define OPENED_FILES_BUCKETS 256
 
 #define WAIT_FOR_RESPONSE() \
   do { \
     char response_buffer[RESPONSE_CODE_LENGTH + 1] = {0}; \
-    if (readn(fss_client_socket, response_buffer, RESPONSE_CODE_LENGTH) == -1) {\
+    if (readn(conn->socket, response_buffer, RESPONSE_CODE_LENGTH) == -1) {\
+      goto end; \
+    } \
+    if (str2num(response_buffer, &response_code) != 0) { \
+      response_code = INVALID_RESPONSE; \
+      errno = EINVAL; \
+      goto end; \
+    } \
+    if (response_code != OK) { \
+      errno = ECANCELED; \
+      goto end; \
+    } \
+  } while (0)
+
+// whether 'size' bytes of content are exchanged in the memory shared with the server (the server applies the same rule)
+#define IN_SHM(conn, size) ((conn)->shm && (size_t)(size) <= (conn)->shm_size)
+
+// like WAIT_FOR_RESPONSE, but also receive in 'fd' the file descriptor passed with the response code (-1 if none)
+#define WAIT_FOR_RESPONSE_FD(fd) \
+  do { \
+    char response_buffer[RESPONSE_CODE_LENGTH + 1] = {0}; \
+    if (receive_response_fd(conn->socket, response_buffer, &(fd)) == -1) { \
       goto end; \
     } \
     if (str2num(response_buffer, &response_code) != 0) { \
@@ -32,8 +70,44 @@
     } \
   } while (0)
 
-int fss_client_socket;
-char* fss_socket_name = NULL;
+#define CHECK_CONN(conn) \
+  do { \
+    if (!(conn) && !((conn) = fss_default_conn)) { \
+      errno = ENOTCONN; \
+      return -1; \
+    } \
+  } while (0)
+
+#define DESTROY_SINK(sink, result) \
+  do { \
+    if (sink) { \
+      int myerrno = errno; \
+      if (fss_sink_destroy(sink) == -1) { \
+        result = -1; \
+      } else { \
+        errno = myerrno; \
+      } \
+    } \
+  } while (0)
+
+// file waiting for the background writer of a sink
+typedef struct {
+  char* pathname;
+  char* content;
+  size_t size;
+} sink_job_t;
+
+// state used to move the received files from the socket to the disk
+typedef struct {
+  // fixed-size buffer used when splice() cannot be used
+  char* chunk;
+  // pipe used to splice the data from the socket to the file ({-1, -1} if not created yet)
+  int pipefd[2];
+  char use_splice;
+} stream_t;
+
+// connection used by the global API (openConnection, openFile, ...)
+static fss_conn_t* fss_default_conn = NULL;
 // verbose mode is disabled by default
 char fss_verbose = 0;
 
@@ -80,102 +154,337 @@ static void print_error(const long response_code)
   fprintf(stderr, "         (%s)\n", msg);
 }
 
-int store_file(const char* abs_pathname, const char* content, const size_t size, const char* directory)
+/**
+ * Create a new file for 'pathname' in the sink directory,
+ * appending a counter to its name if a file with the same name already exists.
+ * The name of the created file is copied in 'filename'.
+ *
+ * Return the file descriptor of the created file on success, -1 on error (set errno)
+ */
+static int sink_create_file(fss_sink_t* sink, const char* pathname, char filename[NAME_MAX + 1])
 {
-  // variables initialization
-  char* abs_directory = NULL;
-  char* cwd = NULL;
-  FILE* file = NULL;
-
-  if (!abs_pathname || !strlen(abs_pathname) || !content || !size || !directory) {
-    errno = EINVAL;
-    goto end;
-  }
-
-  // get directory's absolute path
-  if ((abs_directory = realpath(directory, NULL)) == NULL) {
-    goto end;
-  }
-  // get current working directory
-  if ((cwd = getcwd(NULL, PATH_MAX)) == NULL) {
-    goto end;
-  }
-  // change working directory
-  if (chdir(abs_directory) == -1) {
-    goto end;
+  // get filename from the pathname
+  const char* name;
+  if ((name = strrchr(pathname, '/')) == NULL) {
+    name = pathname;
+  } else {
+    name += 1;
   }
-  free_item((void**)&abs_directory);
-
-  // get filename from the absolute pathname
-  char* name;
-  if ((name = strrchr(abs_pathname, '/')) == NULL || *(name + 1) == '\0') {
+  if (*name == '\0') {
     // invalid pathname
     errno = EINVAL;
-    goto end;
+    return -1;
+  }
+  if (strlen(name) > NAME_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
   }
-  name += 1;
-  char filename[NAME_MAX] = {0};
+  memset(filename, 0, NAME_MAX + 1);
   memcpy(filename, name, strlen(name));
 
-  // check for duplicates
+  // O_EXCL makes the creation fail if the file exists,
+  // so concurrent writers never pick the same name
+  int fd;
   size_t duplicates = 0;
-  while ((errno = 0, access(filename, F_OK)) == 0) {
+  while ((fd = openat(sink->dirfd, filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) == -1) {
+    if (errno != EEXIST) {
+      return -1;
+    }
     duplicates++;
     // make a new filename
-    if (snprintf(filename, NAME_MAX - 1, "%s(%zu)", name, duplicates) == NAME_MAX - 1) {
-      if (filename[NAME_MAX - 2] != ')' && filename[NAME_MAX - 2] != '\0') {
-        // filename is too long and cannot be formatted properly
-	goto end;
+    if (snprintf(filename, NAME_MAX + 1, "%s(%zu)", name, duplicates) >= NAME_MAX + 1) {
+      // filename is too long and cannot be formatted properly
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/**
+ * Write a file in the sink directory
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int sink_write(fss_sink_t* sink, const char* pathname, const char* content, const size_t size)
+{
+  if (!sink || !pathname || !strlen(pathname) || !content || !size) {
+    errno = EINVAL;
+    return -1;
+  }
+  int fd;
+  char filename[NAME_MAX + 1];
+  if ((fd = sink_create_file(sink, pathname, filename)) == -1) {
+    return -1;
+  }
+  if (writen(fd, (void*)content, size) == -1) {
+    int myerrno = errno;
+    close(fd);
+    errno = myerrno;
+    return -1;
+  }
+  return close(fd);
+}
+
+/**
+ * Function executed by the background writer of a sink
+ */
+static void* sink_writer(void* args)
+{
+  fss_sink_t* sink = (fss_sink_t*)args;
+
+  sink_job_t* job;
+  while (1) {
+    EXIT_ON_NULL((job = (sink_job_t*)bbuffer_dequeue(sink->queue)));
+    if (!job->pathname) {
+      // termination message
+      break;
+    }
+    if (sink_write(sink, job->pathname, job->content, job->size) == -1) {
+      // keep the first error, it will be reported when the sink is destroyed
+      LOCK(&(sink->mutex));
+      if (!sink->error) {
+        sink->error = errno;
       }
+      UNLOCK(&(sink->mutex));
     }
+    free_item((void**)&(job->pathname));
+    free_item((void**)&(job->content));
+    free_item((void**)&job);
   }
-  if (errno != ENOENT) {
-    perror("access");
-    goto end;
+  free_item((void**)&job);
+  return NULL;
+}
+
+fss_sink_t* fss_sink_create(const char* directory, const size_t queue_length)
+{
+  // variables initialization
+  fss_sink_t* sink = NULL;
+
+  if (!directory || !strlen(directory)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if ((sink = calloc(1, sizeof(fss_sink_t))) == NULL) {
+    return NULL;
   }
+  if ((sink->directory = strdup(directory)) == NULL) {
+    free_item((void**)&sink);
+    return NULL;
+  }
+  if ((sink->dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    free_item((void**)&(sink->directory));
+    free_item((void**)&sink);
+    return NULL;
+  }
+  EXIT_ON_NZ(pthread_mutex_init(&(sink->mutex), NULL));
+  if (queue_length) {
+    // start the background writer
+    EXIT_ON_NULL((sink->queue = bbuffer_create(queue_length)));
+    EXIT_ON_NZ(pthread_create(&(sink->writer), NULL, sink_writer, sink));
+  }
+  return sink;
+}
 
-  // store the file content
-  if ((file = fopen(filename, "w+")) == NULL) {
-    goto end;
+int fss_sink_destroy(fss_sink_t* sink)
+{
+  if (!sink) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (sink->queue) {
+    // wait for the background writer to store the queued files
+    sink_job_t* term;
+    EXIT_ON_NULL((term = calloc(1, sizeof(sink_job_t))));
+    EXIT_ON_NEG_ONE(bbuffer_enqueue(sink->queue, term));
+    EXIT_ON_NZ(pthread_join(sink->writer, NULL));
+    EXIT_ON_NEG_ONE(bbuffer_destroy(sink->queue));
+  }
+  int error = sink->error;
+  EXIT_ON_NZ(pthread_mutex_destroy(&(sink->mutex)));
+  int result = close(sink->dirfd);
+  free_item((void**)&(sink->directory));
+  free_item((void**)&sink);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return result;
+}
+
+int fss_sink_store(fss_sink_t* sink, const char* pathname, char* content, const size_t size)
+{
+  if (!sink || !pathname || !strlen(pathname) || !content || !size) {
+    errno = EINVAL;
+    return -1;
   }
-  if (fwrite(content, 1, size, file) != size) {
+  if (!sink->queue) {
+    // write the file directly
+    int result = sink_write(sink, pathname, content, size);
     int myerrno = errno;
-    if (ferror(file)) {
-      errno = myerrno;
-      goto end;
-    }
+    free_item((void**)&content);
+    errno = myerrno;
+    return result;
+  }
+  // hand the file over to the background writer
+  sink_job_t* job;
+  if ((job = malloc(sizeof(sink_job_t))) == NULL) {
+    return -1;
+  }
+  if ((job->pathname = strdup(pathname)) == NULL) {
+    free_item((void**)&job);
+    return -1;
+  }
+  job->content = content;
+  job->size = size;
+  EXIT_ON_NEG_ONE(bbuffer_enqueue(sink->queue, job));
+  return 0;
+}
+
+int store_file(const char* abs_pathname, const char* content, const size_t size, const char* directory)
+{
+  fss_sink_t* sink;
+  if ((sink = fss_sink_create(directory, 0)) == NULL) {
+    return -1;
+  }
+  int result = sink_write(sink, abs_pathname, content, size);
+  int myerrno = errno;
+  if (fss_sink_destroy(sink) == -1 && !result) {
+    return -1;
   }
-  if (file != NULL) EXIT_ON_NZ(fclose(file));
-  file = NULL;
+  errno = myerrno;
+  return result;
+}
 
-  // return to the previous working directory
-  if (chdir(cwd) == -1) {
-    goto end;
+/**
+ * Move 'size' bytes from the descriptor 'from' to the descriptor 'to'
+ * through the pipe of the stream, without copying them in user space
+ *
+ * Return the number of bytes moved (less than 'size' if splice() is not supported by 'from' or 'to'),
+ * -1 on error (set errno)
+ */
+static ssize_t splice_n(stream_t* stream, int from, int to, size_t size)
+{
+  size_t moved = 0;
+  while (moved < size) {
+    size_t length = size - moved;
+    if (length > RECEIVE_CHUNK_SIZE) {
+      length = RECEIVE_CHUNK_SIZE;
+    }
+    ssize_t in;
+    if ((in = splice(from, NULL, stream->pipefd[1], NULL, length, SPLICE_F_MOVE)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EINVAL && !moved) {
+        // splice() is not supported by 'from'
+        return 0;
+      }
+      return -1;
+    }
+    if (in == 0) {
+      // the server closed the connection
+      errno = ECONNRESET;
+      return -1;
+    }
+    ssize_t left = in;
+    while (left > 0) {
+      ssize_t out;
+      if ((out = splice(stream->pipefd[0], NULL, to, NULL, left, SPLICE_F_MOVE)) == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EINVAL) {
+          return -1;
+        }
+        // splice() is not supported by 'to': empty the pipe by hand and give up on splicing
+        if (readn(stream->pipefd[0], stream->chunk, left) <= 0 || writen(to, stream->chunk, left) != 1) {
+          return -1;
+        }
+        return moved + in;
+      }
+      left -= out;
+    }
+    moved += in;
   }
-  free_item((void**)&cwd);
+  return moved;
+}
 
+/**
+ * Move 'size' bytes from the descriptor 'from' to the descriptor 'to' (or discard them if 'to' is -1),
+ * never holding more than a chunk of them in memory
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int stream_n(stream_t* stream, int from, int to, size_t size)
+{
+  if (to != -1 && stream->use_splice) {
+    if (stream->pipefd[0] == -1 && pipe2(stream->pipefd, O_CLOEXEC) == -1) {
+      return -1;
+    }
+    ssize_t moved;
+    if ((moved = splice_n(stream, from, to, size)) == -1) {
+      return -1;
+    }
+    if ((size_t)moved < size) {
+      // fall back to read() and write() from now on
+      stream->use_splice = 0;
+    }
+    size -= moved;
+  }
+  while (size > 0) {
+    size_t length = size > RECEIVE_CHUNK_SIZE ? RECEIVE_CHUNK_SIZE : size;
+    ssize_t result;
+    if ((result = readn(from, stream->chunk, length)) <= 0) {
+      if (result == 0) {
+        // the server closed the connection
+        errno = ECONNRESET;
+      }
+      return -1;
+    }
+    if (to != -1 && writen(to, stream->chunk, length) != 1) {
+      return -1;
+    }
+    size -= length;
+  }
   return 0;
+}
 
-  end:
-  free_item((void**)&abs_directory);
-  if (cwd != NULL) {
-    EXIT_ON_NEG_ONE(chdir(cwd));
-    free_item((void**)&cwd);
+/**
+ * Receive a file of 'size' bytes from the socket and write it in the sink directory while it arrives
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int sink_receive(fss_sink_t* sink, stream_t* stream, int socket, const char* pathname, size_t size)
+{
+  int fd;
+  char filename[NAME_MAX + 1];
+  if ((fd = sink_create_file(sink, pathname, filename)) == -1) {
+    return -1;
   }
-  if (file != NULL) EXIT_ON_NZ(fclose(file));
-  return -1;
+  if (stream_n(stream, socket, fd, size) == -1) {
+    // do not leave a truncated file behind
+    int myerrno = errno;
+    close(fd);
+    unlinkat(sink->dirfd, filename, 0);
+    errno = myerrno;
+    return -1;
+  }
+  return close(fd);
 }
 
 /**
- * Read files sent by the server and store them under 'dirname'
+ * Read files sent by the server and store them in 'sink' (if not NULL).
+ * The content of the files is streamed to disk in chunks of RECEIVE_CHUNK_SIZE bytes,
+ * so memory usage does not depend on the size of the files.
  *
  * Return the number of files received on success, -1 on error (set errno)
  */
-static int receive_files(const char* dirname)
+static int receive_files(fss_conn_t* conn, fss_sink_t* sink)
 {
   // variables initialization
   char* pathname_buffer = NULL;
-  char* file_buffer = NULL;
+  stream_t stream = {.chunk = NULL, .pipefd = {-1, -1}, .use_splice = 1};
 
   int files_read = 0;
   char length_buffer[METADATA_LENGTH + 1] = {0};
@@ -184,7 +493,7 @@ static int receive_files(const char* dirname)
 
   while (1) {
     // read pathname length
-    if (readn(fss_client_socket, length_buffer, METADATA_LENGTH) == -1) {
+    if (readn(conn->socket, length_buffer, METADATA_LENGTH) == -1) {
       goto end;
     }
     if ((pathname_length = atol(length_buffer)) == 0) {
@@ -196,36 +505,50 @@ static int receive_files(const char* dirname)
       goto end;
     }
     // read pathname
-    if (readn(fss_client_socket, pathname_buffer, pathname_length) == -1) {
+    if (readn(conn->socket, pathname_buffer, pathname_length) == -1) {
       goto end;
     }
 
     // read file size
-    if (readn(fss_client_socket, length_buffer, METADATA_LENGTH) == -1) {
+    if (readn(conn->socket, length_buffer, METADATA_LENGTH) == -1) {
       goto end;
     }
-    file_size = atol(length_buffer);
-    if ((file_buffer = calloc(1, sizeof(char) * (file_size + 1))) == NULL) {
+    if ((file_size = atol(length_buffer)) < 0) {
+      errno = EBADMSG;
       goto end;
     }
-    // read file content
-    if (readn(fss_client_socket, file_buffer, file_size) == -1) {
+    if (!stream.chunk && (stream.chunk = malloc(RECEIVE_CHUNK_SIZE)) == NULL) {
       goto end;
     }
-    files_read++;
-
-    // store file on disk
-    if (dirname && store_file(pathname_buffer, file_buffer, file_size, dirname) == -1) {
+    // read file content, storing it on disk
+    if (sink) {
+      if (sink_receive(sink, &stream, conn->socket, pathname_buffer, file_size) == -1) {
+        goto end;
+      }
+    } else if (stream_n(&stream, conn->socket, -1, file_size) == -1) {
       goto end;
     }
+    files_read++;
     free_item((void**)&pathname_buffer);
-    free_item((void**)&file_buffer);
+  }
+  free_item((void**)&(stream.chunk));
+  if (stream.pipefd[0] != -1) {
+    close(stream.pipefd[0]);
+    close(stream.pipefd[1]);
   }
   return files_read;
 
   end:
-  free_item((void**)&pathname_buffer);
-  free_item((void**)&file_buffer);
+  {
+    int myerrno = errno;
+    free_item((void**)&pathname_buffer);
+    free_item((void**)&(stream.chunk));
+    if (stream.pipefd[0] != -1) {
+      close(stream.pipefd[0]);
+      close(stream.pipefd[1]);
+    }
+    errno = myerrno;
+  }
   return -1;
 }
 
@@ -244,8 +567,11 @@ void sleep_for(const long msec)
   }
 }
 
-int openConnection(const char* sockname, int msec, const struct timespec abstime)
+fss_conn_t* fss_connect(const char* sockname, int msec, const struct timespec abstime)
 {
+  // variables initialization
+  fss_conn_t* conn = NULL;
+
   if (!sockname || !strlen(sockname) || msec < 0) {
     errno = EINVAL;
     goto end;
@@ -256,11 +582,15 @@ int openConnection(const char* sockname, int msec, const struct timespec abstime
   address.sun_family = AF_UNIX;
   strncpy(address.sun_path, sockname, sizeof(address.sun_path) - 1);
 
-  if ((fss_client_socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+  if ((conn = calloc(1, sizeof(fss_conn_t))) == NULL) {
+    goto end;
+  }
+  conn->socket = -1;
+  if ((conn->socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
     goto end;
   }
   time_t current_time;
-  while (connect(fss_client_socket, (struct sockaddr*)&address, sizeof(address)) == -1) {
+  while (connect(conn->socket, (struct sockaddr*)&address, sizeof(address)) == -1) {
     if (errno == ENOENT) {
       current_time = time(NULL); // man 2 time: "when tloc is NULL, the call cannot fail"
       if (current_time >= abstime.tv_sec) {
@@ -279,36 +609,87 @@ int openConnection(const char* sockname, int msec, const struct timespec abstime
   }
   // The POSIX specification does not define the length of the sun_path array
   // and it specifically warns that applications should not assume a particular length
-  if ((fss_socket_name = calloc(1, sizeof(char) * (strlen(address.sun_path) + 1))) == NULL) {
+  if ((conn->socket_name = calloc(1, sizeof(char) * (strlen(address.sun_path) + 1))) == NULL) {
+    goto end;
+  }
+  memcpy(conn->socket_name, address.sun_path, strlen(address.sun_path));
+  if ((conn->opened = icl_hash_create(OPENED_FILES_BUCKETS, NULL, NULL)) == NULL) {
     goto end;
   }
-  memcpy(fss_socket_name, address.sun_path, strlen(address.sun_path));
+  EXIT_ON_NZ(pthread_mutex_init(&(conn->mutex), NULL));
   if (fss_verbose) {
     fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "openConnection", sockname);
     fprintf(stdout, "successfully connected to socket\n");
   }
-  return 0;
+  return conn;
 
   end:
-  free_item((void**)&fss_socket_name);
+  ;
+  int myerrno = errno;
+  if (conn != NULL) {
+    if (conn->socket != -1) close(conn->socket);
+    free_item((void**)&(conn->socket_name));
+    if (conn->opened) icl_hash_destroy(conn->opened, free, NULL);
+    free_item((void**)&conn);
+  }
   if (fss_verbose) {
     fprintf(stderr, "[%d]: (%s) '%s': ", getpid(), "openConnection", sockname);
     fprintf(stderr, "error: could not connect to socket\n");
   }
-  return -1;
+  errno = myerrno;
+  return NULL;
+}
+
+int fss_disconnect(fss_conn_t* conn)
+{
+  if (!conn) {
+    errno = EINVAL;
+    return -1;
+  }
+  // wait for any request in progress on the handle
+  LOCK(&(conn->mutex));
+  int result = close(conn->socket);
+  UNLOCK(&(conn->mutex));
+  if (result == -1) {
+    return -1;
+  }
+  if (conn->shm) {
+    EXIT_ON_NEG_ONE(munmap(conn->shm, conn->shm_size));
+  }
+  if (conn->index) {
+    EXIT_ON_NEG_ONE(munmap(conn->index, conn->index_size));
+  }
+  EXIT_ON_NEG_ONE(icl_hash_destroy(conn->opened, free, NULL));
+  EXIT_ON_NZ(pthread_mutex_destroy(&(conn->mutex)));
+  free_item((void**)&(conn->socket_name));
+  free_item((void**)&conn);
+  return 0;
+}
+
+int openConnection(const char* sockname, int msec, const struct timespec abstime)
+{
+  if (fss_default_conn) {
+    // the default connection is already open
+    errno = EISCONN;
+    return -1;
+  }
+  if ((fss_default_conn = fss_connect(sockname, msec, abstime)) == NULL) {
+    return -1;
+  }
+  return 0;
 }
 
 int closeConnection(const char* sockname)
 {
-  if (!sockname || !fss_socket_name || strncmp(sockname, fss_socket_name, strlen(fss_socket_name))) {
+  if (!sockname || !fss_default_conn || strncmp(sockname, fss_default_conn->socket_name, strlen(fss_default_conn->socket_name))) {
     errno = EINVAL;
     goto end;
   }
 
-  if (close(fss_client_socket) == -1) {
+  if (fss_disconnect(fss_default_conn) == -1) {
     goto end;
   }
-  free_item((void**)&fss_socket_name);
+  fss_default_conn = NULL;
   if (fss_verbose) {
     fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "closeConnection", sockname);
     fprintf(stdout, "successfully disconnected from socket\n");
@@ -323,7 +704,7 @@ int closeConnection(const char* sockname)
   return -1;
 }
 
-int openFile(const char* pathname, int flags)
+static int open_file(fss_conn_t* conn, const char* pathname, int flags)
 {
   // variables initialization
   char* abs_pathname = NULL;
@@ -345,16 +726,19 @@ int openFile(const char* pathname, int flags)
     goto end;
   }
   // assemble the request
-  snprintf(request, request_length, "%d%010ld%s%d", OPEN_FILE, pathname_length, abs_pathname, flags);
-  free_item((void**)&abs_pathname);
+  snprintf(request, request_length, "%02d%010ld%s%d", OPEN_FILE, pathname_length, abs_pathname, flags);
   // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (writen(conn->socket, request, request_length - 1) == -1) {
     goto end;
   }
   free_item((void**)&request);
 
   WAIT_FOR_RESPONSE();
 
+  // remember the file as opened through the handle
+  if (icl_hash_find(conn->opened, abs_pathname) || icl_hash_insert(conn->opened, abs_pathname, abs_pathname) == NULL) {
+    free_item((void**)&abs_pathname);
+  }
   if (fss_verbose) {
     fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "openFile", pathname);
     fprintf(stdout, "file successfully opened\n");
@@ -372,7 +756,7 @@ int openFile(const char* pathname, int flags)
   return -1;
 }
 
-int readFile(const char* pathname, void** buf, size_t* size)
+static int read_file(fss_conn_t* conn, const char* pathname, void** buf, size_t* size)
 {
   // variables initialization
   char* abs_pathname = NULL;
@@ -388,6 +772,16 @@ int readFile(const char* pathname, void** buf, size_t* size)
   if ((abs_pathname = realpath(pathname, NULL)) == NULL) {
     goto end;
   }
+  // a file opened through the handle and published in the index is read without a request
+  if (conn->index && icl_hash_find(conn->opened, abs_pathname) && shm_index_lookup(conn->index, abs_pathname, (void**)&file_buffer, size) == 0) {
+    free_item((void**)&abs_pathname);
+    if (fss_verbose) {
+      fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "readFile", pathname);
+      fprintf(stdout, "%zu bytes read from the index\n", *size);
+    }
+    *buf = file_buffer;
+    return 0;
+  }
 
   const size_t pathname_length = strlen(abs_pathname);
   const size_t request_length = REQUEST_CODE_LENGTH + METADATA_LENGTH + pathname_length + 1;
@@ -395,10 +789,10 @@ int readFile(const char* pathname, void** buf, size_t* size)
     goto end;
   }
   // assemble the request
-  snprintf(request, request_length, "%d%010ld%s", READ_FILE, pathname_length, abs_pathname);
+  snprintf(request, request_length, "%02d%010ld%s", READ_FILE, pathname_length, abs_pathname);
   free_item((void**)&abs_pathname);
   // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (writen(conn->socket, request, request_length - 1) == -1) {
     goto end;
   }
   free_item((void**)&request);
@@ -407,7 +801,7 @@ int readFile(const char* pathname, void** buf, size_t* size)
 
   // get file size
   char file_size_buffer[METADATA_LENGTH + 1] = {0};
-  if (readn(fss_client_socket, file_size_buffer, METADATA_LENGTH) == -1) {
+  if (readn(conn->socket, file_size_buffer, METADATA_LENGTH) == -1) {
     response_code = INVALID_RESPONSE;
     goto end;
   }
@@ -422,7 +816,10 @@ int readFile(const char* pathname, void** buf, size_t* size)
     response_code = RESPONSE_CODE_INIT;
     goto end;
   }
-  if (readn(fss_client_socket, file_buffer, file_size) == -1) {
+  if (IN_SHM(conn, file_size)) {
+    // the server placed the content in the shared memory
+    memcpy(file_buffer, conn->shm, file_size);
+  } else if (readn(conn->socket, file_buffer, file_size) == -1) {
     response_code = INVALID_RESPONSE;
     goto end;
   }
@@ -446,7 +843,7 @@ int readFile(const char* pathname, void** buf, size_t* size)
   return -1;
 }
 
-int readNFiles(int N, const char* dirname)
+static int read_n_files(fss_conn_t* conn, int N, fss_sink_t* sink)
 {
   // variables initialization
   long response_code = RESPONSE_CODE_INIT;
@@ -454,9 +851,9 @@ int readNFiles(int N, const char* dirname)
   const size_t request_length = REQUEST_CODE_LENGTH + METADATA_LENGTH + 1;
   char request[request_length];
   // assemble the request
-  snprintf(request, request_length, "%d%010d", READ_N_FILES, N);
+  snprintf(request, request_length, "%02d%010d", READ_N_FILES, N);
   // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (writen(conn->socket, request, request_length - 1) == -1) {
     goto end;
   }
 
@@ -464,14 +861,14 @@ int readNFiles(int N, const char* dirname)
 
   // receive files
   int files_read;
-  if ((files_read = receive_files(dirname)) == -1) {
+  if ((files_read = receive_files(conn, sink)) == -1) {
     response_code = INVALID_RESPONSE;
     goto end;
   }
   if (fss_verbose) {
-    fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "readNFiles", dirname);
+    fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "readNFiles", (sink ? sink->directory : "(null)"));
     fprintf(stdout, "%d files read", files_read);
-    if (dirname) {
+    if (sink) {
       fprintf(stdout, " (and stored)");
     }
     fprintf(stdout, "\n");
@@ -480,19 +877,50 @@ int readNFiles(int N, const char* dirname)
 
   end:
   if (fss_verbose) {
-    fprintf(stderr, "[%d]: (%s) '%s': ", getpid(), "readNFiles", dirname);
+    fprintf(stderr, "[%d]: (%s) '%s': ", getpid(), "readNFiles", (sink ? sink->directory : "(null)"));
     fprintf(stderr, "error: could not read files\n");
     print_error(response_code);
   }
   return -1;
 }
 
-int writeFile(const char* pathname, const char* dirname)
+/**
+ * Send 'size' bytes of the file 'fd' (from its beginning) to the socket, in chunks of UPLOAD_CHUNK_SIZE bytes,
+ * without copying them in user space
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int sendfile_n(int socket, int fd, size_t size)
+{
+  off_t offset = 0;
+  while ((size_t)offset < size) {
+    size_t length = size - offset;
+    if (length > UPLOAD_CHUNK_SIZE) {
+      length = UPLOAD_CHUNK_SIZE;
+    }
+    ssize_t sent;
+    if ((sent = sendfile(socket, fd, &offset, length)) == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -1;
+    }
+    if (sent == 0) {
+      // the file has been truncated while sending it
+      errno = EIO;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int write_file(fss_conn_t* conn, const char* pathname, fss_sink_t* sink)
 {
   // variables initialization
   char* abs_pathname = NULL;
-  FILE* file = NULL;
-  char* file_buffer = NULL;
+  int fd = -1;
+  void* file_map = MAP_FAILED;
+  size_t map_size = 0;
   char* request = NULL;
   long response_code = RESPONSE_CODE_INIT;
   int removed_files = 0;
@@ -508,53 +936,56 @@ int writeFile(const char* pathname, const char* dirname)
 
   // open file
   const size_t pathname_length = strlen(abs_pathname);
-  if ((file = fopen(abs_pathname, "r")) == NULL) {
+  if ((fd = open(abs_pathname, O_RDONLY | O_CLOEXEC)) == -1) {
     goto end;
   }
-  // calculate file size
-  if (fseek(file, 0L, SEEK_END) == -1) {
-    goto end;
-  }
-  ssize_t file_size;
-  if ((file_size = ftell(file)) == -1) {
-    goto end;
-  }
-  // rewind file position indicator
-  errno = 0;
-  rewind(file);
-  if (errno) {
+  // get file size
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
     goto end;
   }
-  // read file content
-  if ((file_buffer = calloc(1, sizeof(char) * file_size + 1)) == NULL) {
+  const long file_size = file_stat.st_size;
+
+  // assemble the request header, the file content is sent straight from the file
+  const size_t header_length = REQUEST_CODE_LENGTH + METADATA_LENGTH + pathname_length + METADATA_LENGTH + 1;
+  if ((request = calloc(1, sizeof(char) * header_length)) == NULL) {
     goto end;
   }
-  if (fread(file_buffer, sizeof(char), file_size, file) < (size_t)file_size) {
-    if (ferror(file)) {
+  snprintf(request, header_length, "%02d%010ld%s%010ld", WRITE_FILE, pathname_length, abs_pathname, file_size);
+  free_item((void**)&abs_pathname);
+  struct iovec iov[2] = {
+    {.iov_base = request, .iov_len = header_length - 1},
+    {.iov_base = NULL, .iov_len = 0}
+  };
+  if (IN_SHM(conn, file_size)) {
+    // read the file straight into the shared memory, only the header is sent
+    if (readn(fd, conn->shm, file_size) == -1) {
       goto end;
     }
+  } else if (file_size > 0 && file_size <= UPLOAD_MMAP_LIMIT) {
+    // send the header and the mapped file with a single writev
+    if ((file_map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+      goto end;
+    }
+    map_size = file_size;
+    madvise(file_map, map_size, MADV_SEQUENTIAL);
+    iov[1].iov_base = file_map;
+    iov[1].iov_len = map_size;
   }
-  // close file
-  if (file && fclose(file) != 0) {
-    goto end;
-  }
-  file = NULL;
-
-  const size_t request_length = REQUEST_CODE_LENGTH + METADATA_LENGTH + pathname_length + METADATA_LENGTH + file_size + 1;
-  if ((request = calloc(1, sizeof(char) * request_length)) == NULL) {
+  // send the request
+  if (writevn(conn->socket, iov, 2) == -1) {
     goto end;
   }
-  // assemble the request
-  snprintf(request, request_length, "%d%010ld%s%010ld", WRITE_FILE, pathname_length, abs_pathname, file_size);
-  free_item((void**)&abs_pathname);
-  // append file content
-  memcpy((request + strlen(request)), file_buffer, file_size);
-  free_item((void**)&file_buffer);
-  // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (!IN_SHM(conn, file_size) && file_size > UPLOAD_MMAP_LIMIT && sendfile_n(conn->socket, fd, file_size) == -1) {
     goto end;
   }
   free_item((void**)&request);
+  if (file_map != MAP_FAILED) {
+    EXIT_ON_NEG_ONE(munmap(file_map, map_size));
+    file_map = MAP_FAILED;
+  }
+  EXIT_ON_NEG_ONE(close(fd));
+  fd = -1;
 
   WAIT_FOR_RESPONSE();
 
@@ -563,7 +994,7 @@ int writeFile(const char* pathname, const char* dirname)
     fprintf(stdout, "%ld bytes written\n", file_size);
   }
   // receive any removed files
-  if ((removed_files = receive_files(dirname)) == -1) {
+  if ((removed_files = receive_files(conn, sink)) == -1) {
     response_code = INVALID_RESPONSE;
     goto end;
   }
@@ -577,8 +1008,8 @@ int writeFile(const char* pathname, const char* dirname)
   ;
   int myerrno = errno;
   free_item((void**)&abs_pathname);
-  if (file != NULL) EXIT_ON_NZ(fclose(file));
-  free_item((void**)&file_buffer);
+  if (file_map != MAP_FAILED) EXIT_ON_NEG_ONE(munmap(file_map, map_size));
+  if (fd != -1) EXIT_ON_NEG_ONE(close(fd));
   free_item((void**)&request);
   if (fss_verbose) {
     fprintf(stderr, "[%d]: (%s) '%s': ", getpid(), "writeFile", pathname);
@@ -593,7 +1024,7 @@ int writeFile(const char* pathname, const char* dirname)
   return -1;
 }
 
-int appendToFile(const char* pathname, void* buf, size_t size, const char* dirname)
+static int append_to_file(fss_conn_t* conn, const char* pathname, void* buf, size_t size, fss_sink_t* sink)
 {
   // variables initialization
   char* abs_pathname = NULL;
@@ -611,17 +1042,24 @@ int appendToFile(const char* pathname, void* buf, size_t size, const char* dirna
   }
 
   const size_t pathname_length = strlen(abs_pathname);
-  const size_t request_length = REQUEST_CODE_LENGTH + METADATA_LENGTH + pathname_length + METADATA_LENGTH + size + 1;
-  if ((request = calloc(1, sizeof(char) * request_length)) == NULL) {
+  const size_t header_length = REQUEST_CODE_LENGTH + METADATA_LENGTH + pathname_length + METADATA_LENGTH + 1;
+  if ((request = calloc(1, sizeof(char) * header_length)) == NULL) {
     goto end;
   }
-  // assemble the request
-  snprintf(request, request_length, "%d%010ld%s%010ld", APPEND_TO_FILE, pathname_length, abs_pathname, size);
+  // assemble the request header
+  snprintf(request, header_length, "%02d%010ld%s%010ld", APPEND_TO_FILE, pathname_length, abs_pathname, size);
   free_item((void**)&abs_pathname);
-  // append content to request
-  memcpy((request + strlen(request)), buf, size);
-  // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  // send the request, the content is sent straight from the caller's buffer
+  struct iovec iov[2] = {
+    {.iov_base = request, .iov_len = header_length - 1},
+    {.iov_base = buf, .iov_len = size}
+  };
+  if (IN_SHM(conn, size)) {
+    // the content is placed in the shared memory, only the header is sent
+    memcpy(conn->shm, buf, size);
+    iov[1].iov_len = 0;
+  }
+  if (writevn(conn->socket, iov, 2) == -1) {
     goto end;
   }
   free_item((void**)&request);
@@ -634,7 +1072,7 @@ int appendToFile(const char* pathname, void* buf, size_t size, const char* dirna
   }
 
   // receive any removed files
-  if ((removed_files = receive_files(dirname)) == -1) {
+  if ((removed_files = receive_files(conn, sink)) == -1) {
     response_code = INVALID_RESPONSE;
     goto end;
   }
@@ -659,7 +1097,7 @@ int appendToFile(const char* pathname, void* buf, size_t size, const char* dirna
   return -1;
 }
 
-int lockFile(const char* pathname)
+static int lock_file(fss_conn_t* conn, const char* pathname)
 {
   // variables initialization
   char* abs_pathname = NULL;
@@ -681,10 +1119,10 @@ int lockFile(const char* pathname)
     goto end;
   }
   // assemble the request
-  snprintf(request, request_length, "%d%010ld%s", LOCK_FILE, pathname_length, abs_pathname);
+  snprintf(request, request_length, "%02d%010ld%s", LOCK_FILE, pathname_length, abs_pathname);
   free_item((void**)&abs_pathname);
   // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (writen(conn->socket, request, request_length - 1) == -1) {
     goto end;
   }
   free_item((void**)&request);
@@ -708,7 +1146,7 @@ int lockFile(const char* pathname)
   return -1;
 }
 
-int unlockFile(const char* pathname)
+static int unlock_file(fss_conn_t* conn, const char* pathname)
 {
   // variables initialization
   char* abs_pathname = NULL;
@@ -730,10 +1168,10 @@ int unlockFile(const char* pathname)
     goto end;
   }
   // assemble the request
-  snprintf(request, request_length, "%d%010ld%s", UNLOCK_FILE, pathname_length, abs_pathname);
+  snprintf(request, request_length, "%02d%010ld%s", UNLOCK_FILE, pathname_length, abs_pathname);
   free_item((void**)&abs_pathname);
   // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (writen(conn->socket, request, request_length - 1) == -1) {
     goto end;
   }
   free_item((void**)&request);
@@ -757,7 +1195,7 @@ int unlockFile(const char* pathname)
   return -1;
 }
 
-int closeFile(const char* pathname)
+static int close_file(fss_conn_t* conn, const char* pathname)
 {
   // variables initialization
   char* abs_pathname = NULL;
@@ -779,16 +1217,18 @@ int closeFile(const char* pathname)
     goto end;
   }
   // assemble the request
-  snprintf(request, request_length, "%d%010ld%s", CLOSE_FILE, pathname_length, abs_pathname);
-  free_item((void*)&abs_pathname);
+  snprintf(request, request_length, "%02d%010ld%s", CLOSE_FILE, pathname_length, abs_pathname);
   // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (writen(conn->socket, request, request_length - 1) == -1) {
     goto end;
   }
   free_item((void**)&request);
 
   WAIT_FOR_RESPONSE();
 
+  // the file can no longer be read through the handle
+  icl_hash_delete(conn->opened, abs_pathname, free, NULL);
+  free_item((void**)&abs_pathname);
   if (fss_verbose) {
     fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "closeFile", pathname);
     fprintf(stdout, "file successfully closed\n");
@@ -806,7 +1246,7 @@ int closeFile(const char* pathname)
   return -1;
 }
 
-int removeFile(const char* pathname)
+static int remove_file(fss_conn_t* conn, const char* pathname)
 {
   // variables initialization
   char* abs_pathname = NULL;
@@ -828,16 +1268,18 @@ int removeFile(const char* pathname)
     goto end;
   }
   // assemble the request
-  snprintf(request, request_length, "%d%010ld%s", REMOVE_FILE, pathname_length, abs_pathname);
-  free_item((void**)&abs_pathname);
+  snprintf(request, request_length, "%02d%010ld%s", REMOVE_FILE, pathname_length, abs_pathname);
   // send the request
-  if (writen(fss_client_socket, request, request_length - 1) == -1) {
+  if (writen(conn->socket, request, request_length - 1) == -1) {
     goto end;
   }
   free_item((void**)&request);
 
   WAIT_FOR_RESPONSE();
 
+  // the file can no longer be read through the handle
+  icl_hash_delete(conn->opened, abs_pathname, free, NULL);
+  free_item((void**)&abs_pathname);
   if (fss_verbose) {
     fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "removeFile", pathname);
     fprintf(stdout, "file successfully removed\n");
@@ -854,3 +1296,614 @@ int removeFile(const char* pathname)
   }
   return -1;
 }
+
+static int get_stats(fss_conn_t* conn, char** buf, size_t* size)
+{
+  // variables initialization
+  char* report = NULL;
+  long response_code = RESPONSE_CODE_INIT;
+
+  if (!buf || !size) {
+    errno = EINVAL;
+    goto end;
+  }
+  // the request is the request code only
+  char request[REQUEST_CODE_LENGTH + 1];
+  snprintf(request, REQUEST_CODE_LENGTH + 1, "%02d", GET_STATS);
+  // send the request
+  if (writen(conn->socket, request, REQUEST_CODE_LENGTH) == -1) {
+    goto end;
+  }
+
+  WAIT_FOR_RESPONSE();
+
+  // get report size
+  char report_size_buffer[METADATA_LENGTH + 1] = {0};
+  if (readn(conn->socket, report_size_buffer, METADATA_LENGTH) == -1) {
+    response_code = INVALID_RESPONSE;
+    goto end;
+  }
+  long report_size;
+  if (str2num(report_size_buffer, &report_size) != 0) {
+    response_code = INVALID_RESPONSE;
+    errno = EINVAL;
+    goto end;
+  }
+  // get report, terminated so that it can be printed
+  if ((report = calloc(1, sizeof(char) * (report_size + 1))) == NULL) {
+    response_code = RESPONSE_CODE_INIT;
+    goto end;
+  }
+  if (readn(conn->socket, report, report_size) == -1) {
+    response_code = INVALID_RESPONSE;
+    goto end;
+  }
+  if (fss_verbose) {
+    fprintf(stdout, "[%d]: (%s): ", getpid(), "getStats");
+    fprintf(stdout, "%ld bytes of statistics read\n", report_size);
+  }
+  *size = report_size;
+  *buf = report;
+  return 0;
+
+  end:
+  free_item((void**)&report);
+  if (fss_verbose) {
+    fprintf(stderr, "[%d]: (%s): ", getpid(), "getStats");
+    fprintf(stderr, "error: could not get the server statistics\n");
+    print_error(response_code);
+  }
+  return -1;
+}
+
+/**
+ * Receive the response code, and the file descriptor passed with it if any (-1 otherwise)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int receive_response_fd(int socket, char response_buffer[RESPONSE_CODE_LENGTH + 1], int* fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = response_buffer, .iov_len = RESPONSE_CODE_LENGTH};
+  struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+  ssize_t received;
+  while ((received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    ;
+  }
+  if (received <= 0) {
+    if (received == 0) {
+      errno = ECONNRESET;
+    }
+    return -1;
+  }
+  *fd = -1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  return 0;
+}
+
+static int negotiate_shm(fss_conn_t* conn, const size_t size)
+{
+  // variables initialization
+  int shm_fd = -1;
+  long response_code = RESPONSE_CODE_INIT;
+
+  if (!size || conn->shm) {
+    errno = EINVAL;
+    goto end;
+  }
+  char request[32];
+  // assemble the request (the size must fit in the metadata field)
+  if (snprintf(request, sizeof(request), "%02d%010zu", NEGOTIATE_SHM, size) != REQUEST_CODE_LENGTH + METADATA_LENGTH) {
+    errno = EINVAL;
+    goto end;
+  }
+  // send the request
+  if (writen(conn->socket, request, REQUEST_CODE_LENGTH + METADATA_LENGTH) == -1) {
+    goto end;
+  }
+
+  // the memfd of the shared memory comes with the response code
+  WAIT_FOR_RESPONSE_FD(shm_fd);
+  // get the size granted
+  char size_buffer[METADATA_LENGTH + 1] = {0};
+  if (readn(conn->socket, size_buffer, METADATA_LENGTH) == -1) {
+    response_code = INVALID_RESPONSE;
+    goto end;
+  }
+  long shm_size;
+  if (str2num(size_buffer, &shm_size) != 0 || shm_size <= 0 || shm_fd == -1) {
+    response_code = INVALID_RESPONSE;
+    errno = EINVAL;
+    goto end;
+  }
+  void* shm;
+  if ((shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0)) == MAP_FAILED) {
+    goto end;
+  }
+  EXIT_ON_NEG_ONE(close(shm_fd));
+  conn->shm = shm;
+  conn->shm_size = shm_size;
+  if (fss_verbose) {
+    fprintf(stdout, "[%d]: (%s): ", getpid(), "negotiateShm");
+    fprintf(stdout, "%ld bytes of memory shared with the server\n", shm_size);
+  }
+  return 0;
+
+  end:
+  ;
+  int myerrno = errno;
+  if (shm_fd != -1) close(shm_fd);
+  if (fss_verbose) {
+    fprintf(stderr, "[%d]: (%s): ", getpid(), "negotiateShm");
+    fprintf(stderr, "error: could not share memory with the server\n");
+    print_error(response_code);
+  }
+  errno = myerrno;
+  return -1;
+}
+
+static int map_index(fss_conn_t* conn)
+{
+  // variables initialization
+  int index_fd = -1;
+  void* index = MAP_FAILED;
+  long index_size = 0;
+  long response_code = RESPONSE_CODE_INIT;
+
+  if (conn->index) {
+    errno = EINVAL;
+    goto end;
+  }
+  char request[REQUEST_CODE_LENGTH + 1];
+  snprintf(request, REQUEST_CODE_LENGTH + 1, "%02d", MAP_INDEX);
+  // send the request
+  if (writen(conn->socket, request, REQUEST_CODE_LENGTH) == -1) {
+    goto end;
+  }
+
+  // the segment of the index comes with the response code
+  WAIT_FOR_RESPONSE_FD(index_fd);
+  // get the size of the segment
+  char size_buffer[METADATA_LENGTH + 1] = {0};
+  if (readn(conn->socket, size_buffer, METADATA_LENGTH) == -1) {
+    response_code = INVALID_RESPONSE;
+    goto end;
+  }
+  if (str2num(size_buffer, &index_size) != 0 || index_size <= 0 || index_fd == -1) {
+    response_code = INVALID_RESPONSE;
+    errno = EINVAL;
+    goto end;
+  }
+  if ((index = mmap(NULL, index_size, PROT_READ, MAP_SHARED, index_fd, 0)) == MAP_FAILED) {
+    goto end;
+  }
+  EXIT_ON_NEG_ONE(close(index_fd));
+  index_fd = -1;
+  if (shm_index_check(index, index_size) == -1) {
+    response_code = INVALID_RESPONSE;
+    goto end;
+  }
+  conn->index = index;
+  conn->index_size = index_size;
+  if (fss_verbose) {
+    fprintf(stdout, "[%d]: (%s): ", getpid(), "mapIndex");
+    fprintf(stdout, "%ld bytes of index mapped\n", index_size);
+  }
+  return 0;
+
+  end:
+  ;
+  int myerrno = errno;
+  if (index_fd != -1) close(index_fd);
+  if (index != MAP_FAILED) munmap(index, index_size);
+  if (fss_verbose) {
+    fprintf(stderr, "[%d]: (%s): ", getpid(), "mapIndex");
+    fprintf(stderr, "error: could not map the index\n");
+    print_error(response_code);
+  }
+  errno = myerrno;
+  return -1;
+}
+
+static int map_file(fss_conn_t* conn, const char* pathname, void** buf, size_t* size)
+{
+  // variables initialization
+  char* abs_pathname = NULL;
+  char* request = NULL;
+  int memfd = -1;
+  void* map = MAP_FAILED;
+  long file_size = 0;
+  long response_code = RESPONSE_CODE_INIT;
+
+  if (!pathname || !strlen(pathname) || !buf || !size) {
+    errno = EINVAL;
+    goto end;
+  }
+  // get absolute pathname
+  if ((abs_pathname = realpath(pathname, NULL)) == NULL) {
+    goto end;
+  }
+
+  const size_t pathname_length = strlen(abs_pathname);
+  const size_t request_length = REQUEST_CODE_LENGTH + METADATA_LENGTH + pathname_length + 1;
+  if ((request = calloc(1, sizeof(char) * request_length)) == NULL) {
+    goto end;
+  }
+  // assemble the request
+  snprintf(request, request_length, "%02d%010ld%s", READ_FILE_FD, pathname_length, abs_pathname);
+  free_item((void**)&abs_pathname);
+  // send the request
+  if (writen(conn->socket, request, request_length - 1) == -1) {
+    goto end;
+  }
+  free_item((void**)&request);
+
+  // a large file comes as a sealed memfd with the response code
+  WAIT_FOR_RESPONSE_FD(memfd);
+
+  // get file size
+  char file_size_buffer[METADATA_LENGTH + 1] = {0};
+  if (readn(conn->socket, file_size_buffer, METADATA_LENGTH) == -1) {
+    response_code = INVALID_RESPONSE;
+    goto end;
+  }
+  if (str2num(file_size_buffer, &file_size) != 0 || file_size <= 0) {
+    response_code = INVALID_RESPONSE;
+    errno = EINVAL;
+    goto end;
+  }
+  if (memfd != -1) {
+    // the content is mapped without being copied
+    if ((map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+      goto end;
+    }
+    EXIT_ON_NEG_ONE(close(memfd));
+    memfd = -1;
+  } else {
+    // the content is received in an anonymous mapping, so that every file is released the same way
+    if ((map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+      response_code = RESPONSE_CODE_INIT;
+      goto end;
+    }
+    if (IN_SHM(conn, file_size)) {
+      // the content is in the memory shared with the server
+      memcpy(map, conn->shm, file_size);
+    } else if (readn(conn->socket, map, file_size) == -1) {
+      response_code = INVALID_RESPONSE;
+      goto end;
+    }
+  }
+  if (fss_verbose) {
+    fprintf(stdout, "[%d]: (%s) '%s': ", getpid(), "mapFile", pathname);
+    fprintf(stdout, "%ld bytes read\n", file_size);
+  }
+  *size = file_size;
+  *buf = map;
+  return 0;
+
+  end:
+  ;
+  int myerrno = errno;
+  free_item((void**)&abs_pathname);
+  free_item((void**)&request);
+  if (memfd != -1) close(memfd);
+  if (map != MAP_FAILED) munmap(map, file_size);
+  if (fss_verbose) {
+    fprintf(stderr, "[%d]: (%s) '%s': ", getpid(), "mapFile", pathname);
+    fprintf(stderr, "error: could not read file\n");
+    print_error(response_code);
+  }
+  errno = myerrno;
+  return -1;
+}
+
+/**
+ * The following functions serialize the requests made on the same handle:
+ * each request is sent and its whole response is received while holding the handle mutex,
+ * so that many threads can share a handle without interleaving their messages
+ */
+
+int fss_open_file(fss_conn_t* conn, const char* pathname, int flags)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = open_file(conn, pathname, flags);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_read_file(fss_conn_t* conn, const char* pathname, void** buf, size_t* size)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = read_file(conn, pathname, buf, size);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_read_n_files(fss_conn_t* conn, int N, fss_sink_t* sink)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = read_n_files(conn, N, sink);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_write_file(fss_conn_t* conn, const char* pathname, fss_sink_t* sink)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = write_file(conn, pathname, sink);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_append_to_file(fss_conn_t* conn, const char* pathname, void* buf, size_t size, fss_sink_t* sink)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = append_to_file(conn, pathname, buf, size, sink);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_lock_file(fss_conn_t* conn, const char* pathname)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = lock_file(conn, pathname);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_unlock_file(fss_conn_t* conn, const char* pathname)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = unlock_file(conn, pathname);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_close_file(fss_conn_t* conn, const char* pathname)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = close_file(conn, pathname);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_remove_file(fss_conn_t* conn, const char* pathname)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = remove_file(conn, pathname);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_stats(fss_conn_t* conn, char** buf, size_t* size)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = get_stats(conn, buf, size);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_map_file(fss_conn_t* conn, const char* pathname, void** buf, size_t* size)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = map_file(conn, pathname, buf, size);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_unmap_file(void* buf, const size_t size)
+{
+  if (!buf || !size) {
+    errno = EINVAL;
+    return -1;
+  }
+  return munmap(buf, size);
+}
+
+int fss_negotiate_shm(fss_conn_t* conn, const size_t size)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = negotiate_shm(conn, size);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+int fss_map_index(fss_conn_t* conn)
+{
+  CHECK_CONN(conn);
+  LOCK(&(conn->mutex));
+  int result = map_index(conn);
+  UNLOCK(&(conn->mutex));
+  return result;
+}
+
+/**
+ * The global API works on the default connection opened by openConnection
+ */
+
+int openFile(const char* pathname, int flags)
+{
+  return fss_open_file(NULL, pathname, flags);
+}
+
+int readFile(const char* pathname, void** buf, size_t* size)
+{
+  return fss_read_file(NULL, pathname, buf, size);
+}
+
+int readNFiles(int N, const char* dirname)
+{
+  fss_sink_t* sink = NULL;
+  if (dirname && (sink = fss_sink_create(dirname, 0)) == NULL) {
+    return -1;
+  }
+  int result = fss_read_n_files(NULL, N, sink);
+  DESTROY_SINK(sink, result);
+  return result;
+}
+
+int writeFile(const char* pathname, const char* dirname)
+{
+  fss_sink_t* sink = NULL;
+  if (dirname && (sink = fss_sink_create(dirname, 0)) == NULL) {
+    return -1;
+  }
+  int result = fss_write_file(NULL, pathname, sink);
+  DESTROY_SINK(sink, result);
+  return result;
+}
+
+int appendToFile(const char* pathname, void* buf, size_t size, const char* dirname)
+{
+  fss_sink_t* sink = NULL;
+  if (dirname && (sink = fss_sink_create(dirname, 0)) == NULL) {
+    return -1;
+  }
+  int result = fss_append_to_file(NULL, pathname, buf, size, sink);
+  DESTROY_SINK(sink, result);
+  return result;
+}
+
+int lockFile(const char* pathname)
+{
+  return fss_lock_file(NULL, pathname);
+}
+
+int unlockFile(const char* pathname)
+{
+  return fss_unlock_file(NULL, pathname);
+}
+
+int closeFile(const char* pathname)
+{
+  return fss_close_file(NULL, pathname);
+}
+
+int removeFile(const char* pathname)
+{
+  return fss_remove_file(NULL, pathname);
+}
+
+fss_pool_t* fss_pool_create(const char* sockname, const size_t size, int msec, const struct timespec abstime)
+{
+  // variables initialization
+  fss_pool_t* pool = NULL;
+
+  if (!size) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if ((pool = calloc(1, sizeof(fss_pool_t))) == NULL) {
+    goto end;
+  }
+  if ((pool->connections = calloc(size, sizeof(fss_conn_t*))) == NULL) {
+    goto end;
+  }
+  if ((pool->idle = calloc(size, sizeof(fss_conn_t*))) == NULL) {
+    goto end;
+  }
+  // open all the connections up front
+  for (pool->size = 0; pool->size < size; pool->size++) {
+    if ((pool->connections[pool->size] = fss_connect(sockname, msec, abstime)) == NULL) {
+      goto end;
+    }
+    pool->idle[pool->size] = pool->connections[pool->size];
+  }
+  pool->idle_count = size;
+  EXIT_ON_NZ(pthread_mutex_init(&(pool->mutex), NULL));
+  EXIT_ON_NZ(pthread_cond_init(&(pool->cond), NULL));
+
+  return pool;
+
+  end:
+  ;
+  int myerrno = errno;
+  if (pool != NULL) {
+    for (size_t i = 0; i < pool->size; i++) {
+      fss_disconnect(pool->connections[i]);
+    }
+    free_item((void**)&(pool->connections));
+    free_item((void**)&(pool->idle));
+    free_item((void**)&pool);
+  }
+  errno = myerrno;
+  return NULL;
+}
+
+int fss_pool_destroy(fss_pool_t* pool)
+{
+  if (!pool) {
+    errno = EINVAL;
+    return -1;
+  }
+  int result = 0;
+  for (size_t i = 0; i < pool->size; i++) {
+    if (fss_disconnect(pool->connections[i]) == -1) {
+      result = -1;
+    }
+  }
+  EXIT_ON_NZ(pthread_mutex_destroy(&(pool->mutex)));
+  EXIT_ON_NZ(pthread_cond_destroy(&(pool->cond)));
+  free_item((void**)&(pool->connections));
+  free_item((void**)&(pool->idle));
+  free_item((void**)&pool);
+  return result;
+}
+
+fss_conn_t* fss_pool_acquire(fss_pool_t* pool)
+{
+  if (!pool) {
+    errno = EINVAL;
+    return NULL;
+  }
+  LOCK(&(pool->mutex));
+  while (!pool->idle_count) {
+    // wait for a connection to be released
+    WAIT(&(pool->cond), &(pool->mutex));
+  }
+  fss_conn_t* conn = pool->idle[--(pool->idle_count)];
+  UNLOCK(&(pool->mutex));
+  return conn;
+}
+
+int fss_pool_release(fss_pool_t* pool, fss_conn_t* conn)
+{
+  if (!pool || !conn) {
+    errno = EINVAL;
+    return -1;
+  }
+  LOCK(&(pool->mutex));
+  // the connection must belong to this pool and be acquired (not idle)
+  char owned = 0;
+  for (size_t i = 0; i < pool->size && !owned; i++) {
+    owned = (pool->connections[i] == conn);
+  }
+  for (size_t i = 0; i < pool->idle_count && owned; i++) {
+    owned = (pool->idle[i] != conn);
+  }
+  if (!owned) {
+    // the connection was not acquired from this pool, or it was already released
+    UNLOCK(&(pool->mutex));
+    errno = EINVAL;
+    return -1;
+  }
+  pool->idle[(pool->idle_count)++] = conn;
+  SIGNAL(&(pool->cond));
+  UNLOCK(&(pool->mutex));
+  return 0;
+}
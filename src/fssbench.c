@@ -0,0 +1,831 @@
+#include <posixver.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <fss_api.h>
+#include <fss_defaults.h>
+#include <communication_protocol.h>
+#include <error_handling.h>
+#include <free_item.h>
+#include <str2num.h>
+
+#define HELP_MESSAGE "- Load generator for File Storage Server -\n\nUsage: %s [options] ...\n\nOptions:\n   -h                     Print a list of all options and exit.\n   -f filename            Specify the socket name to connect to.\n   -c n                   Number of clients (default 4).\n   -P                     Run the clients as processes instead of threads.\n   -d seconds             Duration of the run (default 10).\n   -n n                   Operations made by each client, instead of a duration.\n   -x op=weight[,...]     Operation mix, among open, read, write, append, lock\n                          and readN (default read=50,write=20,append=10,\n                          open=10,lock=5,readN=5).\n   -s distribution        File and append sizes: fixed:S, uniform:MIN-MAX or exp:MEAN,\n                          sizes in bytes with an optional K or M suffix (default fixed:4K).\n   -F n                   Number of files of each client (default 16).\n   -N n                   Number of files read by a readN operation (default 8).\n   -r rate                Open-loop mode: total operations per second\n                          (default 0, closed-loop mode).\n   -J filename            Write the results in JSON format to 'filename' (only to stdout if '-').\n   -D dirname             Folder where the files to send are created (default tmp/fssbench).\n   -S seed                Seed of the random choices (default 1).\n   -M size                Share 'size' bytes of memory (optional K or M suffix) with the server\n                          on each connection, the contents that fit in it are not copied\n                          through the socket (default 0, none).\n   -Z                     Read the files through fss_map_file, the large ones are returned\n                          by the server as memfds instead of being copied through the socket.\n   -I                     Map the index of the files recently read, if the server shares one\n                          (SHM_INDEX_SIZE), and read the files published in it without a request.\n"
+#define RETRY_DELAY 200
+#define TIMEOUT 5
+#define DEF_CLIENTS 4
+#define DEF_DURATION 10
+#define DEF_MIX "read=50,write=20,append=10,open=10,lock=5,readN=5"
+#define DEF_SIZES "fixed:4K"
+#define DEF_FILES 16
+#define DEF_READN 8
+#define DEF_WORK_DIR "tmp/fssbench"
+// sizes drawn from an exponential distribution are capped to this multiple of the mean
+#define EXP_SIZE_CAP 16
+
+// operations of the mix
+#define OP_OPEN 0
+#define OP_READ 1
+#define OP_WRITE 2
+#define OP_APPEND 3
+#define OP_LOCK 4
+#define OP_READN 5
+#define OPS 6
+
+// latency histogram buckets, 16 per power of two of microseconds
+#define SUB_BUCKETS 16
+#define LATENCY_BUCKETS (40 * SUB_BUCKETS)
+
+static const char* op_names[OPS] = {"open", "read", "write", "append", "lock", "readN"};
+
+#define SIZE_FIXED 0
+#define SIZE_UNIFORM 1
+#define SIZE_EXP 2
+
+typedef struct {
+  int type;
+  long min;
+  long max;
+  long mean;
+} size_dist_t;
+
+typedef struct {
+  size_t count;
+  size_t errors;
+  size_t bytes;
+  size_t histogram[LATENCY_BUCKETS];
+} op_stats_t;
+
+// results of a client (in shared memory when the clients are processes)
+typedef struct {
+  op_stats_t ops[OPS];
+  char failed;
+} client_stats_t;
+
+typedef struct {
+  const char* socket_name;
+  const char* work_dir;
+  long clients;
+  long files;
+  long read_n;
+  long ops_per_client;
+  struct timespec deadline;
+  // interval between two operations of a client in open-loop mode (0 in closed-loop mode)
+  double interval;
+  long weights[OPS];
+  long total_weight;
+  size_dist_t sizes;
+  long seed;
+  // size of the file of each client, indexed by client * files + file
+  long* file_sizes;
+  // bytes of memory shared with the server on each connection (0 if none)
+  long shm_size;
+  // read the files through fss_map_file
+  char map_reads;
+  // read the files published in the index of the server without a request
+  char map_index;
+} bench_t;
+
+typedef struct {
+  bench_t* bench;
+  int id;
+  client_stats_t* stats;
+} client_args_t;
+
+static int parse_size(const char* s, long* size);
+static int parse_sizes(const char* s, size_dist_t* dist);
+static int parse_mix(const char* s, long weights[OPS], long* total_weight);
+static unsigned long long next_random(unsigned long long* state);
+static long draw_size(const size_dist_t* dist, unsigned long long* state);
+static double elapsed_sec(const struct timespec* start, const struct timespec* end);
+static void add_msec(struct timespec* t, const double msec);
+static size_t latency_bucket(const double msec);
+static double bucket_upper_bound(const size_t bucket);
+static double percentile(const op_stats_t* stats, const double fraction);
+static int create_files(bench_t* bench, const long clients);
+static void remove_files(bench_t* bench, const long clients);
+static void* client(void* args);
+static void print_results(FILE* out, const client_stats_t* total, const double elapsed, const char json, const bench_t* bench, const long clients, const char processes);
+
+int main(int argc, char* argv[])
+{
+  char* f_arg = DEF_SOCKET_NAME,
+      * x_arg = DEF_MIX,
+      * s_arg = DEF_SIZES,
+      * J_arg = NULL,
+      * D_arg = DEF_WORK_DIR,
+      * M_arg = NULL;
+  long clients = DEF_CLIENTS,
+       duration = DEF_DURATION,
+       ops_per_client = 0,
+       files = DEF_FILES,
+       read_n = DEF_READN,
+       rate = 0,
+       seed = 1;
+  char processes = 0,
+       map_reads = 0,
+       map_index = 0;
+
+  int opt;
+  // disable getopt error messages
+  opterr = 0;
+  while ((opt = getopt(argc, argv, ":hf:c:Pd:n:x:s:F:N:r:J:D:S:M:ZI")) != -1) {
+    long* number = NULL;
+    switch (opt) {
+      case 'h':
+        printf(HELP_MESSAGE, argv[0]);
+        return 0;
+      case 'f':
+        f_arg = optarg;
+        break;
+      case 'P':
+        processes = 1;
+        break;
+      case 'Z':
+        map_reads = 1;
+        break;
+      case 'I':
+        map_index = 1;
+        break;
+      case 'x':
+        x_arg = optarg;
+        break;
+      case 's':
+        s_arg = optarg;
+        break;
+      case 'J':
+        J_arg = optarg;
+        break;
+      case 'D':
+        D_arg = optarg;
+        break;
+      case 'M':
+        M_arg = optarg;
+        break;
+      case 'c':
+        number = &clients;
+        break;
+      case 'd':
+        number = &duration;
+        break;
+      case 'n':
+        number = &ops_per_client;
+        break;
+      case 'F':
+        number = &files;
+        break;
+      case 'N':
+        number = &read_n;
+        break;
+      case 'r':
+        number = &rate;
+        break;
+      case 'S':
+        number = &seed;
+        break;
+      case ':':
+        fprintf(stderr, "error: option '-%c' is missing a required argument\n", optopt);
+        return EXIT_FAILURE;
+      default: /* '?' */
+        fprintf(stderr, "error: unrecognized command-line option '-%c'\n", optopt);
+        return EXIT_FAILURE;
+    }
+    if (number && (str2num(optarg, number) != 0 || *number < 0)) {
+      fprintf(stderr, "error: unable to parse the value of '-%c' option\n", opt);
+      return EXIT_FAILURE;
+    }
+  }
+  if (clients < 1 || files < 1 || read_n < 1 || (!duration && !ops_per_client)) {
+    fprintf(stderr, "error: the number of clients, files, files read by readN and the duration must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  bench_t bench = {.socket_name = f_arg, .work_dir = D_arg, .clients = clients, .files = files, .read_n = read_n, .ops_per_client = ops_per_client, .seed = seed, .map_reads = map_reads, .map_index = map_index};
+  if (parse_mix(x_arg, bench.weights, &(bench.total_weight)) == -1) {
+    fprintf(stderr, "error: invalid operation mix '%s'\n", x_arg);
+    return EXIT_FAILURE;
+  }
+  if (parse_sizes(s_arg, &(bench.sizes)) == -1) {
+    fprintf(stderr, "error: invalid size distribution '%s'\n", s_arg);
+    return EXIT_FAILURE;
+  }
+  if (M_arg && parse_size(M_arg, &(bench.shm_size)) == -1) {
+    fprintf(stderr, "error: invalid shared memory size '%s'\n", M_arg);
+    return EXIT_FAILURE;
+  }
+  if (rate) {
+    // each client makes its part of the operations at regular intervals
+    bench.interval = 1000.0 * clients / rate;
+  }
+
+  // create the files sent by the clients
+  if (create_files(&bench, clients) == -1) {
+    perror("create_files");
+    remove_files(&bench, clients);
+    return EXIT_FAILURE;
+  }
+
+  // the statistics are written by the clients in shared memory, so that they can be processes
+  client_stats_t* stats;
+  if ((stats = mmap(NULL, sizeof(client_stats_t) * clients, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    perror("mmap");
+    remove_files(&bench, clients);
+    return EXIT_FAILURE;
+  }
+  client_args_t* args;
+  EXIT_ON_NULL((args = calloc(clients, sizeof(client_args_t))));
+
+  struct timespec start, stop;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &start));
+  bench.deadline = start;
+  bench.deadline.tv_sec += duration;
+
+  pthread_t* threads = NULL;
+  pid_t* pids = NULL;
+  if (processes) {
+    EXIT_ON_NULL((pids = calloc(clients, sizeof(pid_t))));
+  } else {
+    EXIT_ON_NULL((threads = calloc(clients, sizeof(pthread_t))));
+  }
+  for (long i = 0; i < clients; i++) {
+    args[i].bench = &bench;
+    args[i].id = (int)i;
+    args[i].stats = &(stats[i]);
+    if (processes) {
+      EXIT_ON_NEG_ONE((pids[i] = fork()));
+      if (!pids[i]) {
+        client(&(args[i]));
+        _exit(0);
+      }
+    } else {
+      EXIT_ON_NZ((errno = pthread_create(&(threads[i]), NULL, client, &(args[i]))));
+    }
+  }
+  for (long i = 0; i < clients; i++) {
+    if (processes) {
+      EXIT_ON_NEG_ONE(waitpid(pids[i], NULL, 0));
+    } else {
+      EXIT_ON_NZ((errno = pthread_join(threads[i], NULL)));
+    }
+  }
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &stop));
+
+  // merge the statistics of the clients
+  client_stats_t total;
+  memset(&total, 0, sizeof(client_stats_t));
+  for (long i = 0; i < clients; i++) {
+    if (stats[i].failed) {
+      total.failed = 1;
+    }
+    for (int op = 0; op < OPS; op++) {
+      total.ops[op].count += stats[i].ops[op].count;
+      total.ops[op].errors += stats[i].ops[op].errors;
+      total.ops[op].bytes += stats[i].ops[op].bytes;
+      for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        total.ops[op].histogram[b] += stats[i].ops[op].histogram[b];
+      }
+    }
+  }
+  double elapsed = elapsed_sec(&start, &stop);
+  if (!J_arg || strcmp(J_arg, "-") != 0) {
+    // stdout is left to the JSON results if they go there
+    print_results(stdout, &total, elapsed, 0, &bench, clients, processes);
+  }
+  if (J_arg) {
+    FILE* json = stdout;
+    if (strcmp(J_arg, "-") != 0 && (json = fopen(J_arg, "w")) == NULL) {
+      perror("fopen");
+    } else {
+      print_results(json, &total, elapsed, 1, &bench, clients, processes);
+      if (json != stdout) {
+        fclose(json);
+      }
+    }
+  }
+
+  remove_files(&bench, clients);
+  free_item((void**)&threads);
+  free_item((void**)&pids);
+  free_item((void**)&args);
+  EXIT_ON_NEG_ONE(munmap(stats, sizeof(client_stats_t) * clients));
+  return (total.failed ? EXIT_FAILURE : 0);
+}
+
+/**
+ * Parse a size in bytes with an optional K or M suffix
+ *
+ * Return 0 on success, -1 on error
+ */
+static int parse_size(const char* s, long* size)
+{
+  char buffer[32];
+  size_t length = strlen(s);
+  if (!length || length >= sizeof(buffer)) {
+    return -1;
+  }
+  memcpy(buffer, s, length + 1);
+  long multiplier = 1;
+  switch (buffer[length - 1]) {
+    case 'K':
+    case 'k':
+      multiplier = 1024;
+      buffer[length - 1] = '\0';
+      break;
+    case 'M':
+    case 'm':
+      multiplier = 1024 * 1024;
+      buffer[length - 1] = '\0';
+      break;
+  }
+  if (str2num(buffer, size) != 0 || *size < 1) {
+    return -1;
+  }
+  *size *= multiplier;
+  return 0;
+}
+
+/**
+ * Parse a size distribution (fixed:S, uniform:MIN-MAX or exp:MEAN)
+ *
+ * Return 0 on success, -1 on error
+ */
+static int parse_sizes(const char* s, size_dist_t* dist)
+{
+  if (strncmp(s, "fixed:", 6) == 0) {
+    dist->type = SIZE_FIXED;
+    return parse_size(s + 6, &(dist->min));
+  }
+  if (strncmp(s, "uniform:", 8) == 0) {
+    char buffer[64];
+    if (strlen(s + 8) >= sizeof(buffer)) {
+      return -1;
+    }
+    strcpy(buffer, s + 8);
+    char* dash;
+    if ((dash = strchr(buffer, '-')) == NULL) {
+      return -1;
+    }
+    *dash = '\0';
+    dist->type = SIZE_UNIFORM;
+    if (parse_size(buffer, &(dist->min)) == -1 || parse_size(dash + 1, &(dist->max)) == -1 || dist->max < dist->min) {
+      return -1;
+    }
+    return 0;
+  }
+  if (strncmp(s, "exp:", 4) == 0) {
+    dist->type = SIZE_EXP;
+    return parse_size(s + 4, &(dist->mean));
+  }
+  return -1;
+}
+
+/**
+ * Parse an operation mix (op=weight[,op=weight]...)
+ *
+ * Return 0 on success, -1 on error
+ */
+static int parse_mix(const char* s, long weights[OPS], long* total_weight)
+{
+  char* mix;
+  if ((mix = malloc(strlen(s) + 1)) == NULL) {
+    return -1;
+  }
+  strcpy(mix, s);
+  memset(weights, 0, sizeof(long) * OPS);
+  *total_weight = 0;
+  char* saveptr;
+  for (char* token = strtok_r(mix, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+    char* equalsign;
+    if ((equalsign = strchr(token, '=')) == NULL) {
+      free_item((void**)&mix);
+      return -1;
+    }
+    *equalsign = '\0';
+    int op;
+    for (op = 0; op < OPS && strcmp(token, op_names[op]) != 0; op++);
+    long weight;
+    if (op == OPS || str2num(equalsign + 1, &weight) != 0 || weight < 0) {
+      free_item((void**)&mix);
+      return -1;
+    }
+    weights[op] = weight;
+  }
+  free_item((void**)&mix);
+  for (int op = 0; op < OPS; op++) {
+    *total_weight += weights[op];
+  }
+  return (*total_weight > 0 ? 0 : -1);
+}
+
+/**
+ * Return the next number of a xorshift64* random sequence
+ */
+static unsigned long long next_random(unsigned long long* state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/**
+ * Return a size drawn from a size distribution
+ */
+static long draw_size(const size_dist_t* dist, unsigned long long* state)
+{
+  switch (dist->type) {
+    case SIZE_UNIFORM:
+      return dist->min + (long)(next_random(state) % (dist->max - dist->min + 1));
+    case SIZE_EXP:
+      {
+        // uniform in (0, 1]
+        double u = ((next_random(state) >> 11) + 1) / 9007199254740992.0;
+        long size = (long)(-log(u) * dist->mean) + 1;
+        return (size < EXP_SIZE_CAP * dist->mean ? size : EXP_SIZE_CAP * dist->mean);
+      }
+    default:
+      return dist->min;
+  }
+}
+
+/**
+ * Return the seconds elapsed from 'start' to 'end'
+ */
+static double elapsed_sec(const struct timespec* start, const struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/**
+ * Add 'msec' milliseconds to 't'
+ */
+static void add_msec(struct timespec* t, const double msec)
+{
+  long long nsec = t->tv_nsec + (long long)(msec * 1000000);
+  t->tv_sec += nsec / 1000000000;
+  t->tv_nsec = nsec % 1000000000;
+}
+
+/**
+ * Return the latency histogram bucket of 'msec' milliseconds
+ */
+static size_t latency_bucket(const double msec)
+{
+  unsigned long long usec = (unsigned long long)(msec * 1000);
+  if (usec < SUB_BUCKETS) {
+    return (size_t)usec;
+  }
+  // SUB_BUCKETS buckets for each power of two
+  int bit = 63 - __builtin_clzll(usec);
+  size_t bucket = SUB_BUCKETS * (bit - 3) + ((usec >> (bit - 4)) & (SUB_BUCKETS - 1));
+  return (bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Return the upper bound in milliseconds of the latencies in a histogram bucket
+ */
+static double bucket_upper_bound(const size_t bucket)
+{
+  if (bucket < SUB_BUCKETS) {
+    return (bucket + 1) / 1000.0;
+  }
+  int bit = bucket / SUB_BUCKETS + 3;
+  return (double)((SUB_BUCKETS + 1ULL + bucket % SUB_BUCKETS) << (bit - 4)) / 1000.0;
+}
+
+/**
+ * Return an upper bound in milliseconds of the given percentile of the latencies of an operation
+ */
+static double percentile(const op_stats_t* stats, const double fraction)
+{
+  if (!stats->count) {
+    return 0;
+  }
+  size_t rank = (size_t)(stats->count * fraction);
+  if (rank < stats->count * fraction || !rank) {
+    rank++;
+  }
+  size_t seen = 0;
+  for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += stats->histogram[i];
+    if (seen >= rank) {
+      return bucket_upper_bound(i);
+    }
+  }
+  return bucket_upper_bound(LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Create the files of the clients, with sizes drawn from the size distribution
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int create_files(bench_t* bench, const long clients)
+{
+  if ((bench->file_sizes = calloc(clients * bench->files, sizeof(long))) == NULL) {
+    return -1;
+  }
+  if (mkdir(bench->work_dir, 0755) == -1 && errno != EEXIST) {
+    return -1;
+  }
+  unsigned long long state = bench->seed * 0x9E3779B97F4A7C15ULL + 1;
+  long max_size = 0;
+  for (long i = 0; i < clients * bench->files; i++) {
+    bench->file_sizes[i] = draw_size(&(bench->sizes), &state);
+    if (bench->file_sizes[i] > max_size) {
+      max_size = bench->file_sizes[i];
+    }
+  }
+  char* content;
+  if ((content = malloc(max_size)) == NULL) {
+    return -1;
+  }
+  for (long i = 0; i < max_size; i++) {
+    content[i] = (char)('a' + next_random(&state) % 26);
+  }
+  char pathname[PATH_MAX];
+  for (long c = 0; c < clients; c++) {
+    snprintf(pathname, PATH_MAX, "%s/%ld", bench->work_dir, c);
+    if (mkdir(pathname, 0755) == -1 && errno != EEXIST) {
+      free_item((void**)&content);
+      return -1;
+    }
+    for (long f = 0; f < bench->files; f++) {
+      snprintf(pathname, PATH_MAX, "%s/%ld/file%ld", bench->work_dir, c, f);
+      FILE* file;
+      if ((file = fopen(pathname, "w")) == NULL) {
+        free_item((void**)&content);
+        return -1;
+      }
+      size_t size = bench->file_sizes[c * bench->files + f];
+      if (fwrite(content, 1, size, file) != size) {
+        fclose(file);
+        free_item((void**)&content);
+        return -1;
+      }
+      if (fclose(file) != 0) {
+        free_item((void**)&content);
+        return -1;
+      }
+    }
+  }
+  free_item((void**)&content);
+  return 0;
+}
+
+/**
+ * Remove the files of the clients
+ */
+static void remove_files(bench_t* bench, const long clients)
+{
+  char pathname[PATH_MAX];
+  for (long c = 0; c < clients; c++) {
+    for (long f = 0; f < bench->files; f++) {
+      snprintf(pathname, PATH_MAX, "%s/%ld/file%ld", bench->work_dir, c, f);
+      unlink(pathname);
+    }
+    snprintf(pathname, PATH_MAX, "%s/%ld", bench->work_dir, c);
+    rmdir(pathname);
+  }
+  rmdir(bench->work_dir);
+  free_item((void**)&(bench->file_sizes));
+}
+
+/**
+ * Function executed by the clients: make operations drawn from the mix on the client files
+ * until the deadline or the number of operations is reached
+ */
+static void* client(void* args)
+{
+  bench_t* bench = ((client_args_t*)args)->bench;
+  int id = ((client_args_t*)args)->id;
+  client_stats_t* stats = ((client_args_t*)args)->stats;
+
+  struct timespec abstime = {.tv_sec = time(NULL) + TIMEOUT, .tv_nsec = 0};
+  fss_conn_t* conn;
+  if ((conn = fss_connect(bench->socket_name, RETRY_DELAY, abstime)) == NULL) {
+    perror("fss_connect");
+    stats->failed = 1;
+    return NULL;
+  }
+  if (bench->shm_size && fss_negotiate_shm(conn, bench->shm_size) == -1) {
+    perror("fss_negotiate_shm");
+    fss_disconnect(conn);
+    stats->failed = 1;
+    return NULL;
+  }
+  if (bench->map_index && fss_map_index(conn) == -1) {
+    perror("fss_map_index");
+    fss_disconnect(conn);
+    stats->failed = 1;
+    return NULL;
+  }
+  unsigned long long state = (bench->seed + id + 1) * 0x9E3779B97F4A7C15ULL;
+  // files of the client currently stored on the server (as far as the client knows)
+  char* stored;
+  char** pathnames;
+  EXIT_ON_NULL((stored = calloc(bench->files, sizeof(char))));
+  EXIT_ON_NULL((pathnames = calloc(bench->files, sizeof(char*))));
+  long stored_count = 0;
+  for (long f = 0; f < bench->files; f++) {
+    EXIT_ON_NULL((pathnames[f] = malloc(PATH_MAX)));
+    snprintf(pathnames[f], PATH_MAX, "%s/%d/file%ld", bench->work_dir, id, f);
+  }
+  // content of the appends
+  long max_append = (bench->sizes.type == SIZE_FIXED ? bench->sizes.min : (bench->sizes.type == SIZE_UNIFORM ? bench->sizes.max : EXP_SIZE_CAP * bench->sizes.mean));
+  char* append_buffer;
+  EXIT_ON_NULL((append_buffer = calloc(max_append, sizeof(char))));
+
+  struct timespec scheduled;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &scheduled));
+  // in open-loop mode, spread the operations of the clients over the interval
+  add_msec(&scheduled, bench->interval * id / bench->clients);
+  for (long n = 0; !bench->ops_per_client || n < bench->ops_per_client; n++) {
+    struct timespec start, end;
+    if (bench->interval > 0) {
+      // open loop: wait for the scheduled time, the latency is measured from it
+      // so that the time spent waiting for late operations is accounted for
+      EXIT_ON_NZ((errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &scheduled, NULL)));
+      start = scheduled;
+      add_msec(&scheduled, bench->interval);
+    } else {
+      EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &start));
+    }
+    if (!bench->ops_per_client && elapsed_sec(&(bench->deadline), &start) >= 0) {
+      break;
+    }
+
+    // draw the operation
+    long draw = (long)(next_random(&state) % bench->total_weight);
+    int op = 0;
+    while (draw >= bench->weights[op]) {
+      draw -= bench->weights[op++];
+    }
+    // draw the file: a stored one, unless the operation creates it
+    long f = (long)(next_random(&state) % bench->files);
+    if (op != OP_WRITE && op != OP_READN) {
+      if (!stored_count) {
+        // nothing to operate on yet
+        op = OP_WRITE;
+      } else {
+        while (!stored[f]) {
+          f = (f + 1) % bench->files;
+        }
+      }
+    }
+    char* pathname = pathnames[f];
+    int result = 0;
+    size_t bytes = 0;
+    switch (op) {
+      case OP_OPEN:
+        if ((result = fss_open_file(conn, pathname, O_NOFLAG)) == 0) {
+          result = fss_close_file(conn, pathname);
+        }
+        break;
+      case OP_READ:
+        if ((result = fss_open_file(conn, pathname, O_NOFLAG)) == 0) {
+          void* buf = NULL;
+          size_t size = 0;
+          if (bench->map_reads) {
+            if ((result = fss_map_file(conn, pathname, &buf, &size)) == 0) {
+              bytes = size;
+              fss_unmap_file(buf, size);
+            }
+          } else {
+            if ((result = fss_read_file(conn, pathname, &buf, &size)) == 0) {
+              bytes = size;
+            }
+            free_item(&buf);
+          }
+          fss_close_file(conn, pathname);
+        }
+        break;
+      case OP_WRITE:
+        if (stored[f]) {
+          // replace the file
+          if (fss_open_file(conn, pathname, O_LOCK) == 0) {
+            fss_remove_file(conn, pathname);
+          }
+          stored[f] = 0;
+          stored_count--;
+        }
+        if ((result = fss_open_file(conn, pathname, O_CREATE | O_LOCK)) == 0) {
+          if ((result = fss_write_file(conn, pathname, NULL)) == 0) {
+            bytes = bench->file_sizes[id * bench->files + f];
+            stored[f] = 1;
+            stored_count++;
+          }
+          // leave the file available to the other operations
+          fss_unlock_file(conn, pathname);
+          fss_close_file(conn, pathname);
+        } else if (errno == ECANCELED) {
+          // left by an earlier run: replace it next time
+          stored[f] = 1;
+          stored_count++;
+        }
+        break;
+      case OP_APPEND:
+        if ((result = fss_open_file(conn, pathname, O_NOFLAG)) == 0) {
+          size_t size = draw_size(&(bench->sizes), &state);
+          if ((result = fss_append_to_file(conn, pathname, append_buffer, size, NULL)) == 0) {
+            bytes = size;
+          }
+          fss_close_file(conn, pathname);
+        }
+        break;
+      case OP_LOCK:
+        if ((result = fss_open_file(conn, pathname, O_NOFLAG)) == 0) {
+          if ((result = fss_lock_file(conn, pathname)) == 0) {
+            result = fss_unlock_file(conn, pathname);
+          }
+          fss_close_file(conn, pathname);
+        }
+        break;
+      case OP_READN:
+        result = (fss_read_n_files(conn, (int)bench->read_n, NULL) == -1 ? -1 : 0);
+        break;
+    }
+    EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &end));
+
+    op_stats_t* op_stats = &(stats->ops[op]);
+    op_stats->count++;
+    op_stats->bytes += bytes;
+    op_stats->histogram[latency_bucket(elapsed_sec(&start, &end) * 1000)]++;
+    if (result == -1) {
+      op_stats->errors++;
+      if (errno != ECANCELED) {
+        // the connection cannot be used anymore
+        perror(op_names[op]);
+        stats->failed = 1;
+        break;
+      }
+      if (op != OP_WRITE && op != OP_READN && stored[f]) {
+        // the file has been evicted by the server
+        stored[f] = 0;
+        stored_count--;
+      }
+    }
+  }
+
+  fss_disconnect(conn);
+  for (long f = 0; f < bench->files; f++) {
+    free_item((void**)&(pathnames[f]));
+  }
+  free_item((void**)&pathnames);
+  free_item((void**)&stored);
+  free_item((void**)&append_buffer);
+  return NULL;
+}
+
+/**
+ * Print the results of the run, as text or in JSON format
+ */
+static void print_results(FILE* out, const client_stats_t* total, const double elapsed, const char json, const bench_t* bench, const long clients, const char processes)
+{
+  size_t count = 0, errors = 0, bytes = 0;
+  for (int op = 0; op < OPS; op++) {
+    count += total->ops[op].count;
+    errors += total->ops[op].errors;
+    bytes += total->ops[op].bytes;
+  }
+  double megabytes = (double)bytes / (1024 * 1024);
+  if (json) {
+    fprintf(out, "{\n  \"clients\": %ld,\n  \"processes\": %s,\n  \"mode\": \"%s\",\n  \"elapsed_s\": %.3f,\n", clients, (processes ? "true" : "false"), (bench->interval > 0 ? "open" : "closed"), elapsed);
+    fprintf(out, "  \"ops\": %zu,\n  \"errors\": %zu,\n  \"ops_per_s\": %.1f,\n  \"mb_per_s\": %.2f,\n  \"per_op\": {", count, errors, count / elapsed, megabytes / elapsed);
+    const char* separator = "\n";
+    for (int op = 0; op < OPS; op++) {
+      const op_stats_t* stats = &(total->ops[op]);
+      if (!bench->weights[op] && !stats->count) {
+        continue;
+      }
+      fprintf(out, "%s    \"%s\": {\"ops\": %zu, \"errors\": %zu, \"ops_per_s\": %.1f, \"mb_per_s\": %.2f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f}",
+              separator, op_names[op], stats->count, stats->errors, stats->count / elapsed, (double)stats->bytes / (1024 * 1024) / elapsed,
+              percentile(stats, 0.5), percentile(stats, 0.99), percentile(stats, 0.999));
+      separator = ",\n";
+    }
+    fprintf(out, "\n  }\n}\n");
+    return;
+  }
+  fprintf(out, "%ld %s, %s loop, %.3f s: %zu operation(s) (%zu error(s)), %.1f ops/s, %.2f MB/s\n",
+          clients, (processes ? "process(es)" : "thread(s)"), (bench->interval > 0 ? "open" : "closed"), elapsed, count, errors, count / elapsed, megabytes / elapsed);
+  fprintf(out, "%-8s %10s %8s %12s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s", "MB/s", "p50 ms", "p99 ms", "p999 ms");
+  for (int op = 0; op < OPS; op++) {
+    const op_stats_t* stats = &(total->ops[op]);
+    if (!bench->weights[op] && !stats->count) {
+      continue;
+    }
+    fprintf(out, "%-8s %10zu %8zu %12.1f %10.2f %10.3f %10.3f %10.3f\n", op_names[op], stats->count, stats->errors, stats->count / elapsed,
+            (double)stats->bytes / (1024 * 1024) / elapsed, percentile(stats, 0.5), percentile(stats, 0.99), percentile(stats, 0.999));
+  }
+}
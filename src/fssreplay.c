@@ -0,0 +1,463 @@
+#include <posixver.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <fss_api.h>
+#include <fss_defaults.h>
+#include <communication_protocol.h>
+#include <trace.h>
+#include <error_handling.h>
+#include <free_item.h>
+
+#define HELP_MESSAGE "- Trace replay for File Storage Server -\n\nUsage: %s [options] ...\n\nOptions:\n   -h                     Print a list of all options and exit.\n   -f filename            Specify the socket name to connect to.\n   -t filename            Trace to replay, written by the server (TRACE_FILE).\n   -s speed               Replay speed: 1 is the original speed (default), 2 twice as fast,\n                          0 as fast as possible.\n   -D dirname             Folder where the files to write are created (default tmp/fssreplay).\n\nEach traced connection is replayed by its own client, which makes the requests of the connection\nin the same order; the traced pathnames are replaced by '<dirname>/<pathname hash>'.\nTraced latencies are measured by the server, replayed latencies by the clients.\n"
+
+#define RETRY_DELAY 200
+#define TIMEOUT 5
+#define DEF_WORK_DIR "tmp/fssreplay"
+
+// request codes go from 1 to 9, 0 is a disconnection
+#define OPCODES 14
+
+static const char* opcode_names[OPCODES] = {"disconnect", "open", "read", "readN", "write", "append", "lock", "unlock", "close", "remove", "stats", "negotiate", "read_fd", "index"};
+
+typedef struct {
+  size_t count;
+  // requests whose success differs from the trace
+  size_t mismatches;
+  double traced_latency;
+  double replayed_latency;
+} opcode_stats_t;
+
+typedef struct {
+  const char* socket_name;
+  const char* work_dir;
+  double speed;
+  // when the replay started and timestamp of the first traced request
+  struct timespec start;
+  uint64_t first_timestamp;
+} replay_t;
+
+typedef struct {
+  replay_t* replay;
+  // records of the connection, in timestamp order
+  trace_record_t* records;
+  size_t count;
+  opcode_stats_t stats[OPCODES];
+  // maximum delay of a request with respect to its schedule, in milliseconds
+  double max_lag;
+  char failed;
+} connection_args_t;
+
+static int compare_records(const void* a, const void* b);
+static int compare_writes(const void* a, const void* b);
+static int create_files(const replay_t* replay, trace_record_t* records, const size_t count);
+static void replay_pathname(const replay_t* replay, const uint64_t hash, char pathname[PATH_MAX]);
+static double elapsed_msec(const struct timespec* start, const struct timespec* end);
+static void* connection(void* args);
+
+int main(int argc, char* argv[])
+{
+  char* f_arg = DEF_SOCKET_NAME,
+      * t_arg = NULL,
+      * D_arg = DEF_WORK_DIR;
+  double speed = 1;
+
+  int opt;
+  // disable getopt error messages
+  opterr = 0;
+  while ((opt = getopt(argc, argv, ":hf:t:s:D:")) != -1) {
+    switch (opt) {
+      case 'h':
+        printf(HELP_MESSAGE, argv[0]);
+        return 0;
+      case 'f':
+        f_arg = optarg;
+        break;
+      case 't':
+        t_arg = optarg;
+        break;
+      case 'D':
+        D_arg = optarg;
+        break;
+      case 's':
+        {
+          char* end;
+          errno = 0;
+          speed = strtod(optarg, &end);
+          if (errno || end == optarg || *end != '\0' || speed < 0) {
+            fprintf(stderr, "error: unable to parse the value of '-%c' option\n", opt);
+            return EXIT_FAILURE;
+          }
+        }
+        break;
+      case ':':
+        fprintf(stderr, "error: option '-%c' is missing a required argument\n", optopt);
+        return EXIT_FAILURE;
+      default: /* '?' */
+        fprintf(stderr, "error: unrecognized command-line option '-%c'\n", optopt);
+        return EXIT_FAILURE;
+    }
+  }
+  if (!t_arg) {
+    fprintf(stderr, "error: no trace to replay ('-t' option)\n");
+    return EXIT_FAILURE;
+  }
+
+  // load the trace
+  FILE* file;
+  if ((file = fopen(t_arg, "r")) == NULL) {
+    perror(t_arg);
+    return EXIT_FAILURE;
+  }
+  trace_header_t header;
+  if (fread(&header, sizeof(trace_header_t), 1, file) != 1 || trace_check_header(&header) == -1) {
+    fprintf(stderr, "error: '%s' is not a trace written by this version of the server\n", t_arg);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+  struct stat info;
+  EXIT_ON_NEG_ONE(fstat(fileno(file), &info));
+  size_t count = (info.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t);
+  trace_record_t* records;
+  EXIT_ON_NULL((records = malloc(sizeof(trace_record_t) * (count ? count : 1))));
+  if (fread(records, sizeof(trace_record_t), count, file) != count) {
+    fprintf(stderr, "error: could not read '%s'\n", t_arg);
+    fclose(file);
+    free_item((void**)&records);
+    return EXIT_FAILURE;
+  }
+  fclose(file);
+  if (!count) {
+    printf("The trace is empty\n");
+    free_item((void**)&records);
+    return 0;
+  }
+
+  replay_t replay = {.socket_name = f_arg, .work_dir = D_arg, .speed = speed, .first_timestamp = UINT64_MAX};
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].timestamp < replay.first_timestamp) {
+      replay.first_timestamp = records[i].timestamp;
+    }
+  }
+  // create the files the clients write
+  if (create_files(&replay, records, count) == -1) {
+    perror("error: could not create the files to write");
+    free_item((void**)&records);
+    return EXIT_FAILURE;
+  }
+  // group the records by connection, each connection in the order its requests were made
+  qsort(records, count, sizeof(trace_record_t), compare_records);
+  size_t connections = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!i || records[i].connection != records[i - 1].connection) {
+      connections++;
+    }
+  }
+  connection_args_t* args;
+  pthread_t* tids;
+  EXIT_ON_NULL((args = calloc(connections, sizeof(connection_args_t))));
+  EXIT_ON_NULL((tids = calloc(connections, sizeof(pthread_t))));
+  for (size_t i = 0, c = 0; i < count; i++) {
+    if (i && records[i].connection != records[i - 1].connection) {
+      c++;
+    }
+    if (!args[c].records) {
+      args[c].records = &(records[i]);
+      args[c].replay = &replay;
+    }
+    args[c].count++;
+  }
+
+  // start a client for each connection
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &(replay.start)));
+  for (size_t c = 0; c < connections; c++) {
+    EXIT_ON_NZ(pthread_create(&(tids[c]), NULL, connection, &(args[c])));
+  }
+  opcode_stats_t total[OPCODES];
+  memset(total, 0, sizeof(total));
+  double max_lag = 0;
+  char failed = 0;
+  for (size_t c = 0; c < connections; c++) {
+    EXIT_ON_NZ(pthread_join(tids[c], NULL));
+    for (int op = 0; op < OPCODES; op++) {
+      total[op].count += args[c].stats[op].count;
+      total[op].mismatches += args[c].stats[op].mismatches;
+      total[op].traced_latency += args[c].stats[op].traced_latency;
+      total[op].replayed_latency += args[c].stats[op].replayed_latency;
+    }
+    if (args[c].max_lag > max_lag) {
+      max_lag = args[c].max_lag;
+    }
+    failed |= args[c].failed;
+  }
+  struct timespec stop;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &stop));
+  double elapsed = elapsed_msec(&(replay.start), &stop) / 1000;
+
+  // print the results
+  size_t requests = 0, mismatches = 0;
+  for (int op = 1; op < OPCODES; op++) {
+    requests += total[op].count;
+    mismatches += total[op].mismatches;
+  }
+  printf("%zu connection(s), %zu request(s) replayed in %.3f s (%.1f requests/s)", connections, requests, elapsed, requests / elapsed);
+  if (speed > 0) {
+    printf(", at most %.3f ms behind schedule", max_lag);
+  }
+  printf("\n%zu request(s) with a different outcome than in the trace\n", mismatches);
+  printf("%-10s %10s %10s %18s %18s\n", "request", "count", "different", "traced avg ms", "replayed avg ms");
+  for (int op = 1; op < OPCODES; op++) {
+    if (!total[op].count) {
+      continue;
+    }
+    printf("%-10s %10zu %10zu %18.3f %18.3f\n", opcode_names[op], total[op].count, total[op].mismatches,
+           total[op].traced_latency / total[op].count, total[op].replayed_latency / total[op].count);
+  }
+
+  // remove the files written
+  qsort(records, count, sizeof(trace_record_t), compare_writes);
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].opcode == WRITE_FILE && (!i || records[i - 1].opcode != WRITE_FILE || records[i].pathname_hash != records[i - 1].pathname_hash)) {
+      char pathname[PATH_MAX];
+      replay_pathname(&replay, records[i].pathname_hash, pathname);
+      unlink(pathname);
+    }
+  }
+  rmdir(D_arg);
+  free_item((void**)&args);
+  free_item((void**)&tids);
+  free_item((void**)&records);
+  return (failed ? EXIT_FAILURE : 0);
+}
+
+/**
+ * Order the records by connection, and by timestamp within a connection
+ */
+static int compare_records(const void* a, const void* b)
+{
+  const trace_record_t* x = (const trace_record_t*)a;
+  const trace_record_t* y = (const trace_record_t*)b;
+  if (x->connection != y->connection) {
+    return (x->connection < y->connection ? -1 : 1);
+  }
+  if (x->timestamp != y->timestamp) {
+    return (x->timestamp < y->timestamp ? -1 : 1);
+  }
+  // a disconnection is the last thing a connection does
+  return (x->opcode == TRACE_DISCONNECT) - (y->opcode == TRACE_DISCONNECT);
+}
+
+/**
+ * Order the write records by pathname hash, and by timestamp for the same pathname,
+ * after all the other records
+ */
+static int compare_writes(const void* a, const void* b)
+{
+  const trace_record_t* x = (const trace_record_t*)a;
+  const trace_record_t* y = (const trace_record_t*)b;
+  if ((x->opcode == WRITE_FILE) != (y->opcode == WRITE_FILE)) {
+    return (x->opcode == WRITE_FILE ? 1 : -1);
+  }
+  if (x->pathname_hash != y->pathname_hash) {
+    return (x->pathname_hash < y->pathname_hash ? -1 : 1);
+  }
+  if (x->timestamp != y->timestamp) {
+    return (x->timestamp < y->timestamp ? -1 : 1);
+  }
+  return 0;
+}
+
+/**
+ * Write in 'pathname' the pathname that replaces the traced one with hash 'hash'
+ */
+static void replay_pathname(const replay_t* replay, const uint64_t hash, char pathname[PATH_MAX])
+{
+  snprintf(pathname, PATH_MAX, "%s/%016" PRIx64, replay->work_dir, hash);
+}
+
+/**
+ * Create the files sent by write requests, as large as the first write of each pathname
+ * (a pathname written again with a different size is replayed with the size of its first write)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int create_files(const replay_t* replay, trace_record_t* records, const size_t count)
+{
+  if (mkdir(replay->work_dir, 0755) == -1 && errno != EEXIST) {
+    return -1;
+  }
+  qsort(records, count, sizeof(trace_record_t), compare_writes);
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].opcode != WRITE_FILE || (i && records[i - 1].opcode == WRITE_FILE && records[i].pathname_hash == records[i - 1].pathname_hash)) {
+      continue;
+    }
+    char pathname[PATH_MAX];
+    replay_pathname(replay, records[i].pathname_hash, pathname);
+    int fd;
+    if ((fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+      return -1;
+    }
+    // the content does not matter, only its size
+    if (ftruncate(fd, records[i].request_size) == -1) {
+      int errnosav = errno;
+      close(fd);
+      errno = errnosav;
+      return -1;
+    }
+    if (close(fd) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Return the milliseconds elapsed from 'start' to 'end'
+ */
+static double elapsed_msec(const struct timespec* start, const struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/**
+ * Function executed by the clients: make the requests of a traced connection, each one at its scheduled time
+ */
+static void* connection(void* args)
+{
+  connection_args_t* conn_args = (connection_args_t*)args;
+  replay_t* replay = conn_args->replay;
+
+  // content of the appends
+  size_t max_append = 1;
+  for (size_t i = 0; i < conn_args->count; i++) {
+    if (conn_args->records[i].opcode == APPEND_TO_FILE && conn_args->records[i].request_size > max_append) {
+      max_append = conn_args->records[i].request_size;
+    }
+  }
+  char* append_buffer;
+  EXIT_ON_NULL((append_buffer = calloc(max_append, sizeof(char))));
+
+  fss_conn_t* conn = NULL;
+  for (size_t i = 0; i < conn_args->count; i++) {
+    trace_record_t* record = &(conn_args->records[i]);
+    if (replay->speed > 0) {
+      // wait for the scheduled time of the request
+      struct timespec scheduled = replay->start;
+      double offset = (record->timestamp - replay->first_timestamp) / replay->speed;
+      scheduled.tv_sec += (time_t)(offset / 1000000000);
+      scheduled.tv_nsec += (long)(offset - (double)(time_t)(offset / 1000000000) * 1000000000);
+      if (scheduled.tv_nsec >= 1000000000) {
+        scheduled.tv_sec++;
+        scheduled.tv_nsec -= 1000000000;
+      }
+      EXIT_ON_NZ((errno = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &scheduled, NULL)));
+      struct timespec now;
+      EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &now));
+      double lag = elapsed_msec(&scheduled, &now);
+      if (lag > conn_args->max_lag) {
+        conn_args->max_lag = lag;
+      }
+    }
+    if (record->opcode == TRACE_DISCONNECT) {
+      break;
+    }
+    if (record->opcode >= OPCODES) {
+      // a request the server could not parse
+      continue;
+    }
+    if (record->opcode == GET_STATS || record->opcode == NEGOTIATE_SHM || record->opcode == MAP_INDEX) {
+      // the requests that change nothing in the storage are not replayed
+      continue;
+    }
+    if (!conn) {
+      // the connection starts with its first request
+      struct timespec abstime = {.tv_sec = time(NULL) + TIMEOUT, .tv_nsec = 0};
+      if ((conn = fss_connect(replay->socket_name, RETRY_DELAY, abstime)) == NULL) {
+        perror("fss_connect");
+        conn_args->failed = 1;
+        break;
+      }
+    }
+
+    char pathname[PATH_MAX];
+    replay_pathname(replay, record->pathname_hash, pathname);
+    struct timespec start, end;
+    EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &start));
+    int result = -1;
+    switch (record->opcode) {
+      case OPEN_FILE:
+        result = fss_open_file(conn, pathname, (int)record->request_size);
+        break;
+      case READ_FILE:
+        {
+          void* buf = NULL;
+          size_t size;
+          result = fss_read_file(conn, pathname, &buf, &size);
+          free_item(&buf);
+        }
+        break;
+      case READ_FILE_FD:
+        {
+          void* buf = NULL;
+          size_t size;
+          if ((result = fss_map_file(conn, pathname, &buf, &size)) == 0) {
+            fss_unmap_file(buf, size);
+          }
+        }
+        break;
+      case READ_N_FILES:
+        result = (fss_read_n_files(conn, (int)record->request_size, NULL) == -1 ? -1 : 0);
+        break;
+      case WRITE_FILE:
+        result = fss_write_file(conn, pathname, NULL);
+        break;
+      case APPEND_TO_FILE:
+        result = fss_append_to_file(conn, pathname, append_buffer, record->request_size, NULL);
+        break;
+      case LOCK_FILE:
+        result = fss_lock_file(conn, pathname);
+        break;
+      case UNLOCK_FILE:
+        result = fss_unlock_file(conn, pathname);
+        break;
+      case CLOSE_FILE:
+        result = fss_close_file(conn, pathname);
+        break;
+      case REMOVE_FILE:
+        result = fss_remove_file(conn, pathname);
+        break;
+    }
+    EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &end));
+    if (result == -1 && errno != ECANCELED) {
+      // the connection cannot be used anymore
+      perror(opcode_names[record->opcode]);
+      conn_args->failed = 1;
+      break;
+    }
+
+    opcode_stats_t* stats = &(conn_args->stats[record->opcode]);
+    stats->count++;
+    // the outcome of a delayed response is not known
+    if (record->result && (record->result == OK) != (result == 0)) {
+      stats->mismatches++;
+    }
+    stats->traced_latency += record->latency / 1000.0;
+    stats->replayed_latency += elapsed_msec(&start, &end);
+  }
+
+  if (conn) {
+    fss_disconnect(conn);
+  }
+  free_item((void**)&append_buffer);
+  return NULL;
+}
@@ -0,0 +1,626 @@
+#include <posixver.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <trace.h>
+#include <icl_hash.h>
+#include <communication_protocol.h>
+#include <concurrency.h>
+#include <error_handling.h>
+#include <free_item.h>
+#include <str2num.h>
+
+#define HELP_MESSAGE "- Replacement policy simulator for File Storage Server -\n\nUsage: %s [options] ...\n\nOptions:\n   -h                     Print a list of all options and exit.\n   -t filename            Trace to simulate, written by the server (TRACE_FILE).\n   -p policy[,policy]...  Replacement policies among fifo (the server one), lru, clock and lfu\n                          (default all of them).\n   -c size[,size]...      Storage capacities (STORAGE_MAX_SIZE) in bytes, with an optional K, M or G\n                          suffix (default: 10 points up to the largest size the trace reaches).\n   -n points              Number of capacities when they are not given (default 10).\n   -F n[,n]...            Maximum numbers of files (STORAGE_MAX_FILE_NUMBER, default 0: no limit).\n   -j n                   Number of simulations run in parallel (default: online CPUs).\n\nOne line is printed for each policy, maximum number of files and capacity, with tab-separated fields:\npolicy, capacity, maximum number of files, references, misses, miss ratio, byte miss ratio,\nevictions and refused requests. Lines starting with '#' are comments.\n"
+
+#define DEF_POINTS 10
+#define MAX_VALUES 64
+
+// replacement policies
+#define POLICY_FIFO 0
+#define POLICY_LRU 1
+#define POLICY_CLOCK 2
+#define POLICY_LFU 3
+#define POLICIES 4
+
+static const char* policy_names[POLICIES] = {"fifo", "lru", "clock", "lfu"};
+
+/**
+ * A file of the simulated storage, kept after its eviction to recognize a miss
+ */
+typedef struct sim_file_s {
+  uint64_t hash;
+  size_t size;
+  char resident;
+  // only modified files can be evicted, as in the server
+  char modified;
+  // used by the clock and lfu policies
+  char referenced;
+  size_t frequency;
+  // resident files in insertion order (fifo, clock, lfu) or in recency order (lru)
+  struct sim_file_s* previous;
+  struct sim_file_s* next;
+} sim_file_t;
+
+/**
+ * A storage simulated with a policy and capacity, accounting files and bytes like src/storage.c
+ */
+typedef struct {
+  int policy;
+  size_t max_size;
+  size_t max_file_number;
+  size_t size;
+  size_t file_number;
+  icl_hash_t* files;
+  sim_file_t* head;
+  sim_file_t* tail;
+  sim_file_t* hand;
+  // results
+  size_t references;
+  size_t misses;
+  size_t referenced_bytes;
+  size_t missed_bytes;
+  size_t evictions;
+  size_t refused;
+  size_t max_size_reached;
+} sim_t;
+
+typedef struct {
+  const trace_record_t* records;
+  size_t count;
+  sim_t* sims;
+  size_t sim_count;
+  // next simulation to run
+  size_t next;
+  pthread_mutex_t mutex;
+} jobs_t;
+
+static int parse_size(const char* s, long* size);
+static int parse_list(char* s, long values[MAX_VALUES], size_t* count, const char sizes);
+static int compare_timestamps(const void* a, const void* b);
+static void simulate(sim_t* sim, const trace_record_t* records, const size_t count);
+static void* simulator(void* args);
+
+int main(int argc, char* argv[])
+{
+  char* t_arg = NULL,
+      * p_arg = NULL,
+      * c_arg = NULL,
+      * F_arg = NULL;
+  long points = DEF_POINTS,
+       parallel = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  // disable getopt error messages
+  opterr = 0;
+  while ((opt = getopt(argc, argv, ":ht:p:c:n:F:j:")) != -1) {
+    long* number = NULL;
+    switch (opt) {
+      case 'h':
+        printf(HELP_MESSAGE, argv[0]);
+        return 0;
+      case 't':
+        t_arg = optarg;
+        break;
+      case 'p':
+        p_arg = optarg;
+        break;
+      case 'c':
+        c_arg = optarg;
+        break;
+      case 'F':
+        F_arg = optarg;
+        break;
+      case 'n':
+        number = &points;
+        break;
+      case 'j':
+        number = &parallel;
+        break;
+      case ':':
+        fprintf(stderr, "error: option '-%c' is missing a required argument\n", optopt);
+        return EXIT_FAILURE;
+      default: /* '?' */
+        fprintf(stderr, "error: unrecognized command-line option '-%c'\n", optopt);
+        return EXIT_FAILURE;
+    }
+    if (number && (str2num(optarg, number) != 0 || *number < 1 || *number > MAX_VALUES)) {
+      fprintf(stderr, "error: unable to parse the value of '-%c' option\n", opt);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!t_arg) {
+    fprintf(stderr, "error: no trace to simulate ('-t' option)\n");
+    return EXIT_FAILURE;
+  }
+
+  // policies to simulate
+  char policies[POLICIES] = {0};
+  size_t policy_count = 0;
+  if (!p_arg) {
+    memset(policies, 1, sizeof(policies));
+    policy_count = POLICIES;
+  } else {
+    for (char* saveptr = NULL, * token = strtok_r(p_arg, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+      int p = 0;
+      while (p < POLICIES && strcmp(token, policy_names[p]) != 0) {
+        p++;
+      }
+      if (p == POLICIES) {
+        fprintf(stderr, "error: unknown replacement policy '%s'\n", token);
+        return EXIT_FAILURE;
+      }
+      policy_count += !policies[p];
+      policies[p] = 1;
+    }
+  }
+  long capacities[MAX_VALUES], file_numbers[MAX_VALUES] = {0};
+  size_t capacity_count = 0, file_number_count = 1;
+  if (c_arg && parse_list(c_arg, capacities, &capacity_count, 1) == -1) {
+    fprintf(stderr, "error: invalid list of capacities '%s'\n", c_arg);
+    return EXIT_FAILURE;
+  }
+  if (F_arg && parse_list(F_arg, file_numbers, &file_number_count, 0) == -1) {
+    fprintf(stderr, "error: invalid list of maximum numbers of files '%s'\n", F_arg);
+    return EXIT_FAILURE;
+  }
+
+  // load the trace
+  FILE* file;
+  if ((file = fopen(t_arg, "r")) == NULL) {
+    perror(t_arg);
+    return EXIT_FAILURE;
+  }
+  trace_header_t header;
+  if (fread(&header, sizeof(trace_header_t), 1, file) != 1 || trace_check_header(&header) == -1) {
+    fprintf(stderr, "error: '%s' is not a trace written by this version of the server\n", t_arg);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+  struct stat info;
+  EXIT_ON_NEG_ONE(fstat(fileno(file), &info));
+  size_t count = (info.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t);
+  trace_record_t* records;
+  EXIT_ON_NULL((records = malloc(sizeof(trace_record_t) * (count ? count : 1))));
+  if (fread(records, sizeof(trace_record_t), count, file) != count) {
+    fprintf(stderr, "error: could not read '%s'\n", t_arg);
+    fclose(file);
+    free_item((void**)&records);
+    return EXIT_FAILURE;
+  }
+  fclose(file);
+  // the requests of all the connections, in the order they were ready to be served
+  qsort(records, count, sizeof(trace_record_t), compare_timestamps);
+
+  if (!capacity_count) {
+    // spread the capacities up to the largest size reached without evictions
+    sim_t unbounded = {.policy = POLICY_FIFO, .max_size = SIZE_MAX, .max_file_number = SIZE_MAX};
+    simulate(&unbounded, records, count);
+    size_t peak = (unbounded.max_size_reached ? unbounded.max_size_reached : 1);
+    for (long p = 1; p <= points; p++) {
+      capacities[capacity_count++] = (peak * p + points - 1) / points;
+    }
+  }
+
+  // one simulation for each policy, maximum number of files and capacity
+  jobs_t jobs = {.records = records, .count = count, .sim_count = policy_count * file_number_count * capacity_count};
+  EXIT_ON_NULL((jobs.sims = calloc(jobs.sim_count, sizeof(sim_t))));
+  size_t s = 0;
+  for (int p = 0; p < POLICIES; p++) {
+    for (size_t f = 0; policies[p] && f < file_number_count; f++) {
+      for (size_t c = 0; c < capacity_count; c++) {
+        jobs.sims[s].policy = p;
+        jobs.sims[s].max_file_number = (file_numbers[f] ? (size_t)file_numbers[f] : SIZE_MAX);
+        jobs.sims[s].max_size = capacities[c];
+        s++;
+      }
+    }
+  }
+  EXIT_ON_NZ(pthread_mutex_init(&(jobs.mutex), NULL));
+  if ((size_t)parallel > jobs.sim_count) {
+    parallel = jobs.sim_count;
+  }
+  pthread_t* tids;
+  EXIT_ON_NULL((tids = calloc(parallel, sizeof(pthread_t))));
+  for (long t = 0; t < parallel; t++) {
+    EXIT_ON_NZ(pthread_create(&(tids[t]), NULL, simulator, &jobs));
+  }
+  for (long t = 0; t < parallel; t++) {
+    EXIT_ON_NZ(pthread_join(tids[t], NULL));
+  }
+  EXIT_ON_NZ(pthread_mutex_destroy(&(jobs.mutex)));
+
+  printf("# fsssim trace=%s records=%zu\n", t_arg, count);
+  printf("# policy\tcapacity\tmax_files\treferences\tmisses\tmiss_ratio\tbyte_miss_ratio\tevictions\trefused\n");
+  for (s = 0; s < jobs.sim_count; s++) {
+    sim_t* sim = &(jobs.sims[s]);
+    printf("%s\t%zu\t%zu\t%zu\t%zu\t%.6f\t%.6f\t%zu\t%zu\n", policy_names[sim->policy], sim->max_size,
+           (sim->max_file_number == SIZE_MAX ? 0 : sim->max_file_number), sim->references, sim->misses,
+           (sim->references ? (double)sim->misses / sim->references : 0),
+           (sim->referenced_bytes ? (double)sim->missed_bytes / sim->referenced_bytes : 0),
+           sim->evictions, sim->refused);
+  }
+  free_item((void**)&tids);
+  free_item((void**)&(jobs.sims));
+  free_item((void**)&records);
+  return 0;
+}
+
+/**
+ * Parse a size in bytes with an optional K, M or G suffix
+ *
+ * Return 0 on success, -1 on error
+ */
+static int parse_size(const char* s, long* size)
+{
+  char buffer[32];
+  size_t length = strlen(s);
+  if (!length || length >= sizeof(buffer)) {
+    return -1;
+  }
+  memcpy(buffer, s, length + 1);
+  long multiplier = 1;
+  switch (buffer[length - 1]) {
+    case 'K':
+    case 'k':
+      multiplier = 1024;
+      buffer[length - 1] = '\0';
+      break;
+    case 'M':
+    case 'm':
+      multiplier = 1024 * 1024;
+      buffer[length - 1] = '\0';
+      break;
+    case 'G':
+    case 'g':
+      multiplier = 1024 * 1024 * 1024;
+      buffer[length - 1] = '\0';
+      break;
+  }
+  if (str2num(buffer, size) != 0 || *size < 1) {
+    return -1;
+  }
+  *size *= multiplier;
+  return 0;
+}
+
+/**
+ * Parse a comma-separated list of sizes (if 'sizes' is set) or of non-negative numbers
+ *
+ * Return 0 on success, -1 on error
+ */
+static int parse_list(char* s, long values[MAX_VALUES], size_t* count, const char sizes)
+{
+  *count = 0;
+  for (char* saveptr = NULL, * token = strtok_r(s, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+    if (*count == MAX_VALUES) {
+      return -1;
+    }
+    if (sizes ? parse_size(token, &(values[*count])) != 0 : (str2num(token, &(values[*count])) != 0 || values[*count] < 0)) {
+      return -1;
+    }
+    (*count)++;
+  }
+  return (*count ? 0 : -1);
+}
+
+/**
+ * Order the records by timestamp
+ */
+static int compare_timestamps(const void* a, const void* b)
+{
+  const trace_record_t* x = (const trace_record_t*)a;
+  const trace_record_t* y = (const trace_record_t*)b;
+  if (x->timestamp != y->timestamp) {
+    return (x->timestamp < y->timestamp ? -1 : 1);
+  }
+  return 0;
+}
+
+/**
+ * The pathname hashes of the trace are used as keys
+ */
+static unsigned int hash_key(void* key)
+{
+  uint64_t hash = *(uint64_t*)key;
+  return (unsigned int)(hash ^ (hash >> 32));
+}
+
+static int compare_keys(void* a, void* b)
+{
+  return *(uint64_t*)a == *(uint64_t*)b;
+}
+
+/**
+ * Remove a file from the list of the resident files
+ */
+static void list_remove(sim_t* sim, sim_file_t* file)
+{
+  if (sim->hand == file) {
+    sim->hand = file->next;
+  }
+  if (file->previous) {
+    file->previous->next = file->next;
+  } else {
+    sim->head = file->next;
+  }
+  if (file->next) {
+    file->next->previous = file->previous;
+  } else {
+    sim->tail = file->previous;
+  }
+  file->previous = file->next = NULL;
+}
+
+/**
+ * Put a file at the end of the list of the resident files
+ */
+static void list_append(sim_t* sim, sim_file_t* file)
+{
+  file->previous = sim->tail;
+  file->next = NULL;
+  if (sim->tail) {
+    sim->tail->next = file;
+  } else {
+    sim->head = file;
+  }
+  sim->tail = file;
+}
+
+/**
+ * Choose the file to evict according to the policy, never 'spare' nor a file not yet modified
+ *
+ * Return the victim, NULL if no file can be evicted
+ */
+static sim_file_t* get_victim(sim_t* sim, const sim_file_t* spare)
+{
+  switch (sim->policy) {
+    case POLICY_CLOCK:
+      {
+        // give a second chance to the referenced files, two rounds are enough to find a victim
+        size_t steps = 2 * sim->file_number + 1;
+        for (size_t i = 0; i < steps && sim->head; i++) {
+          if (!sim->hand) {
+            sim->hand = sim->head;
+          }
+          sim_file_t* file = sim->hand;
+          sim->hand = file->next;
+          if (file == spare || !file->modified) {
+            continue;
+          }
+          if (!file->referenced) {
+            return file;
+          }
+          file->referenced = 0;
+        }
+        return NULL;
+      }
+    case POLICY_LFU:
+      {
+        // the least frequently referenced file, the oldest one if tied
+        sim_file_t* victim = NULL;
+        for (sim_file_t* file = sim->head; file; file = file->next) {
+          if (file != spare && file->modified && (!victim || file->frequency < victim->frequency)) {
+            victim = file;
+          }
+        }
+        return victim;
+      }
+    default:
+      // fifo and lru: the list is already in eviction order
+      for (sim_file_t* file = sim->head; file; file = file->next) {
+        if (file != spare && file->modified) {
+          return file;
+        }
+      }
+      return NULL;
+  }
+}
+
+/**
+ * Evict a resident file, which is kept to recognize later references to it
+ */
+static void evict(sim_t* sim, sim_file_t* file)
+{
+  list_remove(sim, file);
+  file->resident = 0;
+  sim->size -= file->size;
+  sim->file_number--;
+  sim->evictions++;
+}
+
+/**
+ * Make room for 'length' more bytes, never evicting 'spare' (as storage_append_reserve)
+ *
+ * Return 0 on success, -1 if there is not enough room
+ */
+static int make_room(sim_t* sim, const sim_file_t* spare, const size_t length)
+{
+  if (length > sim->max_size) {
+    return -1;
+  }
+  while (sim->size + length > sim->max_size) {
+    sim_file_t* victim;
+    if ((victim = get_victim(sim, spare)) == NULL) {
+      return -1;
+    }
+    evict(sim, victim);
+  }
+  return 0;
+}
+
+/**
+ * Make a file resident, evicting others if the maximum number of files or the capacity is reached
+ * (as storage_open)
+ *
+ * Return 0 on success, -1 if there is no room for the file
+ */
+static int insert(sim_t* sim, sim_file_t* file)
+{
+  if (sim->file_number == sim->max_file_number) {
+    sim_file_t* victim;
+    if ((victim = get_victim(sim, NULL)) == NULL) {
+      return -1;
+    }
+    evict(sim, victim);
+  }
+  if (make_room(sim, NULL, file->size) == -1) {
+    return -1;
+  }
+  file->resident = 1;
+  file->referenced = 0;
+  list_append(sim, file);
+  sim->file_number++;
+  sim->size += file->size;
+  if (sim->size > sim->max_size_reached) {
+    sim->max_size_reached = sim->size;
+  }
+  return 0;
+}
+
+/**
+ * Reference a file that would be stored in a storage without limits:
+ * a miss if it has been evicted, in which case the client stores it again
+ */
+static void reference(sim_t* sim, sim_file_t* file)
+{
+  sim->references++;
+  sim->referenced_bytes += file->size;
+  file->frequency++;
+  if (!file->resident) {
+    sim->misses++;
+    sim->missed_bytes += file->size;
+    if (insert(sim, file) == -1) {
+      sim->refused++;
+    }
+    return;
+  }
+  switch (sim->policy) {
+    case POLICY_LRU:
+      list_remove(sim, file);
+      list_append(sim, file);
+      break;
+    case POLICY_CLOCK:
+      file->referenced = 1;
+      break;
+  }
+}
+
+/**
+ * Add 'length' bytes to a resident file (as storage_append_reserve and storage_append_commit)
+ */
+static void append(sim_t* sim, sim_file_t* file, const size_t length)
+{
+  if (!file->resident || file->size + length > sim->max_size || make_room(sim, file, length) == -1) {
+    // the server refuses the content
+    sim->refused++;
+    return;
+  }
+  file->size += length;
+  file->modified = 1;
+  sim->size += length;
+  if (sim->size > sim->max_size_reached) {
+    sim->max_size_reached = sim->size;
+  }
+}
+
+/**
+ * Run the requests of the trace against a simulated storage
+ */
+static void simulate(sim_t* sim, const trace_record_t* records, const size_t count)
+{
+  EXIT_ON_NULL((sim->files = icl_hash_create(count / 4 + 1, hash_key, compare_keys)));
+  for (size_t i = 0; i < count; i++) {
+    const trace_record_t* record = &(records[i]);
+    if (record->result && record->result != OK && record->result != FILE_NOT_FOUND && record->result != OUT_OF_MEMORY) {
+      // the request was refused for reasons the capacity has nothing to do with
+      continue;
+    }
+    uint64_t key = record->pathname_hash;
+    sim_file_t* file = icl_hash_find(sim->files, &key);
+    switch (record->opcode) {
+      case OPEN_FILE:
+        if (IS_SET(O_CREATE, record->request_size)) {
+          if (file && file->resident) {
+            break;
+          }
+          if (!file) {
+            EXIT_ON_NULL((file = calloc(1, sizeof(sim_file_t))));
+            file->hash = key;
+            EXIT_ON_NULL(icl_hash_insert(sim->files, &(file->hash), file));
+          }
+          // a new file, even if an evicted one had the same pathname
+          file->size = 0;
+          file->modified = 0;
+          file->frequency = 0;
+          if (insert(sim, file) == -1) {
+            sim->refused++;
+          }
+        } else if (file) {
+          reference(sim, file);
+        }
+        break;
+      case READ_FILE:
+      case READ_FILE_FD:
+        if (file) {
+          reference(sim, file);
+        }
+        break;
+      case WRITE_FILE:
+        if (file) {
+          if (!file->resident) {
+            // evicted between its creation and its first write
+            file->size = 0;
+            if (insert(sim, file) == -1) {
+              sim->refused++;
+              break;
+            }
+          }
+          append(sim, file, record->request_size);
+        }
+        break;
+      case APPEND_TO_FILE:
+        if (file) {
+          reference(sim, file);
+          append(sim, file, record->request_size);
+        }
+        break;
+      case REMOVE_FILE:
+        if (file) {
+          if (file->resident) {
+            list_remove(sim, file);
+            sim->size -= file->size;
+            sim->file_number--;
+          }
+          EXIT_ON_NEG_ONE(icl_hash_delete(sim->files, &key, NULL, free));
+        }
+        break;
+    }
+  }
+  EXIT_ON_NEG_ONE(icl_hash_destroy(sim->files, NULL, free));
+  sim->files = NULL;
+}
+
+/**
+ * Function executed by the simulator threads: run the simulations not yet taken by others
+ */
+static void* simulator(void* args)
+{
+  jobs_t* jobs = (jobs_t*)args;
+  while (1) {
+    LOCK(&(jobs->mutex));
+    size_t s = jobs->next++;
+    UNLOCK(&(jobs->mutex));
+    if (s >= jobs->sim_count) {
+      break;
+    }
+    simulate(&(jobs->sims[s]), jobs->records, jobs->count);
+  }
+  return NULL;
+}
@@ -0,0 +1,214 @@
+#include <posixver.h>
+
+#include <lock_profile.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <error_handling.h>
+
+typedef struct {
+  pthread_mutex_t* mutex;
+  lock_site_t* site;
+  uint64_t since;
+} held_lock_t;
+
+// mutexes held by the calling thread
+static __thread held_lock_t held[LOCK_PROFILE_HELD];
+static __thread size_t held_count = 0;
+
+// list of the registered sites (the profiler uses the pthread functions directly)
+static lock_site_t* sites = NULL;
+static size_t site_count = 0;
+static pthread_mutex_t sites_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Return the nanoseconds of the monotonic clock
+ */
+static uint64_t now(void)
+{
+  struct timespec t;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &t));
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/**
+ * Return the class of the mutexes locked at a site, guessed from the mutex expression and the file
+ */
+static const char* lock_class(const lock_site_t* site)
+{
+  if (strstr(site->expression, "storage->mutex")) {
+    return "storage";
+  }
+  if (strstr(site->expression, "->ordering")) {
+    return "file_ordering";
+  }
+  if (strstr(site->file, "storage.c")) {
+    return "file_mutex";
+  }
+  if (strstr(site->file, "ubuffer.c")) {
+    return "ubuffer";
+  }
+  if (strstr(site->file, "bbuffer.c")) {
+    return "bbuffer";
+  }
+  if (strstr(site->file, "worker_pool.c")) {
+    return "worker_pool";
+  }
+  if (strstr(site->file, "connection.c")) {
+    return "connection";
+  }
+  return "other";
+}
+
+/**
+ * Add a site to the list the first time it is used
+ */
+static void register_site(lock_site_t* site)
+{
+  if (__atomic_load_n(&(site->registered), __ATOMIC_ACQUIRE) || __atomic_exchange_n(&(site->registered), 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  site->lock_class = lock_class(site);
+  EXIT_ON_NZ(pthread_mutex_lock(&sites_mutex));
+  site->next = sites;
+  sites = site;
+  site_count++;
+  EXIT_ON_NZ(pthread_mutex_unlock(&sites_mutex));
+}
+
+/**
+ * Start measuring the hold time of a mutex acquired at 'site'
+ */
+static void hold(pthread_mutex_t* mutex, lock_site_t* site, const uint64_t since)
+{
+  if (held_count < LOCK_PROFILE_HELD) {
+    held[held_count++] = (held_lock_t){.mutex = mutex, .site = site, .since = since};
+  }
+}
+
+/**
+ * Count the hold time of a mutex that is being released in the site that acquired it
+ */
+static void release(pthread_mutex_t* mutex, const uint64_t until)
+{
+  // mutexes are not always released in reverse order
+  for (size_t i = held_count; i > 0; i--) {
+    if (held[i - 1].mutex == mutex) {
+      __atomic_fetch_add(&(held[i - 1].site->hold_time), until - held[i - 1].since, __ATOMIC_RELAXED);
+      memmove(&(held[i - 1]), &(held[i]), sizeof(held_lock_t) * (held_count - i));
+      held_count--;
+      return;
+    }
+  }
+}
+
+void lock_profile_lock(pthread_mutex_t* mutex, lock_site_t* site)
+{
+  register_site(site);
+  uint64_t start = now();
+  int error = pthread_mutex_trylock(mutex);
+  if (error == EBUSY) {
+    EXIT_ON_NZ(pthread_mutex_lock(mutex));
+    uint64_t end = now();
+    __atomic_fetch_add(&(site->contended), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(site->wait_time), end - start, __ATOMIC_RELAXED);
+    start = end;
+  } else {
+    EXIT_ON_NZ(error);
+  }
+  __atomic_fetch_add(&(site->acquisitions), 1, __ATOMIC_RELAXED);
+  hold(mutex, site, start);
+}
+
+void lock_profile_unlock(pthread_mutex_t* mutex, lock_site_t* site)
+{
+  register_site(site);
+  release(mutex, now());
+  EXIT_ON_NZ(pthread_mutex_unlock(mutex));
+}
+
+void lock_profile_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, lock_site_t* site)
+{
+  register_site(site);
+  uint64_t start = now();
+  release(mutex, start);
+  EXIT_ON_NZ(pthread_cond_wait(cond, mutex));
+  uint64_t end = now();
+  __atomic_fetch_add(&(site->cond_waits), 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(site->cond_wait_time), end - start, __ATOMIC_RELAXED);
+  hold(mutex, site, end);
+}
+
+int lock_profile_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline, lock_site_t* site)
+{
+  register_site(site);
+  uint64_t start = now();
+  release(mutex, start);
+  int error = pthread_cond_timedwait(cond, mutex, deadline);
+  if (error && error != ETIMEDOUT) {
+    errno = error;
+    perror("pthread_cond_timedwait");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t end = now();
+  __atomic_fetch_add(&(site->cond_waits), 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(site->cond_wait_time), end - start, __ATOMIC_RELAXED);
+  hold(mutex, site, end);
+  return error;
+}
+
+/**
+ * Compare two sites by the time waited to acquire the mutexes, then by the time waited on condition variables
+ */
+static int compare_sites(const void* a, const void* b)
+{
+  const lock_site_t* x = *(const lock_site_t**)a;
+  const lock_site_t* y = *(const lock_site_t**)b;
+  if (x->wait_time != y->wait_time) {
+    return (x->wait_time < y->wait_time ? 1 : -1);
+  }
+  if (x->cond_wait_time != y->cond_wait_time) {
+    return (x->cond_wait_time < y->cond_wait_time ? 1 : -1);
+  }
+  return (x->acquisitions < y->acquisitions) - (x->acquisitions > y->acquisitions);
+}
+
+void lock_profile_print(FILE* stream)
+{
+  EXIT_ON_NZ(pthread_mutex_lock(&sites_mutex));
+  lock_site_t** ranked;
+  if ((ranked = malloc(sizeof(lock_site_t*) * (site_count + 1))) == NULL) {
+    EXIT_ON_NZ(pthread_mutex_unlock(&sites_mutex));
+    perror("lock_profile_print");
+    return;
+  }
+  size_t count = 0;
+  for (lock_site_t* site = sites; site; site = site->next) {
+    ranked[count++] = site;
+  }
+  EXIT_ON_NZ(pthread_mutex_unlock(&sites_mutex));
+  // the counters may be updated while they are sorted, the ranking is approximate anyway
+  qsort(ranked, count, sizeof(lock_site_t*), compare_sites);
+
+  fprintf(stream, "# lock profile: %zu call site(s), ranked by time waited to acquire the mutex\n", count);
+  fprintf(stream, "# wait_ms\tcontended\tacquisitions\tcontended_pct\thold_ms\tmean_hold_us\tcond_waits\tcond_wait_ms\tclass\tsite\tmutex\n");
+  for (size_t i = 0; i < count; i++) {
+    lock_site_t* site = ranked[i];
+    uint64_t acquisitions = __atomic_load_n(&(site->acquisitions), __ATOMIC_RELAXED);
+    uint64_t contended = __atomic_load_n(&(site->contended), __ATOMIC_RELAXED);
+    uint64_t hold_time = __atomic_load_n(&(site->hold_time), __ATOMIC_RELAXED);
+    // the mutex is also acquired again when a wait ends
+    uint64_t cond_waits = __atomic_load_n(&(site->cond_waits), __ATOMIC_RELAXED);
+    fprintf(stream, "%.3f\t%" PRIu64 "\t%" PRIu64 "\t%.2f\t%.3f\t%.3f\t%" PRIu64 "\t%.3f\t%s\t%s:%d\t%s\n",
+            __atomic_load_n(&(site->wait_time), __ATOMIC_RELAXED) / 1e6, contended, acquisitions,
+            (acquisitions ? 100.0 * contended / acquisitions : 0.0), hold_time / 1e6, (acquisitions + cond_waits ? hold_time / 1e3 / (acquisitions + cond_waits) : 0.0),
+            cond_waits, __atomic_load_n(&(site->cond_wait_time), __ATOMIC_RELAXED) / 1e6,
+            site->lock_class, site->file, site->line, site->expression);
+  }
+  free(ranked);
+  fflush(stream);
+}
@@ -0,0 +1,458 @@
+#include <posixver.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <storage.h>
+#include <icl_hash.h>
+#include <ubuffer.h>
+#include <worker_pool.h>
+#include <communication_protocol.h>
+#include <error_handling.h>
+#include <free_item.h>
+#include <str2num.h>
+#ifdef LOCK_PROFILE
+#include <lock_profile.h>
+#endif
+
+#define HELP_MESSAGE "- Microbenchmarks for File Storage Server internals -\n\nUsage: %s [options] ...\n\nOptions:\n   -h                     Print a list of all options and exit.\n   -t n                   Maximum number of threads, each benchmark runs with\n                          1, 2, 4, ... and n threads (default: online CPUs).\n   -n n                   Operations made by each thread (default 100000).\n   -s size                Size in bytes of the files read (default 4096).\n   -a size                Size in bytes of each append (default 64).\n   -k n                   Number of keys in the hash table (default 10000).\n   -b name                Run only the benchmarks whose name starts with 'name'.\n\nOne line is printed for each benchmark and number of threads, with tab-separated fields:\nbenchmark, threads, total operations, wall-clock nanoseconds per operation\nand operations per second (over all the threads).\nLines starting with '#' are comments.\n"
+
+#define DEF_OPS 100000
+#define DEF_FILE_SIZE 4096
+#define DEF_APPEND_SIZE 64
+#define DEF_KEYS 10000
+
+// files are never evicted during a benchmark
+#define STORAGE_MAX_SIZE ((size_t)1 << 40)
+
+typedef struct {
+  long ops;
+  long file_size;
+  long append_size;
+  long keys;
+} params_t;
+
+/**
+ * State shared by the threads of a benchmark run
+ */
+typedef struct run_s {
+  const params_t* params;
+  void (*body)(struct run_s* run, const int id, const long ops);
+  long threads;
+  // the threads operate on the same file if set, on a file each otherwise
+  char shared;
+  storage_t* storage;
+  char** pathnames;
+  icl_hash_t* hash;
+  char** keys;
+  ubuffer_t* ubuffer;
+  worker_pool_t* pool;
+  // one per thread, posted by the pool workers when a request of the thread has been served
+  sem_t* served;
+  pthread_barrier_t barrier;
+  // run time of each thread
+  struct timespec* start;
+  struct timespec* end;
+} run_t;
+
+typedef struct {
+  run_t* run;
+  int id;
+} thread_args_t;
+
+typedef struct {
+  const char* name;
+  char shared;
+  // prepare the shared state, NULL if nothing is needed
+  void (*setup)(run_t* run);
+  // make 'ops' operations
+  void (*body)(run_t* run, const int id, const long ops);
+  // release the shared state, NULL if nothing is needed
+  void (*teardown)(run_t* run);
+} benchmark_t;
+
+static void storage_setup(run_t* run);
+static void storage_teardown(run_t* run);
+static void open_body(run_t* run, const int id, const long ops);
+static void read_body(run_t* run, const int id, const long ops);
+static void append_body(run_t* run, const int id, const long ops);
+static void hash_setup(run_t* run);
+static void hash_teardown(run_t* run);
+static void hash_body(run_t* run, const int id, const long ops);
+static void ubuffer_setup(run_t* run);
+static void ubuffer_teardown(run_t* run);
+static void ubuffer_body(run_t* run, const int id, const long ops);
+static void pool_setup(run_t* run);
+static void pool_teardown(run_t* run);
+static void pool_body(run_t* run, const int id, const long ops);
+static double run_benchmark(const benchmark_t* benchmark, const params_t* params, const long threads);
+
+// names are part of the output format: do not change them
+static const benchmark_t benchmarks[] = {
+  {"storage_open/disjoint", 0, storage_setup, open_body, storage_teardown},
+  {"storage_open/shared", 1, storage_setup, open_body, storage_teardown},
+  {"storage_read/disjoint", 0, storage_setup, read_body, storage_teardown},
+  {"storage_read/shared", 1, storage_setup, read_body, storage_teardown},
+  {"storage_append/disjoint", 0, storage_setup, append_body, storage_teardown},
+  {"storage_append/shared", 1, storage_setup, append_body, storage_teardown},
+  {"icl_hash_find/abs_path", 1, hash_setup, hash_body, hash_teardown},
+  {"ubuffer/enqueue_dequeue", 1, ubuffer_setup, ubuffer_body, ubuffer_teardown},
+  {"worker_pool/round_trip", 0, pool_setup, pool_body, pool_teardown}
+};
+
+int main(int argc, char* argv[])
+{
+  const char* b_arg = "";
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  params_t params = {.ops = DEF_OPS, .file_size = DEF_FILE_SIZE, .append_size = DEF_APPEND_SIZE, .keys = DEF_KEYS};
+
+  int opt;
+  // disable getopt error messages
+  opterr = 0;
+  while ((opt = getopt(argc, argv, ":ht:n:s:a:k:b:")) != -1) {
+    long* number = NULL;
+    switch (opt) {
+      case 'h':
+        printf(HELP_MESSAGE, argv[0]);
+        return 0;
+      case 'b':
+        b_arg = optarg;
+        break;
+      case 't':
+        number = &threads;
+        break;
+      case 'n':
+        number = &(params.ops);
+        break;
+      case 's':
+        number = &(params.file_size);
+        break;
+      case 'a':
+        number = &(params.append_size);
+        break;
+      case 'k':
+        number = &(params.keys);
+        break;
+      case ':':
+        fprintf(stderr, "error: option '-%c' is missing a required argument\n", optopt);
+        return EXIT_FAILURE;
+      default: /* '?' */
+        fprintf(stderr, "error: unrecognized command-line option '-%c'\n", optopt);
+        return EXIT_FAILURE;
+    }
+    if (number && (str2num(optarg, number) != 0 || *number < 1)) {
+      fprintf(stderr, "error: unable to parse the value of '-%c' option\n", opt);
+      return EXIT_FAILURE;
+    }
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads >= FD_SETSIZE) {
+    // the round trip benchmark uses the thread ids as client fds
+    threads = FD_SETSIZE - 1;
+  }
+
+  printf("# microbench ops=%ld file_size=%ld append_size=%ld keys=%ld\n", params.ops, params.file_size, params.append_size, params.keys);
+  printf("# benchmark\tthreads\tops\tns_per_op\tops_per_s\n");
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    if (strncmp(benchmarks[i].name, b_arg, strlen(b_arg)) != 0) {
+      continue;
+    }
+    for (long t = 1; t <= threads; t = (t * 2 > threads && t != threads ? threads : t * 2)) {
+      double elapsed = run_benchmark(&(benchmarks[i]), &params, t);
+      long total = params.ops * t;
+      printf("%s\t%ld\t%ld\t%.1f\t%.0f\n", benchmarks[i].name, t, total, elapsed * 1e9 / total, total / elapsed);
+      fflush(stdout);
+    }
+  }
+#ifdef LOCK_PROFILE
+  // the lock profile covers all the benchmarks run
+  lock_profile_print(stderr);
+#endif
+  return 0;
+}
+
+/**
+ * Return the seconds elapsed from 'start' to 'end'
+ */
+static double elapsed_sec(const struct timespec* start, const struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/**
+ * Create the files of the run, each one with 'file_size' bytes of content,
+ * and open them for all the threads (user 'id' + 1 for thread 'id')
+ */
+static void storage_setup(run_t* run)
+{
+  long files = (run->shared ? 1 : run->threads);
+  EXIT_ON_NULL((run->storage = storage_create(files, STORAGE_MAX_SIZE)));
+  EXIT_ON_NULL((run->pathnames = calloc(files, sizeof(char*))));
+  char* content;
+  EXIT_ON_NULL((content = calloc(run->params->file_size, sizeof(char))));
+  user_node_t* pending_locks = NULL;
+  file_t* removed_list = NULL;
+  for (long f = 0; f < files; f++) {
+    EXIT_ON_NULL((run->pathnames[f] = malloc(sizeof(char) * 64)));
+    snprintf(run->pathnames[f], 64, "/home/fss/microbench/file%ld", f);
+    // written by the first thread that uses it, like a client would do
+    int owner = f + 1;
+    EXIT_ON_NEG_ONE(storage_open(run->storage, run->pathnames[f], O_CREATE | O_LOCK, &pending_locks, owner));
+    EXIT_ON_NEG_ONE(storage_append(run->storage, run->pathnames[f], content, run->params->file_size, &pending_locks, &removed_list, owner));
+    int waiter;
+    EXIT_ON_NEG_ONE(storage_unlock(run->storage, run->pathnames[f], &waiter, owner));
+    EXIT_ON_NEG_ONE(storage_close(run->storage, run->pathnames[f], owner));
+  }
+  for (long t = 0; t < run->threads; t++) {
+    EXIT_ON_NEG_ONE(storage_open(run->storage, run->pathnames[run->shared ? 0 : t], O_NOFLAG, &pending_locks, t + 1));
+  }
+  free_item((void**)&content);
+}
+
+static void storage_teardown(run_t* run)
+{
+  long files = (run->shared ? 1 : run->threads);
+  for (long f = 0; f < files; f++) {
+    free_item((void**)&(run->pathnames[f]));
+  }
+  free_item((void**)&(run->pathnames));
+  EXIT_ON_NEG_ONE(storage_destroy(run->storage));
+}
+
+/**
+ * Open and close the file of the thread
+ */
+static void open_body(run_t* run, const int id, const long ops)
+{
+  const char* pathname = run->pathnames[run->shared ? 0 : id];
+  user_node_t* pending_locks = NULL;
+  for (long i = 0; i < ops; i++) {
+    EXIT_ON_NEG_ONE(storage_open(run->storage, pathname, O_NOFLAG, &pending_locks, id + 1));
+    EXIT_ON_NEG_ONE(storage_close(run->storage, pathname, id + 1));
+  }
+}
+
+/**
+ * Read the file of the thread
+ */
+static void read_body(run_t* run, const int id, const long ops)
+{
+  const char* pathname = run->pathnames[run->shared ? 0 : id];
+  for (long i = 0; i < ops; i++) {
+    void* buffer;
+    size_t size;
+    EXIT_ON_NEG_ONE(storage_read(run->storage, pathname, &buffer, &size, id + 1));
+    free_item(&buffer);
+  }
+}
+
+/**
+ * Append 'append_size' bytes to the file of the thread
+ */
+static void append_body(run_t* run, const int id, const long ops)
+{
+  const char* pathname = run->pathnames[run->shared ? 0 : id];
+  char* content;
+  EXIT_ON_NULL((content = calloc(run->params->append_size, sizeof(char))));
+  user_node_t* pending_locks = NULL;
+  file_t* removed_list = NULL;
+  for (long i = 0; i < ops; i++) {
+    EXIT_ON_NEG_ONE(storage_append(run->storage, pathname, content, run->params->append_size, &pending_locks, &removed_list, id + 1));
+  }
+  free_item((void**)&content);
+}
+
+/**
+ * Fill a hash table with 'keys' absolute pathnames,
+ * with as many buckets as the storage would use for the same number of files
+ */
+static void hash_setup(run_t* run)
+{
+  long keys = run->params->keys;
+  EXIT_ON_NULL((run->hash = icl_hash_create(keys / 10 + 1, NULL, NULL)));
+  EXIT_ON_NULL((run->keys = calloc(keys, sizeof(char*))));
+  for (long k = 0; k < keys; k++) {
+    EXIT_ON_NULL((run->keys[k] = malloc(sizeof(char) * 64)));
+    snprintf(run->keys[k], 64, "/home/fss/projects/dir%03ld/sample_file%06ld.txt", k % 100, k);
+    EXIT_ON_NULL(icl_hash_insert(run->hash, run->keys[k], run->keys[k]));
+  }
+}
+
+static void hash_teardown(run_t* run)
+{
+  EXIT_ON_NEG_ONE(icl_hash_destroy(run->hash, NULL, NULL));
+  for (long k = 0; k < run->params->keys; k++) {
+    free_item((void**)&(run->keys[k]));
+  }
+  free_item((void**)&(run->keys));
+}
+
+/**
+ * Look up the keys of the hash table, each thread starting from a different one
+ */
+static void hash_body(run_t* run, const int id, const long ops)
+{
+  long keys = run->params->keys;
+  long k = (keys / run->threads) * id;
+  for (long i = 0; i < ops; i++) {
+    if (icl_hash_find(run->hash, run->keys[k]) == NULL) {
+      fprintf(stderr, "error: key '%s' not found\n", run->keys[k]);
+      exit(EXIT_FAILURE);
+    }
+    // visit the keys in a different order than they were inserted
+    k = (k + 7919) % keys;
+  }
+}
+
+static void ubuffer_setup(run_t* run)
+{
+  EXIT_ON_NULL((run->ubuffer = ubuffer_create()));
+}
+
+static void ubuffer_teardown(run_t* run)
+{
+  EXIT_ON_NEG_ONE(ubuffer_destroy(run->ubuffer));
+}
+
+/**
+ * Enqueue and dequeue an item (possibly enqueued by another thread)
+ */
+static void ubuffer_body(run_t* run, const int id, const long ops)
+{
+  for (long i = 0; i < ops; i++) {
+    EXIT_ON_NEG_ONE(ubuffer_enqueue(run->ubuffer, run));
+    // every thread enqueues before dequeuing, so the dequeue cannot wait forever
+    EXIT_ON_NULL(ubuffer_dequeue(run->ubuffer));
+  }
+  (void)id;
+}
+
+/**
+ * Function executed by the workers of the pool: mark the clients served as soon as they are dispatched
+ */
+static void* pool_worker(void* arg)
+{
+  worker_pool_t* pool = (worker_pool_t*)arg;
+  run_t* run = (run_t*)pool->arg;
+  int fd;
+  while ((fd = worker_pool_get(pool)) != -1) {
+    worker_pool_done(pool, fd);
+    EXIT_ON_NEG_ONE(sem_post(&(run->served[fd])));
+  }
+  return NULL;
+}
+
+/**
+ * Start a pool with as many workers as threads, which are never retired
+ */
+static void pool_setup(run_t* run)
+{
+  EXIT_ON_NULL((run->served = calloc(run->threads, sizeof(sem_t))));
+  for (long t = 0; t < run->threads; t++) {
+    EXIT_ON_NEG_ONE(sem_init(&(run->served[t]), 0, 0));
+  }
+  const long shares[LANES] = {100, 100};
+  EXIT_ON_NULL((run->pool = worker_pool_create(run->threads, run->threads, shares, 1000, 60000, pool_worker, run)));
+}
+
+static void pool_teardown(run_t* run)
+{
+  EXIT_ON_NEG_ONE(worker_pool_destroy(run->pool));
+  for (long t = 0; t < run->threads; t++) {
+    EXIT_ON_NEG_ONE(sem_destroy(&(run->served[t])));
+  }
+  free_item((void**)&(run->served));
+}
+
+/**
+ * Submit a client (the thread id is used as fd) and wait until a worker has served it
+ */
+static void pool_body(run_t* run, const int id, const long ops)
+{
+  for (long i = 0; i < ops; i++) {
+    EXIT_ON_NEG_ONE(worker_pool_submit(run->pool, id, (i % 2 ? LANE_BULK : LANE_CONTROL)));
+    while (sem_wait(&(run->served[id])) == -1) {
+      if (errno != EINTR) {
+        perror("sem_wait");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+}
+
+/**
+ * Function executed by the benchmark threads
+ */
+static void* bench_thread(void* args)
+{
+  run_t* run = ((thread_args_t*)args)->run;
+  int id = ((thread_args_t*)args)->id;
+
+  int error = pthread_barrier_wait(&(run->barrier));
+  if (error && error != PTHREAD_BARRIER_SERIAL_THREAD) {
+    errno = error;
+    perror("pthread_barrier_wait");
+    exit(EXIT_FAILURE);
+  }
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &(run->start[id])));
+  run->body(run, id, run->params->ops);
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &(run->end[id])));
+  return NULL;
+}
+
+/**
+ * Run a benchmark with 'threads' threads, all starting at the same time
+ *
+ * Return the seconds elapsed from the first thread start to the last thread end
+ */
+static double run_benchmark(const benchmark_t* benchmark, const params_t* params, const long threads)
+{
+  run_t run = {.params = params, .body = benchmark->body, .threads = threads, .shared = benchmark->shared};
+  if (benchmark->setup) {
+    benchmark->setup(&run);
+  }
+  pthread_t* tids;
+  thread_args_t* args;
+  EXIT_ON_NULL((tids = calloc(threads, sizeof(pthread_t))));
+  EXIT_ON_NULL((args = calloc(threads, sizeof(thread_args_t))));
+  EXIT_ON_NULL((run.start = calloc(threads, sizeof(struct timespec))));
+  EXIT_ON_NULL((run.end = calloc(threads, sizeof(struct timespec))));
+  EXIT_ON_NZ(pthread_barrier_init(&(run.barrier), NULL, threads));
+  for (long t = 0; t < threads; t++) {
+    args[t].run = &run;
+    args[t].id = t;
+    EXIT_ON_NZ(pthread_create(&(tids[t]), NULL, bench_thread, &(args[t])));
+  }
+  for (long t = 0; t < threads; t++) {
+    EXIT_ON_NZ(pthread_join(tids[t], NULL));
+  }
+  struct timespec* first = &(run.start[0]);
+  struct timespec* last = &(run.end[0]);
+  for (long t = 1; t < threads; t++) {
+    if (elapsed_sec(&(run.start[t]), first) > 0) {
+      first = &(run.start[t]);
+    }
+    if (elapsed_sec(last, &(run.end[t])) > 0) {
+      last = &(run.end[t]);
+    }
+  }
+  double elapsed = elapsed_sec(first, last);
+
+  EXIT_ON_NZ(pthread_barrier_destroy(&(run.barrier)));
+  if (benchmark->teardown) {
+    benchmark->teardown(&run);
+  }
+  free_item((void**)&tids);
+  free_item((void**)&args);
+  free_item((void**)&(run.start));
+  free_item((void**)&(run.end));
+  return elapsed;
+}
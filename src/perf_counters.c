@@ -0,0 +1,105 @@
+#include <posixver.h>
+
+#include <perf_counters.h>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} events[PERF_EVENTS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}
+};
+
+/**
+ * Open a counter of an event of the calling thread, in the group of 'group_fd' (-1 to start a new group)
+ *
+ * Return the file descriptor of the counter on success, -1 on error (set errno)
+ */
+static int open_event(const int event, const int group_fd, const char user_only)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = events[event].type;
+  attr.config = events[event].config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = user_only;
+  attr.exclude_hv = 1;
+  // the calling thread, on any CPU
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+int perf_counters_open(perf_counters_t* counters)
+{
+  counters->leader = -1;
+  counters->count = 0;
+  counters->user_only = 0;
+  // try to count the kernel too, then the user space only
+  for (char user_only = 0; user_only < 2 && !counters->count; user_only++) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+      int fd;
+      if ((fd = open_event(i, counters->leader, user_only)) == -1) {
+        continue;
+      }
+      if (counters->leader == -1) {
+        counters->leader = fd;
+      }
+      counters->fd[counters->count] = fd;
+      counters->event[counters->count] = i;
+      counters->count++;
+    }
+    counters->user_only = user_only;
+  }
+  return counters->count;
+}
+
+int perf_counters_read(perf_counters_t* counters, perf_sample_t* sample)
+{
+  memset(sample, 0, sizeof(perf_sample_t));
+  if (counters->leader == -1) {
+    return 0;
+  }
+  // layout of a read of a group (see perf_event_open(2))
+  struct {
+    uint64_t nr;
+    uint64_t values[PERF_EVENTS];
+  } group;
+  ssize_t read_bytes;
+  if ((read_bytes = read(counters->leader, &group, sizeof(group))) == -1) {
+    return -1;
+  }
+  if (read_bytes < (ssize_t)sizeof(uint64_t) || group.nr != (uint64_t)counters->count) {
+    errno = EIO;
+    return -1;
+  }
+  for (int i = 0; i < counters->count; i++) {
+    sample->value[counters->event[i]] = group.values[i];
+    sample->available |= 1U << counters->event[i];
+  }
+  return 0;
+}
+
+void perf_counters_delta(const perf_sample_t* start, const perf_sample_t* end, perf_sample_t* delta)
+{
+  delta->available = start->available & end->available;
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    delta->value[i] = ((delta->available & (1U << i)) ? end->value[i] - start->value[i] : 0);
+  }
+}
+
+void perf_counters_close(perf_counters_t* counters)
+{
+  for (int i = 0; i < counters->count; i++) {
+    close(counters->fd[i]);
+  }
+  counters->leader = -1;
+  counters->count = 0;
+}
@@ -44,3 +44,38 @@ ssize_t writen(int fd, void* buf, size_t size)
   }
   return 1;
 }
+
+ssize_t writevn(int fd, struct iovec* iov, int iovcnt)
+{
+  ssize_t nwritten;
+  while (iovcnt > 0) {
+    // skip the buffers that have been completely written
+    if (iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+    if ((nwritten = writev(fd, iov, iovcnt)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (nwritten == 0) {
+      return 0;
+    }
+    while (nwritten > 0) {
+      if ((size_t)nwritten >= iov->iov_len) {
+        nwritten -= iov->iov_len;
+        iov->iov_len = 0;
+        iov++;
+        iovcnt--;
+      } else {
+        iov->iov_base = (char*)iov->iov_base + nwritten;
+        iov->iov_len -= nwritten;
+        nwritten = 0;
+      }
+    }
+  }
+  return 1;
+}
@@ -11,28 +11,61 @@
 #include <sys/select.h>
 #include <signal.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <limits.h>
 
 #include <communication_protocol.h>
 #include <error_handling.h>
+#include <concurrency.h>
 #include <free_item.h>
 #include <readnwrite.h>
 #include <str2num.h>
 #include <config_parser.h>
 #include <storage.h>
-#include <ubuffer.h>
+#include <worker_pool.h>
+#include <connection.h>
+#include <affinity.h>
+#include <trace.h>
+#include <stats.h>
+#include <stages.h>
+#include <perf_counters.h>
+#include <shm_index.h>
+#ifdef LOCK_PROFILE
+#include <lock_profile.h>
+#endif
+
+// content buffers smaller than this are not worth a system call to place them on the local NUMA node
+#define NUMA_BIND_MIN_SIZE 65536
 
 #ifndef UNIX_PATH_MAX
 #define UNIX_PATH_MAX 104
 #endif
 
-#define PIPE_BUFFER_LENGTH 4
+// a message on the workers-to-master pipe is a type followed by a client fd
+#define PIPE_BUFFER_LENGTH 5
+// the client can make a new request
+#define READY_CLIENT 'R'
+// the client left, its connection can be closed
+#define LEFT_CLIENT 'L'
 #define END_OF_CONTENT "0000000000"
-#define NO_CLIENT "0000"
+
+// an error sending data to a client drops its connection, not the server
+#define BREAK_ON_NEG_ONE(conn, f) \
+  do { \
+    if ((f) == -1) { \
+      perror(#f); \
+      conn_break(conn); \
+    } \
+  } while (0)
 
 #define SEND_RESPONSE(fd, code) \
   do { \
     snprintf(response_code_buffer, RESPONSE_CODE_LENGTH + 1, "%d", code); \
-    EXIT_ON_NEG_ONE(writen(fd, response_code_buffer, RESPONSE_CODE_LENGTH)); \
+    BREAK_ON_NEG_ONE(connections[fd], conn_write(connections[fd], response_code_buffer, RESPONSE_CODE_LENGTH)); \
+    if ((fd) == client_socket) { \
+      /* the result of the request being served */ \
+      response = code; \
+    } \
   } while (0)
 
 #define SEND_ERROR(fd) \
@@ -62,36 +95,84 @@
     } \
   } while (0)
 
-#define NOTIFY_PENDING_CLIENTS(pending_clients, response_code, pipe_buffer, pipe) \
+#define SEND_TO_MASTER(pipe, type, fd) \
+  do { \
+    char pipe_buffer[PIPE_BUFFER_LENGTH + 1]; \
+    snprintf(pipe_buffer, PIPE_BUFFER_LENGTH + 1, "%c%04d", type, fd); \
+    EXIT_ON_NEG_ONE(writen(pipe, pipe_buffer, PIPE_BUFFER_LENGTH)); \
+  } while (0)
+
+#define NOTIFY_PENDING_CLIENTS(pending_clients, response_code, pipe) \
   do { \
     while (pending_clients) { \
       SEND_RESPONSE(pending_clients->user, response_code); \
-      snprintf(pipe_buffer, PIPE_BUFFER_LENGTH + 1, "%04d", pending_clients->user); \
-      EXIT_ON_NEG_ONE(writen(pipe, pipe_buffer, PIPE_BUFFER_LENGTH)); \
+      SEND_TO_MASTER(pipe, READY_CLIENT, pending_clients->user); \
       user_node_t* client = pending_clients; \
       pending_clients = pending_clients->next; \
       free_item((void**)&client); \
     } \
   } while (0)
 
-#define SEND_FILE(fd, file, file_content) \
+#define SEND_FILE(fd, file) \
   do { \
-    char* file_buffer; \
-    EXIT_ON_NULL((file_buffer = calloc(1, sizeof(char) * (METADATA_LENGTH + strlen(file->pathname) + METADATA_LENGTH + file->size + 1)))); \
-    snprintf(file_buffer, METADATA_LENGTH + strlen(file->pathname) + METADATA_LENGTH + 1, "%010ld%s%010ld", strlen(file->pathname), file->pathname, file->size); \
-    memcpy(file_buffer + strlen(file_buffer), file_content, file->size); \
-    EXIT_ON_NEG_ONE(writen(fd, file_buffer, (METADATA_LENGTH + strlen(file->pathname) + METADATA_LENGTH + file->size))); \
-    free_item((void**)&file_buffer); \
+    char* header_buffer; \
+    size_t header_length = METADATA_LENGTH + strlen(file->pathname) + METADATA_LENGTH; \
+    EXIT_ON_NULL((header_buffer = malloc(sizeof(char) * (header_length + 1)))); \
+    snprintf(header_buffer, header_length + 1, "%010ld%s%010ld", strlen(file->pathname), file->pathname, file->size); \
+    BREAK_ON_NEG_ONE(connections[fd], conn_write_owned(connections[fd], header_buffer, header_length)); \
+    if (file->size) { \
+      /* the content of a removed file is queued without being copied */ \
+      BREAK_ON_NEG_ONE(connections[fd], conn_write_owned(connections[fd], file->content, file->size)); \
+      file->content = NULL; \
+    } \
   } while (0)
 
 typedef struct {
   storage_t* storage;
-  ubuffer_t* buffer;
   int pipe;
+  size_t max_request_size;
+  // CPUs the workers are bound to (NULL if not bound)
+  cpu_set_t* cpus;
+  // connections of the clients, indexed by fd
+  conn_t** connections;
+  // trace of the requests (NULL if not traced)
+  trace_t* trace;
+  // statistics of the requests, one shard per worker
+  stats_t* stats;
+  // log of the slow requests (NULL if the requests are not timed)
+  slow_log_t* slow_log;
+  char perf_counters;
+  size_t shm_max_size;
+  size_t memfd_min_size;
+  // index of the files recently read (NULL if none)
+  shm_index_t* index;
+  // write-ahead log of the changes to the storage (NULL if none)
+  wal_t* wal;
 } worker_args_t;
 
+typedef struct {
+  storage_t* storage;
+  const char* pathname;
+  // set when a snapshot must be written, while it is written and when the thread must exit
+  char requested;
+  char saving;
+  char stop;
+  // set when a snapshot could not be written
+  char failed;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+} snapshot_writer_t;
+
 volatile sig_atomic_t soft_exit = 0;
 volatile sig_atomic_t hard_exit = 0;
+// set when the slow requests must be printed
+volatile sig_atomic_t slow_log_dump_requested = 0;
+// set when a snapshot of the storage must be written
+volatile sig_atomic_t snapshot_requested = 0;
+// when the server started, to measure how long it takes to serve the first request
+static struct timespec server_start;
+static char first_request_served = 0;
 // socket_name is global because of the cleanup function
 static char* socket_name = NULL;
 
@@ -101,12 +182,31 @@ static int signal_setup(void);
 static void signal_handler(const int signal);
 static int connection_setup(const char* socket_name, const int backlog);
 static int max(const int a, const int b);
-static int update_max(const fd_set set, const int max);
-static char* request_payload(const int client, size_t* size);
+static int update_max(const fd_set set, const fd_set write_set, const int max);
+static long parse_request_code(const char* data);
+static int request_lane(conn_t* conn);
+static int request_header(conn_t* conn, const long request_code, char** pathname, char field[METADATA_LENGTH + 1]);
+static char in_shm(const conn_t* conn, const size_t size);
+static int shm_create(conn_t* conn, const size_t size);
+static double elapsed_msec(const struct timespec* start);
+static uint64_t load_snapshot(storage_t* storage, const char* pathname);
+static int save_snapshot(storage_t* storage, const char* pathname);
+static void* snapshot_writer(void* arg);
+static void snapshot_writer_start(snapshot_writer_t* writer, storage_t* storage, const char* pathname);
+static void snapshot_writer_stop(snapshot_writer_t* writer);
+static void request_snapshot(snapshot_writer_t* writer);
+static char snapshot_pending(snapshot_writer_t* writer, char* failed);
+static wal_t* recover_wal(storage_t* storage, const char* pathname, const uint64_t log_position);
+static int sync_changes(wal_t* wal);
+static long content_length(const char* field, const size_t max_request_size);
+static void stop_reading(conn_t* conn);
+static void place_content(const cpu_set_t* cpus, void* content, const size_t size);
+static void trace_request(trace_t* trace, conn_t* conn, const long request_code, const char* pathname, const char* field, const long response, const struct timespec* ready, const struct timespec* done, const size_t written);
 static void* worker(void* args);
 
 int main(int argc, char* argv[])
 {
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &server_start));
   // check args
   config_t server_config;
   switch (argc) {
@@ -140,24 +240,86 @@ int main(int argc, char* argv[])
   // create storage
   storage_t* storage;
   EXIT_ON_NULL(storage = storage_create(server_config.storage_max_file_number, server_config.storage_max_size));
+  // create the index the clients on the same host read the files from
+  shm_index_t* index = NULL;
+  if (server_config.shm_index_size) {
+    EXIT_ON_NULL((index = shm_index_create(server_config.shm_index_slots, server_config.shm_index_size)));
+    storage_set_index(storage, index);
+  }
+  // warm restart
+  uint64_t log_position = 0;
+  if (server_config.snapshot_file[0]) {
+    log_position = load_snapshot(storage, server_config.snapshot_file);
+  }
+  // replay the changes made after the snapshot, then log the next ones
+  wal_t* wal = NULL;
+  if (server_config.wal_file[0]) {
+    wal = recover_wal(storage, server_config.wal_file, log_position);
+    if (!server_config.snapshot_file[0]) {
+      fprintf(stderr, "warning: no SNAPSHOT_FILE, the write-ahead log is never truncated\n");
+    }
+  }
+  // cleared if a checkpoint fails, not to retry it at every iteration
+  char checkpoints = (wal && server_config.snapshot_file[0] && server_config.wal_checkpoint_size);
+  // the snapshots are written by their own thread, while the requests are served
+  snapshot_writer_t snapshots = {0};
+  if (server_config.snapshot_file[0]) {
+    snapshot_writer_start(&snapshots, storage, server_config.snapshot_file);
+  }
 
-  // create master-to-workers shared buffer
-  ubuffer_t* m2w_buffer;
-  EXIT_ON_NULL(m2w_buffer = ubuffer_create());
   // create workers-to-master shared pipe
   int w2m_pipe[2];
   EXIT_ON_NEG_ONE(pipe(w2m_pipe));
 
-  // create worker thread pool
-  worker_args_t worker_args = {.storage = storage, .buffer = m2w_buffer, .pipe = w2m_pipe[1]};
-  pthread_t* workers;
-  EXIT_ON_NULL(workers = malloc(sizeof(pthread_t) * server_config.worker_pool_size));
-  for (long i = 0; i < server_config.worker_pool_size; i++) {
-    EXIT_ON_NEG_ONE(pthread_create(&workers[i], NULL, worker, (void*)&worker_args));
+  // create the connection table, select cannot handle fds beyond FD_SETSIZE anyway
+  conn_t** connections;
+  EXIT_ON_NULL((connections = calloc(FD_SETSIZE, sizeof(conn_t*))));
+  // used to print a summary of the connections
+  size_t total_requests = 0,
+         total_recv = 0,
+         total_send = 0;
+
+  // bind the master to its CPUs, the workers bind themselves when they start
+  cpu_set_t* worker_cpus = NULL;
+  if (CPU_COUNT(&(server_config.master_cpus)) && !CPU_COUNT(&(server_config.worker_cpus))) {
+    // the workers started by the master would inherit its CPUs
+    EXIT_ON_NEG_ONE(sched_getaffinity(0, sizeof(cpu_set_t), &(server_config.worker_cpus)));
+  }
+  if (CPU_COUNT(&(server_config.worker_cpus))) {
+    worker_cpus = &(server_config.worker_cpus);
+  }
+  if (CPU_COUNT(&(server_config.master_cpus))) {
+    EXIT_ON_NEG_ONE(affinity_pin(&(server_config.master_cpus)));
   }
 
+  // open the trace of the requests
+  trace_t* trace = NULL;
+  if (server_config.trace_file[0]) {
+    EXIT_ON_NULL((trace = trace_open(server_config.trace_file)));
+  }
+  // numbers the connections in the trace, fds are reused
+  unsigned int connection_count = 0;
+
+  // create the statistics, with a shard for each worker that can be alive
+  stats_t* stats;
+  EXIT_ON_NULL((stats = stats_create(server_config.worker_pool_max)));
+  // time the stages of the requests and log the slow ones
+  slow_log_t* slow_log = NULL;
+  if (server_config.slow_request_threshold) {
+    EXIT_ON_NULL((slow_log = slow_log_create(server_config.slow_request_threshold)));
+  }
+
+  // create worker thread pool, the master hands the ready clients to the workers through its queue
+  worker_args_t worker_args = {.pipe = w2m_pipe[1], .storage = storage, .max_request_size = server_config.max_request_size, .cpus = worker_cpus, .connections = connections, .trace = trace, .stats = stats, .slow_log = slow_log, .perf_counters = server_config.perf_counters, .shm_max_size = server_config.shm_max_size, .memfd_min_size = server_config.memfd_min_size, .index = index, .wal = wal};
+  worker_pool_t* pool;
+  long lane_shares[LANES] = {[LANE_CONTROL] = server_config.control_worker_share, [LANE_BULK] = server_config.bulk_worker_share};
+  EXIT_ON_NULL((pool = worker_pool_create(server_config.worker_pool_size, server_config.worker_pool_max, lane_shares, server_config.queue_latency_target, server_config.worker_idle_timeout, worker, (void*)&worker_args)));
+
   // select fd set initialization
   fd_set current_fds, ready_fds;
+  // clients with data waiting to be sent
+  fd_set current_write_fds, ready_write_fds;
+  FD_ZERO(&current_write_fds);
   FD_ZERO(&current_fds);
   FD_SET(server_socket, &current_fds);
   FD_SET(w2m_pipe[0], &current_fds);
@@ -169,11 +331,43 @@ int main(int argc, char* argv[])
   char pipe_buffer[PIPE_BUFFER_LENGTH + 1] = {0};
 
   while (!hard_exit) {
+    if (slow_log_dump_requested) {
+      slow_log_dump_requested = 0;
+      if (slow_log) {
+        slow_log_dump(slow_log, stdout);
+      }
+#ifdef LOCK_PROFILE
+      lock_profile_print(stdout);
+#endif
+    }
+    if (snapshot_requested) {
+      snapshot_requested = 0;
+      if (server_config.snapshot_file[0]) {
+        request_snapshot(&snapshots);
+      }
+    }
+    if (checkpoints) {
+      char failed;
+      if (snapshot_pending(&snapshots, &failed)) {
+        // the log is checkpointed by the snapshot being written
+      } else if (failed) {
+        fprintf(stderr, "server: error: the write-ahead log is no longer checkpointed\n");
+        checkpoints = 0;
+      } else if (wal_size(wal) >= (uint64_t)server_config.wal_checkpoint_size) {
+        request_snapshot(&snapshots);
+      }
+    }
     // initialize ready fd set
     ready_fds = current_fds;
+    ready_write_fds = current_write_fds;
+
+    // while clients are queued, wake up in time to add workers if they wait for too long
+    struct timeval timeout = {.tv_sec = server_config.queue_latency_target / 1000, .tv_usec = (server_config.queue_latency_target % 1000) * 1000};
+    struct timeval* timeoutptr = worker_pool_queued(pool) ? &timeout : NULL;
 
     // wait for a fd to be ready
-    if (select(max_fd + 1, &ready_fds, NULL, NULL, NULL) == -1) {
+    int ready;
+    if ((ready = select(max_fd + 1, &ready_fds, &ready_write_fds, NULL, timeoutptr)) == -1) {
       if (errno == EINTR) {
         if (soft_exit && !connected_clients) {
 	  // no more pending jobs, exit
@@ -185,19 +379,48 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
       }
     }
+    if (!ready) {
+      // timeout, the queued clients may be waiting for too long
+      worker_pool_adjust(pool);
+      continue;
+    }
 
     // check which fd is ready (not checking stdin (0), stdout (1), stderr (2))
     for (int i = 3; i < max_fd + 1; i++) {
+      if (FD_ISSET(i, &ready_write_fds) && connections[i]) {
+        // a client can receive more data
+	ssize_t left;
+	if ((left = conn_flush(connections[i])) == -1) {
+	  perror("conn_flush");
+	  conn_break(connections[i]);
+	  left = 0;
+	}
+	if (!left) {
+	  FD_CLR(i, &current_write_fds);
+	}
+	if (connections[i]->parked && left <= CONN_OUTPUT_CAP) {
+	  // the client has read enough, start reading its requests again
+	  connections[i]->parked = 0;
+	  if (conn_pending(connections[i])) {
+	    // the client has already sent another request
+	    EXIT_ON_NEG_ONE(worker_pool_submit(pool, i, request_lane(connections[i])));
+	  } else {
+	    FD_SET(i, &current_fds);
+	  }
+	}
+      }
       if (FD_ISSET(i, &ready_fds)) {
         // fd is ready
 
         if (i == server_socket) {
           // new connection
           EXIT_ON_NEG_ONE(new_fd = accept(server_socket, NULL, NULL));
-          if (soft_exit) {
+          if (soft_exit || new_fd >= FD_SETSIZE) {
 	    // reject connection immediately
 	    EXIT_ON_NEG_ONE(close(new_fd));
           } else {
+	    EXIT_ON_NULL((connections[new_fd] = conn_create(new_fd)));
+	    connections[new_fd]->id = ++connection_count;
 	    // add fd to listening set
             FD_SET(new_fd, &current_fds);
 	    // update client count
@@ -209,12 +432,35 @@ int main(int argc, char* argv[])
 	  // a worker has finished handling a request
 	  // read client fd
 	  EXIT_ON_NEG_ONE(readn(i, pipe_buffer, PIPE_BUFFER_LENGTH));
-	  if ((new_fd = atol(pipe_buffer))) {
-	    // add fd to listening set
-	    FD_SET(new_fd, &current_fds);
-	    max_fd = max(new_fd, max_fd);
+	  new_fd = atol(pipe_buffer + 1);
+	  if (pipe_buffer[0] == READY_CLIENT) {
+	    size_t output;
+	    if ((output = conn_output(connections[new_fd]))) {
+	      // the client has not received all the responses yet
+	      FD_SET(new_fd, &current_write_fds);
+	      max_fd = max(new_fd, max_fd);
+	    }
+	    if (output > CONN_OUTPUT_CAP) {
+	      // do not read the client requests until it receives the responses
+	      connections[new_fd]->parked = 1;
+	    } else if (conn_pending(connections[new_fd])) {
+	      // the client has already sent another request
+	      EXIT_ON_NEG_ONE(worker_pool_submit(pool, new_fd, request_lane(connections[new_fd])));
+	    } else {
+	      // add fd to listening set
+	      FD_SET(new_fd, &current_fds);
+	      max_fd = max(new_fd, max_fd);
+	    }
 	  } else {
-	    // client left
+	    // client left, close the connection
+	    FD_CLR(new_fd, &current_write_fds);
+	    total_requests += connections[new_fd]->request_count;
+	    total_recv += connections[new_fd]->recv_count;
+	    total_send += connections[new_fd]->send_count;
+	    conn_destroy(connections[new_fd]);
+	    connections[new_fd] = NULL;
+	    worker_pool_forget(pool, new_fd);
+	    EXIT_ON_NEG_ONE(close(new_fd));
 	    connected_clients--;
 	    if (!connected_clients && soft_exit) {
 	      goto end;
@@ -226,44 +472,94 @@ int main(int argc, char* argv[])
           FD_CLR(i, &current_fds);
 	  if (i == max_fd) {
 	    // need to update max fd, but fds are not guaranteed to be generated in increasing order...
-	    max_fd = update_max(current_fds, max_fd);
+	    max_fd = update_max(current_fds, current_write_fds, max_fd);
 	  }
-	  // enqueue ready fd into shared buffer
-	  int* tmp;
-	  EXIT_ON_NULL((tmp = malloc(sizeof(int))));
-	  *tmp = i;
-	  EXIT_ON_NEG_ONE(ubuffer_enqueue(m2w_buffer, (void*)tmp));
+	  // enqueue ready fd into the pool queue
+	  EXIT_ON_NEG_ONE(worker_pool_submit(pool, i, request_lane(connections[i])));
         }
       }
     }
   }
 
   end:
-  // send termination message to workers
-  for (long i = 0; i < server_config.worker_pool_size; i++) {
-    int* term;
-    EXIT_ON_NULL((term = calloc(1, sizeof(int))));
-    EXIT_ON_NEG_ONE(ubuffer_enqueue(m2w_buffer, (void*)term));
-  }
-  // join worker threads
-  for (long i = 0; i < server_config.worker_pool_size; i++) {
-    EXIT_ON_NEG_ONE(pthread_join(workers[i], NULL));
-  }
-  free_item((void**)&workers);
+  // let the workers serve the queued clients, then terminate and join them
+  EXIT_ON_NEG_ONE(worker_pool_stop(pool));
 
   // close server socket
   EXIT_ON_NEG_ONE(close(server_socket));
 
-  // destroy shared buffer
-  EXIT_ON_NEG_ONE(ubuffer_destroy(m2w_buffer));
+  // close the remaining connections
+  for (int i = 0; i < FD_SETSIZE; i++) {
+    if (connections[i]) {
+      total_requests += connections[i]->request_count;
+      total_recv += connections[i]->recv_count;
+      total_send += connections[i]->send_count;
+      conn_destroy(connections[i]);
+      EXIT_ON_NEG_ONE(close(i));
+    }
+  }
+  free_item((void**)&connections);
+
   // close shared pipe
   EXIT_ON_NEG_ONE(close(w2m_pipe[0]));
   EXIT_ON_NEG_ONE(close(w2m_pipe[1]));
 
   // print a summary of the operations performed in the storage
   storage_print_summary(storage);
+  // print a summary of the connections
+  printf("- Connection summary -\n");
+  printf("The server:\n");
+  printf(" - handled %zu request(s)\n", total_requests);
+  printf(" - made %zu receive system call(s)", total_recv);
+  if (total_requests) {
+    printf(" (%.2f per request)", (double)total_recv / total_requests);
+  }
+  printf("\n");
+  printf(" - made %zu send system call(s)", total_send);
+  if (total_requests) {
+    printf(" (%.2f per request)", (double)total_send / total_requests);
+  }
+  printf("\n");
+  if (trace) {
+    printf(" - traced %zu request(s) and disconnection(s) to '%s'%s\n", trace->total, server_config.trace_file, trace->disabled ? " (then disabled on error)" : "");
+    if (trace_close(trace) == -1) {
+      perror("trace_close");
+    }
+  }
+  printf("\n");
+  // print a summary of the worker pool activity
+  worker_pool_print_summary(pool);
+  // destroy worker pool
+  EXIT_ON_NEG_ONE(worker_pool_destroy(pool));
+#ifdef LOCK_PROFILE
+  // print the contention of the mutexes, now that the workers have exited
+  printf("\n");
+  lock_profile_print(stdout);
+#endif
+  if (server_config.snapshot_file[0]) {
+    if (soft_exit && !hard_exit) {
+      // the files are kept for the next start
+      printf("\n");
+      request_snapshot(&snapshots);
+    }
+    // wait for the snapshots requested so far
+    snapshot_writer_stop(&snapshots);
+  }
+  if (wal) {
+    wal_print_summary(wal);
+    if (wal_destroy(wal) == -1) {
+      perror("wal_destroy");
+    }
+  }
+  EXIT_ON_NEG_ONE(stats_destroy(stats));
+  if (slow_log) {
+    EXIT_ON_NEG_ONE(slow_log_destroy(slow_log));
+  }
   //destroy storage
   EXIT_ON_NEG_ONE(storage_destroy(storage));
+  if (index) {
+    EXIT_ON_NEG_ONE(shm_index_destroy(index));
+  }
 
   return 0;
 }
@@ -317,6 +613,8 @@ static int signal_setup(void)
   sigaddset(&handler_mask, SIGINT);
   sigaddset(&handler_mask, SIGQUIT);
   sigaddset(&handler_mask, SIGHUP);
+  sigaddset(&handler_mask, SIGUSR1);
+  sigaddset(&handler_mask, SIGUSR2);
 
   // register signal handler function
   memset(&act, 0, sizeof(act));
@@ -330,6 +628,12 @@ static int signal_setup(void)
   if (sigaction(SIGHUP, &act, NULL) == -1) {
     return -1;
   }
+  if (sigaction(SIGUSR1, &act, NULL) == -1) {
+    return -1;
+  }
+  if (sigaction(SIGUSR2, &act, NULL) == -1) {
+    return -1;
+  }
   return 0;
 }
 
@@ -342,6 +646,12 @@ static void signal_handler(const int signal)
     case SIGHUP:
       soft_exit = 1;
       break;
+    case SIGUSR1:
+      slow_log_dump_requested = 1;
+      break;
+    case SIGUSR2:
+      snapshot_requested = 1;
+      break;
     case SIGINT:
       // fall through
     case SIGQUIT:
@@ -395,14 +705,14 @@ static int max(const int a, const int b)
 }
 
 /**
- * Determine the highest set fd less than max
+ * Determine the highest fd less than max set in one of the two sets
  *
  * Return the new max (>0) on success, -1 on error
  */
-static int update_max(const fd_set set, const int max)
+static int update_max(const fd_set set, const fd_set write_set, const int max)
 {
   for (int i = (max-1); i >= 0; i--) {
-    if (FD_ISSET(i, &set)) {
+    if (FD_ISSET(i, &set) || FD_ISSET(i, &write_set)) {
       return i;
     }
   }
@@ -411,157 +721,555 @@ static int update_max(const fd_set set, const int max)
 }
 
 /**
- * Read the data contained in a request made by a client and return it in a newly allocated buffer
+ * Parse the REQUEST_CODE_LENGTH digits of a request code
  *
- * Return a pointer to the data on sucess, NULL on error (set errno)
+ * Return the request code on success, -1 if it is not valid
  */
-static char* request_payload(const int client, size_t* size)
+static long parse_request_code(const char* data)
 {
-  // variables initialization
-  char* content_buffer = NULL;
+  char buffer[REQUEST_CODE_LENGTH + 1];
+  memcpy(buffer, data, REQUEST_CODE_LENGTH);
+  buffer[REQUEST_CODE_LENGTH] = '\0';
+  long code;
+  if (str2num(buffer, &code) != 0 || code < 0) {
+    return -1;
+  }
+  return code;
+}
 
-  if (client < 0) {
-    errno = EINVAL;
-    goto end;
+/**
+ * Return the lane of the queue for the next request of a client, based on its request code:
+ * the requests that carry file content go in the bulk lane, the others in the control lane
+ */
+static int request_lane(conn_t* conn)
+{
+  char* code = conn_peek(conn, REQUEST_CODE_LENGTH);
+  switch (code ? parse_request_code(code) : -1) {
+    case READ_FILE:
+    case READ_FILE_FD:
+    case READ_N_FILES:
+    case WRITE_FILE:
+    case APPEND_TO_FILE:
+      return LANE_BULK;
+    default:
+      // a client that left is handled quickly as well
+      return LANE_CONTROL;
   }
-  // read the content length
-  char content_length_buffer[METADATA_LENGTH + 1] = {0};
-  if (readn(client, content_length_buffer, METADATA_LENGTH) == -1) {
-    return NULL;
+}
+
+/**
+ * Receive the header of a request made by a client (everything but the content of a write or append request).
+ * The pathname is referenced in place in the input buffer of the connection,
+ * while the field that follows it (the flags of an open request, the content length of a write or append request,
+ * or N for a readNFiles request) is copied in 'field'.
+ *
+ * Return 1 on success, 0 if the client left, -1 on error (set errno, EMSGSIZE if the pathname is too long)
+ */
+static int request_header(conn_t* conn, const long request_code, char** pathname, char field[METADATA_LENGTH + 1])
+{
+  size_t field_length = 0;
+  switch (request_code) {
+    case OPEN_FILE:
+      field_length = OPEN_FLAGS_LENGTH;
+      break;
+    case READ_N_FILES:
+    case WRITE_FILE:
+    case APPEND_TO_FILE:
+    case NEGOTIATE_SHM:
+      field_length = METADATA_LENGTH;
+      break;
   }
-  size_t content_length = atol(content_length_buffer);
-  // give back the size to the caller
-  if (size) {
-    *size = content_length;
+  int result;
+  size_t pathname_length = 0;
+  char has_pathname = (request_code != READ_N_FILES && request_code != GET_STATS && request_code != NEGOTIATE_SHM && request_code != MAP_INDEX);
+  if (has_pathname) {
+    // read the pathname length
+    if ((result = conn_fill(conn, METADATA_LENGTH)) <= 0) {
+      return result;
+    }
+    char length_buffer[METADATA_LENGTH + 1] = {0};
+    memcpy(length_buffer, conn_take(conn, METADATA_LENGTH), METADATA_LENGTH);
+    long length = atol(length_buffer);
+    if (length < 0 || length > PATH_MAX) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    pathname_length = length;
   }
-  // read the content
-  if ((content_buffer = calloc(1, sizeof(char) * (content_length + 1))) == NULL) {
-    return NULL;
+  // receive the pathname and the following field at once
+  if ((result = conn_fill(conn, pathname_length + field_length)) <= 0) {
+    return result;
   }
-  if (readn(client, content_buffer, content_length) == -1) {
-    return NULL;
+  char* pathname_data = conn_take(conn, pathname_length);
+  memset(field, 0, METADATA_LENGTH + 1);
+  memcpy(field, conn_take(conn, field_length), field_length);
+  if (has_pathname) {
+    // the pathname is used in place
+    conn_terminate(conn, pathname_data, pathname_length);
+    *pathname = pathname_data;
   }
-  return content_buffer;
+  return 1;
+}
 
-  end:
-  free_item((void**)&content_buffer);
+/**
+ * Return whether 'size' bytes of content are placed in the memory shared with the client
+ * instead of going through the socket (the client applies the same rule)
+ */
+static char in_shm(const conn_t* conn, const size_t size)
+{
+  return (conn->shm && size <= conn->shm_size);
+}
+
+/**
+ * Create the memory shared with a client, backed by a memfd of 'size' bytes
+ *
+ * Return the memfd on success, -1 on error (set errno)
+ */
+static int shm_create(conn_t* conn, const size_t size)
+{
+  int fd;
+  if ((fd = memfd_create("fss-shm", MFD_CLOEXEC)) == -1) {
+    return -1;
+  }
+  void* shm;
+  if (ftruncate(fd, size) == -1 || (shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    int errnosav = errno;
+    close(fd);
+    errno = errnosav;
+    return -1;
+  }
+  conn->shm = shm;
+  conn->shm_size = size;
+  return fd;
+}
+
+/**
+ * Return the milliseconds elapsed since 'start' on the monotonic clock
+ */
+static double elapsed_msec(const struct timespec* start)
+{
+  struct timespec now;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &now));
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/**
+ * Load the snapshot of the storage, if there is one, with a thread per online CPU
+ * (a snapshot that cannot be loaded is fatal, so that it is not overwritten at shutdown)
+ *
+ * Return the position of the write-ahead log recorded in the snapshot (0 if none)
+ */
+static uint64_t load_snapshot(storage_t* storage, const char* pathname)
+{
+  struct timespec start;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &start));
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t left_out = 0;
+  uint64_t log_position = 0;
+  if (storage_load(storage, pathname, (threads > 0 ? threads : 1), &left_out, &log_position) == -1) {
+    if (errno == ENOENT) {
+      printf("server: no snapshot in '%s', starting with an empty storage\n", pathname);
+      return 0;
+    }
+    fprintf(stderr, "server: fatal error: could not load the snapshot '%s': %s\n", pathname, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  storage_usage_t usage;
+  storage_usage(storage, &usage);
+  printf("server: loaded %zu file(s), %f Megabyte(s) from '%s' in %.3f ms with %ld thread(s)", usage.file_number, (float)usage.size / 1048576, pathname, elapsed_msec(&start), (threads > 0 ? threads : 1));
+  if (left_out) {
+    printf(", leaving out %zu file(s) beyond the limits of the storage", left_out);
+  }
+  printf("\n");
+  fflush(stdout);
+  return log_position;
+}
+
+/**
+ * Write a snapshot of the storage (a checkpoint of the write-ahead log, if there is one)
+ *
+ * Return 0 on success, -1 on error
+ */
+static int save_snapshot(storage_t* storage, const char* pathname)
+{
+  struct timespec start;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &start));
+  if (storage_save(storage, pathname) == -1) {
+    fprintf(stderr, "server: error: could not write the snapshot '%s': %s\n", pathname, strerror(errno));
+    return -1;
+  }
+  storage_usage_t usage;
+  storage_usage(storage, &usage);
+  printf("server: wrote a snapshot of %zu file(s), %f Megabyte(s) to '%s' in %.3f ms\n", usage.file_number, (float)usage.size / 1048576, pathname, elapsed_msec(&start));
+  fflush(stdout);
+  return 0;
+}
+
+/**
+ * Function executed by the thread that writes the snapshots requested, until it is stopped
+ */
+static void* snapshot_writer(void* arg)
+{
+  snapshot_writer_t* writer = (snapshot_writer_t*)arg;
+  LOCK(&(writer->mutex));
+  while (1) {
+    while (!writer->requested && !writer->stop) {
+      WAIT(&(writer->cond), &(writer->mutex));
+    }
+    if (!writer->requested) {
+      break;
+    }
+    // the requests made while a snapshot is written are served by the next one
+    writer->requested = 0;
+    writer->saving = 1;
+    UNLOCK(&(writer->mutex));
+    int result = save_snapshot(writer->storage, writer->pathname);
+    LOCK(&(writer->mutex));
+    writer->saving = 0;
+    writer->failed = (result == -1);
+  }
+  UNLOCK(&(writer->mutex));
   return NULL;
 }
 
+/**
+ * Start the thread that writes the snapshots of 'storage' to 'pathname'
+ */
+static void snapshot_writer_start(snapshot_writer_t* writer, storage_t* storage, const char* pathname)
+{
+  writer->storage = storage;
+  writer->pathname = pathname;
+  EXIT_ON_NZ(pthread_mutex_init(&(writer->mutex), NULL));
+  EXIT_ON_NZ(pthread_cond_init(&(writer->cond), NULL));
+  EXIT_ON_NZ((errno = pthread_create(&(writer->thread), NULL, snapshot_writer, writer)));
+}
+
+/**
+ * Stop the thread that writes the snapshots, once it has written the ones requested
+ */
+static void snapshot_writer_stop(snapshot_writer_t* writer)
+{
+  LOCK(&(writer->mutex));
+  writer->stop = 1;
+  SIGNAL(&(writer->cond));
+  UNLOCK(&(writer->mutex));
+  EXIT_ON_NZ((errno = pthread_join(writer->thread, NULL)));
+  EXIT_ON_NZ(pthread_cond_destroy(&(writer->cond)));
+  EXIT_ON_NZ(pthread_mutex_destroy(&(writer->mutex)));
+}
+
+/**
+ * Ask for a snapshot to be written, without waiting for it
+ */
+static void request_snapshot(snapshot_writer_t* writer)
+{
+  LOCK(&(writer->mutex));
+  writer->requested = 1;
+  SIGNAL(&(writer->cond));
+  UNLOCK(&(writer->mutex));
+}
+
+/**
+ * Get whether a snapshot is requested or being written, and in 'failed' whether the last one could not be written
+ */
+static char snapshot_pending(snapshot_writer_t* writer, char* failed)
+{
+  LOCK(&(writer->mutex));
+  char pending = (writer->requested || writer->saving);
+  *failed = writer->failed;
+  UNLOCK(&(writer->mutex));
+  return pending;
+}
+
+/**
+ * Replay the write-ahead log on top of the snapshot, then open it to log the next changes
+ * (a log that cannot be replayed is fatal, like a snapshot that cannot be loaded)
+ *
+ * Return a pointer to the log
+ */
+static wal_t* recover_wal(storage_t* storage, const char* pathname, const uint64_t log_position)
+{
+  struct timespec start;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &start));
+  size_t records = 0;
+  if (storage_recover(storage, pathname, log_position, &records) == -1 && errno != ENOENT) {
+    fprintf(stderr, "server: fatal error: could not replay the write-ahead log '%s': %s\n", pathname, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (records) {
+    storage_usage_t usage;
+    storage_usage(storage, &usage);
+    printf("server: replayed %zu record(s) from '%s' in %.3f ms, the storage has %zu file(s), %f Megabyte(s)\n", records, pathname, elapsed_msec(&start), usage.file_number, (float)usage.size / 1048576);
+    fflush(stdout);
+  }
+  wal_t* wal;
+  if ((wal = wal_create(pathname, log_position)) == NULL) {
+    fprintf(stderr, "server: fatal error: could not open the write-ahead log '%s': %s\n", pathname, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  storage_set_wal(storage, wal);
+  return wal;
+}
+
+/**
+ * Parse the length of the content of a write or append request
+ *
+ * Return the length on success, -1 if it is not a number, it is negative or larger than 'max_request_size'
+ */
+static long content_length(const char* field, const size_t max_request_size)
+{
+  long length;
+  if (str2num(field, &length) != 0 || length < 0 || (size_t)length > max_request_size) {
+    return -1;
+  }
+  return length;
+}
+
+/**
+ * Stop reading from a client whose request cannot be trusted: the data received and not parsed is dropped
+ * and the socket is shut down for reading (the responses are still sent)
+ */
+static void stop_reading(conn_t* conn)
+{
+  conn_take(conn, conn_pending(conn));
+  // a client that already left has nothing left to be read
+  shutdown(conn->fd, SHUT_RD);
+}
+
+/**
+ * Place the space about to receive 'size' bytes of content on the NUMA node of the calling worker,
+ * if the workers are bound to 'cpus' and the content is large enough to be worth it (best effort)
+ */
+static void place_content(const cpu_set_t* cpus, void* content, const size_t size)
+{
+  if (cpus && size >= NUMA_BIND_MIN_SIZE) {
+    numa_bind_local(content, size);
+  }
+}
+
+/**
+ * Wait for the changes made by the request being served to be synced to the write-ahead log, if there is one
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int sync_changes(wal_t* wal)
+{
+  if (!wal) {
+    return 0;
+  }
+  int result;
+  STAGE_TIMED(STAGE_SYNC, result = wal_sync(wal));
+  return result;
+}
+
+/**
+ * Add a served request to the trace, 'ready' is when the client was put in the queue,
+ * 'done' when the request was served and 'written' the bytes written to the client before serving the request
+ */
+static void trace_request(trace_t* trace, conn_t* conn, const long request_code, const char* pathname, const char* field, const long response, const struct timespec* ready, const struct timespec* done, const size_t written)
+{
+  trace_record_t record = {
+    .timestamp = trace_timestamp(trace, ready),
+    .pathname_hash = (pathname ? trace_hash(pathname) : 0),
+    .response_size = conn_written(conn) - written,
+    .connection = conn->id,
+    .latency = (trace_timestamp(trace, done) - trace_timestamp(trace, ready)) / 1000,
+    .opcode = (uint8_t)request_code,
+    .result = (uint8_t)response
+  };
+  switch (request_code) {
+    case OPEN_FILE:
+    case READ_N_FILES:
+    case WRITE_FILE:
+    case APPEND_TO_FILE:
+      record.request_size = atol(field);
+      break;
+  }
+  if (trace_record(trace, &record) == -1) {
+    // the requests are served anyway
+    perror("trace_record");
+    fprintf(stderr, "warning: cannot write the trace, the requests are not traced anymore\n");
+  }
+}
+
 /**
  * Function executed by worker threads in the threadpool
  */
-static void* worker(void* args)
+static void* worker(void* arg)
 {
   // get worker arguments
+  worker_pool_t* pool = (worker_pool_t*)arg;
+  void* args = pool->arg;
   storage_t* storage = ((worker_args_t*)args)->storage;
-  ubuffer_t* shared_buffer = ((worker_args_t*)args)->buffer;
   int master_pipe = ((worker_args_t*)args)->pipe;
+  size_t max_request_size = ((worker_args_t*)args)->max_request_size;
+  conn_t** connections = ((worker_args_t*)args)->connections;
+  cpu_set_t* cpus = ((worker_args_t*)args)->cpus;
+  trace_t* trace = ((worker_args_t*)args)->trace;
+  stats_t* stats = ((worker_args_t*)args)->stats;
+  slow_log_t* slow_log = ((worker_args_t*)args)->slow_log;
+  char perf_enabled = ((worker_args_t*)args)->perf_counters;
+  size_t shm_max_size = ((worker_args_t*)args)->shm_max_size;
+  size_t memfd_min_size = ((worker_args_t*)args)->memfd_min_size;
+  shm_index_t* index = ((worker_args_t*)args)->index;
+  wal_t* wal = ((worker_args_t*)args)->wal;
+
+  if (cpus) {
+    EXIT_ON_NEG_ONE(affinity_pin(cpus));
+  }
+  // the counters of this worker
+  stats_shard_t* shard = stats_attach(stats);
+  // the events of this worker thread, attributed to the requests it serves
+  perf_counters_t perf = {.leader = -1};
+  if (perf_enabled && !perf_counters_open(&perf)) {
+    static char perf_warned = 0;
+    if (!__atomic_exchange_n(&perf_warned, 1, __ATOMIC_RELAXED)) {
+      fprintf(stderr, "warning: no performance counter is available, the requests are not measured\n");
+    }
+  }
 
-  int* client_socket = NULL;
+  int client_socket;
 
   while (1) {
     // variables initialization
     char* pathname = NULL;
-    char request_code_buffer[REQUEST_CODE_LENGTH + 1] = {0};
     char response_code_buffer[RESPONSE_CODE_LENGTH + 1] = {0};
-    char pipe_buffer[PIPE_BUFFER_LENGTH + 1] = {0};
+    char field_buffer[METADATA_LENGTH + 1] = {0};
     char pending_request = 0;
     user_node_t* pending_clients = NULL;
     file_t* removed_files = NULL;
 
-    // get ready client from shared buffer
-    EXIT_ON_NULL((client_socket = (int*)ubuffer_dequeue(shared_buffer)));
-    if (!(*client_socket)) {
-      // server termination message
+    // get ready client from the pool queue
+    if ((client_socket = worker_pool_get(pool)) == -1) {
+      // the server is terminating or the worker has been idle for too long
       break;
     }
 
+    conn_t* conn = connections[client_socket];
+    // response code sent to the client, and what is needed to measure the request
+    long response = 0;
+    struct timespec ready = worker_pool_submitted(pool, client_socket);
+    size_t written = conn_written(conn);
+    size_t parsed = conn->read_bytes;
+    // time spent by the request in each stage, the storage and the connection add to it
+    stage_times_t times = {{0}};
+    perf_sample_t perf_start;
+    if (perf.count) {
+      EXIT_ON_NEG_ONE(perf_counters_read(&perf, &perf_start));
+    }
+    if (slow_log) {
+      struct timespec dispatched;
+      EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &dispatched));
+      times.time[STAGE_QUEUE] = (dispatched.tv_sec - ready.tv_sec) * 1000000000ULL + dispatched.tv_nsec - ready.tv_nsec;
+      stage_times = &times;
+    }
+
     // read the request code
-    ssize_t bytes_read;
-    if ((bytes_read = readn((*client_socket), request_code_buffer, REQUEST_CODE_LENGTH)) == -1) {
-      if (errno == ECONNRESET) {
-        bytes_read = 0;
-      } else {
-        perror("readn");
-        exit(EXIT_FAILURE);
+    long request_code = 0;
+    int result;
+    EXIT_ON_NEG_ONE((result = conn_fill(conn, REQUEST_CODE_LENGTH)));
+    if (result) {
+      request_code = parse_request_code(conn_take(conn, REQUEST_CODE_LENGTH));
+      // read the rest of the request header
+      if ((result = request_header(conn, request_code, &pathname, field_buffer)) == -1) {
+        if (errno != EMSGSIZE) {
+	  perror("request_header");
+	  exit(EXIT_FAILURE);
+	}
+	// the pathname is too long: the rest of the request cannot be trusted,
+	// so the request is refused and the client will not be read anymore
+	stop_reading(conn);
+	request_code = -1;
+	result = 1;
       }
     }
 
-    if (bytes_read) {
+    if (result) {
       // successful read
-      long request_code = atol(request_code_buffer);
-
-      if (request_code != READ_N_FILES) {
-        // read the file pathname
-	EXIT_ON_NULL((pathname = request_payload(*client_socket, NULL)));
-      }
 
       switch (request_code) {
 
         case OPEN_FILE:
 	  {
-	    // read flags
-	    char flags_buffer[OPEN_FLAGS_LENGTH + 1] = {0};
-	    EXIT_ON_NEG_ONE(readn(*client_socket, flags_buffer, OPEN_FLAGS_LENGTH));
+	    // get flags
 	    long flags;
-	    if (str2num(flags_buffer, &flags) != 0) {
+	    if (str2num(field_buffer, &flags) != 0) {
 	      // invalid flags
-	      SEND_RESPONSE(*client_socket, BAD_REQUEST);
-	    } else if (storage_open(storage, pathname, flags, &pending_clients, *client_socket) == -1) {
-	      SEND_ERROR(*client_socket);
+	      SEND_RESPONSE(client_socket, BAD_REQUEST);
+	    } else if (storage_open(storage, pathname, flags, &pending_clients, client_socket) == -1) {
+	      SEND_ERROR(client_socket);
 	    } else {
-	      SEND_RESPONSE(*client_socket, OK);
+	      if (IS_SET(O_CREATE, flags) && sync_changes(wal) == -1) {
+	        // the file was created, but it would not survive a crash
+	        SEND_ERROR(client_socket);
+	      } else {
+	        SEND_RESPONSE(client_socket, OK);
+	      }
 	      if (pending_clients) {
 	        // if there are clients waiting to lock removed files,
 		// notify them that these files no longer exist
-	        NOTIFY_PENDING_CLIENTS(pending_clients, FILE_NOT_FOUND, pipe_buffer, master_pipe);
+	        NOTIFY_PENDING_CLIENTS(pending_clients, FILE_NOT_FOUND, master_pipe);
 	      }
 	    }
 	  }
 	  break;
 
+	case READ_FILE_FD:
+	  {
+	    size_t file_size;
+	    int memfd = -1;
+	    if (memfd_min_size && storage_read_fd(storage, pathname, memfd_min_size, &memfd, &file_size, client_socket) == -1) {
+	      SEND_ERROR(client_socket);
+	      break;
+	    }
+	    if (memfd != -1) {
+	      // the memfd is passed with the response instead of the content, then the connection closes it
+	      char memfd_buffer[32];
+	      snprintf(memfd_buffer, sizeof(memfd_buffer), "%d%010zu", OK, file_size);
+	      BREAK_ON_NEG_ONE(conn, conn_write_fd(conn, memfd_buffer, RESPONSE_CODE_LENGTH + METADATA_LENGTH, memfd));
+	      response = OK;
+	      break;
+	    }
+	  }
+	  // the file is too small, it is read as usual
+	  // fall through
 	case READ_FILE:
 	  {
 	    char* file_buffer;
 	    size_t file_size;
-	    // read file
-	    if (storage_read(storage, pathname, (void**)&file_buffer, &file_size, *client_socket) == -1) {
-	      SEND_ERROR(*client_socket);
+	    // read file (the content that fits in the memory shared with the client is copied straight into it)
+	    if (storage_read_to(storage, pathname, conn->shm, conn->shm_size, (void**)&file_buffer, &file_size, client_socket) == -1) {
+	      SEND_ERROR(client_socket);
 	    } else {
-	      SEND_RESPONSE(*client_socket, OK);
-	      // send file
-	      char* send_buffer;
-	      EXIT_ON_NULL(send_buffer = calloc(1, sizeof(char) * (METADATA_LENGTH + file_size + 1)));
-	      snprintf(send_buffer, METADATA_LENGTH + 1, "%010ld", file_size);
-	      memcpy(send_buffer + METADATA_LENGTH, file_buffer, file_size);
-	      free_item((void**)&file_buffer);
-	      EXIT_ON_NEG_ONE(writen(*client_socket, send_buffer, METADATA_LENGTH + file_size));
-	      free_item((void**)&send_buffer);
+	      SEND_RESPONSE(client_socket, OK);
+	      // send file, its content is queued without being copied (unless it is in the shared memory)
+	      char size_buffer[METADATA_LENGTH + 1];
+	      snprintf(size_buffer, METADATA_LENGTH + 1, "%010ld", file_size);
+	      BREAK_ON_NEG_ONE(conn, conn_write(conn, size_buffer, METADATA_LENGTH));
+	      if (file_buffer) {
+	        BREAK_ON_NEG_ONE(conn, conn_write_owned(conn, file_buffer, file_size));
+	      }
 	    }
 	  }
 	  break;
 
 	case READ_N_FILES:
 	  {
-	    // read N
-	    char N_buffer[METADATA_LENGTH + 1] = {0};
-	    EXIT_ON_NEG_ONE(readn(*client_socket, N_buffer, METADATA_LENGTH));
+	    // get N
 	    long N;
-	    if (str2num(N_buffer, &N) != 0) {
+	    if (str2num(field_buffer, &N) != 0) {
 	      // invalid N
-	      SEND_RESPONSE(*client_socket, BAD_REQUEST);
+	      SEND_RESPONSE(client_socket, BAD_REQUEST);
 	    } else {
 	      char* files_buffer;
 	      size_t files_size;
-	      if (storage_read_many(storage, N, (void**)&files_buffer, &files_size, *client_socket) == -1) {
-	        SEND_ERROR(*client_socket);
+	      if (storage_read_many(storage, N, (void**)&files_buffer, &files_size, client_socket) == -1) {
+	        SEND_ERROR(client_socket);
 	      } else {
-	        SEND_RESPONSE(*client_socket, OK);
-		// send the files
-		EXIT_ON_NEG_ONE(writen(*client_socket, files_buffer, files_size));
-		free_item((void**)&files_buffer);
-		EXIT_ON_NEG_ONE(writen(*client_socket, END_OF_CONTENT, METADATA_LENGTH));
+	        SEND_RESPONSE(client_socket, OK);
+		// send the files (not the null terminator of the buffer)
+		BREAK_ON_NEG_ONE(conn, conn_write_owned(conn, files_buffer, files_size - 1));
+		BREAK_ON_NEG_ONE(conn, conn_write(conn, END_OF_CONTENT, METADATA_LENGTH));
 	      }
 	    }
 	  }
@@ -569,62 +1277,135 @@ static void* worker(void* args)
 
 	case WRITE_FILE:
 	  {
-	    if (!storage_can_write(storage, pathname, *client_socket)) {
-	      SEND_RESPONSE(*client_socket, FORBIDDEN);
+	    long content_size;
+	    if ((content_size = content_length(field_buffer, max_request_size)) == -1) {
+	      // the content cannot be skipped, the client will not be read anymore
+	      SEND_RESPONSE(client_socket, BAD_REQUEST);
+	      stop_reading(conn);
+	      break;
+	    }
+	    if (!storage_can_write(storage, pathname, client_socket)) {
+	      SEND_RESPONSE(client_socket, FORBIDDEN);
 	      // discard the rest of the request
-	      char* content_buffer;
-	      EXIT_ON_NULL((content_buffer = request_payload(*client_socket, NULL)));
-	      free_item((void**)&content_buffer);
+	      if (!in_shm(conn, content_size)) {
+	        EXIT_ON_NEG_ONE(conn_skip(conn, content_size));
+	      }
 	      break;
 	    }
 	  }
 	  // fall through
 	case APPEND_TO_FILE:
 	  {
-	    // get the new content to append
-	    char* new_content;
-	    size_t new_content_size;
-	    EXIT_ON_NULL((new_content = request_payload(*client_socket, &new_content_size)));
-	    // append the new content
-	    if (storage_append(storage, pathname, new_content, new_content_size, &pending_clients, &removed_files, *client_socket) == -1) {
-	      SEND_ERROR(*client_socket);
+	    // get the length of the new content to append
+	    long content_size;
+	    if ((content_size = content_length(field_buffer, max_request_size)) == -1) {
+	      // the content cannot be skipped, the client will not be read anymore
+	      SEND_RESPONSE(client_socket, BAD_REQUEST);
+	      stop_reading(conn);
+	      break;
+	    }
+	    if (request_code == APPEND_TO_FILE && !storage_can_append(storage, pathname, client_socket)) {
+	      // refused before the content is buffered
+	      SEND_RESPONSE(client_socket, FORBIDDEN);
+	      // discard the rest of the request
+	      if (!in_shm(conn, content_size)) {
+	        EXIT_ON_NEG_ONE(conn_skip(conn, content_size));
+	      }
+	      break;
+	    }
+	    size_t new_content_size = content_size;
+	    file_t* file;
+	    char* new_content = NULL;
+	    ssize_t bytes_received = 1;
+	    int result = -1;
+	    if (in_shm(conn, new_content_size)) {
+	      // the client placed the content in the shared memory before sending the header,
+	      // it is copied straight into the space reserved in the file
+	      if ((file = storage_append_reserve(storage, pathname, new_content_size, &pending_clients, &removed_files, client_socket, &new_content)) != NULL) {
+	        place_content(cpus, new_content, new_content_size);
+	        STAGE_TIMED(STAGE_RECEIVE, memcpy(new_content, conn->shm, new_content_size));
+	        storage_append_commit(storage, file, new_content_size);
+	        result = 0;
+	      }
+	    } else if (request_code == APPEND_TO_FILE) {
+	      // the content is received straight into the space reserved at the end of the file
+	      if ((file = storage_append_reserve(storage, pathname, new_content_size, &pending_clients, &removed_files, client_socket, &new_content)) == NULL) {
+	        // discard the new content
+	        int errnosav = errno;
+	        EXIT_ON_NEG_ONE(conn_skip(conn, new_content_size));
+	        errno = errnosav;
+	      } else {
+	        place_content(cpus, new_content, new_content_size);
+	        STAGE_TIMED(STAGE_RECEIVE, bytes_received = conn_read(conn, new_content, new_content_size));
+	        if (bytes_received > 0) {
+	          storage_append_commit(storage, file, new_content_size);
+	          result = 0;
+	        } else {
+	          storage_append_abort(file);
+	        }
+	      }
+	    } else if (!new_content_size || (new_content = malloc(new_content_size)) == NULL) {
+	      // discard the new content
+	      errno = (new_content_size ? ENOMEM : EINVAL);
+	      EXIT_ON_NEG_ONE(conn_skip(conn, new_content_size));
+	    } else {
+	      // the content of a new file is received before the file is reserved, then it becomes
+	      // the content of the file without being copied
+	      place_content(cpus, new_content, new_content_size);
+	      STAGE_TIMED(STAGE_RECEIVE, bytes_received = conn_read(conn, new_content, new_content_size));
+	      if (bytes_received > 0) {
+	        result = storage_append_owned(storage, pathname, &new_content, new_content_size, &pending_clients, &removed_files, client_socket);
+	      }
+	      int errnosav = errno;
+	      free_item((void**)&new_content);
+	      errno = errnosav;
+	    }
+	    if (result == -1 || sync_changes(wal) == -1) {
+	      if (bytes_received > 0) {
+	        // the content was not appended, or it would not survive a crash
+	        SEND_ERROR(client_socket);
+	      }
+	      // the files removed to make room for the new content are lost anyway
+	      if (pending_clients) {
+	        NOTIFY_PENDING_CLIENTS(pending_clients, FILE_NOT_FOUND, master_pipe);
+	      }
+	      file_t* current_file;
+	      while ((current_file = removed_files)) {
+	        removed_files = removed_files->next;
+	        file_dealloc(current_file);
+	      }
 	    } else {
-	      SEND_RESPONSE(*client_socket, OK);
+	      SEND_RESPONSE(client_socket, OK);
 	      if (pending_clients) {
 	        // if there are clients waiting to lock removed files,
 		// notify them that these files no longer exist
-	        NOTIFY_PENDING_CLIENTS(pending_clients, FILE_NOT_FOUND, pipe_buffer, master_pipe);
+	        NOTIFY_PENDING_CLIENTS(pending_clients, FILE_NOT_FOUND, master_pipe);
 	      }
 	      // send the removed files to the client
 	      file_t* current_file;
 	      while ((current_file = removed_files)) {
-		// copy the file content
-		char* content_buffer;
-		EXIT_ON_NULL((content_buffer = storage_copy(current_file, 0)));
-		SEND_FILE(*client_socket, current_file, content_buffer);
-		free_item((void**)&content_buffer);
+		SEND_FILE(client_socket, current_file);
 		removed_files = removed_files->next;
 		file_dealloc(current_file);
 	      }
 	      // tell the client there are no more removed files to read
-	      EXIT_ON_NEG_ONE(writen(*client_socket, END_OF_CONTENT, METADATA_LENGTH));
+	      BREAK_ON_NEG_ONE(conn, conn_write(conn, END_OF_CONTENT, METADATA_LENGTH));
 	    }
-	    free_item((void**)&new_content);
 	  }
 	  break;
 
 	case LOCK_FILE:
 	  {
-	    switch (storage_lock(storage, pathname, *client_socket)) {
+	    switch (storage_lock(storage, pathname, client_socket)) {
 	      case -1:
-	        SEND_ERROR(*client_socket);
+	        SEND_ERROR(client_socket);
 		break;
 	      case -2:
 	        // the client will not be sent back to the master
 	        pending_request = 1;
 		break;
 	      default:
-	        SEND_RESPONSE(*client_socket, OK);
+	        SEND_RESPONSE(client_socket, OK);
 	    }
 	  }
 	  break;
@@ -632,16 +1413,15 @@ static void* worker(void* args)
 	case UNLOCK_FILE:
 	  {
 	    int pending_client;
-	    if (storage_unlock(storage, pathname, &pending_client, *client_socket) == -1) {
-	      SEND_ERROR(*client_socket);
+	    if (storage_unlock(storage, pathname, &pending_client, client_socket) == -1) {
+	      SEND_ERROR(client_socket);
 	    } else {
-	      SEND_RESPONSE(*client_socket, OK);
+	      SEND_RESPONSE(client_socket, OK);
 	      if (pending_client) {
 	        // a client waiting to lock the file has finally acquired the lock
 		SEND_RESPONSE(pending_client, OK);
 		// send the pending client back to the master
-		snprintf(pipe_buffer, PIPE_BUFFER_LENGTH + 1, "%04d", pending_client);
-		EXIT_ON_NEG_ONE(writen(master_pipe, pipe_buffer, PIPE_BUFFER_LENGTH));
+		SEND_TO_MASTER(master_pipe, READY_CLIENT, pending_client);
 	      }
 	    }
 	  }
@@ -649,67 +1429,161 @@ static void* worker(void* args)
 
 	case CLOSE_FILE:
 	  {
-	    if (storage_close(storage, pathname, *client_socket) == -1) {
-	      SEND_ERROR(*client_socket);
+	    if (storage_close(storage, pathname, client_socket) == -1) {
+	      SEND_ERROR(client_socket);
 	    } else {
-	      SEND_RESPONSE(*client_socket, OK);
+	      SEND_RESPONSE(client_socket, OK);
 	    }
 	  }
 	  break;
 
 	case REMOVE_FILE:
 	  {
-	    if (storage_remove(storage, pathname, &pending_clients, *client_socket) == -1) {
-	      SEND_ERROR(*client_socket);
+	    if (storage_remove(storage, pathname, &pending_clients, client_socket) == -1) {
+	      SEND_ERROR(client_socket);
 	    } else {
-	      SEND_RESPONSE(*client_socket, OK);
+	      if (sync_changes(wal) == -1) {
+	        // the file was removed, but it would be back after a crash
+	        SEND_ERROR(client_socket);
+	      } else {
+	        SEND_RESPONSE(client_socket, OK);
+	      }
 	      if (pending_clients) {
 	        // if there are clients waiting to lock removed files,
 		// notify them that these files no longer exist
-	        NOTIFY_PENDING_CLIENTS(pending_clients, FILE_NOT_FOUND, pipe_buffer, master_pipe);
+	        NOTIFY_PENDING_CLIENTS(pending_clients, FILE_NOT_FOUND, master_pipe);
 	      }
 	    }
 	  }
 	  break;
 
+	case GET_STATS:
+	  {
+	    char* report;
+	    size_t report_size;
+	    if ((report = stats_report(stats, storage, &report_size)) == NULL) {
+	      SEND_ERROR(client_socket);
+	    } else {
+	      SEND_RESPONSE(client_socket, OK);
+	      char size_buffer[METADATA_LENGTH + 1];
+	      snprintf(size_buffer, METADATA_LENGTH + 1, "%010ld", report_size);
+	      BREAK_ON_NEG_ONE(conn, conn_write(conn, size_buffer, METADATA_LENGTH));
+	      BREAK_ON_NEG_ONE(conn, conn_write_owned(conn, report, report_size));
+	    }
+	  }
+	  break;
+
+	case NEGOTIATE_SHM:
+	  {
+	    long shm_size;
+	    int shm_fd;
+	    if (str2num(field_buffer, &shm_size) != 0 || shm_size <= 0) {
+	      SEND_RESPONSE(client_socket, BAD_REQUEST);
+	    } else if (!shm_max_size) {
+	      SEND_RESPONSE(client_socket, FORBIDDEN);
+	    } else if (conn->shm) {
+	      SEND_RESPONSE(client_socket, ALREADY_EXISTS);
+	    } else if ((shm_fd = shm_create(conn, ((size_t)shm_size < shm_max_size ? (size_t)shm_size : shm_max_size))) == -1) {
+	      SEND_ERROR(client_socket);
+	    } else {
+	      // the memfd is passed with the response, then the connection closes it
+	      char negotiate_buffer[32];
+	      snprintf(negotiate_buffer, sizeof(negotiate_buffer), "%d%010zu", OK, conn->shm_size);
+	      BREAK_ON_NEG_ONE(conn, conn_write_fd(conn, negotiate_buffer, RESPONSE_CODE_LENGTH + METADATA_LENGTH, shm_fd));
+	      response = OK;
+	    }
+	  }
+	  break;
+
+	case MAP_INDEX:
+	  {
+	    int index_fd;
+	    if (!index) {
+	      SEND_RESPONSE(client_socket, FORBIDDEN);
+	    } else if ((index_fd = shm_index_reader_fd(index)) == -1) {
+	      SEND_ERROR(client_socket);
+	    } else {
+	      // the file descriptor is passed with the response, then the connection closes it
+	      char index_buffer[32];
+	      snprintf(index_buffer, sizeof(index_buffer), "%d%010zu", OK, index->size);
+	      BREAK_ON_NEG_ONE(conn, conn_write_fd(conn, index_buffer, RESPONSE_CODE_LENGTH + METADATA_LENGTH, index_fd));
+	      response = OK;
+	    }
+	  }
+	  break;
+
 	default:
 	  {
-	    SEND_RESPONSE(*client_socket, BAD_REQUEST);
+	    SEND_RESPONSE(client_socket, BAD_REQUEST);
 	  }
       }
 
-      // free the resources allocated to handle the request
-      free_item((void**)&pathname);
+      struct timespec done;
+      EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &done));
+      stage_times = NULL;
+      if (pending_request) {
+        // the response is sent when the lock is acquired, its latency is not known yet
+        stats_add(&(shard->lock_waits), 1);
+      } else {
+        uint64_t latency = (done.tv_sec - ready.tv_sec) * 1000000000ULL + done.tv_nsec - ready.tv_nsec;
+        stats_request(shard, request_code, response, latency / 1000, (slow_log ? &times : NULL));
+        if (slow_log) {
+          slow_log_add(slow_log, conn->id, request_code, response, pathname, latency, &times);
+        }
+      }
+      if (!__atomic_load_n(&first_request_served, __ATOMIC_RELAXED) && !__atomic_exchange_n(&first_request_served, 1, __ATOMIC_RELAXED)) {
+        // time to first request, which includes the load of the snapshot
+        printf("server: first request served %.3f ms after the start\n", elapsed_msec(&server_start));
+        fflush(stdout);
+      }
+      stats_add(&(shard->bytes_in), conn->read_bytes - parsed);
+      stats_add(&(shard->bytes_out), conn_written(conn) - written);
+      if (perf.count) {
+        perf_sample_t perf_end, perf_delta;
+        EXIT_ON_NEG_ONE(perf_counters_read(&perf, &perf_end));
+        perf_counters_delta(&perf_start, &perf_end, &perf_delta);
+        stats_perf(shard, request_code, &perf_delta, (conn->read_bytes - parsed) + (conn_written(conn) - written));
+      }
+      if (trace) {
+        trace_request(trace, conn, request_code, pathname, field_buffer, response, &ready, &done, written);
+      }
+      // the request has been handled, the pathname is no longer used
+      conn_release(conn);
+      conn->request_count++;
+      worker_pool_done(pool, client_socket);
 
       if (!pending_request) {
         // send the client back to master
-        snprintf(pipe_buffer, PIPE_BUFFER_LENGTH + 1, "%04d", *client_socket);
-	EXIT_ON_NEG_ONE(writen(master_pipe, pipe_buffer, PIPE_BUFFER_LENGTH));
+	SEND_TO_MASTER(master_pipe, READY_CLIENT, client_socket);
       }
 
     } else {
       // unsuccessful read, the client left
+      stage_times = NULL;
+      if (trace) {
+        struct timespec done;
+        EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &done));
+        trace_request(trace, conn, TRACE_DISCONNECT, NULL, NULL, 0, &ready, &done, written);
+      }
+      worker_pool_done(pool, client_socket);
 
       // release the lock on all files locked by the client
       // and get a list of the first clients waiting to lock these files
-      EXIT_ON_NEG_ONE(storage_user_exit(storage, &pending_clients, *client_socket));
-
-      // close the connection
-      EXIT_ON_NEG_ONE(close(*client_socket));
+      EXIT_ON_NEG_ONE(storage_user_exit(storage, &pending_clients, client_socket));
 
       if (pending_clients) {
         // notify the "first in line" clients, waiting to lock the files locked by the client that just exited,
 	// that they have finally acquired the lock
-        NOTIFY_PENDING_CLIENTS(pending_clients, OK, pipe_buffer, master_pipe);
+        NOTIFY_PENDING_CLIENTS(pending_clients, OK, master_pipe);
       }
 
-      // tell the master that the client left
-      EXIT_ON_NEG_ONE(writen(master_pipe, NO_CLIENT, PIPE_BUFFER_LENGTH));
+      // tell the master that the client left, the master will close the connection
+      SEND_TO_MASTER(master_pipe, LEFT_CLIENT, client_socket);
     }
-    free_item((void**)&client_socket);
 
   }
-  free_item((void**)&client_socket);
 
+  perf_counters_close(&perf);
+  stats_detach(stats, shard);
   return NULL;
 }
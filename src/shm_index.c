@@ -0,0 +1,270 @@
+#include <posixver.h>
+
+#include <shm_index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <error_handling.h>
+#include <concurrency.h>
+#include <free_item.h>
+
+// the slots and the log start on a cache line of their own
+#define SLOTS_OFFSET 64
+#define ALIGN(x) (((x) + 63) & ~(size_t)63)
+
+/**
+ * Compute the layout of a segment
+ *
+ * Return the size of the segment, 0 if it would not fit in a size_t
+ */
+static size_t layout(const uint64_t slot_count, const uint64_t log_size, size_t* log_offset)
+{
+  if (!slot_count || slot_count > (SIZE_MAX / 2) / sizeof(shm_index_slot_t) || log_size > SIZE_MAX / 2) {
+    return 0;
+  }
+  *log_offset = ALIGN(SLOTS_OFFSET + slot_count * sizeof(shm_index_slot_t));
+  return *log_offset + log_size;
+}
+
+/**
+ * Hash a pathname (FNV-1a)
+ */
+static uint64_t hash_pathname(const char* pathname, const size_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)pathname[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Check whether the entry at 'position' has not been overwritten yet
+ */
+static char intact(const shm_index_t* index, const uint64_t position)
+{
+  return index->header->head <= position + index->header->log_size;
+}
+
+/**
+ * Search the slots of a pathname for its entry, and for a slot where it could be placed
+ * (an empty slot, or one whose entry was overwritten) if it has none
+ *
+ * Return a pointer to the slot of the entry, NULL if there is none
+ */
+static shm_index_slot_t* find_slot(shm_index_t* index, const char* pathname, const size_t length, const uint64_t hash, shm_index_slot_t** free_slot)
+{
+  *free_slot = NULL;
+  for (int i = 0; i < SHM_INDEX_PROBES; i++) {
+    shm_index_slot_t* slot = &(index->slots[(hash + i) % index->header->slot_count]);
+    char used = (slot->pathname_length && intact(index, slot->position));
+    if (used && slot->hash == hash && slot->pathname_length == length && memcmp(index->log + slot->position % index->header->log_size, pathname, length) == 0) {
+      return slot;
+    }
+    if (!used && !*free_slot) {
+      *free_slot = slot;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Write the fields of a slot under its seqlock
+ */
+static void write_slot(shm_index_slot_t* slot, const uint64_t hash, const uint32_t pathname_length, const uint64_t position, const uint64_t size)
+{
+  uint32_t sequence = slot->sequence;
+  __atomic_store_n(&(slot->sequence), sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&(slot->hash), hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->pathname_length), pathname_length, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->position), position, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->size), size, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->sequence), sequence + 2, __ATOMIC_RELEASE);
+}
+
+shm_index_t* shm_index_create(const size_t slot_count, const size_t log_size)
+{
+  size_t log_offset;
+  size_t size;
+  if (!log_size || !(size = layout(slot_count, log_size, &log_offset))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  shm_index_t* index;
+  if ((index = calloc(1, sizeof(shm_index_t))) == NULL) {
+    return NULL;
+  }
+  if ((index->fd = memfd_create("fss-index", MFD_CLOEXEC)) == -1) {
+    goto error;
+  }
+  if (ftruncate(index->fd, size) == -1 || (index->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0)) == MAP_FAILED) {
+    EXIT_ON_NEG_ONE(close(index->fd));
+    goto error;
+  }
+  index->size = size;
+  index->header = index->map;
+  index->slots = (shm_index_slot_t*)((char*)index->map + SLOTS_OFFSET);
+  index->log = (char*)index->map + log_offset;
+  // the segment starts zeroed: every slot is empty
+  index->header->slot_count = slot_count;
+  index->header->log_size = log_size;
+  index->header->head = 0;
+  __atomic_store_n(&(index->header->magic), SHM_INDEX_MAGIC, __ATOMIC_RELEASE);
+  EXIT_ON_NZ(pthread_mutex_init(&(index->mutex), NULL));
+  return index;
+
+  error:
+  ;
+  int errnosav = errno;
+  free_item((void**)&index);
+  errno = errnosav;
+  return NULL;
+}
+
+int shm_index_destroy(shm_index_t* index)
+{
+  if (!index) {
+    errno = EINVAL;
+    return -1;
+  }
+  EXIT_ON_NZ(pthread_mutex_destroy(&(index->mutex)));
+  EXIT_ON_NEG_ONE(munmap(index->map, index->size));
+  EXIT_ON_NEG_ONE(close(index->fd));
+  free_item((void**)&index);
+  return 0;
+}
+
+int shm_index_reader_fd(shm_index_t* index)
+{
+  // the memfd reopened read-only cannot be mapped for writing
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", index->fd);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int shm_index_publish(shm_index_t* index, const char* pathname, const char* content, const size_t size)
+{
+  size_t length = strlen(pathname);
+  if (!length || length > UINT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  const uint64_t log_size = index->header->log_size;
+  if (length + size < length || length + size > log_size / 16) {
+    errno = EFBIG;
+    return -1;
+  }
+  uint64_t hash = hash_pathname(pathname, length);
+
+  LOCK(&(index->mutex));
+  shm_index_slot_t* slot;
+  shm_index_slot_t* free_slot;
+  if ((slot = find_slot(index, pathname, length, hash, &free_slot)) != NULL) {
+    // the content is withdrawn whenever it changes, the entry is still up to date
+    UNLOCK(&(index->mutex));
+    return 0;
+  }
+  // take the place of the entry of another pathname if no slot is free
+  slot = (free_slot ? free_slot : &(index->slots[hash % index->header->slot_count]));
+  // an entry never wraps around the end of the log
+  uint64_t position = index->header->head;
+  if (position % log_size + length + size > log_size) {
+    position += log_size - position % log_size;
+  }
+  // reserve the entry before writing it, so that the readers of the entries it overwrites notice it
+  __atomic_store_n(&(index->header->head), position + length + size, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(index->log + position % log_size, pathname, length);
+  memcpy(index->log + position % log_size + length, content, size);
+  write_slot(slot, hash, length, position, size);
+  UNLOCK(&(index->mutex));
+
+  return 0;
+}
+
+void shm_index_withdraw(shm_index_t* index, const char* pathname)
+{
+  size_t length = strlen(pathname);
+  uint64_t hash = hash_pathname(pathname, length);
+  LOCK(&(index->mutex));
+  shm_index_slot_t* slot;
+  shm_index_slot_t* free_slot;
+  if ((slot = find_slot(index, pathname, length, hash, &free_slot)) != NULL) {
+    write_slot(slot, 0, 0, 0, 0);
+  }
+  UNLOCK(&(index->mutex));
+}
+
+int shm_index_check(const void* map, const size_t size)
+{
+  const shm_index_header_t* header = map;
+  size_t log_offset;
+  if (size < sizeof(shm_index_header_t) || __atomic_load_n(&(header->magic), __ATOMIC_ACQUIRE) != SHM_INDEX_MAGIC
+      || !header->log_size || layout(header->slot_count, header->log_size, &log_offset) != size) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int shm_index_lookup(const void* map, const char* pathname, void** buffer, size_t* size)
+{
+  const shm_index_header_t* header = map;
+  const shm_index_slot_t* slots = (const shm_index_slot_t*)((const char*)map + SLOTS_OFFSET);
+  // the layout was checked when the segment was mapped
+  size_t log_offset = 0;
+  layout(header->slot_count, header->log_size, &log_offset);
+  const char* log = (const char*)map + log_offset;
+  const uint64_t log_size = header->log_size;
+
+  size_t length = strlen(pathname);
+  uint64_t hash = hash_pathname(pathname, length);
+  for (int i = 0; i < SHM_INDEX_PROBES; i++) {
+    const shm_index_slot_t* slot = &(slots[(hash + i) % header->slot_count]);
+    uint32_t sequence = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+    if (sequence & 1) {
+      // the slot is being written
+      return -1;
+    }
+    if (__atomic_load_n(&(slot->hash), __ATOMIC_RELAXED) != hash || __atomic_load_n(&(slot->pathname_length), __ATOMIC_RELAXED) != length) {
+      continue;
+    }
+    uint64_t position = __atomic_load_n(&(slot->position), __ATOMIC_RELAXED);
+    uint64_t entry_size = __atomic_load_n(&(slot->size), __ATOMIC_RELAXED);
+    // the fields may be torn, they are checked before being used to access the log
+    if (entry_size > log_size / 16 || position % log_size + length + entry_size > log_size) {
+      return -1;
+    }
+    char* copy;
+    // terminated like the content received through the socket
+    if ((copy = malloc(entry_size + 1)) == NULL) {
+      return -1;
+    }
+    copy[entry_size] = '\0';
+    char same = (memcmp(log + position % log_size, pathname, length) == 0);
+    memcpy(copy, log + position % log_size + length, entry_size);
+    // the copy is valid if neither the slot nor the entry changed while it was made
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&(slot->sequence), __ATOMIC_RELAXED) != sequence || __atomic_load_n(&(header->head), __ATOMIC_RELAXED) > position + log_size) {
+      free(copy);
+      return -1;
+    }
+    if (!same) {
+      // another pathname with the same hash
+      free(copy);
+      continue;
+    }
+    *buffer = copy;
+    *size = entry_size;
+    return 0;
+  }
+  return -1;
+}
@@ -0,0 +1,88 @@
+#include <posixver.h>
+
+#include <stages.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <concurrency.h>
+#include <free_item.h>
+
+__thread stage_times_t* stage_times = NULL;
+
+static const char* stage_names[STAGES] = {"queue", "storage_lock", "file_wait", "copy", "receive", "send", "sync"};
+
+slow_log_t* slow_log_create(const long threshold)
+{
+  if (threshold < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  slow_log_t* log;
+  if ((log = calloc(1, sizeof(slow_log_t))) == NULL) {
+    return NULL;
+  }
+  log->threshold = (uint64_t)threshold * 1000000;
+  EXIT_ON_NZ(pthread_mutex_init(&(log->mutex), NULL));
+  return log;
+}
+
+int slow_log_destroy(slow_log_t* log)
+{
+  if (!log) {
+    errno = EINVAL;
+    return -1;
+  }
+  EXIT_ON_NZ(pthread_mutex_destroy(&(log->mutex)));
+  free_item((void**)&log);
+  return 0;
+}
+
+void slow_log_add(slow_log_t* log, const unsigned int connection, const long request_code, const long response, const char* pathname, const uint64_t total, const stage_times_t* stages)
+{
+  if (total < log->threshold) {
+    return;
+  }
+  slow_request_t request = {.connection = connection, .request_code = request_code, .response = response, .total = total, .stages = *stages};
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_REALTIME, &(request.served)));
+  if (pathname) {
+    // the end of a pathname tells more than its beginning
+    size_t length = strlen(pathname);
+    strcpy(request.pathname, pathname + (length > SLOW_LOG_PATHNAME_LENGTH ? length - SLOW_LOG_PATHNAME_LENGTH : 0));
+  } else {
+    strcpy(request.pathname, "-");
+  }
+  LOCK(&(log->mutex));
+  log->ring[log->next] = request;
+  log->next = (log->next + 1) % SLOW_LOG_LENGTH;
+  log->total++;
+  UNLOCK(&(log->mutex));
+}
+
+void slow_log_dump(slow_log_t* log, FILE* stream)
+{
+  LOCK(&(log->mutex));
+  size_t count = (log->total < SLOW_LOG_LENGTH ? log->total : SLOW_LOG_LENGTH);
+  fprintf(stream, "# slow requests: %zu over %" PRIu64 " ms since the start, the last %zu follow\n", log->total, log->threshold / 1000000, count);
+  fprintf(stream, "# served\tconnection\trequest_code\tresponse_code\ttotal_us");
+  for (size_t i = 0; i < STAGES; i++) {
+    fprintf(stream, "\t%s_us", stage_names[i]);
+  }
+  fprintf(stream, "\tpathname\n");
+  for (size_t i = 0; i < count; i++) {
+    slow_request_t* request = &(log->ring[(log->next + SLOW_LOG_LENGTH - count + i) % SLOW_LOG_LENGTH]);
+    struct tm served;
+    char time_buffer[32];
+    localtime_r(&(request->served.tv_sec), &served);
+    strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%dT%H:%M:%S", &served);
+    fprintf(stream, "%s.%06ld\t%u\t%ld\t%ld\t%" PRIu64, time_buffer, request->served.tv_nsec / 1000, request->connection, request->request_code, request->response, request->total / 1000);
+    for (size_t j = 0; j < STAGES; j++) {
+      fprintf(stream, "\t%" PRIu64, request->stages.time[j] / 1000);
+    }
+    fprintf(stream, "\t%s\n", request->pathname);
+  }
+  UNLOCK(&(log->mutex));
+  fflush(stream);
+}
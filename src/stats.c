@@ -0,0 +1,312 @@
+#include <posixver.h>
+
+#include <stats.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <communication_protocol.h>
+#include <concurrency.h>
+#include <error_handling.h>
+#include <free_item.h>
+
+static const char* request_names[STATS_REQUESTS] = {"unknown", "open", "read", "readN", "write", "append", "lock", "unlock", "close", "remove", "stats", "negotiate", "read_fd", "index"};
+static const char* response_names[STATS_RESPONSES] = {"none", "ok", "file_not_found", "already_exists", "no_content", "forbidden", "out_of_memory", "internal_server_error", "bad_request", "invalid_response"};
+
+stats_t* stats_create(const size_t size)
+{
+  if (!size) {
+    errno = EINVAL;
+    return NULL;
+  }
+  stats_t* stats;
+  if ((stats = calloc(1, sizeof(stats_t))) == NULL) {
+    return NULL;
+  }
+  int error;
+  if ((error = posix_memalign((void**)&(stats->shards), STATS_CACHE_LINE, sizeof(stats_shard_t) * size)) != 0) {
+    free_item((void**)&stats);
+    errno = error;
+    return NULL;
+  }
+  memset(stats->shards, 0, sizeof(stats_shard_t) * size);
+  if ((stats->owned = calloc(size, sizeof(char))) == NULL) {
+    free_item((void**)&(stats->shards));
+    free_item((void**)&stats);
+    return NULL;
+  }
+  stats->size = size;
+  EXIT_ON_NZ(pthread_mutex_init(&(stats->mutex), NULL));
+  EXIT_ON_NZ(pthread_cond_init(&(stats->cond), NULL));
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &(stats->start)));
+  return stats;
+}
+
+int stats_destroy(stats_t* stats)
+{
+  if (!stats) {
+    errno = EINVAL;
+    return -1;
+  }
+  EXIT_ON_NZ(pthread_cond_destroy(&(stats->cond)));
+  EXIT_ON_NZ(pthread_mutex_destroy(&(stats->mutex)));
+  free_item((void**)&(stats->owned));
+  free_item((void**)&(stats->shards));
+  free_item((void**)&stats);
+  return 0;
+}
+
+stats_shard_t* stats_attach(stats_t* stats)
+{
+  LOCK(&(stats->mutex));
+  // a worker may start before the one it replaces has released its shard
+  while (stats->owned_count == stats->size) {
+    WAIT(&(stats->cond), &(stats->mutex));
+  }
+  size_t i = 0;
+  while (stats->owned[i]) {
+    i++;
+  }
+  stats->owned[i] = 1;
+  stats->owned_count++;
+  UNLOCK(&(stats->mutex));
+  return &(stats->shards[i]);
+}
+
+void stats_detach(stats_t* stats, stats_shard_t* shard)
+{
+  LOCK(&(stats->mutex));
+  stats->owned[shard - stats->shards] = 0;
+  stats->owned_count--;
+  SIGNAL(&(stats->cond));
+  UNLOCK(&(stats->mutex));
+}
+
+void stats_add(uint64_t* counter, const uint64_t value)
+{
+  // only the owner writes the counter, a plain load and store are enough
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return the histogram bucket of a latency of 'usec' microseconds
+ */
+static size_t latency_bucket(const uint64_t usec)
+{
+  if (usec < 2 * STATS_SUB_BUCKETS) {
+    return usec;
+  }
+  // position of the most significant bit (at least 4)
+  int bit = 63 - __builtin_clzll(usec);
+  size_t bucket = 2 * STATS_SUB_BUCKETS + STATS_SUB_BUCKETS * (bit - 4) + ((usec >> (bit - 3)) & (STATS_SUB_BUCKETS - 1));
+  return (bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1);
+}
+
+/**
+ * Return the highest latency in microseconds counted in a histogram bucket
+ */
+static uint64_t bucket_upper_bound(const size_t bucket)
+{
+  if (bucket < 2 * STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+  int bit = (bucket - 2 * STATS_SUB_BUCKETS) / STATS_SUB_BUCKETS + 4;
+  uint64_t sub_bucket = (bucket - 2 * STATS_SUB_BUCKETS) % STATS_SUB_BUCKETS;
+  return ((STATS_SUB_BUCKETS + sub_bucket + 1) << (bit - 3)) - 1;
+}
+
+void stats_request(stats_shard_t* shard, const long request_code, const long response, const uint64_t latency, const stage_times_t* stages)
+{
+  stats_op_t* op = &(shard->ops[(request_code > 0 && request_code < STATS_REQUESTS) ? request_code : 0]);
+  stats_add(&(op->count), 1);
+  stats_add(&(op->total_latency), latency);
+  stats_add(&(op->histogram[latency_bucket(latency)]), 1);
+  if (latency > op->max_latency) {
+    __atomic_store_n(&(op->max_latency), latency, __ATOMIC_RELAXED);
+  }
+  if (stages) {
+    stats_add(&(op->timed), 1);
+    for (size_t i = 0; i < STAGES; i++) {
+      stats_add(&(op->stage_time[i]), stages->time[i]);
+    }
+  }
+  if (response >= 0 && response < STATS_RESPONSES) {
+    stats_add(&(shard->responses[response]), 1);
+  }
+}
+
+void stats_perf(stats_shard_t* shard, const long request_code, const perf_sample_t* delta, const uint64_t bytes)
+{
+  if (!delta->available) {
+    return;
+  }
+  stats_op_t* op = &(shard->ops[(request_code > 0 && request_code < STATS_REQUESTS) ? request_code : 0]);
+  for (size_t i = 0; i < PERF_EVENTS; i++) {
+    if (delta->available & (1U << i)) {
+      stats_add(&(op->perf_samples[i]), 1);
+      stats_add(&(op->perf_count[i]), delta->value[i]);
+    }
+  }
+  stats_add(&(op->perf_bytes), bytes);
+}
+
+/**
+ * Add the counters of all the shards in 'total' (read while the workers update them)
+ */
+static void stats_merge(stats_t* stats, stats_shard_t* total)
+{
+  memset(total, 0, sizeof(stats_shard_t));
+  for (size_t i = 0; i < stats->size; i++) {
+    stats_shard_t* shard = &(stats->shards[i]);
+    for (size_t j = 0; j < STATS_REQUESTS; j++) {
+      stats_op_t* op = &(shard->ops[j]);
+      total->ops[j].count += __atomic_load_n(&(op->count), __ATOMIC_RELAXED);
+      total->ops[j].total_latency += __atomic_load_n(&(op->total_latency), __ATOMIC_RELAXED);
+      uint64_t max_latency = __atomic_load_n(&(op->max_latency), __ATOMIC_RELAXED);
+      if (max_latency > total->ops[j].max_latency) {
+        total->ops[j].max_latency = max_latency;
+      }
+      for (size_t k = 0; k < STATS_BUCKETS; k++) {
+        total->ops[j].histogram[k] += __atomic_load_n(&(op->histogram[k]), __ATOMIC_RELAXED);
+      }
+      total->ops[j].timed += __atomic_load_n(&(op->timed), __ATOMIC_RELAXED);
+      for (size_t k = 0; k < STAGES; k++) {
+        total->ops[j].stage_time[k] += __atomic_load_n(&(op->stage_time[k]), __ATOMIC_RELAXED);
+      }
+      for (size_t k = 0; k < PERF_EVENTS; k++) {
+        total->ops[j].perf_samples[k] += __atomic_load_n(&(op->perf_samples[k]), __ATOMIC_RELAXED);
+        total->ops[j].perf_count[k] += __atomic_load_n(&(op->perf_count[k]), __ATOMIC_RELAXED);
+      }
+      total->ops[j].perf_bytes += __atomic_load_n(&(op->perf_bytes), __ATOMIC_RELAXED);
+    }
+    for (size_t j = 0; j < STATS_RESPONSES; j++) {
+      total->responses[j] += __atomic_load_n(&(shard->responses[j]), __ATOMIC_RELAXED);
+    }
+    total->bytes_in += __atomic_load_n(&(shard->bytes_in), __ATOMIC_RELAXED);
+    total->bytes_out += __atomic_load_n(&(shard->bytes_out), __ATOMIC_RELAXED);
+    total->lock_waits += __atomic_load_n(&(shard->lock_waits), __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Return an upper bound in microseconds of the given percentile of the latencies of an operation
+ */
+static uint64_t percentile(const stats_op_t* op, const double fraction)
+{
+  // the histogram may have been read while a request was being counted
+  uint64_t count = 0;
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    count += op->histogram[i];
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    seen += op->histogram[i];
+    if (seen && seen >= fraction * count) {
+      uint64_t bound = bucket_upper_bound(i);
+      return (bound < op->max_latency ? bound : op->max_latency);
+    }
+  }
+  return op->max_latency;
+}
+
+/**
+ * Print a tab and a mean, or '-' if it is negative (not available)
+ */
+static void print_mean(FILE* stream, const double mean, const char* format)
+{
+  fprintf(stream, "\t");
+  if (mean < 0) {
+    fprintf(stream, "-");
+  } else {
+    fprintf(stream, format, mean);
+  }
+}
+
+char* stats_report(stats_t* stats, storage_t* storage, size_t* length)
+{
+  if (!stats || !storage || !length) {
+    errno = EINVAL;
+    return NULL;
+  }
+  stats_shard_t* total;
+  if ((total = malloc(sizeof(stats_shard_t))) == NULL) {
+    return NULL;
+  }
+  stats_merge(stats, total);
+  storage_usage_t usage;
+  storage_usage(storage, &usage);
+  struct timespec now;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &now));
+
+  char* report = NULL;
+  FILE* stream;
+  if ((stream = open_memstream(&report, length)) == NULL) {
+    free_item((void**)&total);
+    return NULL;
+  }
+  fprintf(stream, "# fss stats uptime=%.3fs\n", (now.tv_sec - stats->start.tv_sec) + (now.tv_nsec - stats->start.tv_nsec) / 1e9);
+  fprintf(stream, "storage\tfiles\t%zu\n", usage.file_number);
+  fprintf(stream, "storage\tsize\t%zu\n", usage.size);
+  fprintf(stream, "storage\tmax_files\t%zu\n", usage.max_file_number_reached);
+  fprintf(stream, "storage\tmax_size\t%zu\n", usage.max_size_reached);
+  fprintf(stream, "storage\tevictions\t%zu\n", usage.evicted_files);
+  fprintf(stream, "traffic\tbytes_in\t%" PRIu64 "\n", total->bytes_in);
+  fprintf(stream, "traffic\tbytes_out\t%" PRIu64 "\n", total->bytes_out);
+  fprintf(stream, "traffic\tlock_waits\t%" PRIu64 "\n", total->lock_waits);
+  for (size_t i = OK; i < STATS_RESPONSES; i++) {
+    fprintf(stream, "response\t%s\t%" PRIu64 "\n", response_names[i], total->responses[i]);
+  }
+  fprintf(stream, "# latency\trequest\tcount\tmean_us\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\n");
+  for (size_t i = 0; i < STATS_REQUESTS; i++) {
+    stats_op_t* op = &(total->ops[i]);
+    if (!op->count) {
+      continue;
+    }
+    fprintf(stream, "latency\t%s\t%" PRIu64 "\t%.1f\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", request_names[i], op->count, (double)op->total_latency / op->count,
+            percentile(op, 0.5), percentile(op, 0.9), percentile(op, 0.99), percentile(op, 0.999), op->max_latency);
+  }
+  fprintf(stream, "# stage\trequest\ttimed\tqueue_us\tstorage_lock_us\tfile_wait_us\tcopy_us\treceive_us\tsend_us\tsync_us (means)\n");
+  for (size_t i = 0; i < STATS_REQUESTS; i++) {
+    stats_op_t* op = &(total->ops[i]);
+    if (!op->timed) {
+      continue;
+    }
+    fprintf(stream, "stage\t%s\t%" PRIu64, request_names[i], op->timed);
+    for (size_t j = 0; j < STAGES; j++) {
+      fprintf(stream, "\t%.1f", (double)op->stage_time[j] / op->timed / 1000);
+    }
+    fprintf(stream, "\n");
+  }
+  fprintf(stream, "# perf\trequest\tmeasured\tcycles\tinstructions\tipc\tcache_misses\tmisses_per_kb\tcontext_switches (means, - if not available)\n");
+  for (size_t i = 0; i < STATS_REQUESTS; i++) {
+    stats_op_t* op = &(total->ops[i]);
+    uint64_t measured = 0;
+    double mean[PERF_EVENTS];
+    for (size_t j = 0; j < PERF_EVENTS; j++) {
+      if (op->perf_samples[j] > measured) {
+        measured = op->perf_samples[j];
+      }
+      mean[j] = (op->perf_samples[j] ? (double)op->perf_count[j] / op->perf_samples[j] : -1);
+    }
+    if (!measured) {
+      continue;
+    }
+    fprintf(stream, "perf\t%s\t%" PRIu64, request_names[i], measured);
+    print_mean(stream, mean[PERF_CYCLES], "%.0f");
+    print_mean(stream, mean[PERF_INSTRUCTIONS], "%.0f");
+    print_mean(stream, (mean[PERF_CYCLES] > 0 && mean[PERF_INSTRUCTIONS] >= 0 ? mean[PERF_INSTRUCTIONS] / mean[PERF_CYCLES] : -1), "%.2f");
+    print_mean(stream, mean[PERF_CACHE_MISSES], "%.1f");
+    print_mean(stream, (op->perf_samples[PERF_CACHE_MISSES] && op->perf_bytes ? op->perf_count[PERF_CACHE_MISSES] * 1024.0 / op->perf_bytes : -1), "%.2f");
+    print_mean(stream, mean[PERF_CONTEXT_SWITCHES], "%.3f");
+    fprintf(stream, "\n");
+  }
+  free_item((void**)&total);
+  if (fclose(stream) == EOF) {
+    free_item((void**)&report);
+    return NULL;
+  }
+  return report;
+}
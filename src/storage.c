@@ -1,13 +1,23 @@
+#include <posixver.h>
+
 #include <storage.h>
 
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <communication_protocol.h>
 #include <error_handling.h>
 #include <concurrency.h>
 #include <free_item.h>
+#include <stages.h>
+#include <snapshot.h>
 
 /**
  * Create a file
@@ -28,6 +38,7 @@ static file_t* file_create(const char* pathname)
     goto end;
   }
   memcpy(new_file->pathname, pathname, strlen(pathname));
+  new_file->memfd = -1;
   EXIT_ON_NZ(pthread_mutex_init(&(new_file->mutex), NULL));
 
   return new_file;
@@ -40,11 +51,35 @@ static file_t* file_create(const char* pathname)
 
 void file_dealloc(file_t* file)
 {
+  if (file->memfd != -1) {
+    // the clients that received the memfd keep their own references
+    EXIT_ON_NEG_ONE(close(file->memfd));
+  }
   free_item((void**)&(file->pathname));
   free_item((void**)&(file->content));
   free_item((void**)&file);
 }
 
+/**
+ * Withdraw a file from the index, before it is modified, locked or removed
+ */
+static void file_withdraw(storage_t* storage, file_t* file)
+{
+  if (storage->index) {
+    shm_index_withdraw(storage->index, file->pathname);
+  }
+}
+
+/**
+ * Record a change to the storage in its log, if it has one
+ */
+static void file_log(storage_t* storage, const uint32_t type, const char* pathname, const char* data, const size_t size)
+{
+  if (storage->wal) {
+    wal_append(storage->wal, type, pathname, data, size);
+  }
+}
+
 /**
  * Destroy a file in the storage
  * (assume that the storage is locked)
@@ -54,12 +89,14 @@ static void file_destroy(storage_t* storage, file_t* file, user_node_t** pending
   if (!storage || !file) {
     return;
   }
-  LOCK(&(file->ordering));
-  LOCK(&(file->mutex));
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
 
-  while (file->active_readers || file->active_writers) {
-    WAIT(&(file->cond), &(file->mutex));
-  }
+  STAGE_TIMED(STAGE_FILE_WAIT,
+    while (file->active_readers || file->active_writers) {
+      WAIT(&(file->cond), &(file->mutex));
+    }
+  );
+  file_withdraw(storage, file);
 
   // remove the file from the list structure
   if (file->previous) {
@@ -95,7 +132,7 @@ static void file_destroy(storage_t* storage, file_t* file, user_node_t** pending
   }
 
   storage->file_number--;
-  storage->size -= file->size;
+  storage->size -= file->size + file->reserved;
 
   EXIT_ON_NZ(pthread_cond_destroy(&(file->cond)));
   UNLOCK(&(file->ordering));
@@ -132,6 +169,16 @@ storage_t* storage_create(const size_t max_file_number, const size_t max_size)
   return NULL;
 }
 
+void storage_set_index(storage_t* storage, shm_index_t* index)
+{
+  storage->index = index;
+}
+
+void storage_set_wal(storage_t* storage, wal_t* wal)
+{
+  storage->wal = wal;
+}
+
 int storage_destroy(storage_t* storage)
 {
   if (!storage) {
@@ -159,7 +206,8 @@ void storage_print_summary(storage_t* storage)
   printf("The storage:\n");
   printf(" - has reached the maximum number of %zu files\n", storage->max_file_number_reached);
   printf(" - has reached a maximum size of %f Megabyte(s)\n", (float)storage->max_size_reached / 1048576);
-  printf(" - ran the replacement algorithm %zu time(s)\n", storage->replacement_counter);
+  printf(" - ran the replacement algorithm %zu time(s)", storage->replacement_counter);
+  printf(", evicting %zu file(s)\n", storage->evicted_files);
 
   // print all files in the storage
   printf(" - currently contains the following files:\n");
@@ -179,6 +227,17 @@ void storage_print_summary(storage_t* storage)
   printf("\n");
 }
 
+void storage_usage(storage_t* storage, storage_usage_t* usage)
+{
+  LOCK(&(storage->mutex));
+  usage->file_number = storage->file_number;
+  usage->size = storage->size;
+  usage->max_file_number_reached = storage->max_file_number_reached;
+  usage->max_size_reached = storage->max_size_reached;
+  usage->evicted_files = storage->evicted_files;
+  UNLOCK(&(storage->mutex));
+}
+
 /**
  * Add a file to the storage
  * (assume that the storage is locked)
@@ -195,6 +254,7 @@ static void storage_add(storage_t* storage, file_t* file)
     }
   }
   storage->tail = file;
+  file->serial = ++storage->last_serial;
 
   // add the file to the dictionary structure
   EXIT_ON_NULL(icl_hash_insert(storage->dictionary, file->pathname, file));
@@ -247,7 +307,13 @@ static file_t* get_victim(storage_t* storage, const file_t* spare)
   file_t* victim = storage->head;
   while (victim) {
     if (victim != spare && victim->modified) {
-      return victim;
+      // skip the files with an append in progress
+      LOCK(&(victim->mutex));
+      char busy = victim->active_writers;
+      UNLOCK(&(victim->mutex));
+      if (!busy) {
+        return victim;
+      }
     }
     victim = victim->next;
   }
@@ -270,7 +336,7 @@ char* storage_copy(const file_t* file, const size_t extra_space)
   if ((copy_buffer = calloc(1, sizeof(char) * (file->size + extra_space))) == NULL) {
     return NULL;
   }
-  memcpy(copy_buffer, file->content, file->size);
+  STAGE_TIMED(STAGE_COPY, memcpy(copy_buffer, file->content, file->size));
   return copy_buffer;
 }
 
@@ -380,7 +446,7 @@ int storage_open(storage_t* storage, const char* pathname, const int flags, user
   const char create_flag = IS_SET(O_CREATE, flags);
   const char lock_flag = IS_SET(O_LOCK, flags);
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   // search for the file
   file_t* file;
@@ -403,7 +469,9 @@ int storage_open(storage_t* storage, const char* pathname, const int flags, user
 	errno = ENOMEM;
 	return -1;
       }
+      file_log(storage, WAL_REMOVE, victim->pathname, NULL, 0);
       file_destroy(storage, victim, pending_locks, 1);
+      storage->evicted_files++;
     }
 
     // create file
@@ -419,6 +487,7 @@ int storage_open(storage_t* storage, const char* pathname, const int flags, user
     EXIT_ON_NEG_ONE(enqueue_user(&(file->opened_by), user));
     // add file to storage
     storage_add(storage, file);
+    file_log(storage, WAL_CREATE, pathname, NULL, 0);
 
   } else {
     // file exists
@@ -429,12 +498,12 @@ int storage_open(storage_t* storage, const char* pathname, const int flags, user
       return -1;
     }
 
-    LOCK(&(file->ordering));
-    LOCK(&(file->mutex));
+    STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
     
     if (lock_flag) {
       if (!file->locked_by) {
         file->locked_by = user;
+        file_withdraw(storage, file);
       } else {
         // file is already locked
         UNLOCK(&(file->ordering));
@@ -455,13 +524,18 @@ int storage_open(storage_t* storage, const char* pathname, const int flags, user
 }
 
 int storage_read(storage_t* storage, const char* pathname, void** buffer, size_t* size, const int user)
+{
+  return storage_read_to(storage, pathname, NULL, 0, buffer, size, user);
+}
+
+int storage_read_to(storage_t* storage, const char* pathname, void* dest, const size_t capacity, void** buffer, size_t* size, const int user)
 {
   if (!storage || !pathname || !strlen(pathname) || !buffer || !size || user <= 0) {
     errno = EINVAL;
     return -1;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   // search for the file
   file_t* file;
@@ -471,8 +545,7 @@ int storage_read(storage_t* storage, const char* pathname, void** buffer, size_t
     return -1;
   }
 
-  LOCK(&(file->ordering));
-  LOCK(&(file->mutex));
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
   UNLOCK(&(storage->mutex));
 
   if ((file->locked_by && file->locked_by != user) || !contains_user(file->opened_by, user)) {
@@ -483,9 +556,11 @@ int storage_read(storage_t* storage, const char* pathname, void** buffer, size_t
     return -1;
   }
 
-  while (file->active_writers) {
-    WAIT(&(file->cond), &(file->mutex));
-  }
+  STAGE_TIMED(STAGE_FILE_WAIT,
+    while (file->active_writers) {
+      WAIT(&(file->cond), &(file->mutex));
+    }
+  );
   file->active_readers++;
 
   UNLOCK(&(file->ordering));
@@ -494,7 +569,11 @@ int storage_read(storage_t* storage, const char* pathname, void** buffer, size_t
   int errnosav = 0;
 
   // copy file content
-  if ((*buffer = storage_copy(file, 0)) == NULL) {
+  if (dest && file->content && file->size <= capacity) {
+    STAGE_TIMED(STAGE_COPY, memcpy(dest, file->content, file->size));
+    *buffer = NULL;
+    *size = file->size;
+  } else if ((*buffer = storage_copy(file, 0)) == NULL) {
     //could not copy file content
     errnosav = errno;
   } else {
@@ -502,6 +581,11 @@ int storage_read(storage_t* storage, const char* pathname, void** buffer, size_t
   }
 
   LOCK(&(file->mutex));
+  if (!errnosav && storage->index && file->content && !file->locked_by) {
+    // the content cannot change until the readers are done, and a lock withdraws it under the mutex
+    // (a file too large for the index is just not published)
+    shm_index_publish(storage->index, file->pathname, file->content, file->size);
+  }
   file->active_readers--;
   if (!errnosav) {
     // the first write to the file can no longer be performed
@@ -516,6 +600,117 @@ int storage_read(storage_t* storage, const char* pathname, void** buffer, size_t
   return (errno ? -1 : 0);
 }
 
+/**
+ * Create a sealed memfd holding the content of a file
+ * (assume that the file is being read)
+ *
+ * Return the file descriptor on success, -1 on error (set errno)
+ */
+static int file_memfd(const file_t* file)
+{
+  int fd;
+  if ((fd = memfd_create("fss-file", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+    return -1;
+  }
+  void* map;
+  // the pages are allocated all at once rather than one fault at a time
+  if (ftruncate(fd, file->size) == -1 || (map = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+    goto error;
+  }
+  STAGE_TIMED(STAGE_COPY, memcpy(map, file->content, file->size));
+  // a memfd mapped for writing cannot be sealed
+  EXIT_ON_NEG_ONE(munmap(map, file->size));
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+    goto error;
+  }
+  return fd;
+
+  error:
+  ;
+  int errnosav = errno;
+  EXIT_ON_NEG_ONE(close(fd));
+  errno = errnosav;
+  return -1;
+}
+
+int storage_read_fd(storage_t* storage, const char* pathname, const size_t min_size, int* fd, size_t* size, const int user)
+{
+  if (!storage || !pathname || !strlen(pathname) || !fd || !size || user <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
+
+  // search for the file
+  file_t* file;
+  if ((file = storage_find(storage, pathname)) == NULL) {
+    // file not found
+    UNLOCK(&(storage->mutex));
+    return -1;
+  }
+
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
+  UNLOCK(&(storage->mutex));
+
+  if ((file->locked_by && file->locked_by != user) || !contains_user(file->opened_by, user)) {
+    // user cannot access the file
+    UNLOCK(&(file->ordering));
+    UNLOCK(&(file->mutex));
+    errno = EACCES;
+    return -1;
+  }
+
+  STAGE_TIMED(STAGE_FILE_WAIT,
+    while (file->active_writers) {
+      WAIT(&(file->cond), &(file->mutex));
+    }
+  );
+  file->active_readers++;
+  char cached = (file->memfd != -1);
+
+  UNLOCK(&(file->ordering));
+  UNLOCK(&(file->mutex));
+
+  int errnosav = 0;
+  *fd = -1;
+  *size = file->size;
+
+  if (file->size && file->size >= min_size) {
+    // the memfd is created by the first read and shared by the next ones, until the content changes
+    int memfd = -1;
+    if (!cached && (memfd = file_memfd(file)) == -1) {
+      errnosav = errno;
+    } else {
+      LOCK(&(file->mutex));
+      if (file->memfd == -1) {
+        file->memfd = memfd;
+      } else if (memfd != -1) {
+        // another reader created one in the meantime
+        EXIT_ON_NEG_ONE(close(memfd));
+      }
+      if ((*fd = fcntl(file->memfd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        errnosav = errno;
+      }
+      UNLOCK(&(file->mutex));
+    }
+  }
+
+  LOCK(&(file->mutex));
+  file->active_readers--;
+  if (!errnosav && *fd != -1) {
+    // the first write to the file can no longer be performed
+    file->owner = 0;
+  }
+  if (!file->active_readers) {
+    SIGNAL(&(file->cond));
+  }
+  UNLOCK(&(file->mutex));
+
+  errno = errnosav;
+  return (errno ? -1 : 0);
+}
+
 int storage_read_many(storage_t* storage, const long up_to, void** buffer, size_t* size, const int user)
 {
   if (!storage || !buffer || !size || user <= 0) {
@@ -523,25 +718,35 @@ int storage_read_many(storage_t* storage, const long up_to, void** buffer, size_
     return -1;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
+  // take a snapshot of the file sizes, since an append in progress only locks the file
+  size_t* file_sizes = NULL;
+  if (storage->file_number && (file_sizes = calloc(storage->file_number, sizeof(size_t))) == NULL) {
+    UNLOCK(&(storage->mutex));
+    return -1;
+  }
   // calculate the size of the buffer to return
   long file_count = 0;
   size_t return_size = 0;
   file_t* current_file = storage->head;
-  while (current_file && (file_count != up_to || up_to <= 0)) {
-    if (!current_file->size) {
+  for (size_t i = 0; current_file && (file_count != up_to || up_to <= 0); i++) {
+    LOCK(&(current_file->mutex));
+    file_sizes[i] = current_file->size;
+    UNLOCK(&(current_file->mutex));
+    if (!file_sizes[i]) {
       // the file is empty
       current_file = current_file->next;
       continue;
     }
-    return_size += METADATA_LENGTH + strlen(current_file->pathname) + METADATA_LENGTH + current_file->size;
+    return_size += METADATA_LENGTH + strlen(current_file->pathname) + METADATA_LENGTH + file_sizes[i];
     file_count++;
     current_file = current_file->next;
   }
   if (!file_count) {
     // there is no content to read
     UNLOCK(&(storage->mutex));
+    free_item((void**)&file_sizes);
     errno = ENODATA;
     return -1;
   }
@@ -552,32 +757,27 @@ int storage_read_many(storage_t* storage, const long up_to, void** buffer, size_
   char* return_buffer = NULL;
   if ((return_buffer = calloc(1, return_size)) == NULL) {
     UNLOCK(&(storage->mutex));
+    free_item((void**)&file_sizes);
     return -1;
   }
 
   // fill return buffer
+  // (the first bytes of the content of a file never change while the storage is locked)
   size_t new_return_size = 0;
   file_count = 0;
   current_file = storage->head;
-  while (current_file && (file_count != up_to || up_to <= 0)) {
-    if (!current_file->size) {
+  for (size_t i = 0; current_file && (file_count != up_to || up_to <= 0); i++) {
+    if (!file_sizes[i]) {
       // the file is empty
       current_file = current_file->next;
       continue;
     }
     // assemble the response
-    sprintf(return_buffer + new_return_size, "%010ld%s%010ld", strlen(current_file->pathname), current_file->pathname, current_file->size);
+    sprintf(return_buffer + new_return_size, "%010ld%s%010ld", strlen(current_file->pathname), current_file->pathname, file_sizes[i]);
     new_return_size += METADATA_LENGTH + strlen(current_file->pathname) + METADATA_LENGTH;
     // append file content
-    char* file_content = NULL;
-    if ((file_content = storage_copy(current_file, 0)) == NULL) {
-      UNLOCK(&(storage->mutex));
-      free_item((void**)&return_buffer);
-      return -1;
-    }
-    memcpy(return_buffer + new_return_size, file_content, current_file->size);
-    new_return_size += current_file->size;
-    free_item((void**)&file_content);
+    STAGE_TIMED(STAGE_COPY, memcpy(return_buffer + new_return_size, current_file->content, file_sizes[i]));
+    new_return_size += file_sizes[i];
 
     file_count++;
     current_file = current_file->next;
@@ -586,6 +786,7 @@ int storage_read_many(storage_t* storage, const long up_to, void** buffer, size_
   new_return_size += 1;
 
   UNLOCK(&(storage->mutex));
+  free_item((void**)&file_sizes);
 
   if (new_return_size != return_size) {
     // there was an error while reading
@@ -607,7 +808,7 @@ char storage_can_write(storage_t* storage, const char* pathname, const int user)
     return 0;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   // search for the file
   file_t* file;
@@ -617,8 +818,7 @@ char storage_can_write(storage_t* storage, const char* pathname, const int user)
     return 0;
   }
 
-  LOCK(&(file->ordering));
-  LOCK(&(file->mutex));
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
   UNLOCK(&(storage->mutex));
 
   char write_permission = (file->owner == user);
@@ -629,25 +829,59 @@ char storage_can_write(storage_t* storage, const char* pathname, const int user)
   return write_permission;
 }
 
-int storage_append(storage_t* storage, const char* pathname, const char* new_content, const size_t new_content_length, user_node_t** pending_locks, file_t** removed_list, const int user)
+char storage_can_append(storage_t* storage, const char* pathname, const int user)
 {
-  if (!storage || !pathname || !strlen(pathname) || !new_content || !new_content_length || !pending_locks || !removed_list || user <= 0) {
+  if (!storage || !pathname || !strlen(pathname) || user <= 0) {
     errno = EINVAL;
-    return -1;
+    return 0;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   // search for the file
   file_t* file;
   if ((file = storage_find(storage, pathname)) == NULL) {
     // file not found
     UNLOCK(&(storage->mutex));
-    return -1;
+    return 0;
   }
 
-  LOCK(&(file->ordering));
-  LOCK(&(file->mutex));
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
+  UNLOCK(&(storage->mutex));
+
+  char append_permission = (!file->locked_by || file->locked_by == user) && contains_user(file->opened_by, user);
+
+  UNLOCK(&(file->ordering));
+  UNLOCK(&(file->mutex));
+
+  return append_permission;
+}
+
+/**
+ * Reserve space for appending 'length' bytes to a file in the storage, as storage_append_reserve.
+ * If 'adopt' is set and the file is empty, its content is not reallocated and '*space' is set to NULL:
+ * the caller replaces the content with a buffer of 'length' bytes before committing
+ *
+ * Return a pointer to the reserved file on success, NULL on error (set errno)
+ */
+static file_t* append_reserve(storage_t* storage, const char* pathname, const size_t length, user_node_t** pending_locks, file_t** removed_list, const int user, const char adopt, char** space)
+{
+  if (!storage || !pathname || !strlen(pathname) || !length || !pending_locks || !removed_list || user <= 0 || !space) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
+
+  // search for the file
+  file_t* file;
+  if ((file = storage_find(storage, pathname)) == NULL) {
+    // file not found
+    UNLOCK(&(storage->mutex));
+    return NULL;
+  }
+
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
 
   if ((file->locked_by && file->locked_by != user) || !contains_user(file->opened_by, user)) {
     // user cannot access the file
@@ -655,90 +889,165 @@ int storage_append(storage_t* storage, const char* pathname, const char* new_con
     UNLOCK(&(file->mutex));
     UNLOCK(&(storage->mutex));
     errno = EACCES;
-    return -1;
+    return NULL;
   }
 
-  while (file->active_readers || file->active_writers) {
-    WAIT(&(file->cond), &(file->mutex));
-  }
+  STAGE_TIMED(STAGE_FILE_WAIT,
+    while (file->active_readers || file->active_writers) {
+      WAIT(&(file->cond), &(file->mutex));
+    }
+  );
   file->active_writers = 1;
   UNLOCK(&(file->ordering));
   UNLOCK(&(file->mutex));
 
-  char* new_file_content;
-  if ((new_file_content = storage_copy(file, new_content_length)) == NULL) {
-    LOCK(&(file->mutex));
-    file->active_writers = 0;
-    BROADCAST(&(file->cond));
-    UNLOCK(&(file->mutex));
-    UNLOCK(&(storage->mutex));
-    return -1;
+  // the copies shared with the readers no longer match the content
+  file_withdraw(storage, file);
+  if (file->memfd != -1) {
+    EXIT_ON_NEG_ONE(close(file->memfd));
+    file->memfd = -1;
   }
-  // append new content to file content buffer
-  memcpy(new_file_content + file->size, new_content, new_content_length);
-  size_t new_file_size = file->size + new_content_length;
+
+  // give back the space left over by an aborted append
+  storage->size -= file->reserved;
+  file->reserved = 0;
+
+  size_t new_file_size = file->size + length;
 
   // check if storage can store the new file content
-  if (new_file_size > storage->max_size) {
+  if (new_file_size < length || new_file_size > storage->max_size) {
     // new content cannot be stored
-    free_item((void**)&new_file_content);
-    LOCK(&(file->mutex));
-    file->active_writers = 0;
-    BROADCAST(&(file->cond));
-    UNLOCK(&(file->mutex));
-    UNLOCK(&(storage->mutex));
     errno = ENOMEM;
-    return -1;
+    goto end;
   }
-  while (storage->size - file->size + new_file_size > storage->max_size) {
+  // make room for the new content (unless the content of the empty file is going to be replaced)
+  char adopted = (adopt && !file->size);
+  char* new_file_content;
+  if (!adopted) {
+    if ((new_file_content = realloc(file->content, sizeof(char) * new_file_size)) == NULL) {
+      goto end;
+    }
+    file->content = new_file_content;
+  }
+
+  while (storage->size + length > storage->max_size) {
     // need to remove some files
     file_t* victim;
     if ((victim = get_victim(storage, file)) == NULL) {
       // could not find eligible victim
-      free_item((void**)&new_file_content);
-      LOCK(&(file->mutex));
-      file->active_writers = 0;
-      BROADCAST(&(file->cond));
-      UNLOCK(&(file->mutex));
-      UNLOCK(&(storage->mutex));
       errno = ENOMEM;
-      return -1;
+      goto end;
     }
     // remove the victim file from storage and get the list of users who were waiting to lock it
     user_node_t* tmp_list = NULL;
+    file_log(storage, WAL_REMOVE, victim->pathname, NULL, 0);
     file_destroy(storage, victim, &tmp_list, 0);
+    storage->evicted_files++;
 
     // build a list of removed files
     victim->next = *removed_list;
     *removed_list = victim;
-    
+
     // create a single list of all users to be notified of the file removal
     concatenate_lists(pending_locks, tmp_list);
   }
 
-  // update the storage size
-  storage->size = storage->size - file->size + new_file_size;
+  // account the reserved space in the storage size
+  storage->size += length;
+  file->reserved = length;
   // update max storage size reached
   if (storage->size > storage->max_size_reached) {
     storage->max_size_reached = storage->size;
   }
-  // update the written file
-  free_item((void**)&(file->content));
-  file->content = new_file_content;
-  file->size = new_file_size;
+  // the file is going to be modified
   file->modified = 1;
-  // the first write to the file can no longer be performed
-  file->owner = 0;
+  UNLOCK(&(storage->mutex));
 
+  *space = (adopted ? NULL : file->content + file->size);
+  return file;
+
+  end:
   LOCK(&(file->mutex));
   file->active_writers = 0;
   BROADCAST(&(file->cond));
   UNLOCK(&(file->mutex));
   UNLOCK(&(storage->mutex));
+  return NULL;
+}
+
+int storage_append(storage_t* storage, const char* pathname, const char* new_content, const size_t new_content_length, user_node_t** pending_locks, file_t** removed_list, const int user)
+{
+  if (!new_content) {
+    errno = EINVAL;
+    return -1;
+  }
+  file_t* file;
+  char* space;
+  if ((file = storage_append_reserve(storage, pathname, new_content_length, pending_locks, removed_list, user, &space)) == NULL) {
+    return -1;
+  }
+  memcpy(space, new_content, new_content_length);
+  storage_append_commit(storage, file, new_content_length);
+  return 0;
+}
 
+int storage_append_owned(storage_t* storage, const char* pathname, char** new_content, const size_t new_content_length, user_node_t** pending_locks, file_t** removed_list, const int user)
+{
+  if (!new_content || !*new_content) {
+    errno = EINVAL;
+    return -1;
+  }
+  file_t* file;
+  char* space;
+  if ((file = append_reserve(storage, pathname, new_content_length, pending_locks, removed_list, user, 1, &space)) == NULL) {
+    return -1;
+  }
+  if (!space) {
+    // the new content becomes the content of the empty file, instead of being copied
+    free_item((void**)&(file->content));
+    file->content = *new_content;
+    *new_content = NULL;
+  } else {
+    memcpy(space, *new_content, new_content_length);
+  }
+  storage_append_commit(storage, file, new_content_length);
   return 0;
 }
 
+file_t* storage_append_reserve(storage_t* storage, const char* pathname, const size_t length, user_node_t** pending_locks, file_t** removed_list, const int user, char** space)
+{
+  return append_reserve(storage, pathname, length, pending_locks, removed_list, user, 0, space);
+}
+
+void storage_append_commit(storage_t* storage, file_t* file, const size_t length)
+{
+  if (!storage || !file) {
+    return;
+  }
+  // logged before the file is released, so that the next change to the file is logged after this one
+  file_log(storage, WAL_APPEND, file->pathname, file->content + file->size, length);
+  LOCK(&(file->mutex));
+  file->size += length;
+  file->reserved -= length;
+  // the first write to the file can no longer be performed
+  file->owner = 0;
+  file->active_writers = 0;
+  BROADCAST(&(file->cond));
+  UNLOCK(&(file->mutex));
+}
+
+void storage_append_abort(file_t* file)
+{
+  if (!file) {
+    return;
+  }
+  // the reserved space is given back to the storage by the next append or when the file is destroyed
+  LOCK(&(file->mutex));
+  file->active_writers = 0;
+  BROADCAST(&(file->cond));
+  UNLOCK(&(file->mutex));
+}
+
 int storage_lock(storage_t* storage, const char* pathname, const int user)
 {
   if (!storage || !pathname || !strlen(pathname) || user <= 0) {
@@ -746,7 +1055,7 @@ int storage_lock(storage_t* storage, const char* pathname, const int user)
     return -1;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   // search for the file
   file_t* file;
@@ -756,13 +1065,14 @@ int storage_lock(storage_t* storage, const char* pathname, const int user)
     return -1;
   }
 
-  LOCK(&(file->ordering));
-  LOCK(&(file->mutex));
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
   UNLOCK(&(storage->mutex));
 
-  while (file->active_readers || file->active_writers) {
-    WAIT(&(file->cond), &(file->mutex));
-  }
+  STAGE_TIMED(STAGE_FILE_WAIT,
+    while (file->active_readers || file->active_writers) {
+      WAIT(&(file->cond), &(file->mutex));
+    }
+  );
 
   if (file->locked_by && file->locked_by != user) {
     // user cannot lock the file at the moment
@@ -779,6 +1089,7 @@ int storage_lock(storage_t* storage, const char* pathname, const int user)
   UNLOCK(&(file->mutex));
 
   file->locked_by = user;
+  file_withdraw(storage, file);
 
   LOCK(&(file->mutex));
   file->active_writers = 0;
@@ -798,7 +1109,7 @@ int storage_unlock(storage_t* storage, const char* pathname, int* waiter, const
     return -1;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   // search for the file
   file_t* file;
@@ -808,13 +1119,14 @@ int storage_unlock(storage_t* storage, const char* pathname, int* waiter, const
     return -1;
   }
 
-  LOCK(&(file->ordering));
-  LOCK(&(file->mutex));
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
   UNLOCK(&(storage->mutex));
 
-  while (file->active_readers || file->active_writers) {
-    WAIT(&(file->cond), &(file->mutex));
-  }
+  STAGE_TIMED(STAGE_FILE_WAIT,
+    while (file->active_readers || file->active_writers) {
+      WAIT(&(file->cond), &(file->mutex));
+    }
+  );
 
   if (file->locked_by == user) {
     // get the first user waiting to lock the file
@@ -847,7 +1159,7 @@ int storage_close(storage_t* storage, const char* pathname, const int user)
     return -1;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   // search for the file
   file_t* file;
@@ -857,37 +1169,21 @@ int storage_close(storage_t* storage, const char* pathname, const int user)
     return -1;
   }
 
-  LOCK(&(file->ordering));
-  LOCK(&(file->mutex));
-
-  while (file->active_readers || file->active_writers) {
-    WAIT(&(file->cond), &(file->mutex));
-  }
-  file->active_writers = 1;
-
+  STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(file->ordering)); LOCK(&(file->mutex)));
+  UNLOCK(&(storage->mutex));
   UNLOCK(&(file->ordering));
-  UNLOCK(&(file->mutex));
 
-  // remove the user from the list of those who have opened the file
+  // only the users who opened the file change (under the file mutex),
+  // there is no need to wait for the readers and writers of the file
   if (!dequeue_user(&(file->opened_by), user)) {
     // an error occurred or user did not open the file
-    LOCK(&(file->mutex));
-    file->active_writers = 0;
-    BROADCAST(&(file->cond));
     UNLOCK(&(file->mutex));
-    UNLOCK(&(storage->mutex));
     errno = EINVAL;
     return -1;
   }
-
-  LOCK(&(file->mutex));
-  file->active_writers = 0;
   // the first write to the file can no longer be performed
   file->owner = 0;
-
-  BROADCAST(&(file->cond));
   UNLOCK(&(file->mutex));
-  UNLOCK(&(storage->mutex));
 
   return 0;
 }
@@ -899,7 +1195,7 @@ int storage_remove(storage_t* storage, const char* pathname, user_node_t** pendi
     return -1;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
   // search for the file
   file_t* file;
   if ((file = storage_find(storage, pathname)) == NULL) {
@@ -913,6 +1209,7 @@ int storage_remove(storage_t* storage, const char* pathname, user_node_t** pendi
     errno = EACCES;
     return -1;
   }
+  file_log(storage, WAL_REMOVE, file->pathname, NULL, 0);
   file_destroy(storage, file, pending_locks, 1);
 
   UNLOCK(&(storage->mutex));
@@ -927,16 +1224,13 @@ int storage_user_exit(storage_t* storage, user_node_t** pending_locks, const int
     return -1;
   }
 
-  LOCK(&(storage->mutex));
+  STAGE_TIMED(STAGE_STORAGE_LOCK, LOCK(&(storage->mutex)));
 
   file_t* current_file = storage->head;
   while (current_file) {
-    LOCK(&(current_file->ordering));
-    LOCK(&(current_file->mutex));
-
-    while (current_file->active_readers || current_file->active_writers) {
-      WAIT(&(current_file->cond), &(current_file->mutex));
-    }
+    // the lists of the file change under its mutex, without waiting for its readers and writers
+    // (the storage is locked meanwhile)
+    STAGE_TIMED(STAGE_FILE_WAIT, LOCK(&(current_file->ordering)); LOCK(&(current_file->mutex)));
 
     if (current_file->locked_by == user) {
       // get the first user waiting to lock the file
@@ -964,3 +1258,433 @@ int storage_user_exit(storage_t* storage, user_node_t** pending_locks, const int
 
   return 0;
 }
+
+#define ALIGN_TO(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/**
+ * Write 'length' (up to SNAPSHOT_ALIGNMENT) zero bytes, to align what follows
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int write_padding(FILE* stream, const size_t length)
+{
+  static const char zeros[SNAPSHOT_ALIGNMENT];
+  if (length && fwrite(zeros, 1, length, stream) != length) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Pin the content of a file being written to a snapshot, as a reader does,
+ * if the file is still the one found when the snapshot was started
+ *
+ * Return the file on success, NULL if it has been removed since
+ */
+static file_t* save_pin(storage_t* storage, const char* pathname, const uint64_t serial)
+{
+  LOCK(&(storage->mutex));
+  file_t* file;
+  if ((file = storage_find(storage, pathname)) == NULL || file->serial != serial) {
+    UNLOCK(&(storage->mutex));
+    return NULL;
+  }
+  LOCK(&(file->ordering));
+  LOCK(&(file->mutex));
+  UNLOCK(&(storage->mutex));
+  while (file->active_writers) {
+    WAIT(&(file->cond), &(file->mutex));
+  }
+  file->active_readers++;
+  UNLOCK(&(file->ordering));
+  UNLOCK(&(file->mutex));
+  return file;
+}
+
+/**
+ * Release the content of a file pinned by save_pin
+ */
+static void save_unpin(file_t* file)
+{
+  LOCK(&(file->mutex));
+  file->active_readers--;
+  if (!file->active_readers) {
+    SIGNAL(&(file->cond));
+  }
+  UNLOCK(&(file->mutex));
+}
+
+int storage_save(storage_t* storage, const char* pathname)
+{
+  if (!storage || !pathname || !strlen(pathname)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // the snapshot replaces the previous one only once it is complete
+  char* tmp_pathname = NULL;
+  FILE* stream = NULL;
+  snapshot_entry_t* entries = NULL;
+  uint64_t* serials = NULL;
+  char* pathnames = NULL;
+  size_t tmp_length = strlen(pathname) + sizeof(".tmp");
+  if ((tmp_pathname = malloc(tmp_length)) == NULL) {
+    return -1;
+  }
+  snprintf(tmp_pathname, tmp_length, "%s.tmp", pathname);
+
+  // collect the pathnames and the sizes while no file can be created, appended to nor removed
+  LOCK(&(storage->mutex));
+  char locked = 1;
+  size_t count = storage->file_number;
+  uint64_t pathnames_size = 0;
+  for (file_t* file = storage->head; file; file = file->next) {
+    pathnames_size += strlen(file->pathname) + 1;
+  }
+  if (count && ((entries = calloc(count, sizeof(snapshot_entry_t))) == NULL || (serials = malloc(sizeof(uint64_t) * count)) == NULL
+      || (pathnames = malloc(sizeof(char) * pathnames_size)) == NULL)) {
+    goto error;
+  }
+  pathnames_size = 0;
+  size_t i = 0;
+  for (file_t* file = storage->head; file; file = file->next, i++) {
+    // wait for an append reserved before the storage was locked, its record is before the position
+    LOCK(&(file->mutex));
+    while (file->active_writers) {
+      WAIT(&(file->cond), &(file->mutex));
+    }
+    UNLOCK(&(file->mutex));
+    size_t pathname_length = strlen(file->pathname);
+    memcpy(pathnames + pathnames_size, file->pathname, pathname_length + 1);
+    entries[i] = (snapshot_entry_t){
+      .size = file->size,
+      .pathname_offset = pathnames_size,
+      .pathname_length = pathname_length,
+      .flags = (file->modified ? SNAPSHOT_MODIFIED : 0)
+    };
+    serials[i] = file->serial;
+    pathnames_size += pathname_length + 1;
+  }
+  snapshot_header_t header = {
+    .magic = SNAPSHOT_MAGIC,
+    .version = SNAPSHOT_VERSION,
+    .byte_order = SNAPSHOT_BYTE_ORDER,
+    .header_size = sizeof(snapshot_header_t),
+    .entry_size = sizeof(snapshot_entry_t),
+    .alignment = SNAPSHOT_ALIGNMENT
+  };
+  // the changes logged so far are in the snapshot, the ones logged after it are not
+  header.log_position = (storage->wal ? wal_position(storage->wal) : 0);
+  UNLOCK(&(storage->mutex));
+  locked = 0;
+
+  if ((stream = fopen(tmp_pathname, "w")) == NULL) {
+    goto error;
+  }
+  // the header is written again at the end, once the offsets are known
+  if (fwrite(&header, sizeof(header), 1, stream) != 1) {
+    goto error;
+  }
+
+  // write the contents, each one pinned only while it is written
+  // (a file removed since is left out, its removal is logged after the position)
+  uint64_t offset = sizeof(header);
+  size_t saved = 0;
+  for (i = 0; i < count; i++) {
+    file_t* file;
+    if ((file = save_pin(storage, pathnames + entries[i].pathname_offset, serials[i])) == NULL) {
+      continue;
+    }
+    uint64_t content_offset = ALIGN_TO(offset, SNAPSHOT_ALIGNMENT);
+    int result = 0;
+    if (write_padding(stream, content_offset - offset) == -1 || (entries[i].size && fwrite(file->content, 1, entries[i].size, stream) != entries[i].size)) {
+      result = -1;
+    }
+    save_unpin(file);
+    if (result == -1) {
+      goto error;
+    }
+    entries[saved] = entries[i];
+    entries[saved].content_offset = content_offset;
+    offset = content_offset + entries[i].size;
+    header.content_size += entries[i].size;
+    saved++;
+  }
+  // write the pathnames (the ones of the files left out are just not referenced)
+  header.pathnames_offset = offset;
+  if (pathnames_size && fwrite(pathnames, 1, pathnames_size, stream) != pathnames_size) {
+    goto error;
+  }
+
+  // write the index and the header
+  offset += pathnames_size;
+  header.index_offset = ALIGN_TO(offset, sizeof(uint64_t));
+  header.file_count = saved;
+  header.snapshot_size = header.index_offset + saved * sizeof(snapshot_entry_t);
+  header.created = time(NULL);
+  if (write_padding(stream, header.index_offset - offset) == -1 || (saved && fwrite(entries, sizeof(snapshot_entry_t), saved, stream) != saved)) {
+    goto error;
+  }
+  if (fseek(stream, 0, SEEK_SET) == -1 || fwrite(&header, sizeof(header), 1, stream) != 1 || fflush(stream) == EOF || fsync(fileno(stream)) == -1) {
+    goto error;
+  }
+  int result = fclose(stream);
+  stream = NULL;
+  if (result == EOF || rename(tmp_pathname, pathname) == -1) {
+    goto error;
+  }
+  // the records before the snapshot are no longer needed
+  if (storage->wal && wal_checkpoint(storage->wal, header.log_position) == -1) {
+    goto error;
+  }
+  free_item((void**)&entries);
+  free_item((void**)&serials);
+  free_item((void**)&pathnames);
+  free_item((void**)&tmp_pathname);
+  return 0;
+
+  error:
+  ;
+  int errnosav = errno;
+  if (locked) {
+    UNLOCK(&(storage->mutex));
+  }
+  if (stream) {
+    fclose(stream);
+  }
+  unlink(tmp_pathname);
+  free_item((void**)&entries);
+  free_item((void**)&serials);
+  free_item((void**)&pathnames);
+  free_item((void**)&tmp_pathname);
+  errno = errnosav;
+  return -1;
+}
+
+/**
+ * Check that a snapshot of 'size' bytes is well-formed, so that it can be read without further checks
+ *
+ * Return 0 if it is, -1 otherwise
+ */
+static int check_snapshot(const char* snapshot, const size_t size)
+{
+  const snapshot_header_t* header = (const snapshot_header_t*)snapshot;
+  if (size < sizeof(snapshot_header_t) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+      || header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER
+      || header->header_size != sizeof(snapshot_header_t) || header->entry_size != sizeof(snapshot_entry_t)
+      || header->snapshot_size != size) {
+    return -1;
+  }
+  if (header->pathnames_offset > header->index_offset || header->index_offset > size || header->index_offset % sizeof(uint64_t)
+      || header->file_count > (size - header->index_offset) / sizeof(snapshot_entry_t)) {
+    return -1;
+  }
+  const snapshot_entry_t* entries = (const snapshot_entry_t*)(snapshot + header->index_offset);
+  const char* pathnames = snapshot + header->pathnames_offset;
+  const uint64_t pathnames_size = header->index_offset - header->pathnames_offset;
+  for (uint64_t i = 0; i < header->file_count; i++) {
+    const snapshot_entry_t* entry = &(entries[i]);
+    if (entry->content_offset > header->pathnames_offset || entry->size > header->pathnames_offset - entry->content_offset
+        || entry->pathname_offset >= pathnames_size || entry->pathname_length >= pathnames_size - entry->pathname_offset
+        || !entry->pathname_length || strnlen(pathnames + entry->pathname_offset, entry->pathname_length + 1) != entry->pathname_length) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  const char* snapshot;
+  const snapshot_entry_t* entries;
+  // files loaded, indexed like their entries (NULL if left out)
+  file_t** files;
+  size_t count;
+  // next file to be copied
+  size_t next;
+} load_args_t;
+
+/**
+ * Copy the contents of the files loaded from a snapshot, until every file has been copied
+ */
+static void* load_contents(void* args)
+{
+  load_args_t* load = args;
+  size_t i;
+  while ((i = __atomic_fetch_add(&(load->next), 1, __ATOMIC_RELAXED)) < load->count) {
+    if (load->files[i] && load->files[i]->size) {
+      // the pages of the snapshot are read as they are touched
+      memcpy(load->files[i]->content, load->snapshot + load->entries[i].content_offset, load->files[i]->size);
+    }
+  }
+  return NULL;
+}
+
+int storage_load(storage_t* storage, const char* pathname, const size_t threads, size_t* left_out, uint64_t* log_position)
+{
+  if (!storage || !pathname || !strlen(pathname) || !threads || !left_out || !log_position) {
+    errno = EINVAL;
+    return -1;
+  }
+  int fd;
+  if ((fd = open(pathname, O_RDONLY | O_CLOEXEC)) == -1) {
+    return -1;
+  }
+  char* snapshot = MAP_FAILED;
+  file_t** files = NULL;
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    goto error;
+  }
+  if ((size_t)info.st_size < sizeof(snapshot_header_t)) {
+    errno = EINVAL;
+    goto error;
+  }
+  if ((snapshot = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    goto error;
+  }
+  // start reading ahead, the copies may not touch the pages in order
+  madvise(snapshot, info.st_size, MADV_WILLNEED);
+  if (check_snapshot(snapshot, info.st_size) == -1) {
+    errno = EINVAL;
+    goto error;
+  }
+  const snapshot_header_t* header = (const snapshot_header_t*)snapshot;
+  load_args_t load = {.snapshot = snapshot, .entries = (const snapshot_entry_t*)(snapshot + header->index_offset), .count = header->file_count};
+  if (load.count && (files = calloc(load.count, sizeof(file_t*))) == NULL) {
+    goto error;
+  }
+  load.files = files;
+
+  // create the files in the order they had, then copy their contents in parallel
+  LOCK(&(storage->mutex));
+  if (storage->file_number) {
+    UNLOCK(&(storage->mutex));
+    errno = EEXIST;
+    goto error;
+  }
+  int errnosav = 0;
+  *left_out = 0;
+  *log_position = header->log_position;
+  for (size_t i = 0; i < load.count; i++) {
+    const snapshot_entry_t* entry = &(load.entries[i]);
+    const char* file_pathname = snapshot + header->pathnames_offset + entry->pathname_offset;
+    if (storage->file_number == storage->max_file_number || entry->size > storage->max_size - storage->size || storage_find(storage, file_pathname)) {
+      // the file does not fit in the storage as it is configured now
+      (*left_out)++;
+      continue;
+    }
+    file_t* file;
+    if ((file = file_create(file_pathname)) == NULL || (entry->size && (file->content = malloc(entry->size)) == NULL)) {
+      errnosav = errno;
+      if (file) {
+        file_dealloc(file);
+      }
+      break;
+    }
+    file->size = entry->size;
+    file->modified = ((entry->flags & SNAPSHOT_MODIFIED) != 0);
+    storage_add(storage, file);
+    files[i] = file;
+  }
+  UNLOCK(&(storage->mutex));
+
+  // the files cannot be accessed yet: the server is not serving requests
+  size_t started = 0;
+  pthread_t* workers = NULL;
+  if (threads > 1 && load.count > 1 && (workers = calloc(threads - 1, sizeof(pthread_t))) != NULL) {
+    for (; started < threads - 1 && started < load.count - 1; started++) {
+      if (pthread_create(&(workers[started]), NULL, load_contents, &load) != 0) {
+        break;
+      }
+    }
+  }
+  load_contents(&load);
+  for (size_t i = 0; i < started; i++) {
+    EXIT_ON_NZ(pthread_join(workers[i], NULL));
+  }
+  free_item((void**)&workers);
+
+  free_item((void**)&files);
+  EXIT_ON_NEG_ONE(munmap(snapshot, info.st_size));
+  EXIT_ON_NEG_ONE(close(fd));
+  errno = errnosav;
+  return (errno ? -1 : 0);
+
+  error:
+  errnosav = errno;
+  free_item((void**)&files);
+  if (snapshot != MAP_FAILED) {
+    EXIT_ON_NEG_ONE(munmap(snapshot, info.st_size));
+  }
+  EXIT_ON_NEG_ONE(close(fd));
+  errno = errnosav;
+  return -1;
+}
+
+/**
+ * Apply a record of the log to the storage, as the change was made
+ * (the files that do not fit in the storage are left out, like the ones of the snapshot)
+ */
+static void apply_record(void* arg, const uint32_t type, const char* pathname, const char* data, const size_t size)
+{
+  storage_t* storage = arg;
+  file_t* file = storage_find(storage, pathname);
+  switch (type) {
+    case WAL_CREATE:
+      if (file) {
+        break;
+      }
+      if (storage->file_number == storage->max_file_number) {
+        file_t* victim;
+        if ((victim = get_victim(storage, NULL)) == NULL) {
+          break;
+        }
+        file_destroy(storage, victim, NULL, 1);
+        storage->evicted_files++;
+      }
+      EXIT_ON_NULL(file = file_create(pathname));
+      storage_add(storage, file);
+      break;
+
+    case WAL_APPEND:
+      if (!file || file->size + size < size || file->size + size > storage->max_size) {
+        break;
+      }
+      while (storage->size + size > storage->max_size) {
+        file_t* victim;
+        if ((victim = get_victim(storage, file)) == NULL) {
+          return;
+        }
+        file_destroy(storage, victim, NULL, 1);
+        storage->evicted_files++;
+      }
+      EXIT_ON_NULL(file->content = realloc(file->content, file->size + size));
+      memcpy(file->content + file->size, data, size);
+      file->size += size;
+      file->modified = 1;
+      storage->size += size;
+      if (storage->size > storage->max_size_reached) {
+        storage->max_size_reached = storage->size;
+      }
+      break;
+
+    case WAL_REMOVE:
+      if (file) {
+        file_destroy(storage, file, NULL, 1);
+      }
+      break;
+  }
+}
+
+int storage_recover(storage_t* storage, const char* pathname, const uint64_t log_position, size_t* records)
+{
+  if (!storage || !pathname || !strlen(pathname) || !records || storage->wal) {
+    errno = EINVAL;
+    return -1;
+  }
+  LOCK(&(storage->mutex));
+  int result = wal_replay(pathname, log_position, apply_record, storage, records);
+  int errnosav = errno;
+  UNLOCK(&(storage->mutex));
+  errno = errnosav;
+  return result;
+}
@@ -0,0 +1,134 @@
+#include <posixver.h>
+
+#include <trace.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <concurrency.h>
+#include <error_handling.h>
+#include <free_item.h>
+#include <readnwrite.h>
+
+trace_t* trace_open(const char* pathname)
+{
+  if (!pathname) {
+    errno = EINVAL;
+    return NULL;
+  }
+  trace_t* trace;
+  if ((trace = calloc(1, sizeof(trace_t))) == NULL) {
+    return NULL;
+  }
+  if ((trace->buffer = malloc(sizeof(trace_record_t) * TRACE_BUFFER_RECORDS)) == NULL) {
+    goto end;
+  }
+  if ((trace->fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+    goto end;
+  }
+  trace_header_t header;
+  memset(&header, 0, sizeof(trace_header_t));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(trace_record_t);
+  if (writen(trace->fd, &header, sizeof(trace_header_t)) == -1) {
+    int errnosav = errno;
+    close(trace->fd);
+    errno = errnosav;
+    goto end;
+  }
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &(trace->start)));
+  EXIT_ON_NZ(pthread_mutex_init(&(trace->mutex), NULL));
+  return trace;
+
+  end:
+  free_item((void**)&(trace->buffer));
+  free_item((void**)&trace);
+  return NULL;
+}
+
+/**
+ * Write the buffered records to the file
+ * (assume that the trace is locked)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int trace_flush(trace_t* trace)
+{
+  int result = 0;
+  if (trace->count && writen(trace->fd, trace->buffer, sizeof(trace_record_t) * trace->count) == -1) {
+    // the records are dropped anyway, so that the buffer has room for the next ones
+    trace->disabled = 1;
+    result = -1;
+  }
+  trace->count = 0;
+  return result;
+}
+
+int trace_close(trace_t* trace)
+{
+  if (!trace) {
+    errno = EINVAL;
+    return -1;
+  }
+  int result = trace_flush(trace);
+  int errnosav = errno;
+  if (close(trace->fd) == -1 && result == 0) {
+    errnosav = errno;
+    result = -1;
+  }
+  EXIT_ON_NZ(pthread_mutex_destroy(&(trace->mutex)));
+  free_item((void**)&(trace->buffer));
+  free_item((void**)&trace);
+  errno = errnosav;
+  return result;
+}
+
+uint64_t trace_timestamp(const trace_t* trace, const struct timespec* t)
+{
+  return (uint64_t)(t->tv_sec - trace->start.tv_sec) * 1000000000 + t->tv_nsec - trace->start.tv_nsec;
+}
+
+uint64_t trace_hash(const char* pathname)
+{
+  // 64-bit FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char* c = (const unsigned char*)pathname; *c; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+int trace_record(trace_t* trace, const trace_record_t* record)
+{
+  if (!trace || !record) {
+    errno = EINVAL;
+    return -1;
+  }
+  LOCK(&(trace->mutex));
+  if (trace->disabled) {
+    UNLOCK(&(trace->mutex));
+    return 0;
+  }
+  trace->buffer[trace->count++] = *record;
+  trace->total++;
+  int result = 0;
+  if (trace->count == TRACE_BUFFER_RECORDS) {
+    result = trace_flush(trace);
+  }
+  UNLOCK(&(trace->mutex));
+  return result;
+}
+
+int trace_check_header(const trace_header_t* header)
+{
+  if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != TRACE_VERSION || header->record_size != sizeof(trace_record_t)) {
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,552 @@
+#include <posixver.h>
+
+#include <wal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <error_handling.h>
+#include <concurrency.h>
+#include <free_item.h>
+#include <readnwrite.h>
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+// bytes copied at a time by a checkpoint
+#define COPY_CHUNK 65536
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fill the table of the CRC-32 (reflected polynomial 0xEDB88320)
+ */
+static void crc_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320U : 0);
+    }
+    crc_table[i] = crc;
+  }
+}
+
+/**
+ * Continue the CRC-32 'crc' over 'length' bytes (start from 0)
+ */
+static uint32_t crc32(uint32_t crc, const void* data, const size_t length)
+{
+  const unsigned char* bytes = data;
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc = crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/**
+ * Compute the checksum of a record, whose pathname and data may not follow its header
+ */
+static uint32_t record_crc(const wal_record_t* record, const char* pathname, const char* data)
+{
+  uint32_t crc = crc32(0, (const char*)record + sizeof(record->crc), sizeof(wal_record_t) - sizeof(record->crc));
+  crc = crc32(crc, pathname, record->pathname_length + 1);
+  return crc32(crc, data, record->size);
+}
+
+/**
+ * Write the header of a log file starting at 'base'
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int write_header(const int fd, const uint64_t base)
+{
+  wal_header_t header = {
+    .magic = WAL_MAGIC,
+    .version = WAL_VERSION,
+    .byte_order = WAL_BYTE_ORDER,
+    .base = base
+  };
+  if (writen(fd, &header, sizeof(header)) != 1) {
+    if (!errno) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Check the header of a log file
+ *
+ * Return 0 if it is valid, -1 otherwise
+ */
+static int check_header(const wal_header_t* header)
+{
+  if (memcmp(header->magic, WAL_MAGIC, sizeof(WAL_MAGIC)) != 0 || header->version != WAL_VERSION || header->byte_order != WAL_BYTE_ORDER) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Write the records appended to the log file in batches, syncing each batch, until the log is destroyed
+ */
+static void* writer(void* arg)
+{
+  wal_t* wal = arg;
+  LOCK(&(wal->mutex));
+  while (1) {
+    while ((!wal->length && !wal->stop) || wal->checkpointing) {
+      WAIT(&(wal->appended_cond), &(wal->mutex));
+    }
+    if (!wal->length) {
+      break;
+    }
+    // take every record appended so far, the next ones go to the spare buffer
+    char* batch = wal->buffer;
+    size_t length = wal->length;
+    size_t capacity = wal->capacity;
+    uint64_t end = wal->appended;
+    size_t records = 0;
+    int fd = wal->fd;
+    wal->buffer = wal->spare;
+    wal->capacity = wal->spare_capacity;
+    wal->length = 0;
+    wal->writing = 1;
+    UNLOCK(&(wal->mutex));
+
+    int error = 0;
+    ssize_t result;
+    if ((result = writen(fd, batch, length)) != 1) {
+      error = (result ? errno : EIO);
+    } else if (fdatasync(fd) == -1) {
+      error = errno;
+    }
+    for (size_t offset = 0; offset < length; records++) {
+      const wal_record_t* record = (const wal_record_t*)(batch + offset);
+      offset += ALIGN8(sizeof(wal_record_t) + record->pathname_length + 1 + record->size);
+    }
+
+    LOCK(&(wal->mutex));
+    wal->spare = batch;
+    wal->spare_capacity = capacity;
+    wal->writing = 0;
+    if (error) {
+      if (!wal->error) {
+        wal->error = error;
+      }
+    } else if (!wal->error) {
+      wal->synced = end;
+      wal->records += records;
+      wal->batches++;
+    }
+    BROADCAST(&(wal->synced_cond));
+  }
+  UNLOCK(&(wal->mutex));
+  return NULL;
+}
+
+int wal_replay(const char* pathname, const uint64_t position, wal_apply_t apply, void* arg, size_t* count)
+{
+  if (!pathname || !strlen(pathname) || !apply || !count) {
+    errno = EINVAL;
+    return -1;
+  }
+  EXIT_ON_NZ(pthread_once(&crc_once, crc_init));
+  *count = 0;
+  int fd;
+  if ((fd = open(pathname, O_RDWR | O_CLOEXEC)) == -1) {
+    return -1;
+  }
+  char* log = MAP_FAILED;
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    goto error;
+  }
+  const size_t size = info.st_size;
+  if (size < sizeof(wal_header_t)) {
+    // the header itself was torn, the log is empty
+    if (ftruncate(fd, 0) == -1) {
+      goto error;
+    }
+    EXIT_ON_NEG_ONE(close(fd));
+    return 0;
+  }
+  if ((log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    goto error;
+  }
+  madvise(log, size, MADV_SEQUENTIAL);
+  const wal_header_t* header = (const wal_header_t*)log;
+  if (check_header(header) == -1 || header->base > position) {
+    // records between the snapshot and the log would be missing
+    errno = EINVAL;
+    goto error;
+  }
+
+  size_t offset = sizeof(wal_header_t);
+  while (size - offset >= sizeof(wal_record_t)) {
+    const wal_record_t* record = (const wal_record_t*)(log + offset);
+    const char* record_pathname = log + offset + sizeof(wal_record_t);
+    const size_t room = size - offset - sizeof(wal_record_t);
+    if (record->type < WAL_CREATE || record->type > WAL_REMOVE || !record->pathname_length
+        || record->pathname_length >= room || record->size > room - record->pathname_length - 1
+        || record_pathname[record->pathname_length] != '\0'
+        || record_crc(record, record_pathname, record_pathname + record->pathname_length + 1) != record->crc) {
+      break;
+    }
+    if (header->base + (offset - sizeof(wal_header_t)) >= position) {
+      apply(arg, record->type, record_pathname, record_pathname + record->pathname_length + 1, record->size);
+      (*count)++;
+    }
+    offset += ALIGN8(sizeof(wal_record_t) + record->pathname_length + 1 + record->size);
+    if (offset > size) {
+      // the padding of the last record was torn
+      offset = size;
+    }
+  }
+  EXIT_ON_NEG_ONE(munmap(log, size));
+  log = MAP_FAILED;
+  if (offset < size && ftruncate(fd, offset) == -1) {
+    goto error;
+  }
+  EXIT_ON_NEG_ONE(close(fd));
+  return 0;
+
+  error:
+  ;
+  int errnosav = errno;
+  if (log != MAP_FAILED) {
+    EXIT_ON_NEG_ONE(munmap(log, size));
+  }
+  EXIT_ON_NEG_ONE(close(fd));
+  errno = errnosav;
+  return -1;
+}
+
+wal_t* wal_create(const char* pathname, const uint64_t position)
+{
+  if (!pathname || !strlen(pathname)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  EXIT_ON_NZ(pthread_once(&crc_once, crc_init));
+  wal_t* wal;
+  if ((wal = calloc(1, sizeof(wal_t))) == NULL) {
+    return NULL;
+  }
+  wal->fd = -1;
+  if ((wal->pathname = malloc(strlen(pathname) + 1)) == NULL) {
+    goto error;
+  }
+  strcpy(wal->pathname, pathname);
+  // the records are always written at the end of the file
+  if ((wal->fd = open(pathname, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+    goto error;
+  }
+  struct stat info;
+  if (fstat(wal->fd, &info) == -1) {
+    goto error;
+  }
+  wal_header_t header;
+  if ((size_t)info.st_size >= sizeof(header)) {
+    if (readn(wal->fd, &header, sizeof(header)) != (ssize_t)sizeof(header) || check_header(&header) == -1 || header.base > position) {
+      errno = EINVAL;
+      goto error;
+    }
+    wal->base = header.base;
+    wal->appended = header.base + (info.st_size - sizeof(header));
+  }
+  if ((size_t)info.st_size < sizeof(header) || wal->appended < position) {
+    // start a new log: the records of the old one (if any) are all in the snapshot
+    if (ftruncate(wal->fd, 0) == -1 || write_header(wal->fd, position) == -1 || fdatasync(wal->fd) == -1) {
+      goto error;
+    }
+    wal->base = position;
+    wal->appended = position;
+  }
+  wal->synced = wal->appended;
+  EXIT_ON_NZ(pthread_mutex_init(&(wal->mutex), NULL));
+  EXIT_ON_NZ(pthread_cond_init(&(wal->appended_cond), NULL));
+  EXIT_ON_NZ(pthread_cond_init(&(wal->synced_cond), NULL));
+  if ((errno = pthread_create(&(wal->writer), NULL, writer, wal)) != 0) {
+    EXIT_ON_NZ(pthread_mutex_destroy(&(wal->mutex)));
+    EXIT_ON_NZ(pthread_cond_destroy(&(wal->appended_cond)));
+    EXIT_ON_NZ(pthread_cond_destroy(&(wal->synced_cond)));
+    goto error;
+  }
+  return wal;
+
+  error:
+  ;
+  int errnosav = errno;
+  if (wal->fd != -1) {
+    EXIT_ON_NEG_ONE(close(wal->fd));
+  }
+  free_item((void**)&(wal->pathname));
+  free_item((void**)&wal);
+  errno = errnosav;
+  return NULL;
+}
+
+int wal_destroy(wal_t* wal)
+{
+  if (!wal) {
+    errno = EINVAL;
+    return -1;
+  }
+  // the writer syncs the records left before it exits
+  LOCK(&(wal->mutex));
+  wal->stop = 1;
+  SIGNAL(&(wal->appended_cond));
+  UNLOCK(&(wal->mutex));
+  EXIT_ON_NZ(pthread_join(wal->writer, NULL));
+  int error = wal->error;
+
+  EXIT_ON_NZ(pthread_mutex_destroy(&(wal->mutex)));
+  EXIT_ON_NZ(pthread_cond_destroy(&(wal->appended_cond)));
+  EXIT_ON_NZ(pthread_cond_destroy(&(wal->synced_cond)));
+  EXIT_ON_NEG_ONE(close(wal->fd));
+  free_item((void**)&(wal->buffer));
+  free_item((void**)&(wal->spare));
+  free_item((void**)&(wal->pathname));
+  free_item((void**)&wal);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+void wal_append(wal_t* wal, const uint32_t type, const char* pathname, const char* data, const size_t size)
+{
+  wal_record_t record = {
+    .type = type,
+    .pathname_length = strlen(pathname),
+    .size = size
+  };
+  // the checksum is computed before taking the mutex
+  record.crc = record_crc(&record, pathname, data);
+  const size_t length = ALIGN8(sizeof(record) + record.pathname_length + 1 + size);
+
+  LOCK(&(wal->mutex));
+  if (wal->error) {
+    UNLOCK(&(wal->mutex));
+    return;
+  }
+  if (wal->length + length > wal->capacity) {
+    size_t capacity = (wal->capacity ? wal->capacity : COPY_CHUNK);
+    while (capacity < wal->length + length) {
+      capacity *= 2;
+    }
+    char* buffer;
+    if ((buffer = realloc(wal->buffer, capacity)) == NULL) {
+      // the change cannot be made durable, nor the ones after it
+      wal->error = ENOMEM;
+      BROADCAST(&(wal->synced_cond));
+      UNLOCK(&(wal->mutex));
+      return;
+    }
+    wal->buffer = buffer;
+    wal->capacity = capacity;
+  }
+  char* dest = wal->buffer + wal->length;
+  memcpy(dest, &record, sizeof(record));
+  memcpy(dest + sizeof(record), pathname, record.pathname_length + 1);
+  if (size) {
+    memcpy(dest + sizeof(record) + record.pathname_length + 1, data, size);
+  }
+  size_t padding = length - (sizeof(record) + record.pathname_length + 1 + size);
+  memset(dest + length - padding, 0, padding);
+  wal->length += length;
+  wal->appended += length;
+  SIGNAL(&(wal->appended_cond));
+  UNLOCK(&(wal->mutex));
+}
+
+int wal_sync(wal_t* wal)
+{
+  if (!wal) {
+    errno = EINVAL;
+    return -1;
+  }
+  LOCK(&(wal->mutex));
+  const uint64_t position = wal->appended;
+  while (wal->synced < position && !wal->error) {
+    WAIT(&(wal->synced_cond), &(wal->mutex));
+  }
+  int error = wal->error;
+  UNLOCK(&(wal->mutex));
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+uint64_t wal_position(wal_t* wal)
+{
+  LOCK(&(wal->mutex));
+  uint64_t position = wal->appended;
+  UNLOCK(&(wal->mutex));
+  return position;
+}
+
+uint64_t wal_size(wal_t* wal)
+{
+  LOCK(&(wal->mutex));
+  uint64_t size = wal->appended - wal->base;
+  UNLOCK(&(wal->mutex));
+  return size;
+}
+
+/**
+ * Copy the bytes of the log file 'from' between 'offset' and 'end' to the end of the file 'to'
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int copy_records(const int from, const int to, off_t offset, const off_t end, char* chunk)
+{
+  while (offset < end) {
+    size_t length = (end - offset < COPY_CHUNK ? (size_t)(end - offset) : COPY_CHUNK);
+    ssize_t read_bytes;
+    if ((read_bytes = pread(from, chunk, length, offset)) <= 0) {
+      if (!read_bytes) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    if (writen(to, chunk, read_bytes) != 1) {
+      if (!errno) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    offset += read_bytes;
+  }
+  return 0;
+}
+
+int wal_checkpoint(wal_t* wal, const uint64_t position)
+{
+  if (!wal) {
+    errno = EINVAL;
+    return -1;
+  }
+  LOCK(&(wal->mutex));
+  // wait until the records before 'position' are in the file and the writer is not writing it
+  while ((wal->synced < position || wal->writing) && !wal->error) {
+    WAIT(&(wal->synced_cond), &(wal->mutex));
+  }
+  if (wal->error) {
+    errno = wal->error;
+    UNLOCK(&(wal->mutex));
+    return -1;
+  }
+  if (position <= wal->base) {
+    UNLOCK(&(wal->mutex));
+    return 0;
+  }
+  // only a checkpoint replaces the file, so it does not change until this one is done
+  const int old_fd = wal->fd;
+  const uint64_t base = wal->base;
+  uint64_t copied = wal->synced;
+  UNLOCK(&(wal->mutex));
+  char locked = 0;
+
+  // copy the records synced after 'position' to a new file, while the writer appends the next ones to the old file
+  // (if the new file does not replace the old one, the old records are skipped by the next replay anyway)
+  char* tmp_pathname = NULL;
+  char* chunk = NULL;
+  int fd = -1;
+  size_t tmp_length = strlen(wal->pathname) + sizeof(".tmp");
+  if ((tmp_pathname = malloc(tmp_length)) == NULL || (chunk = malloc(COPY_CHUNK)) == NULL) {
+    goto error;
+  }
+  snprintf(tmp_pathname, tmp_length, "%s.tmp", wal->pathname);
+  if ((fd = open(tmp_pathname, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1 || write_header(fd, position) == -1) {
+    goto error;
+  }
+  if (copy_records(old_fd, fd, sizeof(wal_header_t) + (position - base), sizeof(wal_header_t) + (copied - base), chunk) == -1) {
+    goto error;
+  }
+
+  // stop the writer, then copy the records synced meanwhile
+  // (the appends go on, and are synced to the new file)
+  LOCK(&(wal->mutex));
+  locked = 1;
+  wal->checkpointing = 1;
+  while (wal->writing) {
+    WAIT(&(wal->synced_cond), &(wal->mutex));
+  }
+  if (wal->error) {
+    errno = wal->error;
+    goto error;
+  }
+  const uint64_t synced = wal->synced;
+  UNLOCK(&(wal->mutex));
+  locked = 0;
+  if (copy_records(old_fd, fd, sizeof(wal_header_t) + (copied - base), sizeof(wal_header_t) + (synced - base), chunk) == -1) {
+    goto error;
+  }
+  if (fdatasync(fd) == -1 || rename(tmp_pathname, wal->pathname) == -1) {
+    goto error;
+  }
+  LOCK(&(wal->mutex));
+  wal->fd = fd;
+  wal->base = position;
+  wal->checkpointing = 0;
+  SIGNAL(&(wal->appended_cond));
+  UNLOCK(&(wal->mutex));
+  EXIT_ON_NEG_ONE(close(old_fd));
+  free_item((void**)&chunk);
+  free_item((void**)&tmp_pathname);
+  return 0;
+
+  error:
+  ;
+  int errnosav = errno;
+  if (!locked) {
+    LOCK(&(wal->mutex));
+  }
+  if (wal->checkpointing) {
+    // the writer goes on with the old file
+    wal->checkpointing = 0;
+    SIGNAL(&(wal->appended_cond));
+  }
+  UNLOCK(&(wal->mutex));
+  if (fd != -1) {
+    EXIT_ON_NEG_ONE(close(fd));
+    unlink(tmp_pathname);
+  }
+  free_item((void**)&chunk);
+  free_item((void**)&tmp_pathname);
+  errno = errnosav;
+  return -1;
+}
+
+void wal_print_summary(wal_t* wal)
+{
+  if (!wal) {
+    return;
+  }
+  LOCK(&(wal->mutex));
+  printf("\n- Write-ahead log summary -\n");
+  printf("The log:\n");
+  printf(" - synced %" PRIu64 " record(s) in %" PRIu64 " batch(es)", wal->records, wal->batches);
+  if (wal->batches) {
+    printf(", %.2f record(s) per sync", (double)wal->records / wal->batches);
+  }
+  printf("\n - holds %f Megabyte(s) of records after the last checkpoint\n", (float)(wal->appended - wal->base) / 1048576);
+  if (wal->error) {
+    printf(" - stopped syncing the records: %s\n", strerror(wal->error));
+  }
+  UNLOCK(&(wal->mutex));
+}
@@ -0,0 +1,439 @@
+#include <posixver.h>
+
+#include <worker_pool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <concurrency.h>
+#include <error_handling.h>
+#include <free_item.h>
+
+/**
+ * Return the milliseconds elapsed from 'start' to 'end'
+ */
+static double elapsed_msec(const struct timespec* start, const struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/**
+ * Join the workers that exited
+ * (assume that the pool is locked)
+ */
+static void join_exited(worker_pool_t* pool)
+{
+  while (pool->exited_count) {
+    EXIT_ON_NZ(pthread_join(pool->exited[--(pool->exited_count)], NULL));
+  }
+}
+
+/**
+ * Start a new worker
+ * (assume that the pool is locked)
+ *
+ * Return 0 on success, -1 on error (set errno)
+ */
+static int spawn_worker(worker_pool_t* pool)
+{
+  join_exited(pool);
+  pthread_t tid;
+  int error;
+  if ((error = pthread_create(&tid, NULL, pool->routine, (void*)pool)) != 0) {
+    errno = error;
+    return -1;
+  }
+  pool->size++;
+  pool->created++;
+  if (pool->size > pool->peak_size) {
+    pool->peak_size = pool->size;
+  }
+  return 0;
+}
+
+/**
+ * Return the latency histogram bucket of 'msec' milliseconds
+ */
+static size_t latency_bucket(const double msec)
+{
+  unsigned long long usec = (unsigned long long)(msec * 1000);
+  if (usec < 4) {
+    return (size_t)usec;
+  }
+  // 4 buckets for each power of two
+  int bit = 63 - __builtin_clzll(usec);
+  size_t bucket = 4 * (bit - 1) + ((usec >> (bit - 2)) & 3);
+  return (bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Return the upper bound in milliseconds of the latencies in a histogram bucket
+ */
+static double bucket_upper_bound(const size_t bucket)
+{
+  if (bucket < 4) {
+    return (bucket + 1) / 1000.0;
+  }
+  int bit = bucket / 4 + 1;
+  return (double)((5ULL + bucket % 4) << (bit - 2)) / 1000.0;
+}
+
+/**
+ * Return an upper bound in milliseconds of the given percentile of the latencies in a histogram
+ */
+static double percentile(const size_t histogram[LATENCY_BUCKETS], const size_t count, const double fraction)
+{
+  size_t rank = (size_t)(count * fraction);
+  if (rank < count * fraction || !rank) {
+    rank++;
+  }
+  size_t seen = 0;
+  for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += histogram[i];
+    if (seen >= rank) {
+      return bucket_upper_bound(i);
+    }
+  }
+  return bucket_upper_bound(LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Return the lane the next client is taken from: among the lanes with queued clients and free workers,
+ * the one that has received less service for its share (-1 if there is none)
+ * (assume that the pool is locked)
+ */
+static int next_lane(worker_pool_t* pool)
+{
+  int next = -1;
+  for (int i = 0; i < LANES; i++) {
+    lane_t* lane = &(pool->lanes[i]);
+    if (lane->queued && lane->busy < lane->cap && (next == -1 || lane->served < pool->lanes[next].served)) {
+      next = i;
+    }
+  }
+  return next;
+}
+
+/**
+ * Start a new worker if no worker is idle and a client that could be served has waited for too long
+ * (assume that the pool is locked)
+ */
+static void grow_if_late(worker_pool_t* pool)
+{
+  if (!pool->queued || pool->idle || pool->size >= pool->max_size || pool->terminating) {
+    return;
+  }
+  struct timespec now;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &now));
+  for (int i = 0; i < LANES; i++) {
+    lane_t* lane = &(pool->lanes[i]);
+    if (lane->busy >= lane->cap) {
+      // more workers would not serve the lane anyway
+      continue;
+    }
+    for (job_t* job = lane->front; job; job = job->next) {
+      if (elapsed_msec(&(pool->clients[job->fd].submitted), &now) > pool->latency_target) {
+        // if the worker cannot be started, go on with the current ones
+        spawn_worker(pool);
+        return;
+      }
+    }
+  }
+}
+
+worker_pool_t* worker_pool_create(const size_t min_size, const size_t max_size, const long shares[LANES], const long latency_target, const long idle_timeout, void* (*routine)(void*), void* arg)
+{
+  if (!min_size || max_size < min_size || !shares || latency_target < 0 || idle_timeout < 0 || !routine) {
+    errno = EINVAL;
+    return NULL;
+  }
+  for (int i = 0; i < LANES; i++) {
+    if (shares[i] < 1 || shares[i] > 100) {
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  worker_pool_t* pool;
+  if ((pool = calloc(1, sizeof(worker_pool_t))) == NULL) {
+    return NULL;
+  }
+  if ((pool->exited = calloc(max_size, sizeof(pthread_t))) == NULL) {
+    free_item((void**)&pool);
+    return NULL;
+  }
+  pool->min_size = min_size;
+  pool->max_size = max_size;
+  pool->latency_target = latency_target;
+  pool->idle_timeout = idle_timeout;
+  pool->routine = routine;
+  pool->arg = arg;
+  for (int i = 0; i < LANES; i++) {
+    pool->lanes[i].share = shares[i];
+    // each lane can use at least a worker
+    pool->lanes[i].cap = (max_size * shares[i] + 99) / 100;
+  }
+  EXIT_ON_NZ(pthread_mutex_init(&(pool->mutex), NULL));
+  // idle timeouts are measured with the monotonic clock
+  pthread_condattr_t attr;
+  EXIT_ON_NZ(pthread_condattr_init(&attr));
+  EXIT_ON_NZ(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+  EXIT_ON_NZ(pthread_cond_init(&(pool->cond), &attr));
+  EXIT_ON_NZ(pthread_condattr_destroy(&attr));
+  EXIT_ON_NZ(pthread_cond_init(&(pool->exit_cond), NULL));
+
+  LOCK(&(pool->mutex));
+  for (size_t i = 0; i < min_size; i++) {
+    EXIT_ON_NEG_ONE(spawn_worker(pool));
+  }
+  UNLOCK(&(pool->mutex));
+  return pool;
+}
+
+int worker_pool_stop(worker_pool_t* pool)
+{
+  if (!pool) {
+    errno = EINVAL;
+    return -1;
+  }
+  LOCK(&(pool->mutex));
+  // the workers exit once the queue is empty
+  pool->terminating = 1;
+  BROADCAST(&(pool->cond));
+  while (pool->size) {
+    WAIT(&(pool->exit_cond), &(pool->mutex));
+  }
+  join_exited(pool);
+  UNLOCK(&(pool->mutex));
+  return 0;
+}
+
+int worker_pool_destroy(worker_pool_t* pool)
+{
+  if (!pool) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (pool->size && worker_pool_stop(pool) == -1) {
+    return -1;
+  }
+  // free the clients never served
+  for (int i = 0; i < LANES; i++) {
+    job_t* job;
+    while ((job = pool->lanes[i].front)) {
+      pool->lanes[i].front = job->next;
+      free_item((void**)&job);
+    }
+  }
+  EXIT_ON_NZ(pthread_cond_destroy(&(pool->exit_cond)));
+  EXIT_ON_NZ(pthread_cond_destroy(&(pool->cond)));
+  EXIT_ON_NZ(pthread_mutex_destroy(&(pool->mutex)));
+  free_item((void**)&(pool->exited));
+  free_item((void**)&pool);
+  return 0;
+}
+
+int worker_pool_submit(worker_pool_t* pool, const int fd, const int lane)
+{
+  if (!pool || fd < 0 || fd >= FD_SETSIZE || lane < 0 || lane >= LANES) {
+    errno = EINVAL;
+    return -1;
+  }
+  job_t* job;
+  if ((job = malloc(sizeof(job_t))) == NULL) {
+    return -1;
+  }
+  job->fd = fd;
+  job->next = NULL;
+
+  LOCK(&(pool->mutex));
+  client_state_t* client = &(pool->clients[fd]);
+  lane_t* current_lane = &(pool->lanes[lane]);
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &(client->submitted)));
+  client->lane = lane;
+  // the client starts when the lane reaches the time at which its previous request finished
+  job->start_tag = (client->finish_tag > current_lane->vtime ? client->finish_tag : current_lane->vtime);
+  if (!current_lane->queued && !current_lane->busy) {
+    // a lane that has been idle does not get credit for the time it was not used
+    for (int i = 0; i < LANES; i++) {
+      lane_t* other = &(pool->lanes[i]);
+      if ((other->queued || other->busy) && other->served > current_lane->served) {
+        current_lane->served = other->served;
+      }
+    }
+  }
+  if (current_lane->back) {
+    current_lane->back->next = job;
+  } else {
+    current_lane->front = job;
+  }
+  current_lane->back = job;
+  current_lane->queued++;
+  pool->queued++;
+  if (pool->idle) {
+    SIGNAL(&(pool->cond));
+  } else {
+    grow_if_late(pool);
+  }
+  UNLOCK(&(pool->mutex));
+  return 0;
+}
+
+int worker_pool_get(worker_pool_t* pool)
+{
+  LOCK(&(pool->mutex));
+  int next;
+  while ((next = next_lane(pool)) == -1) {
+    if (pool->terminating && !pool->queued) {
+      goto retire;
+    }
+    struct timespec deadline;
+    EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &deadline));
+    deadline.tv_sec += pool->idle_timeout / 1000;
+    deadline.tv_nsec += (pool->idle_timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pool->idle++;
+    int error;
+    TIMEDWAIT(&(pool->cond), &(pool->mutex), &deadline, error);
+    pool->idle--;
+    if (error == ETIMEDOUT && !pool->queued && pool->size > pool->min_size) {
+      // the worker has been idle for too long
+      pool->retired++;
+      goto retire;
+    }
+  }
+  // get the client of the lane with the lowest start tag (the oldest one if tied)
+  lane_t* lane = &(pool->lanes[next]);
+  job_t* job = lane->front;
+  job_t* prev = NULL;
+  for (job_t* current = lane->front, * current_prev = NULL; current; current_prev = current, current = current->next) {
+    if (current->start_tag < job->start_tag) {
+      job = current;
+      prev = current_prev;
+    }
+  }
+  if (prev) {
+    prev->next = job->next;
+  } else {
+    lane->front = job->next;
+  }
+  if (lane->back == job) {
+    lane->back = prev;
+  }
+  lane->queued--;
+  pool->queued--;
+  lane->busy++;
+  lane->vtime = job->start_tag;
+
+  client_state_t* client = &(pool->clients[job->fd]);
+  client->start_tag = job->start_tag;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &(client->dispatched)));
+  double latency = elapsed_msec(&(client->submitted), &(client->dispatched));
+  pool->dispatched++;
+  pool->total_latency += latency;
+  if (latency > pool->max_latency) {
+    pool->max_latency = latency;
+  }
+  grow_if_late(pool);
+  UNLOCK(&(pool->mutex));
+
+  int fd = job->fd;
+  free_item((void**)&job);
+  return fd;
+
+  retire:
+  // the worker is joined by the next worker started or when the pool is stopped
+  pool->size--;
+  pool->exited[pool->exited_count++] = pthread_self();
+  if (!pool->size) {
+    SIGNAL(&(pool->exit_cond));
+  }
+  UNLOCK(&(pool->mutex));
+  return -1;
+}
+
+void worker_pool_done(worker_pool_t* pool, const int fd)
+{
+  if (!pool || fd < 0 || fd >= FD_SETSIZE) {
+    return;
+  }
+  struct timespec now;
+  EXIT_ON_NEG_ONE(clock_gettime(CLOCK_MONOTONIC, &now));
+  LOCK(&(pool->mutex));
+  client_state_t* client = &(pool->clients[fd]);
+  lane_t* lane = &(pool->lanes[client->lane]);
+  // the next request of the client starts after the service time of this one
+  double service = elapsed_msec(&(client->dispatched), &now);
+  client->finish_tag = client->start_tag + service;
+  lane->served += service / lane->share;
+  lane->busy--;
+  lane->served_count++;
+  lane->histogram[latency_bucket(elapsed_msec(&(client->submitted), &now))]++;
+  if (lane->queued) {
+    // a worker has become available for the lane
+    SIGNAL(&(pool->cond));
+  }
+  UNLOCK(&(pool->mutex));
+}
+
+struct timespec worker_pool_submitted(worker_pool_t* pool, const int fd)
+{
+  // no lock needed: the client is not submitted again before the worker serving it sends it back to the master
+  return pool->clients[fd].submitted;
+}
+
+void worker_pool_forget(worker_pool_t* pool, const int fd)
+{
+  if (!pool || fd < 0 || fd >= FD_SETSIZE) {
+    return;
+  }
+  LOCK(&(pool->mutex));
+  pool->clients[fd].finish_tag = 0;
+  UNLOCK(&(pool->mutex));
+}
+
+void worker_pool_adjust(worker_pool_t* pool)
+{
+  LOCK(&(pool->mutex));
+  grow_if_late(pool);
+  UNLOCK(&(pool->mutex));
+}
+
+size_t worker_pool_queued(worker_pool_t* pool)
+{
+  LOCK(&(pool->mutex));
+  size_t queued = pool->queued;
+  UNLOCK(&(pool->mutex));
+  return queued;
+}
+
+void worker_pool_print_summary(worker_pool_t* pool)
+{
+  if (!pool) {
+    return;
+  }
+  LOCK(&(pool->mutex));
+  printf("- Worker pool summary -\n");
+  printf("The worker pool:\n");
+  printf(" - could run from %zu to %zu worker(s) and reached %zu worker(s)\n", pool->min_size, pool->max_size, pool->peak_size);
+  printf(" - started %zu worker(s) and retired %zu idle worker(s)\n", pool->created, pool->retired);
+  printf(" - dispatched %zu ready client(s)", pool->dispatched);
+  if (pool->dispatched) {
+    printf(", with a queue latency of %.3f ms on average (%.3f ms at most)", pool->total_latency / pool->dispatched, pool->max_latency);
+  }
+  printf("\n");
+  const char* lane_names[LANES] = {"control", "bulk"};
+  for (int i = 0; i < LANES; i++) {
+    lane_t* lane = &(pool->lanes[i]);
+    printf(" - served %zu %s request(s) with up to %zu worker(s)", lane->served_count, lane_names[i], lane->cap);
+    if (lane->served_count) {
+      printf(", responding within %.3f ms (p50) and %.3f ms (p99)", percentile(lane->histogram, lane->served_count, 0.5), percentile(lane->histogram, lane->served_count, 0.99));
+    }
+    printf("\n");
+  }
+  printf("\n");
+  UNLOCK(&(pool->mutex));
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# compare the server throughput with unbound and bound threads
+# usage: test/bench_affinity.sh [master_cpus] [worker_cpus] [connections]
+
+CPUS=$(nproc)
+MASTER_CPUS=${1:-0}
+if [ $CPUS -gt 1 ]; then
+  WORKER_CPUS=${2:-1-$((CPUS - 1))}
+else
+  WORKER_CPUS=${2:-0}
+fi
+CONNECTIONS=${3:-4}
+BENCH_DIR=tmp/bench_affinity
+
+# generate the files to send: 400 files from 4 to 256 KB
+rm -rf $BENCH_DIR
+mkdir -p $BENCH_DIR/files
+for i in $(seq 400); do
+  head -c $(( (i % 64 + 1) * 4096 )) /dev/urandom > $BENCH_DIR/files/file$i
+done
+
+run() {
+  cat > $BENCH_DIR/config.txt <<CONFIG
+WORKER_POOL_SIZE = 4
+STORAGE_MAX_FILE_NUMBER = 10000
+STORAGE_MAX_SIZE = 1073741824
+$2
+CONFIG
+  echo "$1:"
+  # every round starts from an empty storage
+  for round in 1 2 3; do
+    bin/server $BENCH_DIR/config.txt > $BENCH_DIR/server.out &
+    SERVER_PID=$!
+    sleep 0.5
+    bin/client -f tmp/filestorageserver.sk -w $BENCH_DIR/files -j $CONNECTIONS 2>&1 | grep "(-w)"
+    kill -s SIGHUP $SERVER_PID
+    wait $SERVER_PID
+  done
+}
+
+run "unbound threads" ""
+run "master bound to $MASTER_CPUS, workers bound to $WORKER_CPUS" "MASTER_CPUS = $MASTER_CPUS
+WORKER_CPUS = $WORKER_CPUS"
+
+rm -rf $BENCH_DIR
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# measure the response time of control requests (lock/unlock) while other clients transfer large files,
+# with the bulk requests allowed to use all the workers or only a share of them
+# usage: test/bench_lanes.sh [bulk_worker_share] [bulk_clients]
+
+BULK_SHARE=${1:-50}
+BULK_CLIENTS=${2:-4}
+BENCH_DIR=tmp/bench_lanes
+
+rm -rf $BENCH_DIR
+mkdir -p $BENCH_DIR/small $BENCH_DIR/bulk
+for i in $(seq 20); do
+  head -c 1024 /dev/urandom > $BENCH_DIR/small/file$i
+done
+for i in $(seq $BULK_CLIENTS); do
+  mkdir -p $BENCH_DIR/bulk/$i
+  head -c 16777216 /dev/urandom > $BENCH_DIR/bulk/$i/big1
+  head -c 16777216 /dev/urandom > $BENCH_DIR/bulk/$i/big2
+done
+SMALL_FILES=$(ls -d $BENCH_DIR/small/* | paste -sd,)
+
+run() {
+  cat > $BENCH_DIR/config.txt <<CONFIG
+WORKER_POOL_SIZE = 2
+WORKER_POOL_MAX = 4
+STORAGE_MAX_FILE_NUMBER = 1000
+STORAGE_MAX_SIZE = 1073741824
+BULK_WORKER_SHARE = $1
+CONFIG
+  bin/server $BENCH_DIR/config.txt > $BENCH_DIR/server.out &
+  SERVER_PID=$!
+  sleep 0.5
+  bin/client -f tmp/filestorageserver.sk -W $SMALL_FILES
+  # bulk load: write and remove the large files over and over
+  BULK_PIDS=""
+  for i in $(seq $BULK_CLIENTS); do
+    FILES=$BENCH_DIR/bulk/$i/big1,$BENCH_DIR/bulk/$i/big2
+    (while [ ! -f $BENCH_DIR/stop ]; do
+      bin/client -f tmp/filestorageserver.sk -W $FILES -c $FILES
+    done) &
+    BULK_PIDS="$BULK_PIDS $!"
+  done
+  # control requests
+  for i in $(seq 50); do
+    bin/client -f tmp/filestorageserver.sk -l $SMALL_FILES -u $SMALL_FILES
+  done
+  touch $BENCH_DIR/stop
+  wait $BULK_PIDS
+  rm -f $BENCH_DIR/stop
+  kill -s SIGHUP $SERVER_PID
+  wait $SERVER_PID
+  echo "bulk requests served by up to $1% of the workers:"
+  grep "served" $BENCH_DIR/server.out
+}
+
+run 100
+run $BULK_SHARE
+
+rm -rf $BENCH_DIR
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# crash recovery: the files in the snapshot and the changes logged after it
+# are back when the server restarts after being killed
+
+rm -rf tmp/test3.snapshot tmp/test3.wal tmp/recovered_files/ tmp/expected_files/
+bin/server test/config/test3_config.txt &
+SERVER_PID=$!
+# let the server start listening (the client retries only while the socket does not exist)
+sleep 1
+
+# write 'test/sample_files/file1', 'test/sample_files/file2' and 'test/sample_files/big_file1'
+bin/client -p -f tmp/filestorageserver.sk -W test/sample_files/file1,test/sample_files/file2,test/sample_files/big_file1
+
+# write a snapshot of the storage, and wait for it
+kill -s SIGUSR2 $SERVER_PID
+for i in $(seq 50); do
+  [ -f tmp/test3.snapshot ] && break
+  sleep 0.1
+done
+
+# changes logged after the snapshot: append 'test/sample_files/file1' to itself,
+# write 'test/sample_files/file3', lock and remove 'test/sample_files/file2'
+bin/client -p -f tmp/filestorageserver.sk -a test/sample_files/file1 -W test/sample_files/file3
+bin/client -p -f tmp/filestorageserver.sk -l test/sample_files/file2 -c test/sample_files/file2
+
+# crash
+kill -s SIGKILL $SERVER_PID
+wait $SERVER_PID
+
+# restart, then read all files from the server and store them in 'tmp/recovered_files/'
+bin/server test/config/test3_config.txt &
+SERVER_PID=$!
+# let the server start listening (the client retries only while the socket does not exist)
+sleep 1
+mkdir -p tmp/recovered_files/
+bin/client -p -f tmp/filestorageserver.sk -R 0 -d tmp/recovered_files/
+
+kill -s SIGHUP $SERVER_PID
+wait $SERVER_PID
+
+# compare the files read back with the expected ones
+mkdir -p tmp/expected_files/
+cat test/sample_files/file1 test/sample_files/file1 > tmp/expected_files/file1
+cp test/sample_files/file3 test/sample_files/big_file1 tmp/expected_files/
+if diff -r tmp/expected_files/ tmp/recovered_files/; then
+  echo "test3: the files have been recovered"
+else
+  echo "test3: the files have not been recovered"
+  exit 1
+fi